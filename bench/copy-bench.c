@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <files-list.h>
+#include <configuration.h>
+#include <sync.h>
+#include <io-ring.h>
+#include <small-copy.h>
+#include <copy-pool.h>
+#include <defines.h>
+
+// Benchmark of the copy of small files: copies a directory of small files with copy_entry_to_destination
+// (the copy engine), with a plain sendfile loop, and with the io_uring chains of copy_small_files, in
+// batches like the copy pool, and reports files per second. The destination is emptied between runs,
+// and the source is in the page cache, so the per-file system calls dominate.
+// Usage: bench-copy [work directory] [files count] [file size] (default /tmp 20000 4096)
+
+#define REPEATS 3
+
+typedef enum {
+    METHOD_ENGINE,
+    METHOD_SENDFILE,
+    METHOD_IO_URING,
+    METHODS_COUNT
+} method_t;
+
+static const char *method_names[METHODS_COUNT] = {"copy engine", "sendfile", "io_uring"};
+
+/*!
+ * @brief copy_with_sendfile copies a file like copy_entry_to_destination, with sendfile
+ */
+static int copy_with_sendfile(files_list_entry_t *entry, configuration_t *the_config) {
+    char destination_path[PATH_SIZE];
+    snprintf(destination_path, sizeof(destination_path), "%s/%s", the_config->destination, strrchr(entry->path_and_name, '/') + 1);
+    int source_fd = open(entry->path_and_name, O_RDONLY | O_CLOEXEC);
+    if (source_fd == -1) {
+        return -1;
+    }
+    int destination_fd = open(destination_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, entry->mode & 07777);
+    if (destination_fd == -1) {
+        close(source_fd);
+        return -1;
+    }
+    off_t offset = 0;
+    int result = 0;
+    while ((uint64_t) offset < entry->size) {
+        ssize_t sent = sendfile(destination_fd, source_fd, &offset, entry->size - offset);
+        if (sent <= 0) {
+            result = -1;
+            break;
+        }
+    }
+    struct timespec times[2] = {entry->mtime, entry->mtime};
+    fchmod(destination_fd, entry->mode & 07777);
+    futimens(destination_fd, times);
+    close(source_fd);
+    close(destination_fd);
+    return result;
+}
+
+/*!
+ * @brief empty_directory removes the files copied by a run
+ */
+static void empty_directory(char *directory, files_list_entry_t **files, size_t count) {
+    char path[PATH_SIZE];
+    for (size_t i=0; i<count; ++i) {
+        snprintf(path, sizeof(path), "%s/%s", directory, strrchr(files[i]->path_and_name, '/') + 1);
+        unlink(path);
+    }
+}
+
+/*!
+ * @brief copy_files copies all the files with a method, and returns the time it took
+ */
+static double copy_files(method_t method, files_list_entry_t **files, size_t count, configuration_t *the_config, size_t *failed) {
+    struct timespec start, end;
+    bool copied[COPY_BATCH_FILES];
+    *failed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t first=0; first<count; first+=COPY_BATCH_FILES) {
+        size_t batch_count = (count - first < COPY_BATCH_FILES) ? count - first : COPY_BATCH_FILES;
+        memset(copied, 0, sizeof(copied));
+        if (method == METHOD_IO_URING) {
+            copy_small_files(&files[first], batch_count, the_config, copied);
+        }
+        for (size_t i=0; i<batch_count; ++i) {
+            int result = copied[i] ? 0 : (method == METHOD_SENDFILE) ? copy_with_sendfile(files[first + i], the_config)
+                                                                    : copy_entry_to_destination(files[first + i], the_config);
+            if (result == -1) {
+                ++*failed;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    char *directory = (argc > 1) ? argv[1] : "/tmp";
+    size_t count = (argc > 2) ? strtoull(argv[2], NULL, 10) : 20000;
+    size_t size = (argc > 3) ? strtoull(argv[3], NULL, 10) : 4096;
+    if (size > SMALL_FILE_SIZE) {
+        printf("Files must be at most %d bytes\n", SMALL_FILE_SIZE);
+        return 1;
+    }
+
+    configuration_t config;
+    init_configuration(&config);
+    snprintf(config.source, sizeof(config.source), "%s/copy-bench-source", directory);
+    snprintf(config.destination, sizeof(config.destination), "%s/copy-bench-destination", directory);
+    mkdir(config.source, 0755);
+    mkdir(config.destination, 0755);
+    bool has_io_uring = enable_io_ring(false, true) == 0 && is_io_ring_copy_enabled();
+
+    // The source files, with their properties as the diff would give them
+    files_list_t list = {0};
+    files_list_entry_t **files = malloc(count * sizeof(files_list_entry_t *));
+    char *content = malloc(size + 1);
+    for (size_t i=0; i<size; ++i) {
+        content[i] = (char) ('a' + i % 26);
+    }
+    char path[PATH_SIZE];
+    for (size_t i=0; i<count; ++i) {
+        snprintf(path, sizeof(path), "%s/file-%zu", config.source, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || write(fd, content, size) != (ssize_t) size) {
+            perror(path);
+            return 1;
+        }
+        close(fd);
+        files[i] = new_files_list_entry(&list, path);
+        struct stat file_stat;
+        stat(path, &file_stat);
+        files[i]->entry_type = FICHIER;
+        files[i]->mode = file_stat.st_mode;
+        files[i]->size = file_stat.st_size;
+        files[i]->mtime = file_stat.st_mtim;
+    }
+
+    printf("method,files,file_size,seconds,files_per_s,failed\n");
+    for (method_t method=0; method<METHODS_COUNT; ++method) {
+        if (method == METHOD_IO_URING && !has_io_uring) {
+            printf("# io_uring is unavailable\n");
+            continue;
+        }
+        double best = 0;
+        size_t failed = 0;
+        for (int repeat=0; repeat<REPEATS; ++repeat) {
+            empty_directory(config.destination, files, count);
+            double seconds = copy_files(method, files, count, &config, &failed);
+            if (repeat == 0 || seconds < best) {
+                best = seconds;
+            }
+        }
+        printf("%s,%zu,%zu,%.3f,%.0f,%zu\n", method_names[method], count, size, best, count / best, failed);
+    }
+
+    empty_directory(config.destination, files, count);
+    empty_directory(config.source, files, count);
+    rmdir(config.destination);
+    rmdir(config.source);
+    clear_files_list(&list);
+    free(files);
+    free(content);
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <files-list.h>
+#include <sync.h>
+#include <utility.h>
+#include <defines.h>
+
+// Benchmark of the diff engine (diff_files_lists): builds ordered source and destination lists of
+// growing sizes, with a few changed, added and deleted entries, and reports the time per entry.
+// Usage: bench-diff [max entries] (default 10000000)
+
+#define FILES_PER_DIR 1000
+
+typedef struct {
+    size_t added;
+    size_t changed;
+    size_t identical;
+} diff_counters_t;
+
+/*!
+ * @brief count_difference is the diff_files_lists callback, it only counts the results
+ */
+static void count_difference(files_list_entry_t *src_entry, files_list_entry_t *dst_entry, diff_status_t status, void *parameters) {
+    diff_counters_t *counters = (diff_counters_t *) parameters;
+    if (status == DIFF_ADDED) {
+        ++counters->added;
+    } else if (status == DIFF_CHANGED) {
+        ++counters->changed;
+    } else {
+        ++counters->identical;
+    }
+}
+
+/*!
+ * @brief build_list builds an ordered list of count entries under root
+ * Every 100th entry is missing when skip_some is set, every 97th entry gets a different size when change_some is set.
+ */
+static void build_list(files_list_t *list, char *root, size_t count, bool skip_some, bool change_some) {
+    for (size_t i=0; i<count; ++i) {
+        if (skip_some && i % 100 == 50) {
+            continue;
+        }
+        char path[PATH_SIZE];
+        snprintf(path, sizeof(path), "%s/dir%06zu/file%06zu", root, i / FILES_PER_DIR, i % FILES_PER_DIR);
+        files_list_entry_t *entry = new_files_list_entry(list, path);
+        if (!entry) {
+            fprintf(stderr, "Out of memory at %zu entries\n", i);
+            exit(1);
+        }
+        entry->entry_type = FICHIER;
+        entry->mode = 0644;
+        entry->size = (change_some && i % 97 == 0) ? i + 1 : i;
+        add_entry_to_tail(list, entry);
+    }
+}
+
+/*!
+ * @brief list_memory sums the memory used by the pages of a list
+ */
+static size_t list_memory(files_list_t *list) {
+    size_t total = 0;
+    for (files_list_page_t *page=list->entry_pages; page!=NULL; page=page->next) {
+        total += sizeof(files_list_page_t) + page->capacity;
+    }
+    for (files_list_page_t *page=list->path_pages; page!=NULL; page=page->next) {
+        total += sizeof(files_list_page_t) + page->capacity;
+    }
+    return total;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_entries = (argc > 1) ? strtoull(argv[1], NULL, 10) : 10000000;
+
+    printf("entries,added,changed,identical,seconds,ns_per_entry,bytes_per_entry\n");
+    for (size_t count=10000; count<=max_entries; count*=10) {
+        files_list_t src_list = {0}, dst_list = {0};
+        build_list(&src_list, "/source", count, false, true);
+        build_list(&dst_list, "/backup/destination", count, true, false);
+
+        diff_counters_t counters = {0};
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        diff_files_lists(&src_list, &dst_list, root_prefix_length("/source"), root_prefix_length("/backup/destination"), false, count_difference, &counters);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = elapsed_seconds(&start, &end);
+        printf("%zu,%zu,%zu,%zu,%.6f,%.1f,%.1f\n", count, counters.added, counters.changed, counters.identical, seconds, seconds * 1e9 / count,
+               (double) list_memory(&src_list) / count);
+        fflush(stdout);
+
+        clear_files_list(&src_list);
+        clear_files_list(&dst_list);
+    }
+    return 0;
+}
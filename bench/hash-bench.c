@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <hash-engine.h>
+#include <hash-algorithms.h>
+#include <xxh3.h>
+#include <blake3.h>
+
+// Benchmark of the hash engine (hash_file_contents): hashes one large file and many small files
+// with each strategy and each hash algorithm, plus a no-op hash (to measure reading alone), and reports GB/s.
+// Files are written first, so they are read from the page cache unless caches are dropped in between.
+// Usage: bench-hash [directory] [large file size in MB] (default /tmp 256)
+
+#define SMALL_FILES_COUNT 2000
+#define SMALL_FILE_SIZE (16 * 1024)
+#define REPEATS 3
+
+static int null_update(void *context, const uint8_t *data, size_t length) {
+    // Touch every page so that the read (or page faults for mmap) cannot be skipped
+    uint64_t sum = data[length - 1];
+    for (size_t i=0; i<length; i+=4096) {
+        sum += data[i];
+    }
+    *(uint64_t *) context += sum;
+    return 0;
+}
+
+/*!
+ * @brief write_file writes a file of pseudo-random content
+ */
+static int write_file(char *path, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    static uint8_t block[HASH_BUFFER_SIZE];
+    for (size_t i=0; i<sizeof(block); ++i) {
+        block[i] = (uint8_t) (i * 2654435761u >> 13);
+    }
+    for (size_t written=0; written<size; ) {
+        size_t length = (size - written < sizeof(block)) ? size - written : sizeof(block);
+        if (write(fd, block, length) != (ssize_t) length) {
+            close(fd);
+            return -1;
+        }
+        written += length;
+    }
+    close(fd);
+    return 0;
+}
+
+/*!
+ * @brief hash_files hashes a set of files and returns the time it took
+ */
+static double hash_files(char **paths, size_t count, size_t size, hash_strategy_t strategy, hash_algorithm_t algorithm) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i=0; i<count; ++i) {
+        int fd = open(paths[i], O_RDONLY);
+        if (fd == -1) {
+            perror(paths[i]);
+            exit(1);
+        }
+        if (algorithm != HASH_NONE) {
+            // compute_digest uses the automatic strategy
+            uint8_t digest[DIGEST_SIZE];
+            compute_digest(fd, size, algorithm, digest);
+        } else {
+            uint64_t sum = 0;
+            hash_file_contents(fd, size, strategy, null_update, &sum);
+        }
+        close(fd);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    char *directory = (argc > 1) ? argv[1] : "/tmp";
+    size_t large_size = ((argc > 2) ? strtoull(argv[2], NULL, 10) : 256) * 1024 * 1024;
+
+    char large_path[4096];
+    snprintf(large_path, sizeof(large_path), "%s/hash-bench-large", directory);
+    char *large_paths[1] = {large_path};
+    char *small_paths[SMALL_FILES_COUNT];
+    if (write_file(large_path, large_size) == -1) {
+        return 1;
+    }
+    for (size_t i=0; i<SMALL_FILES_COUNT; ++i) {
+        small_paths[i] = malloc(4096);
+        snprintf(small_paths[i], 4096, "%s/hash-bench-small-%zu", directory, i);
+        if (write_file(small_paths[i], SMALL_FILE_SIZE) == -1) {
+            return 1;
+        }
+    }
+
+    hash_strategy_t strategies[] = {HASH_STRATEGY_AUTO, HASH_STRATEGY_READ, HASH_STRATEGY_MMAP, HASH_STRATEGY_PIPELINED};
+    hash_algorithm_t algorithms[] = {HASH_NONE, HASH_MD5, HASH_XXH3, HASH_BLAKE3};
+    printf("# xxh3: %s, blake3: %s\n", xxh3_implementation(), blake3_implementation());
+    printf("files,strategy,hash,bytes,seconds,gb_per_s\n");
+    for (size_t a=0; a<sizeof(algorithms) / sizeof(algorithms[0]); ++a) {
+        // Strategies are only compared on the no-op hash, algorithms use the automatic one
+        size_t strategies_count = (algorithms[a] == HASH_NONE) ? sizeof(strategies) / sizeof(strategies[0]) : 1;
+        for (size_t s=0; s<strategies_count; ++s) {
+            for (int set=0; set<2; ++set) {
+                char **paths = (set == 0) ? large_paths : small_paths;
+                size_t count = (set == 0) ? 1 : SMALL_FILES_COUNT;
+                size_t size = (set == 0) ? large_size : SMALL_FILE_SIZE;
+
+                // Best of a few runs
+                double best = -1;
+                for (int r=0; r<REPEATS; ++r) {
+                    double seconds = hash_files(paths, count, size, strategies[s], algorithms[a]);
+                    if (best < 0 || seconds < best) {
+                        best = seconds;
+                    }
+                }
+                printf("%s,%s,%s,%zu,%.6f,%.3f\n", (set == 0) ? "large" : "small", hash_strategy_name(strategies[s]), hash_algorithm_name(algorithms[a]),
+                       count * size, best, count * size / best / 1e9);
+                fflush(stdout);
+            }
+        }
+    }
+
+    unlink(large_path);
+    for (size_t i=0; i<SMALL_FILES_COUNT; ++i) {
+        unlink(small_paths[i]);
+        free(small_paths[i]);
+    }
+    return 0;
+}
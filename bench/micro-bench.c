@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/stat.h>
+#include <files-list.h>
+#include <file-properties.h>
+#include <messages.h>
+#include <ring-buffer.h>
+#include <sync.h>
+#include <utility.h>
+#include <defines.h>
+
+// Micro-benchmarks of the hot primitives of files-list.c, utility.c, messages.c and file-properties.c.
+// Each one reports the time and the number of allocations (malloc, calloc and realloc calls) per operation,
+// at several list (or file) sizes, as CSV. Lists are built in memory, except for add_file_entry which
+// needs real files (they are created in the work directory, and hashing is disabled to measure the list).
+// Usage: bench-micro [work directory] [max list size] (default /tmp 100000)
+
+#define PATHS_PER_DIR 1000
+#define LOOKUPS 2000
+#define ROUND_TRIPS 100000
+#define SMALL_OPS 1000000
+#define HASHED_BYTES (64 * 1024 * 1024)
+#define RING_CAPACITY (256 * 1024)
+
+// Allocations are counted by wrapping the allocator of the C library
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+static _Atomic size_t allocations;
+
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+
+// Measure of a run of operations
+typedef struct {
+    struct timespec start;
+    size_t allocations;
+} measure_t;
+
+static void start_measure(measure_t *measure) {
+    measure->allocations = atomic_load(&allocations);
+    clock_gettime(CLOCK_MONOTONIC, &measure->start);
+}
+
+/*!
+ * @brief report prints the CSV line of a benchmark, from its measure started before its operations
+ */
+static void report(measure_t *measure, char *name, size_t size, size_t operations) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    size_t allocated = atomic_load(&allocations) - measure->allocations;
+    double seconds = (end.tv_sec - measure->start.tv_sec) + (end.tv_nsec - measure->start.tv_nsec) / 1e9;
+    printf("%s,%zu,%zu,%.1f,%.3f\n", name, size, operations, seconds * 1e9 / operations, (double) allocated / operations);
+    fflush(stdout);
+}
+
+/*!
+ * @brief make_path builds the path of the index-th entry of a tree, the paths are ordered by index
+ */
+static void make_path(char *path, char *root, size_t index) {
+    snprintf(path, PATH_SIZE, "%s/dir%06zu/file%06zu", root, index / PATHS_PER_DIR, index % PATHS_PER_DIR);
+}
+
+/*!
+ * @brief build_list builds an ordered in-memory list of count file entries under root
+ */
+static void build_list(files_list_t *list, char *root, size_t count) {
+    char path[PATH_SIZE];
+    for (size_t i=0; i<count; ++i) {
+        make_path(path, root, i);
+        files_list_entry_t *entry = new_files_list_entry(list, path);
+        if (!entry) {
+            fprintf(stderr, "Out of memory at %zu entries\n", i);
+            exit(1);
+        }
+        entry->entry_type = FICHIER;
+        entry->mode = 0644;
+        entry->size = i;
+        add_entry_to_tail(list, entry);
+    }
+}
+
+static void bench_add_entry_to_tail(size_t size) {
+    files_list_t list = {0};
+    measure_t measure;
+    start_measure(&measure);
+    build_list(&list, "/source", size);
+    report(&measure, "add_entry_to_tail", size, size);
+    clear_files_list(&list);
+}
+
+static void bench_find_entry_by_name(size_t size) {
+    files_list_t list = {0};
+    build_list(&list, "/backup", size);
+    char path[PATH_SIZE];
+    size_t found = 0;
+    measure_t measure;
+    start_measure(&measure);
+    for (size_t i=0; i<LOOKUPS; ++i) {
+        // Spread over the whole list: the search is linear
+        make_path(path, "/source", (i * 7919) % size);
+        found += find_entry_by_name(&list, path, root_prefix_length("/source"), root_prefix_length("/backup")) != NULL;
+    }
+    report(&measure, "find_entry_by_name", size, LOOKUPS);
+    if (found != LOOKUPS) {
+        fprintf(stderr, "find_entry_by_name found %zu entries of %d\n", found, LOOKUPS);
+    }
+    clear_files_list(&list);
+}
+
+static void bench_mismatch(void) {
+    files_list_entry_t source = {.mode = 0644, .size = 4096, .entry_type = FICHIER, .hash_algorithm = HASH_MD5};
+    files_list_entry_t destination = source;
+    size_t mismatches = 0;
+    measure_t measure;
+    start_measure(&measure);
+    for (size_t i=0; i<SMALL_OPS; ++i) {
+        // The last digest byte changes, so that the whole digest is compared
+        source.md5sum[15] = i & 1;
+        mismatches += mismatch(&source, &destination, true);
+    }
+    report(&measure, "mismatch", 1, SMALL_OPS);
+    if (mismatches != SMALL_OPS / 2) {
+        fprintf(stderr, "mismatch reported %zu differences\n", mismatches);
+    }
+}
+
+static void bench_concat_path(void) {
+    char result[PATH_SIZE];
+    size_t length = 0;
+    measure_t measure;
+    start_measure(&measure);
+    for (size_t i=0; i<SMALL_OPS; ++i) {
+        concat_path(result, "/backup/destination", "dir000123/subdirectory/file000456.txt");
+        length += result[i % 32];
+    }
+    report(&measure, "concat_path", 1, SMALL_OPS);
+    if (length == 0) {
+        fprintf(stderr, "concat_path made empty paths\n");
+    }
+}
+
+static void bench_add_file_entry(char *directory, size_t size) {
+    // Files are created once for the largest size, and listed in order
+    char path[PATH_SIZE];
+    files_list_t list = {0};
+    set_hash_algorithm(HASH_NONE);
+    measure_t measure;
+    start_measure(&measure);
+    for (size_t i=0; i<size; ++i) {
+        snprintf(path, sizeof(path), "%s/file%07zu", directory, i);
+        add_file_entry(&list, path);
+    }
+    report(&measure, "add_file_entry", size, size);
+    clear_files_list(&list);
+}
+
+static void bench_message_queue(void) {
+    int msg_queue = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+    if (msg_queue == -1) {
+        perror("msgget");
+        return;
+    }
+    files_list_entry_t entry = {.path_and_name = "/source/dir000123/file000456.txt", .mode = 0644, .size = 4096};
+    files_list_entry_transmit_t message;
+    measure_t measure;
+    start_measure(&measure);
+    for (size_t i=0; i<ROUND_TRIPS; ++i) {
+        send_file_entry(msg_queue, MSG_TYPE_TO_MAIN, &entry, COMMAND_CODE_FILE_ENTRY);
+        msgrcv(msg_queue, &message, sizeof(files_list_entry_transmit_t) - sizeof(long), MSG_TYPE_TO_MAIN, 0);
+    }
+    report(&measure, "send_file_entry+msgrcv", 1, ROUND_TRIPS);
+    msgctl(msg_queue, IPC_RMID, NULL);
+}
+
+static void bench_ring(void) {
+    ring_buffer_t *ring = aligned_alloc(64, ring_buffer_size(RING_CAPACITY));
+    doorbell_t *doorbells = aligned_alloc(64, 2 * sizeof(doorbell_t));
+    if (!ring || !doorbells) {
+        free(ring);
+        free(doorbells);
+        return;
+    }
+    memset(doorbells, 0, 2 * sizeof(doorbell_t));
+    ring_buffer_init(ring, RING_CAPACITY, &doorbells[0], &doorbells[1]);
+    files_list_entry_t entry = {.path_and_name = "/source/dir000123/file000456.txt", .mode = 0644, .size = 4096};
+    static any_message_t message;
+    measure_t measure;
+    start_measure(&measure);
+    for (size_t i=0; i<ROUND_TRIPS; ++i) {
+        ring_send_file_entry(ring, &entry, COMMAND_CODE_FILE_ENTRY);
+        ring_receive_message(ring, &message);
+    }
+    report(&measure, "ring_send_file_entry+receive", 1, ROUND_TRIPS);
+    free(ring);
+    free(doorbells);
+}
+
+static void bench_compute_file_md5(char *directory, size_t file_size) {
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/hashed.dat", directory);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(path);
+        return;
+    }
+    static char block[64 * 1024];
+    for (size_t i=0; i<sizeof(block); ++i) {
+        block[i] = (char) (i * 2654435761u >> 13);
+    }
+    for (size_t written=0; written<file_size; ) {
+        size_t length = (file_size - written < sizeof(block)) ? file_size - written : sizeof(block);
+        if (write(fd, block, length) != (ssize_t) length) {
+            close(fd);
+            return;
+        }
+        written += length;
+    }
+    close(fd);
+
+    set_hash_algorithm(HASH_MD5);
+    files_list_entry_t entry = {.path_and_name = path, .size = file_size, .entry_type = FICHIER};
+    size_t operations = (HASHED_BYTES / file_size > 0) ? HASHED_BYTES / file_size : 1;
+    // A first hash, so that the file is read from the page cache and the buffers are allocated
+    compute_file_md5(&entry);
+    measure_t measure;
+    start_measure(&measure);
+    for (size_t i=0; i<operations; ++i) {
+        compute_file_md5(&entry);
+    }
+    report(&measure, "compute_file_md5", file_size, operations);
+    unlink(path);
+}
+
+int main(int argc, char *argv[]) {
+    char *work_directory = (argc > 1) ? argv[1] : "/tmp";
+    size_t max_size = (argc > 2) ? strtoull(argv[2], NULL, 10) : 100000;
+
+    char directory[PATH_SIZE / 2]; // Room is left for the names of the files
+    snprintf(directory, sizeof(directory), "%s/bench-micro.%d", work_directory, (int) getpid());
+    if (mkdir(directory, 0755) == -1) {
+        perror(directory);
+        return 1;
+    }
+
+    printf("benchmark,size,operations,ns_per_op,allocations_per_op\n");
+    for (size_t size=1000; size<=max_size; size*=10) {
+        bench_add_entry_to_tail(size);
+    }
+    for (size_t size=1000; size<=max_size; size*=10) {
+        bench_find_entry_by_name(size);
+    }
+    bench_mismatch();
+    bench_concat_path();
+
+    // Empty files for add_file_entry, at most 100000 of them
+    size_t files_count = (max_size < 100000) ? max_size : 100000;
+    char path[PATH_SIZE];
+    for (size_t i=0; i<files_count; ++i) {
+        snprintf(path, sizeof(path), "%s/file%07zu", directory, i);
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    for (size_t size=1000; size<=files_count; size*=10) {
+        bench_add_file_entry(directory, size);
+    }
+
+    bench_message_queue();
+    bench_ring();
+    for (size_t file_size=4096; file_size<=16*1024*1024; file_size*=16) {
+        bench_compute_file_md5(directory, file_size);
+    }
+
+    for (size_t i=0; i<files_count; ++i) {
+        snprintf(path, sizeof(path), "%s/file%07zu", directory, i);
+        unlink(path);
+    }
+    rmdir(directory);
+    return 0;
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <messages.h>
+#include <ring-buffer.h>
+#include <processes.h>
+
+// Benchmark of the transports between processes: a producer sends files list entries to a consumer
+// process, through the SysV message queue, through a shared memory ring one entry per message, and in
+// batches, and reports entries/s and the bytes moved per entry.
+// Usage: bench-ring [entries count] [batch size] (default 200000 128)
+
+/*!
+ * @brief make_entry builds the entry sent by the producer, with a typical path
+ */
+static void make_entry(files_list_entry_t *entry, char *path) {
+    memset(entry, 0, sizeof(files_list_entry_t));
+    snprintf(path, PATH_SIZE, "/home/user/documents/projects/lp25/source/file-%06d.c", 42);
+    entry->path_and_name = path;
+    entry->entry_type = FICHIER;
+    entry->mode = 0100644;
+    entry->size = 4096;
+}
+
+/*!
+ * @brief elapsed returns the seconds between two times
+ */
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*!
+ * @brief bench_message_queue sends count entries through a message queue
+ * @param bytes receives the number of bytes sent per entry
+ * @return the time in seconds until the consumer got them all
+ */
+static double bench_message_queue(size_t count, double *bytes) {
+    int msg_queue = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+    if (msg_queue == -1) {
+        perror("msgget");
+        return -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        any_message_t msg;
+        do {
+            msgrcv(msg_queue, &msg, sizeof(any_message_t) - sizeof(long), MSG_TYPE_TO_MAIN, 0);
+        } while (msg.list_entry.op_code != COMMAND_CODE_LIST_COMPLETE);
+        exit(0);
+    }
+
+    files_list_entry_t entry;
+    char path[PATH_SIZE];
+    make_entry(&entry, path);
+    for (size_t i=0; i<count; ++i) {
+        send_files_list_element(msg_queue, MSG_TYPE_TO_MAIN, &entry);
+    }
+    send_list_end(msg_queue, MSG_TYPE_TO_MAIN);
+    waitpid(pid, NULL, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    msgctl(msg_queue, IPC_RMID, NULL);
+    *bytes = sizeof(files_list_entry_transmit_t) - sizeof(long);
+    return elapsed(&start, &end);
+}
+
+/*!
+ * @brief bench_ring sends count entries through a ring
+ * @param batch_size is the number of entries per message, 0 to send them with ring_send_files_list_element
+ * @param bytes receives the number of bytes written to the ring per entry
+ * @return the time in seconds until the consumer got them all
+ */
+static double bench_ring(size_t count, uint32_t batch_size, double *bytes) {
+    size_t size = 2 * sizeof(doorbell_t) + ring_buffer_size(PROCESS_RING_CAPACITY);
+    doorbell_t *doorbells = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (doorbells == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    ring_buffer_t *ring = (ring_buffer_t *) (doorbells + 2);
+    ring_buffer_init(ring, PROCESS_RING_CAPACITY, &doorbells[0], &doorbells[1]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Entries are unpacked like the main process does, into the pages of a list
+        files_list_t list = {0};
+        char op_code;
+        do {
+            size_t size;
+            void *record = ring_peek_wait(ring, &size);
+            op_code = message_op_code(record);
+            if (op_code == COMMAND_CODE_FILE_ENTRY) {
+                any_message_t *msg = (any_message_t *) record;
+                files_list_entry_t *new_entry = new_files_list_entry(&list, msg->list_entry.path);
+                char *stored_path = new_entry->path_and_name;
+                *new_entry = msg->list_entry.payload;
+                new_entry->path_and_name = stored_path;
+                add_entry_to_tail(&list, new_entry);
+            } else if (op_code == COMMAND_CODE_FILE_ENTRIES) {
+                entries_batch_t *batch = (entries_batch_t *) record;
+                packed_entry_t *packed = first_packed_entry(batch);
+                for (uint32_t i=0; i<batch->count; ++i) {
+                    files_list_entry_t *new_entry = new_files_list_entry(&list, packed->path);
+                    unpack_entry(packed, new_entry);
+                    add_entry_to_tail(&list, new_entry);
+                    packed = next_packed_entry(packed);
+                }
+            }
+            ring_release(ring);
+        } while (op_code != COMMAND_CODE_LIST_COMPLETE);
+        clear_files_list(&list);
+        exit(0);
+    }
+
+    files_list_entry_t entry;
+    char path[PATH_SIZE];
+    make_entry(&entry, path);
+    if (batch_size == 0) {
+        for (size_t i=0; i<count; ++i) {
+            ring_send_files_list_element(ring, &entry);
+        }
+    } else {
+        message_batch_t batch;
+        init_message_batch(&batch, ring, COMMAND_CODE_FILE_ENTRIES, true, batch_size);
+        for (size_t i=0; i<count; ++i) {
+            batch_add_entry(&batch, &entry);
+        }
+        flush_message_batch(&batch);
+    }
+    ring_send_list_end(ring);
+    waitpid(pid, NULL, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *bytes = (double) atomic_load(&ring->head) / count;
+
+    munmap(doorbells, size);
+    return elapsed(&start, &end);
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = (argc > 1) ? strtoull(argv[1], NULL, 10) : 200000;
+    uint32_t batch_size = (argc > 2) ? strtoul(argv[2], NULL, 10) : 128;
+
+    printf("transport,entries,seconds,entries_per_s,bytes_per_entry\n");
+    double bytes;
+    double seconds = bench_message_queue(count, &bytes);
+    if (seconds > 0) {
+        printf("mq,%zu,%.6f,%.0f,%.0f\n", count, seconds, count / seconds, bytes);
+    }
+    seconds = bench_ring(count, 0, &bytes);
+    if (seconds > 0) {
+        printf("ring,%zu,%.6f,%.0f,%.0f\n", count, seconds, count / seconds, bytes);
+    }
+    seconds = bench_ring(count, batch_size, &bytes);
+    if (seconds > 0) {
+        printf("ring-batch,%zu,%.6f,%.0f,%.0f\n", count, seconds, count / seconds, bytes);
+    }
+    return 0;
+}
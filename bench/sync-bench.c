@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+
+// End-to-end benchmark of lp25-backup: a tree made by bench-tree-gen is synchronized in several modes
+// (--no-parallel, -n 1..N, --dry-run), with cold and warm page caches. Each run records the wall time,
+// the CPU time and the peak RSS of lp25-backup and its processes, and the number of syscalls they made
+// (counted with ptrace in a second run, as tracing slows the program down). Results are printed as CSV.
+// The trees are generated again before each run, so that every run has the same work to do.
+// Usage: bench-sync [--binary=path] [--generator=path] [--root=dir] [--max-processes=n] [--runs=n]
+//                   [--no-syscalls] [-- generator options]
+// Cold runs need root to drop the caches of the whole system, else only the pages of the trees are dropped.
+
+#define MAX_ARGUMENTS 64
+
+typedef struct {
+    char name[32];
+    char *arguments[4]; // Options of lp25-backup, NULL terminated
+} bench_mode_t;
+
+typedef struct {
+    double wall;
+    double user;
+    double system;
+    long max_rss_kb;
+    long long syscalls;
+    int exit_status;
+} run_result_t;
+
+typedef struct {
+    char *binary;
+    char *generator;
+    char *root;
+    char **generator_arguments;
+    int generator_arguments_count;
+    bool count_syscalls;
+} bench_configuration_t;
+
+/*!
+ * @brief now returns a monotonic time in seconds
+ */
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/*!
+ * @brief remove_entry is the nftw callback removing a tree, children first
+ */
+static int remove_entry(const char *path, const struct stat *stat, int type, struct FTW *ftw) {
+    remove(path);
+    return 0;
+}
+
+/*!
+ * @brief drop_file_cache is the nftw callback writing back a file and removing it from the page cache
+ */
+static int drop_file_cache(const char *path, const struct stat *stat, int type, struct FTW *ftw) {
+    if (type == FTW_F) {
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief read_file_cache is the nftw callback reading a file, so that it is in the page cache
+ */
+static int read_file_cache(const char *path, const struct stat *stat, int type, struct FTW *ftw) {
+    static char buffer[1024 * 1024];
+    if (type == FTW_F) {
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            while (read(fd, buffer, sizeof(buffer)) > 0) {
+            }
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief prepare_caches empties (cold) or fills (warm) the page cache for the trees
+ * The whole cache is dropped when it is allowed, else the pages of the trees are dropped one file at a time.
+ */
+static void prepare_caches(char *root, bool cold) {
+    if (!cold) {
+        nftw(root, read_file_cache, 64, FTW_PHYS);
+        return;
+    }
+    sync();
+    nftw(root, drop_file_cache, 64, FTW_PHYS);
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd != -1) {
+        if (write(fd, "3", 1) != 1) {
+            // Not allowed: the pages of the trees were dropped already
+        }
+        close(fd);
+    }
+}
+
+/*!
+ * @brief generate_trees removes the previous trees and generates them again
+ * @param summary receives the last line printed by the generator (counts of files and bytes)
+ * @return 0 in case of success, -1 else
+ */
+static int generate_trees(bench_configuration_t *configuration, char *summary, size_t summary_size) {
+    nftw(configuration->root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+
+    char command[8192];
+    size_t length = snprintf(command, sizeof(command), "'%s'", configuration->generator);
+    for (int i=0; i<configuration->generator_arguments_count && length < sizeof(command); ++i) {
+        length += snprintf(command + length, sizeof(command) - length, " '%s'", configuration->generator_arguments[i]);
+    }
+    if (length < sizeof(command)) {
+        length += snprintf(command + length, sizeof(command) - length, " '%s'", configuration->root);
+    }
+    FILE *generator = popen(command, "r");
+    if (!generator) {
+        perror("popen");
+        return -1;
+    }
+    summary[0] = '\0';
+    char line[256];
+    while (fgets(line, sizeof(line), generator)) {
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(summary, summary_size, "%s", line);
+    }
+    return (pclose(generator) == 0) ? 0 : -1;
+}
+
+/*!
+ * @brief make_arguments builds the command line of lp25-backup for a mode
+ */
+static void make_arguments(bench_configuration_t *configuration, bench_mode_t *mode, char *source, char *destination, char **arguments) {
+    int count = 0;
+    arguments[count++] = configuration->binary;
+    arguments[count++] = source;
+    arguments[count++] = destination;
+    for (int i=0; mode->arguments[i] && count<MAX_ARGUMENTS-1; ++i) {
+        arguments[count++] = mode->arguments[i];
+    }
+    arguments[count] = NULL;
+}
+
+/*!
+ * @brief start_program forks and executes lp25-backup, its output is discarded
+ * @param traced is true to stop the child until its tracer is ready
+ * @return the pid of the child, -1 in case of error
+ */
+static pid_t start_program(char **arguments, bool traced) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+        execv(arguments[0], arguments);
+        _exit(127);
+    }
+    if (pid == -1) {
+        perror("fork");
+    }
+    return pid;
+}
+
+/*!
+ * @brief time_program runs lp25-backup and measures it
+ * The resource usage of the child includes the processes it forked and waited for.
+ */
+static void time_program(char **arguments, run_result_t *result) {
+    double start = now();
+    pid_t pid = start_program(arguments, false);
+    if (pid == -1) {
+        result->exit_status = -1;
+        return;
+    }
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result->wall = now() - start;
+    result->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6;
+    result->system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+    result->max_rss_kb = usage.ru_maxrss;
+    result->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*!
+ * @brief count_syscalls runs lp25-backup under ptrace and counts the syscalls of all its processes and threads
+ * @return the number of syscalls, -1 if the program can't be traced
+ */
+static long long count_syscalls(char **arguments) {
+    pid_t pid = start_program(arguments, true);
+    if (pid == -1) {
+        return -1;
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        return -1;
+    }
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *) options) == -1) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    // Each syscall stops its thread twice, at the entry and at the exit
+    long long stops = 0;
+    pid_t stopped;
+    while ((stopped = waitpid(-1, &status, __WALL)) != -1) {
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+        int signal = WSTOPSIG(status);
+        if (signal == (SIGTRAP | 0x80)) {
+            ++stops;
+            signal = 0;
+        } else if (signal == SIGTRAP || signal == SIGSTOP) {
+            signal = 0; // Fork, clone and exec events, and the first stop of the new tracees
+        }
+        ptrace(PTRACE_SYSCALL, stopped, NULL, (void *) (long) signal);
+    }
+    return stops / 2;
+}
+
+int main(int argc, char *argv[]) {
+    bench_configuration_t configuration = {
+        .binary = "./lp25-backup", .generator = "./bench-tree-gen", .root = "/tmp/lp25-bench", .count_syscalls = true,
+    };
+    int max_processes = 4, runs = 1;
+    struct option options[] = {
+            {.name="binary",.has_arg=1,.flag=0,.val='b'},
+            {.name="generator",.has_arg=1,.flag=0,.val='g'},
+            {.name="root",.has_arg=1,.flag=0,.val='r'},
+            {.name="max-processes",.has_arg=1,.flag=0,.val='n'},
+            {.name="runs",.has_arg=1,.flag=0,.val='R'},
+            {.name="no-syscalls",.has_arg=0,.flag=0,.val='s'},
+            {.name=0,.has_arg=0,.flag=0,.val=0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'b': configuration.binary = optarg; break;
+            case 'g': configuration.generator = optarg; break;
+            case 'r': configuration.root = optarg; break;
+            case 'n': max_processes = atoi(optarg); break;
+            case 'R': runs = atoi(optarg); break;
+            case 's': configuration.count_syscalls = false; break;
+            default:
+                return 1;
+        }
+    }
+    if (max_processes < 1 || max_processes > 64 || runs < 1) {
+        printf("Processes count must be between 1 and 64, and runs at least 1\n");
+        return 1;
+    }
+    // Remaining arguments (after --) are options of the generator
+    configuration.generator_arguments = argv + optind;
+    configuration.generator_arguments_count = argc - optind;
+
+    bench_mode_t modes[2 + 64];
+    int modes_count = 0;
+    static char counts[64][4];
+    modes[modes_count++] = (bench_mode_t) {.name = "no-parallel", .arguments = {"--no-parallel", NULL}};
+    for (int i=1; i<=max_processes; ++i) {
+        snprintf(counts[i - 1], sizeof(counts[i - 1]), "%d", i);
+        bench_mode_t *mode = &modes[modes_count++];
+        snprintf(mode->name, sizeof(mode->name), "n%d", i);
+        mode->arguments[0] = "-n";
+        mode->arguments[1] = counts[i - 1];
+        mode->arguments[2] = NULL;
+    }
+    modes[modes_count++] = (bench_mode_t) {.name = "dry-run", .arguments = {"--no-parallel", "--dry-run", NULL}};
+
+    char source[4096], destination[4096], summary[256];
+    snprintf(source, sizeof(source), "%s/src", configuration.root);
+    snprintf(destination, sizeof(destination), "%s/dst", configuration.root);
+    char *arguments[MAX_ARGUMENTS];
+
+    printf("mode,cache,run,trees,wall_s,user_s,sys_s,max_rss_kb,syscalls,exit_status\n");
+    for (int m=0; m<modes_count; ++m) {
+        for (int cold=1; cold>=0; --cold) {
+            for (int run=0; run<runs; ++run) {
+                run_result_t result = {.syscalls = -1};
+                make_arguments(&configuration, &modes[m], source, destination, arguments);
+                if (generate_trees(&configuration, summary, sizeof(summary)) == -1) {
+                    fprintf(stderr, "Cannot generate the trees with %s\n", configuration.generator);
+                    return 1;
+                }
+                prepare_caches(configuration.root, cold);
+                time_program(arguments, &result);
+
+                if (configuration.count_syscalls) {
+                    generate_trees(&configuration, summary, sizeof(summary));
+                    prepare_caches(configuration.root, cold);
+                    result.syscalls = count_syscalls(arguments);
+                }
+                printf("%s,%s,%d,\"%s\",%.4f,%.4f,%.4f,%ld,%lld,%d\n", modes[m].name, cold ? "cold" : "warm", run, summary,
+                       result.wall, result.user, result.system, result.max_rss_kb, result.syscalls, result.exit_status);
+                fflush(stdout);
+            }
+        }
+    }
+    nftw(configuration.root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
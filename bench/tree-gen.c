@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Generator of reproducible source and destination trees for the end-to-end benchmark (bench-sync).
+// The same seed and parameters always give the same trees. <root>/dst is the tree of the last backup,
+// <root>/src is the same tree after some files were modified, deleted or added.
+// Directories have fanout subdirectories down to depth, and files files each. File sizes follow
+// a log-uniform distribution between the minimum and maximum sizes (many small files, a few large ones).
+// Usage: bench-tree-gen [options] <root>
+//   --depth=<n> (default 3) --fanout=<n> (default 4) --files=<n> per directory (default 16)
+//   --min-size=<bytes> (default 512) --max-size=<bytes> (default 1048576)
+//   --modified=<fraction> --deleted=<fraction> --added=<fraction> of the files (default 0.05 each)
+//   --seed=<n> (default 1)
+
+#define BASE_MTIME 1600000000 // Files that didn't change have this time in both trees
+#define WRITE_BLOCK_SIZE (64 * 1024)
+
+typedef struct {
+    int depth;
+    int fanout;
+    int files;
+    uint64_t min_size;
+    uint64_t max_size;
+    double modified;
+    double deleted;
+    double added;
+    uint64_t seed;
+} tree_parameters_t;
+
+typedef struct {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t modified;
+    uint64_t deleted;
+    uint64_t added;
+} tree_counts_t;
+
+/*!
+ * @brief next_random is splitmix64, a small generator whose output only depends on the seed
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*!
+ * @brief random_fraction returns a number in [0, 1)
+ */
+static double random_fraction(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*!
+ * @brief random_size draws a file size, log-uniform between the minimum and maximum sizes
+ */
+static uint64_t random_size(tree_parameters_t *parameters, uint64_t *state) {
+    double low = log((double) parameters->min_size), high = log((double) parameters->max_size);
+    return (uint64_t) exp(low + (high - low) * random_fraction(state));
+}
+
+/*!
+ * @brief write_file writes a file of pseudo-random content and sets its mode and time
+ * @param path is the path of the file
+ * @param size is the size of the file
+ * @param content_seed gives the content, files written with the same seed are equal
+ * @param mtime is the modification time of the file
+ * @return 0 in case of success, -1 else
+ */
+static int write_file(char *path, uint64_t size, uint64_t content_seed, time_t mtime) {
+    static uint64_t block[WRITE_BLOCK_SIZE / sizeof(uint64_t)];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    uint64_t state = content_seed;
+    for (uint64_t written=0; written<size; ) {
+        for (size_t i=0; i<sizeof(block)/sizeof(uint64_t); ++i) {
+            block[i] = next_random(&state);
+        }
+        size_t length = (size - written < WRITE_BLOCK_SIZE) ? size - written : WRITE_BLOCK_SIZE;
+        if (write(fd, block, length) != (ssize_t) length) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        written += length;
+    }
+    struct timespec times[2] = {{.tv_sec = mtime}, {.tv_sec = mtime}};
+    futimens(fd, times);
+    close(fd);
+    return 0;
+}
+
+/*!
+ * @brief generate_directory writes the files of a directory in both trees, and recurses in its subdirectories
+ * @param parameters is the shape of the trees
+ * @param source is the path of the directory in the source tree
+ * @param destination is the path of the directory in the destination tree
+ * @param level is the depth of the directory, 0 for the roots
+ * @param state is the random generator, drawn in the same order for the same parameters
+ * @param counts is updated with what was written
+ * @return 0 in case of success, -1 else
+ */
+static int generate_directory(tree_parameters_t *parameters, char *source, char *destination, int level, uint64_t *state, tree_counts_t *counts) {
+    if ((mkdir(source, 0755) == -1 && errno != EEXIST) || (mkdir(destination, 0755) == -1 && errno != EEXIST)) {
+        perror("mkdir");
+        return -1;
+    }
+
+    char source_path[4096], destination_path[4096];
+    for (int i=0; i<parameters->files; ++i) {
+        snprintf(source_path, sizeof(source_path), "%s/file-%04d.dat", source, i);
+        snprintf(destination_path, sizeof(destination_path), "%s/file-%04d.dat", destination, i);
+        uint64_t size = random_size(parameters, state);
+        uint64_t content_seed = next_random(state);
+        double draw = random_fraction(state);
+        int result = 0;
+        if (draw < parameters->deleted) {
+            // Deleted from the source since the backup
+            result = write_file(destination_path, size, content_seed, BASE_MTIME);
+            ++counts->deleted;
+        } else if (draw < parameters->deleted + parameters->added) {
+            // Created in the source since the backup
+            result = write_file(source_path, size, content_seed, BASE_MTIME + 3600);
+            ++counts->added;
+        } else if (draw < parameters->deleted + parameters->added + parameters->modified) {
+            // Same size, different content and time
+            result = write_file(destination_path, size, content_seed, BASE_MTIME);
+            if (result == 0) {
+                result = write_file(source_path, size, content_seed + 1, BASE_MTIME + 3600);
+            }
+            ++counts->modified;
+        } else {
+            result = write_file(destination_path, size, content_seed, BASE_MTIME);
+            if (result == 0) {
+                result = write_file(source_path, size, content_seed, BASE_MTIME);
+            }
+        }
+        if (result == -1) {
+            return -1;
+        }
+        ++counts->files;
+        counts->bytes += size;
+    }
+
+    if (level < parameters->depth) {
+        for (int i=0; i<parameters->fanout; ++i) {
+            snprintf(source_path, sizeof(source_path), "%s/dir-%03d", source, i);
+            snprintf(destination_path, sizeof(destination_path), "%s/dir-%03d", destination, i);
+            if (generate_directory(parameters, source_path, destination_path, level + 1, state, counts) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    tree_parameters_t parameters = {
+        .depth = 3, .fanout = 4, .files = 16, .min_size = 512, .max_size = 1024 * 1024,
+        .modified = 0.05, .deleted = 0.05, .added = 0.05, .seed = 1,
+    };
+    struct option options[] = {
+            {.name="depth",.has_arg=1,.flag=0,.val='d'},
+            {.name="fanout",.has_arg=1,.flag=0,.val='f'},
+            {.name="files",.has_arg=1,.flag=0,.val='n'},
+            {.name="min-size",.has_arg=1,.flag=0,.val='s'},
+            {.name="max-size",.has_arg=1,.flag=0,.val='S'},
+            {.name="modified",.has_arg=1,.flag=0,.val='m'},
+            {.name="deleted",.has_arg=1,.flag=0,.val='x'},
+            {.name="added",.has_arg=1,.flag=0,.val='a'},
+            {.name="seed",.has_arg=1,.flag=0,.val='r'},
+            {.name=0,.has_arg=0,.flag=0,.val=0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'd': parameters.depth = atoi(optarg); break;
+            case 'f': parameters.fanout = atoi(optarg); break;
+            case 'n': parameters.files = atoi(optarg); break;
+            case 's': parameters.min_size = strtoull(optarg, NULL, 10); break;
+            case 'S': parameters.max_size = strtoull(optarg, NULL, 10); break;
+            case 'm': parameters.modified = atof(optarg); break;
+            case 'x': parameters.deleted = atof(optarg); break;
+            case 'a': parameters.added = atof(optarg); break;
+            case 'r': parameters.seed = strtoull(optarg, NULL, 10); break;
+            default:
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || parameters.min_size < 1 || parameters.max_size < parameters.min_size
+        || parameters.modified + parameters.deleted + parameters.added > 1.0) {
+        printf("Usage: %s [--depth=n] [--fanout=n] [--files=n] [--min-size=bytes] [--max-size=bytes]\n"
+               "          [--modified=fraction] [--deleted=fraction] [--added=fraction] [--seed=n] <root>\n", argv[0]);
+        return 1;
+    }
+
+    char source[4096], destination[4096];
+    snprintf(source, sizeof(source), "%s/src", argv[optind]);
+    snprintf(destination, sizeof(destination), "%s/dst", argv[optind]);
+    if (mkdir(argv[optind], 0755) == -1 && errno != EEXIST) {
+        perror(argv[optind]);
+        return 1;
+    }
+    uint64_t state = parameters.seed;
+    tree_counts_t counts = {0};
+    if (generate_directory(&parameters, source, destination, 0, &state, &counts) == -1) {
+        return 1;
+    }
+    printf("files=%llu bytes=%llu modified=%llu deleted=%llu added=%llu\n", (unsigned long long) counts.files,
+           (unsigned long long) counts.bytes, (unsigned long long) counts.modified, (unsigned long long) counts.deleted,
+           (unsigned long long) counts.added);
+    return 0;
+}
@@ -0,0 +1,362 @@
+#include <blake3.h>
+#include <string.h>
+#include <stdbool.h>
+
+// BLAKE3 (https://github.com/BLAKE3-team/BLAKE3) in hash mode. Whole chunks are hashed several at a time,
+// one chunk per vector lane: 4 lanes with SSE2, 8 lanes with AVX2 (chosen at run time).
+// The compression rounds are written once with macros, and apply to scalars and vectors alike.
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+static const uint32_t IV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+// Message words used by each of the 7 rounds (the permutation applied round after round)
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(v, a, b, c, d, x, y) \
+    v[a] = v[a] + v[b] + (x); \
+    v[d] = ROTR32(v[d] ^ v[a], 16); \
+    v[c] = v[c] + v[d]; \
+    v[b] = ROTR32(v[b] ^ v[c], 12); \
+    v[a] = v[a] + v[b] + (y); \
+    v[d] = ROTR32(v[d] ^ v[a], 8); \
+    v[c] = v[c] + v[d]; \
+    v[b] = ROTR32(v[b] ^ v[c], 7);
+
+#define ROUNDS(v, m) \
+    for (int r=0; r<7; ++r) { \
+        const uint8_t *s = MSG_SCHEDULE[r]; \
+        G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]) \
+        G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]) \
+        G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]) \
+        G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]) \
+        G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]) \
+        G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]) \
+        G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]) \
+        G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]) \
+    }
+
+// A node of the tree, ready to be compressed into a chaining value or into the root output
+typedef struct {
+    uint32_t cv[8];
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint64_t counter;
+    uint8_t block_len;
+    uint8_t flags;
+} blake3_node_t;
+
+// Hashes lanes whole chunks starting at input, with counters counter, counter + 1, etc.
+typedef void (*hash_chunks_t)(const uint8_t *input, uint64_t counter, uint32_t cvs[][8]);
+
+static uint32_t load32(const uint8_t *data) {
+    return (uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+static void store32(uint8_t *data, uint32_t value) {
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+/*!
+ * @brief compress is the BLAKE3 compression function
+ * @param out receives the 16 output words (the chaining value is the first 8)
+ */
+static void compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t out[16]) {
+    uint32_t m[16];
+    for (int i=0; i<16; ++i) {
+        m[i] = load32(block + 4 * i);
+    }
+    uint32_t v[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3], (uint32_t) counter, (uint32_t) (counter >> 32), block_len, flags,
+    };
+
+    ROUNDS(v, m)
+
+    for (int i=0; i<8; ++i) {
+        out[i] = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ cv[i];
+    }
+}
+
+/*!
+ * @brief DEFINE_HASH_CHUNKS defines a hash_chunks_t function for a vector type of lanes 32 bits words
+ * Each lane compresses the 16 blocks of its own chunk, so the rounds are the scalar ones applied to vectors.
+ */
+#define DEFINE_HASH_CHUNKS(name, vector_t, lanes, attributes) \
+attributes static void name(const uint8_t *input, uint64_t counter, uint32_t cvs[][8]) { \
+    vector_t h[8], v[16], m[16]; \
+    vector_t zero = {0}; \
+    vector_t counter_low, counter_high; \
+    for (int i=0; i<8; ++i) { \
+        h[i] = zero + IV[i]; \
+    } \
+    for (int lane=0; lane<lanes; ++lane) { \
+        counter_low[lane] = (uint32_t) (counter + lane); \
+        counter_high[lane] = (uint32_t) ((counter + lane) >> 32); \
+    } \
+    for (int block=0; block<BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; ++block) { \
+        uint32_t words[16][lanes]; \
+        for (int lane=0; lane<lanes; ++lane) { \
+            const uint8_t *data = input + lane * BLAKE3_CHUNK_LEN + block * BLAKE3_BLOCK_LEN; \
+            for (int i=0; i<16; ++i) { \
+                words[i][lane] = load32(data + 4 * i); \
+            } \
+        } \
+        for (int i=0; i<16; ++i) { \
+            memcpy(&m[i], words[i], sizeof(vector_t)); \
+        } \
+        uint32_t flags = (block == 0 ? CHUNK_START : 0) | (block == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? CHUNK_END : 0); \
+        for (int i=0; i<8; ++i) { \
+            v[i] = h[i]; \
+        } \
+        v[8] = zero + IV[0]; \
+        v[9] = zero + IV[1]; \
+        v[10] = zero + IV[2]; \
+        v[11] = zero + IV[3]; \
+        v[12] = counter_low; \
+        v[13] = counter_high; \
+        v[14] = zero + BLAKE3_BLOCK_LEN; \
+        v[15] = zero + flags; \
+        ROUNDS(v, m) \
+        for (int i=0; i<8; ++i) { \
+            h[i] = v[i] ^ v[i + 8]; \
+        } \
+    } \
+    for (int lane=0; lane<lanes; ++lane) { \
+        for (int i=0; i<8; ++i) { \
+            cvs[lane][i] = h[i][lane]; \
+        } \
+    } \
+}
+
+typedef uint32_t blake3_u32x4_t __attribute__((vector_size(16)));
+DEFINE_HASH_CHUNKS(hash_chunks_4, blake3_u32x4_t, 4, )
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLAKE3_X86 1
+typedef uint32_t blake3_u32x8_t __attribute__((vector_size(32)));
+DEFINE_HASH_CHUNKS(hash_chunks_8_avx2, blake3_u32x8_t, 8, __attribute__((target("avx2"))))
+#endif
+
+static struct {
+    bool is_selected;
+    hash_chunks_t hash_chunks;
+    size_t lanes;
+    const char *name;
+} implementation;
+
+/*!
+ * @brief select_implementation picks the widest vectors supported by the CPU
+ */
+static void select_implementation(void) {
+    if (implementation.is_selected) {
+        return;
+    }
+    implementation.hash_chunks = hash_chunks_4;
+    implementation.lanes = 4;
+    implementation.name = "4 lanes";
+#ifdef BLAKE3_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        implementation.hash_chunks = hash_chunks_8_avx2;
+        implementation.lanes = 8;
+        implementation.name = "avx2";
+    } else {
+        implementation.name = "sse2";
+    }
+#endif
+    implementation.is_selected = true;
+}
+
+static void chunk_state_init(blake3_chunk_state_t *chunk, uint64_t chunk_counter) {
+    memcpy(chunk->cv, IV, sizeof(IV));
+    chunk->chunk_counter = chunk_counter;
+    memset(chunk->block, 0, sizeof(chunk->block));
+    chunk->block_len = 0;
+    chunk->blocks_compressed = 0;
+}
+
+static size_t chunk_state_length(blake3_chunk_state_t *chunk) {
+    return BLAKE3_BLOCK_LEN * chunk->blocks_compressed + chunk->block_len;
+}
+
+static uint8_t chunk_start_flag(blake3_chunk_state_t *chunk) {
+    return (chunk->blocks_compressed == 0) ? CHUNK_START : 0;
+}
+
+/*!
+ * @brief chunk_state_update adds data to the current chunk
+ * A full block is only compressed when more data comes, as the last block gets the CHUNK_END flag.
+ */
+static void chunk_state_update(blake3_chunk_state_t *chunk, const uint8_t *input, size_t length) {
+    while (length > 0) {
+        if (chunk->block_len == BLAKE3_BLOCK_LEN) {
+            uint32_t out[16];
+            compress(chunk->cv, chunk->block, chunk->chunk_counter, BLAKE3_BLOCK_LEN, chunk_start_flag(chunk), out);
+            memcpy(chunk->cv, out, sizeof(chunk->cv));
+            ++chunk->blocks_compressed;
+            memset(chunk->block, 0, sizeof(chunk->block));
+            chunk->block_len = 0;
+        }
+        size_t take = BLAKE3_BLOCK_LEN - chunk->block_len;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(chunk->block + chunk->block_len, input, take);
+        chunk->block_len += take;
+        input += take;
+        length -= take;
+    }
+}
+
+static void chunk_state_node(blake3_chunk_state_t *chunk, blake3_node_t *node) {
+    memcpy(node->cv, chunk->cv, sizeof(node->cv));
+    memcpy(node->block, chunk->block, sizeof(node->block));
+    node->counter = chunk->chunk_counter;
+    node->block_len = chunk->block_len;
+    node->flags = chunk_start_flag(chunk) | CHUNK_END;
+}
+
+static void node_chaining_value(blake3_node_t *node, uint32_t cv[8]) {
+    uint32_t out[16];
+    compress(node->cv, node->block, node->counter, node->block_len, node->flags, out);
+    memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void parent_node(const uint32_t left[8], const uint32_t right[8], blake3_node_t *node) {
+    memcpy(node->cv, IV, sizeof(IV));
+    for (int i=0; i<8; ++i) {
+        store32(node->block + 4 * i, left[i]);
+        store32(node->block + 32 + 4 * i, right[i]);
+    }
+    node->counter = 0;
+    node->block_len = BLAKE3_BLOCK_LEN;
+    node->flags = PARENT;
+}
+
+/*!
+ * @brief add_chunk_chaining_value pushes the chaining value of a completed chunk
+ * Subtrees are merged as soon as they are complete: the number of trailing zeros of total_chunks
+ * is the number of merges to do.
+ */
+static void add_chunk_chaining_value(blake3_hasher_t *hasher, uint32_t cv[8], uint64_t total_chunks) {
+    uint32_t new_cv[8];
+    memcpy(new_cv, cv, sizeof(new_cv));
+    while ((total_chunks & 1) == 0) {
+        blake3_node_t parent;
+        parent_node(hasher->cv_stack[--hasher->cv_stack_len], new_cv, &parent);
+        node_chaining_value(&parent, new_cv);
+        total_chunks >>= 1;
+    }
+    memcpy(hasher->cv_stack[hasher->cv_stack_len++], new_cv, sizeof(new_cv));
+}
+
+/*!
+ * @brief blake3_init initializes a hasher
+ * @param hasher is the hasher to initialize
+ */
+void blake3_init(blake3_hasher_t *hasher) {
+    select_implementation();
+    chunk_state_init(&hasher->chunk, 0);
+    hasher->cv_stack_len = 0;
+}
+
+/*!
+ * @brief blake3_update adds data to the hash
+ * Whole chunks are hashed in parallel when at least one more byte follows them: the last chunk
+ * always stays in the chunk state, since it may be the root.
+ * @param hasher is the hasher
+ * @param input is the data
+ * @param length is the length of the data
+ */
+void blake3_update(blake3_hasher_t *hasher, const uint8_t *input, size_t length) {
+    while (length > 0) {
+        if (chunk_state_length(&hasher->chunk) == BLAKE3_CHUNK_LEN) {
+            blake3_node_t node;
+            uint32_t cv[8];
+            chunk_state_node(&hasher->chunk, &node);
+            node_chaining_value(&node, cv);
+            uint64_t total_chunks = hasher->chunk.chunk_counter + 1;
+            add_chunk_chaining_value(hasher, cv, total_chunks);
+            chunk_state_init(&hasher->chunk, total_chunks);
+        }
+
+        if (chunk_state_length(&hasher->chunk) == 0) {
+            uint64_t counter = hasher->chunk.chunk_counter;
+            size_t batch_length = implementation.lanes * BLAKE3_CHUNK_LEN;
+            while (length > batch_length) {
+                uint32_t cvs[8][8];
+                implementation.hash_chunks(input, counter, cvs);
+                for (size_t lane=0; lane<implementation.lanes; ++lane) {
+                    add_chunk_chaining_value(hasher, cvs[lane], counter + lane + 1);
+                }
+                counter += implementation.lanes;
+                input += batch_length;
+                length -= batch_length;
+            }
+            hasher->chunk.chunk_counter = counter;
+        }
+
+        size_t take = BLAKE3_CHUNK_LEN - chunk_state_length(&hasher->chunk);
+        if (take > length) {
+            take = length;
+        }
+        chunk_state_update(&hasher->chunk, input, take);
+        input += take;
+        length -= take;
+    }
+}
+
+/*!
+ * @brief blake3_finalize computes the hash of all the data added so far
+ * @param hasher is the hasher, it is not modified
+ * @param output receives the hash
+ * @param output_length is the number of bytes to output (BLAKE3_OUT_LEN is the standard size,
+ * shorter outputs are prefixes of it)
+ */
+void blake3_finalize(blake3_hasher_t *hasher, uint8_t *output, size_t output_length) {
+    blake3_node_t node;
+    chunk_state_node(&hasher->chunk, &node);
+    for (int i=hasher->cv_stack_len; i>0; --i) {
+        uint32_t cv[8];
+        node_chaining_value(&node, cv);
+        parent_node(hasher->cv_stack[i - 1], cv, &node);
+    }
+
+    for (uint64_t block_counter=0; output_length > 0; ++block_counter) {
+        uint32_t out[16];
+        uint8_t bytes[BLAKE3_BLOCK_LEN];
+        compress(node.cv, node.block, block_counter, node.block_len, node.flags | ROOT, out);
+        for (int i=0; i<16; ++i) {
+            store32(bytes + 4 * i, out[i]);
+        }
+        size_t take = (output_length < BLAKE3_BLOCK_LEN) ? output_length : BLAKE3_BLOCK_LEN;
+        memcpy(output, bytes, take);
+        output += take;
+        output_length -= take;
+    }
+}
+
+/*!
+ * @brief blake3_implementation gives the name of the parallel chunks implementation in use, for reports
+ */
+const char *blake3_implementation(void) {
+    select_implementation();
+    return implementation.name;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_MAX_DEPTH 54
+
+// State of the chunk being hashed
+typedef struct {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+} blake3_chunk_state_t;
+
+// Streaming state of BLAKE3 (hash mode, no key)
+typedef struct {
+    blake3_chunk_state_t chunk;
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8]; // Chaining values of the subtrees not merged yet
+    uint8_t cv_stack_len;
+} blake3_hasher_t;
+
+void blake3_init(blake3_hasher_t *hasher);
+void blake3_update(blake3_hasher_t *hasher, const uint8_t *input, size_t length);
+void blake3_finalize(blake3_hasher_t *hasher, uint8_t *output, size_t output_length);
+const char *blake3_implementation(void);
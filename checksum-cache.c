@@ -0,0 +1,308 @@
+#include <checksum-cache.h>
+#include <defines.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+
+// The cache state is per process: the mapping is opened once by the main process and inherited
+// by the forked analyzers, each process keeps its own pending records and saves them.
+static struct {
+    char path[PATH_SIZE];
+    bool is_open;
+    bool force_rehash;
+    bool is_read_only; // Nothing is recorded nor saved, with --dry-run
+    checksum_cache_header_t *mapping; // NULL when there was no valid cache file
+    size_t mapping_size;
+    checksum_record_t *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+} cache;
+
+// Digests are recorded by all the workers in threads mode
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*!
+ * @brief hash_key computes the bucket hash of a key from its device and inode
+ * @param key is the key to hash
+ * @return the hash value
+ */
+static uint64_t hash_key(checksum_key_t *key) {
+    uint64_t hash = key->inode * 0x9e3779b97f4a7c15ULL ^ key->device;
+    hash ^= hash >> 31;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    return hash ^ (hash >> 29);
+}
+
+/*!
+ * @brief same_file tells if two keys identify the same file (device and inode)
+ */
+static bool same_file(checksum_key_t *lhs, checksum_key_t *rhs) {
+    return lhs->device == rhs->device && lhs->inode == rhs->inode;
+}
+
+/*!
+ * @brief find_slot finds the slot of a file in a table, or the free slot where it would go
+ * @param records is the table
+ * @param capacity is the size of the table, a power of 2 (the table is never full)
+ * @param key is the key of the file
+ * @return a pointer to the slot
+ */
+static checksum_record_t *find_slot(checksum_record_t *records, uint64_t capacity, checksum_key_t *key) {
+    uint64_t index = hash_key(key) & (capacity - 1);
+    while (records[index].used && !same_file(&records[index].key, key)) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &records[index];
+}
+
+/*!
+ * @brief map_cache_file maps a cache file and checks it
+ * @param path is the path of the cache file
+ * @param size receives the size of the mapping
+ * @return the mapping, NULL if the file doesn't exist or is not a valid cache
+ */
+static checksum_cache_header_t *map_cache_file(char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat file_stat;
+    checksum_cache_header_t *mapping = NULL;
+    if (fstat(fd, &file_stat) == 0 && (size_t) file_stat.st_size >= sizeof(checksum_cache_header_t)) {
+        mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            mapping = NULL;
+        }
+    }
+    close(fd);
+    if (!mapping) {
+        return NULL;
+    }
+
+    // A file that doesn't match its header is ignored, it is replaced on the next save
+    uint64_t capacity = mapping->capacity;
+    if (memcmp(mapping->magic, CHECKSUM_CACHE_MAGIC, sizeof(mapping->magic)) != 0 || capacity == 0 || (capacity & (capacity - 1)) != 0
+        || mapping->count >= capacity || sizeof(checksum_cache_header_t) + capacity * sizeof(checksum_record_t) != (size_t) file_stat.st_size) {
+        printf("Ignoring invalid checksum cache %s\n", path);
+        munmap(mapping, file_stat.st_size);
+        return NULL;
+    }
+
+    *size = file_stat.st_size;
+    return mapping;
+}
+
+/*!
+ * @brief open_checksum_cache opens the checksum cache, to be used by get_file_stats
+ * @param path is the path of the cache file. It is created on the first save if it doesn't exist
+ * @param force_rehash is true to ignore the cached digests (they are still updated)
+ * @param is_read_only is true to only look digests up, the file is then never written
+ * @return 0 in case of success, -1 else
+ */
+int open_checksum_cache(char *path, bool force_rehash, bool is_read_only) {
+    if (!path || strlen(path) >= PATH_SIZE - 32) {
+        return -1;
+    }
+
+    close_checksum_cache();
+    strcpy(cache.path, path);
+    cache.force_rehash = force_rehash;
+    cache.is_read_only = is_read_only;
+    cache.mapping = map_cache_file(path, &cache.mapping_size);
+    if (cache.mapping) {
+        // Lookups are random accesses in the table
+        madvise(cache.mapping, cache.mapping_size, MADV_RANDOM);
+    }
+    cache.is_open = true;
+    return 0;
+}
+
+/*!
+ * @brief lookup_checksum looks for the digest of a file in the cache
+ * @param key is the stat tuple of the file
+ * @param digest receives the digest when it is found
+ * @return true if the digest was found with the same stat tuple, false else
+ */
+bool lookup_checksum(checksum_key_t *key, uint8_t digest[16]) {
+    if (!cache.is_open || !cache.mapping || cache.force_rehash || !key) {
+        return false;
+    }
+
+    checksum_record_t *records = (checksum_record_t *) (cache.mapping + 1);
+    checksum_record_t *slot = find_slot(records, cache.mapping->capacity, key);
+    if (!slot->used || slot->key.size != key->size || slot->key.mtime_sec != key->mtime_sec || slot->key.mtime_nsec != key->mtime_nsec
+        || slot->key.algorithm != key->algorithm) {
+        return false;
+    }
+    memcpy(digest, slot->digest, 16);
+    return true;
+}
+
+/*!
+ * @brief record_checksum keeps a computed digest, to be written to the cache by save_checksum_cache
+ * @param key is the stat tuple of the file when the digest was computed
+ * @param digest is the digest
+ * @return 0 in case of success (or if the cache is read-only), -1 else
+ */
+int record_checksum(checksum_key_t *key, uint8_t digest[16]) {
+    if (!cache.is_open || !key) {
+        return -1;
+    }
+    if (cache.is_read_only) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pending_lock);
+    if (cache.pending_count == cache.pending_capacity) {
+        size_t new_capacity = (cache.pending_capacity == 0) ? 1024 : cache.pending_capacity * 2;
+        checksum_record_t *new_pending = realloc(cache.pending, new_capacity * sizeof(checksum_record_t));
+        if (!new_pending) {
+            pthread_mutex_unlock(&pending_lock);
+            return -1;
+        }
+        cache.pending = new_pending;
+        cache.pending_capacity = new_capacity;
+    }
+
+    checksum_record_t *record = &cache.pending[cache.pending_count++];
+    memset(record, 0, sizeof(checksum_record_t));
+    record->key = *key;
+    memcpy(record->digest, digest, 16);
+    record->used = 1;
+    pthread_mutex_unlock(&pending_lock);
+    return 0;
+}
+
+/*!
+ * @brief insert_records inserts records in a table, replacing the records of the same files
+ * @param records is the table
+ * @param capacity is the size of the table
+ * @param source is the array of records to insert (unused records are skipped)
+ * @param count is the size of source
+ * @return the number of records added to the table (replaced ones are not counted)
+ */
+static uint64_t insert_records(checksum_record_t *records, uint64_t capacity, checksum_record_t *source, uint64_t count) {
+    uint64_t added = 0;
+    for (uint64_t i=0; i<count; ++i) {
+        if (!source[i].used) {
+            continue;
+        }
+        checksum_record_t *slot = find_slot(records, capacity, &source[i].key);
+        if (!slot->used) {
+            ++added;
+        }
+        *slot = source[i];
+    }
+    return added;
+}
+
+/*!
+ * @brief save_checksum_cache merges the recorded digests into the cache file
+ * Several processes may save at the same time, so the update is serialized with a lock file, and
+ * merged with the current content of the file (not the one mapped at open time). The new table is
+ * written to a temporary file which replaces the cache with rename: after a crash, the cache is
+ * either the old or the new one.
+ * @return 0 in case of success (or nothing to save), -1 else
+ */
+int save_checksum_cache(void) {
+    if (!cache.is_open || cache.pending_count == 0) {
+        return 0;
+    }
+
+    char lock_path[PATH_SIZE + 32], temp_path[PATH_SIZE + 32];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", cache.path);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", cache.path, (int) getpid());
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1) {
+        perror("checksum cache lock");
+        if (lock_fd != -1) {
+            close(lock_fd);
+        }
+        return -1;
+    }
+
+    size_t current_size = 0;
+    checksum_cache_header_t *current = map_cache_file(cache.path, &current_size);
+    uint64_t current_count = current ? current->count : 0;
+
+    // The table is kept at most half full
+    uint64_t capacity = 1024;
+    while (capacity < 2 * (current_count + cache.pending_count)) {
+        capacity *= 2;
+    }
+
+    int result = -1;
+    size_t size = sizeof(checksum_cache_header_t) + capacity * sizeof(checksum_record_t);
+    checksum_cache_header_t *table = calloc(1, size);
+    if (table) {
+        checksum_record_t *records = (checksum_record_t *) (table + 1);
+        memcpy(table->magic, CHECKSUM_CACHE_MAGIC, sizeof(table->magic));
+        table->capacity = capacity;
+        if (current) {
+            table->count += insert_records(records, capacity, (checksum_record_t *) (current + 1), current->capacity);
+        }
+        table->count += insert_records(records, capacity, cache.pending, cache.pending_count);
+
+        int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            size_t written = 0;
+            while (written < size) {
+                ssize_t count = write(fd, (char *) table + written, size - written);
+                if (count <= 0) {
+                    break;
+                }
+                written += count;
+            }
+            bool is_written = (written == size) && fsync(fd) == 0;
+            if (close(fd) != 0) {
+                is_written = false;
+            }
+            if (is_written && rename(temp_path, cache.path) == 0) {
+                result = 0;
+            } else {
+                perror("checksum cache write");
+                unlink(temp_path);
+            }
+        }
+        free(table);
+    }
+
+    if (result == 0) {
+        // Make the rename durable
+        char dir_path[PATH_SIZE];
+        strcpy(dir_path, cache.path);
+        int dir_fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd != -1) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+        cache.pending_count = 0;
+    }
+
+    if (current) {
+        munmap(current, current_size);
+    }
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+    return result;
+}
+
+/*!
+ * @brief close_checksum_cache releases the cache, without saving the recorded digests
+ */
+void close_checksum_cache(void) {
+    if (cache.mapping) {
+        munmap(cache.mapping, cache.mapping_size);
+    }
+    free(cache.pending);
+    memset(&cache, 0, sizeof(cache));
+}
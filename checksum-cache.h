@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CHECKSUM_CACHE_MAGIC "LP25CSC2"
+
+// The stat tuple a digest was computed from. If any field changes, the digest must be computed again
+typedef struct {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t algorithm; // A hash_algorithm_t, digests of other algorithms don't match
+} checksum_key_t;
+
+// On disk, the cache is a header followed by an open addressing hash table of records
+typedef struct {
+    char magic[8];
+    uint64_t capacity; // Number of records, a power of 2
+    uint64_t count; // Number of used records
+} checksum_cache_header_t;
+
+typedef struct {
+    checksum_key_t key;
+    uint8_t digest[16];
+    uint8_t used;
+    uint8_t reserved[7];
+} checksum_record_t;
+
+int open_checksum_cache(char *path, bool force_rehash, bool is_read_only);
+bool lookup_checksum(checksum_key_t *key, uint8_t digest[16]);
+int record_checksum(checksum_key_t *key, uint8_t digest[16]);
+int save_checksum_cache(void);
+void close_checksum_cache(void);
@@ -4,6 +4,12 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <messages.h>
+#include <delta-copy.h>
+#include <watch.h>
+#include <sorted-runs.h>
 
 typedef enum {DATE_SIZE_ONLY, NO_PARALLEL} long_opt_values;
 
@@ -17,9 +23,29 @@ void display_help(char *my_name) {
     printf("Options: \t-n <processes count>\tnumber of processes for file calculations\n");
     printf("         \t-h display help (this text)\n");
     printf("         \t--date_size_only disables MD5 calculation for files\n");
+    printf("         \t--hash=md5|xxh3|blake3 selects the hash used to compare files (default md5)\n");
+    printf("         \t--threads[=<count>] lists and analyzes files with threads instead of processes (default: one per CPU)\n");
+    printf("         \t--batch-size=<count> sends at most count entries per message between processes (default %d)\n", DEFAULT_BATCH_COUNT);
+    printf("         \t--walkers[=<count>] walks each tree with count threads in its lister process (default 1, one per CPU without count)\n");
     printf("         \t--no-parallel disables parallel computing (cancels values of option -n)\n");
     printf("         \t--dry-run lists the changes that would need to be synchronized but doesn't perform them\n");
     printf("         \t-v enables verbose mode\n");
+    printf("         \t--checksum-cache=<file> keeps the MD5 sums of unchanged files in file between runs\n");
+    printf("         \t--rehash computes all MD5 sums again (and refreshes the checksum cache)\n");
+    printf("         \t--pipeline copies the differences while the source and the destination are listed (by two threads)\n");
+    printf("         \t--copy-workers[=<count>] copies files with count threads, large files in ranges (default 1, one per CPU without count)\n");
+    printf("         \t--delta-threshold=<bytes> only writes the changed blocks of existing files of at least this size (default %llu, 0 disables)\n", DELTA_DEFAULT_THRESHOLD);
+    printf("         \t--stats=<file> writes timers and counters of the run as JSON to file (- for the standard output)\n");
+    printf("         \t--watch[=<ms>] keeps copying the changes of the source after the synchronization, once no change came for ms (default %d)\n", WATCH_DEFAULT_DEBOUNCE_MS);
+    printf("         \t--trust-manifest[=<percent>] loads the destination from the manifest of the last synchronization instead of listing it,\n"
+           "         \t\tafter checking percent of its entries (default 0)\n");
+    printf("         \t--trace=<file> records the scans, stats, hashes, waits and copies of every process and thread to file (Chrome trace)\n");
+    printf("         \t--dir-cache=<file> keeps the listings of the directories in file, unchanged directories are not read again\n");
+    printf("         \t--trust-dir-mtime also keeps the properties of the files of unchanged source directories (a file rewritten in place is missed)\n");
+    printf("         \t--io-uring stats the files of a directory or of a batch, and opens and closes the files of a copy batch, at once with io_uring (when the kernel allows it)\n");
+    printf("         \t--io-uring-copy also copies the small files of a batch with chained io_uring requests (often slower, compare with bench-copy)\n");
+    printf("         \t--max-memory=<size>[K|M|G] lists the trees in the main process, spilling the lists to sorted runs in $TMPDIR\n"
+           "         \t\tonce they take size bytes, and streams the diff from their merge (no manifest is written)\n");
 }
 
 /*!
@@ -38,9 +64,13 @@ void init_configuration(configuration_t *the_config) {
 
     //Initialisation de is_parallel
     the_config->is_parallel = true;
+    the_config->threads_count = 0;
+    the_config->batch_size = DEFAULT_BATCH_COUNT;
+    the_config->walkers_count = 1;
 
     //Initialisation de uses_md5
     the_config->uses_md5 = true;
+    the_config->hash_algorithm = HASH_MD5;
 
     //Initialisation de is_verbose
     the_config->is_verbose = false;
@@ -48,6 +78,24 @@ void init_configuration(configuration_t *the_config) {
     //Initialisation de is_dry_run
     the_config->is_dry_run = false;
 
+    //Initialisation du cache des sommes MD5 (désactivé)
+    strcpy(the_config->checksum_cache, "");
+    the_config->force_rehash = false;
+    the_config->is_pipelined = false;
+    the_config->is_watching = false;
+    the_config->watch_debounce_ms = WATCH_DEFAULT_DEBOUNCE_MS;
+    the_config->copy_workers = 1;
+    the_config->delta_threshold = DELTA_DEFAULT_THRESHOLD;
+    strcpy(the_config->stats_path, "");
+    strcpy(the_config->trace_path, "");
+    the_config->trust_manifest = false;
+    the_config->manifest_verify_percent = 0;
+    strcpy(the_config->directory_cache, "");
+    the_config->trust_directory_mtime = false;
+    the_config->uses_io_uring = false;
+    the_config->uses_io_uring_copy = false;
+    the_config->max_memory = 0;
+
 }
 
 /*!
@@ -75,13 +123,39 @@ int set_configuration(configuration_t *the_config, int argc, char *argv[]) {
                 {.name="date-size-only",.has_arg=0,.flag=0,.val='d'},
                 {.name="no-parallel",.has_arg=0,.flag=0,.val='p'},
                 {.name="dry-run",.has_arg=0,.flag=0,.val='r'},
+                {.name="threads",.has_arg=2,.flag=0,.val='t'},
+                {.name="batch-size",.has_arg=1,.flag=0,.val='b'},
+                {.name="walkers",.has_arg=2,.flag=0,.val='L'},
+                {.name="hash",.has_arg=1,.flag=0,.val='H'},
+                {.name="checksum-cache",.has_arg=1,.flag=0,.val='c'},
+                {.name="rehash",.has_arg=0,.flag=0,.val='R'},
+                {.name="pipeline",.has_arg=0,.flag=0,.val='P'},
+                {.name="copy-workers",.has_arg=2,.flag=0,.val='w'},
+                {.name="delta-threshold",.has_arg=1,.flag=0,.val='D'},
+                {.name="stats",.has_arg=1,.flag=0,.val='s'},
+                {.name="trace",.has_arg=1,.flag=0,.val='T'},
+                {.name="watch",.has_arg=2,.flag=0,.val='W'},
+                {.name="trust-manifest",.has_arg=2,.flag=0,.val='M'},
+                {.name="dir-cache",.has_arg=1,.flag=0,.val='C'},
+                {.name="trust-dir-mtime",.has_arg=0,.flag=0,.val='m'},
+                {.name="io-uring",.has_arg=0,.flag=0,.val='U'},
+                {.name="io-uring-copy",.has_arg=0,.flag=0,.val='u'},
+                {.name="max-memory",.has_arg=1,.flag=0,.val='x'},
                 {.name=0,.has_arg=0,.flag=0,.val=0}, // last element must be zero
         };
+        bool sets_listing = false; // -n, --threads or --walkers, which only change how the lists are built in memory
         while((opt = getopt_long(argc, argv, "n:v", my_opts, NULL)) != -1) {
             switch (opt) {
-                case 'n':
-                    the_config->processes_count = *optarg;
+                case 'n': {
+                    int count = atoi(optarg);
+                    if (count < 1 || count > UINT8_MAX) {
+                        printf("Processes count must be between 1 and %d\n", UINT8_MAX);
+                        return -1;
+                    }
+                    the_config->processes_count = count;
+                    sets_listing = true;
                     break;
+                }
                 case 'v':
                     the_config->is_verbose = true;
                     break;
@@ -94,6 +168,143 @@ int set_configuration(configuration_t *the_config, int argc, char *argv[]) {
                 case 'r':
                     the_config->is_dry_run = true;
                     break;
+                case 't': {
+                    long count = optarg ? atol(optarg) : sysconf(_SC_NPROCESSORS_ONLN);
+                    if (count < 1 || count > 1024) {
+                        printf("Threads count must be between 1 and 1024\n");
+                        return -1;
+                    }
+                    the_config->threads_count = count;
+                    sets_listing = true;
+                    break;
+                }
+                case 'b': {
+                    long count = atol(optarg);
+                    if (count < 1 || count > UINT16_MAX) {
+                        printf("Batch size must be between 1 and %d\n", UINT16_MAX);
+                        return -1;
+                    }
+                    the_config->batch_size = count;
+                    break;
+                }
+                case 'H': {
+                    int algorithm = parse_hash_algorithm(optarg);
+                    if (algorithm == -1) {
+                        printf("Unknown hash algorithm %s (use md5, xxh3 or blake3)\n", optarg);
+                        return -1;
+                    }
+                    the_config->hash_algorithm = algorithm;
+                    break;
+                }
+                case 'c':
+                    if (strlen(optarg) >= sizeof(the_config->checksum_cache)) {
+                        printf("Checksum cache path is too long\n");
+                        return -1;
+                    }
+                    strcpy(the_config->checksum_cache, optarg);
+                    break;
+                case 'L': {
+                    long count = optarg ? atol(optarg) : sysconf(_SC_NPROCESSORS_ONLN);
+                    if (count < 1 || count > 1024) {
+                        printf("Walkers count must be between 1 and 1024\n");
+                        return -1;
+                    }
+                    the_config->walkers_count = count;
+                    sets_listing = true;
+                    break;
+                }
+                case 'R':
+                    the_config->force_rehash = true;
+                    break;
+                case 'P':
+                    the_config->is_pipelined = true;
+                    break;
+                case 'w': {
+                    long count = optarg ? atol(optarg) : sysconf(_SC_NPROCESSORS_ONLN);
+                    if (count < 1 || count > 1024) {
+                        printf("Copy workers count must be between 1 and 1024\n");
+                        return -1;
+                    }
+                    the_config->copy_workers = count;
+                    break;
+                }
+                case 'D': {
+                    char *end = NULL;
+                    unsigned long long threshold = strtoull(optarg, &end, 10);
+                    if (end == optarg || *end != '\0') {
+                        printf("Delta threshold must be a number of bytes\n");
+                        return -1;
+                    }
+                    the_config->delta_threshold = threshold;
+                    break;
+                }
+                case 's':
+                    if (strlen(optarg) >= sizeof(the_config->stats_path)) {
+                        printf("Statistics path is too long\n");
+                        return -1;
+                    }
+                    strcpy(the_config->stats_path, optarg);
+                    break;
+                case 'W': {
+                    long debounce = optarg ? atol(optarg) : WATCH_DEFAULT_DEBOUNCE_MS;
+                    if (debounce < 1 || debounce > 60000) {
+                        printf("Watch debounce time must be between 1 and 60000 ms\n");
+                        return -1;
+                    }
+                    the_config->is_watching = true;
+                    the_config->watch_debounce_ms = debounce;
+                    break;
+                }
+                case 'M': {
+                    char *end = NULL;
+                    double percent = optarg ? strtod(optarg, &end) : 0;
+                    if (optarg && (end == optarg || *end != '\0' || percent < 0 || percent > 100)) {
+                        printf("Manifest verification must be a percentage between 0 and 100\n");
+                        return -1;
+                    }
+                    the_config->trust_manifest = true;
+                    the_config->manifest_verify_percent = percent;
+                    break;
+                }
+                case 'T':
+                    if (strlen(optarg) >= sizeof(the_config->trace_path)) {
+                        printf("Trace path is too long\n");
+                        return -1;
+                    }
+                    strcpy(the_config->trace_path, optarg);
+                    break;
+                case 'C':
+                    if (strlen(optarg) >= sizeof(the_config->directory_cache)) {
+                        printf("Directory cache path is too long\n");
+                        return -1;
+                    }
+                    strcpy(the_config->directory_cache, optarg);
+                    break;
+                case 'm':
+                    the_config->trust_directory_mtime = true;
+                    break;
+                case 'U':
+                    the_config->uses_io_uring = true;
+                    break;
+                case 'u':
+                    the_config->uses_io_uring_copy = true;
+                    break;
+                case 'x': {
+                    static const char units[] = "KMG";
+                    char *end = NULL;
+                    unsigned long long size = strtoull(optarg, &end, 10);
+                    char *unit = (end != optarg && *end != '\0') ? strchr(units, toupper((unsigned char) *end)) : NULL;
+                    int shift = unit ? 10 * (int) (unit - units + 1) : 0;
+                    if (unit) {
+                        ++end;
+                    }
+                    if (end == optarg || *end != '\0' || size > (UINT64_MAX >> shift) || size << shift < 2 * SORTED_RUNS_MIN_MEMORY) {
+                        printf("Maximum memory must be at least %d bytes (K, M and G suffixes are allowed)\n", 2 * SORTED_RUNS_MIN_MEMORY);
+                        return -1;
+                    }
+                    the_config->max_memory = size << shift;
+                    break;
+                }
                 case 'h':
                     display_help(argv[0]);
                     break;
@@ -101,6 +312,18 @@ int set_configuration(configuration_t *the_config, int argc, char *argv[]) {
                     printf("Wrong option or missing argument for option\n");
             }
         }
+        if (the_config->max_memory > 0 && sets_listing) {
+            printf("--max-memory lists the trees in the main process, it can't be used with -n, --threads or --walkers\n");
+            return -1;
+        }
+        if (the_config->max_memory > 0 && the_config->is_watching) {
+            printf("--watch keeps the files lists in memory, it can't be used with --max-memory\n");
+            return -1;
+        }
+        if (the_config->is_dry_run && the_config->is_watching) {
+            printf("--watch copies the changes of the source, it can't be used with --dry-run\n");
+            return -1;
+        }
         if (optind < argc) {
             printf("Remaining program arguments:");
             for (int i=optind; i<argc; ++i) {
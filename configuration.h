@@ -2,15 +2,36 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <hash-algorithms.h>
 
 typedef struct {
     char source[1024];
     char destination[1024];
     uint8_t processes_count;
     bool is_parallel;
+    uint32_t batch_size; // Maximum number of entries per message between processes
+    int threads_count; // Workers of the threads mode, 0 when processes are used
+    int walkers_count; // Threads of each lister process walking its tree
     bool uses_md5;
+    hash_algorithm_t hash_algorithm; // Algorithm of the file digests, when uses_md5 is set
     bool is_verbose;
     bool is_dry_run;
+    bool is_pipelined; // Differences are copied while the trees are listed
+    bool is_watching; // The source is watched after the first synchronization, and its changes copied
+    int watch_debounce_ms; // Quiet time before the watched changes are applied
+    char checksum_cache[1024]; // Path of the checksum cache file, empty when disabled
+    bool force_rehash;
+    int copy_workers; // Workers copying the files to the destination
+    uint64_t delta_threshold; // Minimum size of the files updated with a delta transfer, 0 disables it
+    char stats_path[1024]; // File of the JSON statistics report ("-" for the standard output), empty when disabled
+    bool trust_manifest; // The destination list is loaded from its manifest instead of walking the destination
+    double manifest_verify_percent; // Part of the manifest entries compared with the destination before it is trusted
+    char trace_path[1024]; // File of the Chrome trace of the run, empty when disabled
+    char directory_cache[1024]; // Path of the directory listings cache file, empty when disabled
+    bool trust_directory_mtime; // Files of unchanged directories keep their cached properties, without a stat
+    bool uses_io_uring; // Metadata system calls are batched through io_uring when available
+    bool uses_io_uring_copy; // Small files are copied by chained io_uring requests when available
+    uint64_t max_memory; // Memory of the files lists, beyond which they are spilled to temporary files, 0 for no limit
 } configuration_t;
 
 
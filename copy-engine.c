@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include <copy-engine.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// Each thread (or forked process) reuses its own buffer for buffered copies
+static _Thread_local char *thread_buffer;
+
+/*!
+ * @brief get_buffer returns the copy buffer of the calling thread
+ * @return a COPY_BUFFER_SIZE bytes buffer, NULL if out of memory
+ */
+static char *get_buffer(void) {
+    if (!thread_buffer) {
+        thread_buffer = malloc(COPY_BUFFER_SIZE);
+    }
+    return thread_buffer;
+}
+
+/*!
+ * @brief is_unsupported tells if an error means that a copy method can't be used for these files
+ * The copy can then be done again with the next method.
+ */
+static bool is_unsupported(int error) {
+    return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP || error == ENOTTY
+           || error == EBADF || error == ETXTBSY || error == EPERM;
+}
+
+/*!
+ * @brief copy_range_buffered copies a range with pread and pwrite, short writes are completed
+ * @return the number of bytes copied (less than length at the end of the source), -1 in case of error
+ */
+static off_t copy_range_buffered(int source_fd, off_t source_offset, int destination_fd, off_t destination_offset, off_t length) {
+    char *buffer = get_buffer();
+    if (!buffer) {
+        return -1;
+    }
+
+    off_t copied = 0;
+    while (copied < length) {
+        size_t chunk = (length - copied < COPY_BUFFER_SIZE) ? length - copied : COPY_BUFFER_SIZE;
+        ssize_t count = pread(source_fd, buffer, chunk, source_offset + copied);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count == -1) {
+            return -1;
+        } else if (count == 0) {
+            break;
+        }
+        for (ssize_t written=0; written<count; ) {
+            ssize_t result = pwrite(destination_fd, buffer + written, count - written, destination_offset + copied + written);
+            if (result == -1 && errno != EINTR) {
+                return -1;
+            }
+            written += (result > 0) ? result : 0;
+        }
+        copied += count;
+    }
+    return copied;
+}
+
+/*!
+ * @brief copy_range copies a range with copy_file_range, or with buffers when it is not supported
+ * @param use_copy_file_range is set to false when copy_file_range fails as unsupported, to skip it afterwards
+ * @return the number of bytes copied (less than length at the end of the source), -1 in case of error
+ */
+static off_t copy_range(int source_fd, off_t source_offset, int destination_fd, off_t destination_offset, off_t length, bool *use_copy_file_range) {
+    off_t copied = 0;
+    while (*use_copy_file_range && copied < length) {
+        loff_t from = source_offset + copied, to = destination_offset + copied;
+        ssize_t count = copy_file_range(source_fd, &from, destination_fd, &to, length - copied, 0);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count == -1 && is_unsupported(errno)) {
+            *use_copy_file_range = false;
+        } else if (count == -1) {
+            return -1;
+        } else if (count == 0) {
+            return copied;
+        } else {
+            copied += count;
+        }
+    }
+    if (copied < length) {
+        off_t count = copy_range_buffered(source_fd, source_offset + copied, destination_fd, destination_offset + copied, length - copied);
+        if (count == -1) {
+            return -1;
+        }
+        copied += count;
+    }
+    return copied;
+}
+
+/*!
+ * @brief copy_data_extents copies only the data of a sparse file, holes are skipped
+ * @return 0 in case of success, -1 in case of error, 1 if the filesystem can't report holes
+ */
+static int copy_data_extents(int source_fd, int destination_fd, off_t size, bool *use_copy_file_range) {
+    off_t data = 0;
+    while (data < size) {
+        off_t next_data = lseek(source_fd, data, SEEK_DATA);
+        if (next_data == -1) {
+            if (errno == ENXIO) {
+                break; // Only a hole up to the end of the file
+            }
+            return (data == 0 && is_unsupported(errno)) ? 1 : -1;
+        }
+        data = next_data;
+        off_t hole = lseek(source_fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            return -1;
+        }
+        if (copy_range(source_fd, data, destination_fd, data, hole - data, use_copy_file_range) == -1) {
+            return -1;
+        }
+        data = hole;
+    }
+    // A hole at the end is made by the size
+    return (ftruncate(destination_fd, size) == 0) ? 0 : -1;
+}
+
+/*!
+ * @brief copy_file_contents copies the contents of a file to another, with the fastest method that works
+ * Methods are tried in order: a reflink (free on btrfs and XFS within a filesystem), a hole preserving
+ * copy for sparse files, copy_file_range, and read/write when the kernel can't copy the files.
+ * The destination must be empty, with its offset at 0.
+ * @param source_fd is the source file, opened for reading
+ * @param destination_fd is the destination file, opened for writing
+ * @param method receives the method used for the copy (or the last one tried)
+ * @return 0 in case of success, -1 else
+ */
+int copy_file_contents(int source_fd, int destination_fd, copy_method_t *method) {
+    struct stat source_stat;
+    if (fstat(source_fd, &source_stat) == -1) {
+        return -1;
+    }
+
+    *method = COPY_METHOD_REFLINK;
+    if (reflink_file(source_fd, destination_fd) == 0) {
+        return 0;
+    }
+
+    bool use_copy_file_range = true;
+    // Fewer allocated blocks than the size: the file has holes
+    if ((off_t) source_stat.st_blocks * 512 < source_stat.st_size) {
+        *method = COPY_METHOD_SPARSE;
+        int result = copy_data_extents(source_fd, destination_fd, source_stat.st_size, &use_copy_file_range);
+        if (result != 1) {
+            return result;
+        }
+    }
+
+    off_t copied = copy_range(source_fd, 0, destination_fd, 0, source_stat.st_size, &use_copy_file_range);
+    *method = use_copy_file_range ? COPY_METHOD_COPY_FILE_RANGE : COPY_METHOD_BUFFERED;
+    if (copied == -1) {
+        return -1;
+    }
+    // The destination gets the size the source had when it was copied, even if it shrank meanwhile
+    return (ftruncate(destination_fd, copied) == 0) ? 0 : -1;
+}
+
+/*!
+ * @brief copy_file_region copies a range of a file to an offset of another file (or of the same file)
+ * @param source_fd is the source file
+ * @param source_offset is the start of the range in the source
+ * @param destination_fd is the destination file
+ * @param destination_offset is where the range is written in the destination
+ * @param length is the length of the range
+ * @return the number of bytes copied (less than length at the end of the source), -1 in case of error
+ */
+off_t copy_file_region(int source_fd, off_t source_offset, int destination_fd, off_t destination_offset, off_t length) {
+    bool use_copy_file_range = true;
+    return copy_range(source_fd, source_offset, destination_fd, destination_offset, length, &use_copy_file_range);
+}
+
+/*!
+ * @brief reflink_file makes a file share the extents of another one, replacing its contents
+ * @return 0 in case of success, -1 if the filesystems can't do it
+ */
+int reflink_file(int source_fd, int destination_fd) {
+    return ioctl(destination_fd, FICLONE, source_fd);
+}
+
+/*!
+ * @brief copy_method_name returns the name of a copy method, for reports
+ */
+const char *copy_method_name(copy_method_t method) {
+    switch (method) {
+        case COPY_METHOD_REFLINK:
+            return "reflink";
+        case COPY_METHOD_COPY_FILE_RANGE:
+            return "copy_file_range";
+        case COPY_METHOD_SPARSE:
+            return "sparse";
+        case COPY_METHOD_BUFFERED:
+            return "buffered";
+        case COPY_METHOD_DELTA_IN_PLACE:
+            return "delta-in-place";
+        case COPY_METHOD_DELTA_REBUILD:
+            return "delta-rebuild";
+    }
+    return "unknown";
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+typedef enum {
+    COPY_METHOD_REFLINK, // FICLONE: the destination shares the extents of the source
+    COPY_METHOD_COPY_FILE_RANGE, // Copied by the kernel, without going through user space
+    COPY_METHOD_SPARSE, // Only the data extents are copied (SEEK_DATA/SEEK_HOLE), holes stay holes
+    COPY_METHOD_BUFFERED, // read() and write()
+    COPY_METHOD_DELTA_IN_PLACE, // Only the changed blocks are written over the destination (@see delta_copy_file)
+    COPY_METHOD_DELTA_REBUILD, // The destination is rebuilt from its own blocks and the changes, in a temporary file
+} copy_method_t;
+
+int copy_file_contents(int source_fd, int destination_fd, copy_method_t *method);
+off_t copy_file_region(int source_fd, off_t source_offset, int destination_fd, off_t destination_offset, off_t length);
+int reflink_file(int source_fd, int destination_fd);
+const char *copy_method_name(copy_method_t method);
@@ -0,0 +1,563 @@
+#define _GNU_SOURCE
+#include <copy-pool.h>
+#include <copy-engine.h>
+#include <small-copy.h>
+#include <io-ring.h>
+#include <thread-pool.h>
+#include <sync.h>
+#include <utility.h>
+#include <defines.h>
+#include <stats.h>
+#include <trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// A large file copied in ranges by several workers. The worker ending the last range sets its mode and times
+typedef struct {
+    files_list_entry_t *entry;
+    char *destination_path;
+    int source_fd;
+    int destination_fd;
+    size_t chunks_count;
+    _Atomic size_t remaining_chunks;
+    _Atomic int error; // errno of the first range that failed, 0 if none
+} chunked_file_t;
+
+// A job is either a batch of whole files, or a range of a chunked file
+typedef struct {
+    uint64_t bytes;
+    uint64_t cost; // Bytes, and COPY_FILE_COST per file
+    int worker;
+    files_list_entry_t **files;
+    size_t files_count;
+    chunked_file_t *chunked;
+    off_t offset;
+    off_t length;
+} copy_job_t;
+
+struct _copy_pool {
+    configuration_t *config;
+    thread_pool_t *threads;
+    files_list_entry_t **files; // Files added since the last run, in the order of the diff
+    size_t files_count;
+    size_t files_capacity;
+    copy_job_t *jobs;
+    size_t jobs_count;
+    size_t jobs_capacity;
+    _Atomic size_t queued_jobs;
+    _Atomic uint64_t queued_bytes;
+    _Atomic size_t running_jobs;
+    _Atomic uint64_t bytes_in_flight;
+    _Atomic size_t copied_files;
+    _Atomic uint64_t copied_bytes;
+    _Atomic size_t failed_files;
+    deferred_directories_t directories; // Directories created by the pool, finished once their content is copied
+};
+
+/*!
+ * @brief create_copy_pool creates a pool of workers copying files to the destination
+ * @param workers_count is the number of workers, at least 1
+ * @param the_config is the configuration, with the source and the destination
+ * @return the pool, NULL in case of error
+ */
+copy_pool_t *create_copy_pool(int workers_count, configuration_t *the_config) {
+    copy_pool_t *pool = calloc(1, sizeof(copy_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->config = the_config;
+    pool->threads = create_thread_pool(workers_count, pool);
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*!
+ * @brief destroy_copy_pool frees a pool, the files added and not run are not copied
+ * The directories not finished yet get their mode and times (@see copy_pool_finish_directories).
+ * @param pool is the pool
+ */
+void destroy_copy_pool(copy_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    apply_deferred_directories(&pool->directories);
+    destroy_thread_pool(pool->threads);
+    free(pool->files);
+    free(pool->jobs);
+    free(pool);
+}
+
+/*!
+ * @brief append_entry appends an entry to a growing array of entries
+ * @return 0 in case of success, -1 if out of memory
+ */
+static int append_entry(files_list_entry_t ***array, size_t *count, size_t *capacity, files_list_entry_t *entry) {
+    if (*count == *capacity) {
+        size_t new_capacity = (*capacity == 0) ? 1024 : *capacity * 2;
+        files_list_entry_t **new_array = realloc(*array, new_capacity * sizeof(files_list_entry_t *));
+        if (!new_array) {
+            return -1;
+        }
+        *array = new_array;
+        *capacity = new_capacity;
+    }
+    (*array)[(*count)++] = entry;
+    return 0;
+}
+
+/*!
+ * @brief new_job appends an empty job to the jobs of the pool
+ * @return the job, NULL if out of memory
+ */
+static copy_job_t *new_job(copy_pool_t *pool) {
+    if (pool->jobs_count == pool->jobs_capacity) {
+        size_t new_capacity = (pool->jobs_capacity == 0) ? 1024 : pool->jobs_capacity * 2;
+        copy_job_t *new_jobs = realloc(pool->jobs, new_capacity * sizeof(copy_job_t));
+        if (!new_jobs) {
+            return NULL;
+        }
+        pool->jobs = new_jobs;
+        pool->jobs_capacity = new_capacity;
+    }
+    copy_job_t *job = &pool->jobs[pool->jobs_count++];
+    memset(job, 0, sizeof(copy_job_t));
+    return job;
+}
+
+/*!
+ * @brief copy_pool_add adds an entry to copy
+ * Directories are created at once, so that they exist before the files they contain are copied. They stay
+ * writable until copy_pool_finish_directories. Files are copied by copy_pool_run (or at once if they can't be added).
+ * @param pool is the pool
+ * @param source_entry is the entry, it must stay valid until copy_pool_run returns
+ * @return 0 in case of success, -1 else
+ */
+int copy_pool_add(copy_pool_t *pool, files_list_entry_t *source_entry) {
+    if (source_entry->entry_type == DOSSIER) {
+        if (copy_entry_to_destination(source_entry, pool->config) == -1) {
+            atomic_fetch_add(&pool->failed_files, 1);
+            return -1;
+        }
+        if (defer_directory(&pool->directories, source_entry, pool->config) == -1) {
+            printf("Cannot set the mode and times of %s\n", source_entry->path_and_name);
+        }
+        return 0;
+    }
+    if (append_entry(&pool->files, &pool->files_count, &pool->files_capacity, source_entry) == -1) {
+        // Out of memory: the file is copied right away
+        if (copy_entry_to_destination(source_entry, pool->config) == -1) {
+            atomic_fetch_add(&pool->failed_files, 1);
+            return -1;
+        }
+        atomic_fetch_add(&pool->copied_files, 1);
+        atomic_fetch_add(&pool->copied_bytes, source_entry->size);
+    }
+    return 0;
+}
+
+/*!
+ * @brief destination_path_of computes the path of an entry in the destination
+ * @return path, NULL if it is too long
+ */
+static char *destination_path_of(copy_pool_t *pool, files_list_entry_t *entry, char *path) {
+    return concat_path(path, pool->config->destination, entry->path_and_name + root_prefix_length(pool->config->source));
+}
+
+/*!
+ * @brief split_large_file prepares the copy of a large file in ranges
+ * The destination is created at its final size, each range is a job. Files that are better copied
+ * at once are left to the batches: sparse files (ranges would fill their holes), files updated by a
+ * delta transfer, and files that can't be opened (the error is reported by the batch).
+ * @param pool is the pool
+ * @param entry is the file
+ * @return 0 if the file is handled (reflinked or split), -1 if it must be copied as a whole
+ */
+static int split_large_file(copy_pool_t *pool, files_list_entry_t *entry) {
+    char destination_path[PATH_SIZE];
+    struct stat source_stat, destination_stat;
+    if (!destination_path_of(pool, entry, destination_path)) {
+        return -1;
+    }
+    if (pool->config->delta_threshold > 0 && entry->size >= pool->config->delta_threshold
+        && stat(destination_path, &destination_stat) == 0 && S_ISREG(destination_stat.st_mode) && destination_stat.st_size > 0) {
+        return -1;
+    }
+
+    int source_fd = open(entry->path_and_name, O_RDONLY | O_CLOEXEC);
+    if (source_fd == -1) {
+        return -1;
+    }
+    if (fstat(source_fd, &source_stat) == -1 || (off_t) source_stat.st_blocks * 512 < source_stat.st_size) {
+        close(source_fd);
+        return -1;
+    }
+    int destination_fd = open(destination_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, entry->mode & 07777);
+    if (destination_fd == -1) {
+        close(source_fd);
+        return -1;
+    }
+
+    struct timespec times[2] = {entry->mtime, entry->mtime};
+    if (reflink_file(source_fd, destination_fd) == 0) {
+        fchmod(destination_fd, entry->mode & 07777);
+        futimens(destination_fd, times);
+        if (pool->config->is_verbose) {
+            printf("%s -> %s (%s)\n", entry->path_and_name, destination_path, copy_method_name(COPY_METHOD_REFLINK));
+        }
+        atomic_fetch_add(&pool->copied_files, 1);
+        atomic_fetch_add(&pool->copied_bytes, (uint64_t) source_stat.st_size);
+        stats_add(STATS_FILES_COPIED, 1);
+        stats_add(STATS_BYTES_COPIED, (uint64_t) source_stat.st_size);
+        close(source_fd);
+        close(destination_fd);
+        return 0;
+    }
+
+    // The size is set first, so that the ranges are written in any order without extending the file
+    chunked_file_t *file = calloc(1, sizeof(chunked_file_t));
+    char *path_copy = strdup(destination_path);
+    if (!file || !path_copy || ftruncate(destination_fd, source_stat.st_size) == -1) {
+        free(file);
+        free(path_copy);
+        close(source_fd);
+        close(destination_fd);
+        return -1;
+    }
+    file->entry = entry;
+    file->destination_path = path_copy;
+    file->source_fd = source_fd;
+    file->destination_fd = destination_fd;
+    file->chunks_count = (source_stat.st_size + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE;
+    atomic_init(&file->remaining_chunks, file->chunks_count);
+    atomic_init(&file->error, 0);
+
+    for (size_t i=0; i<file->chunks_count; ++i) {
+        copy_job_t *job = new_job(pool);
+        if (!job) {
+            // The ranges already made are run, the missing ones make the copy fail
+            atomic_store(&file->error, ENOMEM);
+            atomic_fetch_sub(&file->remaining_chunks, file->chunks_count - i);
+            break;
+        }
+        job->chunked = file;
+        job->offset = i * COPY_CHUNK_SIZE;
+        job->length = (i + 1 < file->chunks_count) ? (off_t) COPY_CHUNK_SIZE : source_stat.st_size - job->offset;
+        job->bytes = job->length;
+        job->cost = job->bytes;
+    }
+    if (atomic_load(&file->remaining_chunks) == 0) {
+        // Not even one range could be made
+        close(source_fd);
+        close(destination_fd);
+        free(path_copy);
+        free(file);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief make_jobs turns the files added to the pool into jobs
+ * Large files are split in ranges. Other files are grouped in the order of the diff (files of a
+ * directory are copied together) in batches of COPY_BATCH_FILES files or COPY_BATCH_BYTES bytes.
+ * @param pool is the pool
+ * @param batched receives the files of the batches, it has room for all the files of the pool
+ */
+static void make_jobs(copy_pool_t *pool, files_list_entry_t **batched) {
+    size_t batched_count = 0;
+    copy_job_t *batch = NULL;
+    size_t batch_index = 0; // The jobs may move when ranges are added
+    for (size_t i=0; i<pool->files_count; ++i) {
+        files_list_entry_t *entry = pool->files[i];
+        if (entry->size >= 2 * COPY_CHUNK_SIZE && split_large_file(pool, entry) == 0) {
+            continue;
+        }
+        batch = batch ? &pool->jobs[batch_index] : NULL;
+        if (!batch || batch->files_count == COPY_BATCH_FILES || batch->bytes >= COPY_BATCH_BYTES) {
+            batch = new_job(pool);
+            if (!batch) {
+                // Out of memory: the file is copied right away
+                if (copy_entry_to_destination(entry, pool->config) == -1) {
+                    atomic_fetch_add(&pool->failed_files, 1);
+                }
+                continue;
+            }
+            batch->files = &batched[batched_count];
+            batch_index = pool->jobs_count - 1;
+        }
+        batched[batched_count++] = entry;
+        ++batch->files_count;
+        batch->bytes += entry->size;
+        batch->cost += entry->size + COPY_FILE_COST;
+    }
+}
+
+/*!
+ * @brief finish_chunked_file ends the copy of a chunked file once all its ranges are copied
+ */
+static void finish_chunked_file(copy_pool_t *pool, chunked_file_t *file) {
+    files_list_entry_t *entry = file->entry;
+    int error = atomic_load(&file->error);
+    if (error != 0) {
+        // A short copy means that the source shrank meanwhile
+        printf("Cannot copy %s to %s: %s\n", entry->path_and_name, file->destination_path, (error == -1) ? "file changed" : strerror(error));
+        atomic_fetch_add(&pool->failed_files, 1);
+    } else {
+        struct timespec times[2] = {entry->mtime, entry->mtime};
+        fchmod(file->destination_fd, entry->mode & 07777);
+        futimens(file->destination_fd, times);
+        if (pool->config->is_verbose) {
+            printf("%s -> %s (%zu ranges)\n", entry->path_and_name, file->destination_path, file->chunks_count);
+        }
+        atomic_fetch_add(&pool->copied_files, 1);
+        stats_add(STATS_FILES_COPIED, 1);
+    }
+    close(file->source_fd);
+    close(file->destination_fd);
+    free(file->destination_path);
+    free(file);
+}
+
+/*!
+ * @brief copy_opened_files copies the files of a batch whose opens and closes are batched through io_uring
+ * The sources and the destinations are opened by one batch of requests, copied one by one, then closed by
+ * another batch. Files updated by a delta transfer, and files that could not be opened, are left to
+ * copy_entry_to_destination, which reports the errors.
+ * @param pool is the pool
+ * @param job is the batch, of at most COPY_BATCH_FILES files
+ * @param copied marks the files copied, the ones already marked are skipped
+ * @param failed marks the files whose copy failed
+ */
+static void copy_opened_files(copy_pool_t *pool, copy_job_t *job, bool *copied, bool *failed) {
+    io_ring_t *ring = thread_io_ring();
+    char (*destination_paths)[PATH_SIZE] = malloc(job->files_count * PATH_SIZE);
+    if (!ring || !destination_paths) {
+        free(destination_paths);
+        return;
+    }
+    size_t indexes[COPY_BATCH_FILES], count = 0;
+    char *paths[2 * COPY_BATCH_FILES];
+    int flags[2 * COPY_BATCH_FILES], fds[2 * COPY_BATCH_FILES];
+    mode_t modes[2 * COPY_BATCH_FILES];
+    for (size_t i=0; i<job->files_count; ++i) {
+        files_list_entry_t *entry = job->files[i];
+        if (copied[i] || entry->entry_type != FICHIER
+            || (pool->config->delta_threshold > 0 && entry->size >= pool->config->delta_threshold)
+            || !destination_path_of(pool, entry, destination_paths[count])) {
+            continue;
+        }
+        indexes[count] = i;
+        paths[2 * count] = entry->path_and_name;
+        flags[2 * count] = O_RDONLY | O_CLOEXEC;
+        modes[2 * count] = 0;
+        paths[2 * count + 1] = destination_paths[count];
+        flags[2 * count + 1] = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        modes[2 * count + 1] = entry->mode & 07777;
+        ++count;
+    }
+
+    bool is_ring_failed = count > 0 && io_ring_openat_batch(ring, paths, flags, modes, 2 * count, fds) == -1;
+    size_t opened_count = 0;
+    for (size_t i=0; i<count; ++i) {
+        int source_fd = fds[2 * i], destination_fd = fds[2 * i + 1];
+        if (source_fd >= 0 && destination_fd >= 0) {
+            files_list_entry_t *entry = job->files[indexes[i]];
+            bool is_copied = copy_opened_file(entry, source_fd, destination_fd, destination_paths[i], pool->config) == 0;
+            copied[indexes[i]] = is_copied;
+            failed[indexes[i]] = !is_copied;
+        }
+        // The descriptors are packed for their closes
+        if (source_fd >= 0) {
+            fds[opened_count++] = source_fd;
+        }
+        if (destination_fd >= 0) {
+            fds[opened_count++] = destination_fd;
+        }
+    }
+    if (is_ring_failed) {
+        discard_thread_io_ring();
+        for (size_t i=0; i<opened_count; ++i) {
+            close(fds[i]);
+        }
+    } else if (opened_count > 0 && io_ring_close_batch(ring, fds, opened_count) == -1) {
+        discard_thread_io_ring();
+    }
+    free(destination_paths);
+}
+
+/*!
+ * @brief copy_job_task is the thread pool task running a copy job
+ * @param threads is the thread pool of the copy pool
+ * @param worker is the worker running the task
+ * @param data is the copy_job_t
+ */
+static void copy_job_task(thread_pool_t *threads, int worker, void *data) {
+    copy_pool_t *pool = (copy_pool_t *) thread_pool_context(threads);
+    copy_job_t *job = (copy_job_t *) data;
+    // The gauges are sampled as each job starts, the queue before the job leaves it
+    stats_peak(STATS_PEAK_COPY_QUEUED_JOBS, atomic_fetch_sub(&pool->queued_jobs, 1));
+    stats_peak(STATS_PEAK_COPY_QUEUED_BYTES, atomic_fetch_sub(&pool->queued_bytes, job->bytes));
+    stats_peak(STATS_PEAK_COPY_RUNNING_JOBS, atomic_fetch_add(&pool->running_jobs, 1) + 1);
+    stats_peak(STATS_PEAK_COPY_BYTES_IN_FLIGHT, atomic_fetch_add(&pool->bytes_in_flight, job->bytes) + job->bytes);
+
+    if (job->chunked) {
+        chunked_file_t *file = job->chunked;
+        if (atomic_load(&file->error) == 0) {
+            uint64_t start = stats_start(), trace_start = trace_begin();
+            off_t copied = copy_file_region(file->source_fd, job->offset, file->destination_fd, job->offset, job->length);
+            stats_stop(STATS_TIME_COPYING, start);
+            trace_end("copy range", trace_start, file->entry->path_and_name);
+            if (copied == job->length) {
+                atomic_fetch_add(&pool->copied_bytes, job->bytes);
+                stats_add(STATS_BYTES_COPIED, job->bytes);
+            } else {
+                int expected = 0;
+                atomic_compare_exchange_strong(&file->error, &expected, (copied == -1) ? errno : -1);
+            }
+        }
+        if (atomic_fetch_sub(&file->remaining_chunks, 1) == 1) {
+            finish_chunked_file(pool, file);
+        }
+    } else {
+        // Small files are copied together through io_uring first when asked, the others one by one, opened
+        // and closed through io_uring when it is enabled
+        bool copied[COPY_BATCH_FILES] = {false}, failed[COPY_BATCH_FILES] = {false};
+        if (pool->config->uses_io_uring_copy && job->files_count <= COPY_BATCH_FILES) {
+            copy_small_files(job->files, job->files_count, pool->config, copied);
+        }
+        if (is_io_ring_enabled() && job->files_count <= COPY_BATCH_FILES) {
+            copy_opened_files(pool, job, copied, failed);
+        }
+        for (size_t i=0; i<job->files_count; ++i) {
+            if (i < COPY_BATCH_FILES && failed[i]) {
+                atomic_fetch_add(&pool->failed_files, 1);
+            } else if (i < COPY_BATCH_FILES && copied[i]) {
+                atomic_fetch_add(&pool->copied_files, 1);
+                atomic_fetch_add(&pool->copied_bytes, job->files[i]->size);
+            } else if (copy_entry_to_destination(job->files[i], pool->config) == -1) {
+                atomic_fetch_add(&pool->failed_files, 1);
+            } else {
+                atomic_fetch_add(&pool->copied_files, 1);
+                atomic_fetch_add(&pool->copied_bytes, job->files[i]->size);
+            }
+        }
+    }
+
+    atomic_fetch_sub(&pool->running_jobs, 1);
+    atomic_fetch_sub(&pool->bytes_in_flight, job->bytes);
+}
+
+/*!
+ * @brief compare_job_costs is the qsort comparison function ordering jobs from the most expensive
+ */
+static int compare_job_costs(const void *lhs, const void *rhs) {
+    uint64_t left = ((const copy_job_t *) lhs)->cost, right = ((const copy_job_t *) rhs)->cost;
+    return (left < right) ? 1 : (left > right) ? -1 : 0;
+}
+
+/*!
+ * @brief schedule_jobs assigns the jobs to the workers and pushes them
+ * Longest processing time first: from the most expensive, each job goes to the least loaded worker.
+ * The jobs of a worker are pushed from the cheapest, so that the worker runs its largest jobs first,
+ * and idle workers steal the smallest ones at the end of the run.
+ * @param pool is the pool
+ */
+static void schedule_jobs(copy_pool_t *pool) {
+    int workers_count = thread_pool_workers_count(pool->threads);
+    uint64_t *loads = calloc(workers_count, sizeof(uint64_t));
+    qsort(pool->jobs, pool->jobs_count, sizeof(copy_job_t), compare_job_costs);
+    for (size_t i=0; i<pool->jobs_count; ++i) {
+        int least_loaded = 0;
+        for (int worker=1; loads && worker<workers_count; ++worker) {
+            if (loads[worker] < loads[least_loaded]) {
+                least_loaded = worker;
+            }
+        }
+        pool->jobs[i].worker = least_loaded;
+        if (loads) {
+            loads[least_loaded] += pool->jobs[i].cost;
+        }
+        atomic_fetch_add(&pool->queued_jobs, 1);
+        atomic_fetch_add(&pool->queued_bytes, pool->jobs[i].bytes);
+    }
+    free(loads);
+
+    for (size_t i=pool->jobs_count; i-->0; ) {
+        if (thread_pool_push(pool->threads, pool->jobs[i].worker, copy_job_task, &pool->jobs[i]) == -1) {
+            copy_job_task(pool->threads, 0, &pool->jobs[i]);
+        }
+    }
+}
+
+/*!
+ * @brief copy_pool_run copies the files added to the pool, and returns when they are all copied
+ * The pool can then be used for other files.
+ * @param pool is the pool
+ * @return 0 in case of success, -1 if the threads could not be started (the files are still copied)
+ */
+int copy_pool_run(copy_pool_t *pool) {
+    int result = 0;
+    files_list_entry_t **batched = (pool->files_count > 0) ? malloc(pool->files_count * sizeof(files_list_entry_t *)) : NULL;
+    if (pool->files_count > 0 && !batched) {
+        // Out of memory: the files are copied one at a time
+        for (size_t i=0; i<pool->files_count; ++i) {
+            if (copy_entry_to_destination(pool->files[i], pool->config) == -1) {
+                atomic_fetch_add(&pool->failed_files, 1);
+            } else {
+                atomic_fetch_add(&pool->copied_files, 1);
+                atomic_fetch_add(&pool->copied_bytes, pool->files[i]->size);
+            }
+        }
+    } else if (pool->files_count > 0) {
+        make_jobs(pool, batched);
+        schedule_jobs(pool);
+        result = thread_pool_run(pool->threads);
+    }
+    free(batched);
+
+    pool->files_count = 0;
+    pool->jobs_count = 0;
+    return result;
+}
+
+/*!
+ * @brief copy_pool_finish_directories sets the mode and times of the directories created by the pool
+ * It is called once all the files were run, the directories created afterwards are finished by the next call.
+ * @param pool is the pool
+ */
+void copy_pool_finish_directories(copy_pool_t *pool) {
+    apply_deferred_directories(&pool->directories);
+}
+
+/*!
+ * @brief copy_pool_pending_files returns the number of files added and not run yet
+ * @param pool is the pool
+ */
+size_t copy_pool_pending_files(copy_pool_t *pool) {
+    return pool->files_count;
+}
+
+/*!
+ * @brief copy_pool_get_stats reads the counters of a pool, it may be called while the pool runs
+ * @param pool is the pool
+ * @param stats receives the counters
+ */
+void copy_pool_get_stats(copy_pool_t *pool, copy_pool_stats_t *stats) {
+    stats->queued_jobs = atomic_load(&pool->queued_jobs);
+    stats->queued_bytes = atomic_load(&pool->queued_bytes);
+    stats->running_jobs = atomic_load(&pool->running_jobs);
+    stats->bytes_in_flight = atomic_load(&pool->bytes_in_flight);
+    stats->copied_files = atomic_load(&pool->copied_files);
+    stats->copied_bytes = atomic_load(&pool->copied_bytes);
+    stats->failed_files = atomic_load(&pool->failed_files);
+}
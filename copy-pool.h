@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <files-list.h>
+#include <configuration.h>
+
+#define COPY_CHUNK_SIZE (64ULL * 1024 * 1024) // Files of at least 2 chunks are copied in ranges, by several workers
+#define COPY_BATCH_FILES 64 // Small files are grouped in jobs of at most this count...
+#define COPY_BATCH_BYTES (4 * 1024 * 1024) // ... and about this size
+#define COPY_FILE_COST (64 * 1024) // Scheduling cost of a file (open, create, close), in bytes
+#define COPY_PIPELINE_FILES 4096 // Pending files copied at once in pipelined mode, even if the listers are ahead
+
+// Counters of a copy pool, they can be read while it runs. The first four are gauges, back to 0 once
+// copy_pool_run returned: their peaks are sampled in the statistics (@see stats_peak)
+typedef struct {
+    size_t queued_jobs; // Jobs not started yet (the queue depth)
+    uint64_t queued_bytes;
+    size_t running_jobs;
+    uint64_t bytes_in_flight; // Bytes of the running jobs
+    size_t copied_files;
+    uint64_t copied_bytes;
+    size_t failed_files;
+} copy_pool_stats_t;
+
+typedef struct _copy_pool copy_pool_t;
+
+copy_pool_t *create_copy_pool(int workers_count, configuration_t *the_config);
+void destroy_copy_pool(copy_pool_t *pool);
+int copy_pool_add(copy_pool_t *pool, files_list_entry_t *source_entry);
+int copy_pool_run(copy_pool_t *pool);
+void copy_pool_finish_directories(copy_pool_t *pool);
+size_t copy_pool_pending_files(copy_pool_t *pool);
+void copy_pool_get_stats(copy_pool_t *pool, copy_pool_stats_t *stats);
@@ -1,4 +1,5 @@
 #pragma once
 
 #define PATH_SIZE 4096
-#define MAX_BUF_SIZE 1024
\ No newline at end of file
+#define MAX_BUF_SIZE 1024
+#define DIRENT_BUFFER_SIZE (64 * 1024)
@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include <delta-copy.h>
+#include <xxh3.h>
+#include <defines.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define NO_BLOCK UINT32_MAX
+
+// Signatures of the full blocks of the old destination, indexed by their weak checksum
+typedef struct {
+    uint64_t block_size;
+    uint32_t count;
+    uint32_t *weak;
+    uint64_t *strong;
+    uint32_t *next; // Next block in the same bucket, NO_BLOCK at the end
+    uint32_t *buckets; // First block of each bucket, NO_BLOCK when empty
+    uint32_t buckets_mask;
+} block_signatures_t;
+
+// A block of the old destination found in the source
+typedef struct {
+    uint64_t source_offset;
+    uint32_t block;
+} block_match_t;
+
+typedef struct {
+    block_match_t *items;
+    size_t count;
+    size_t capacity;
+} block_matches_t;
+
+/*!
+ * @brief weak_checksum computes the rolling checksum (rsync's) of a block
+ * @param data is the block
+ * @param length is the size of the block
+ * @param a receives the sum of the bytes
+ * @param b receives the sum of the prefix sums
+ */
+static void weak_checksum(const uint8_t *data, size_t length, uint32_t *a, uint32_t *b) {
+    uint32_t sum = 0, prefix_sums = 0;
+    for (size_t i=0; i<length; ++i) {
+        sum += data[i];
+        prefix_sums += sum;
+    }
+    *a = sum & 0xffff;
+    *b = prefix_sums & 0xffff;
+}
+
+/*!
+ * @brief bucket_of gives the bucket of a weak checksum
+ */
+static uint32_t bucket_of(block_signatures_t *signatures, uint32_t weak) {
+    return (weak * 0x9e3779b1U >> 8) & signatures->buckets_mask;
+}
+
+/*!
+ * @brief read_full reads until the buffer is full or the end of file
+ * @return the number of bytes read, -1 in case of error
+ */
+static ssize_t read_full(int fd, uint8_t *buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t count = read(fd, buffer + total, size - total);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count == -1) {
+            return -1;
+        } else if (count == 0) {
+            break;
+        }
+        total += count;
+    }
+    return total;
+}
+
+/*!
+ * @brief free_signatures frees the arrays of the signatures
+ */
+static void free_signatures(block_signatures_t *signatures) {
+    free(signatures->weak);
+    free(signatures->strong);
+    free(signatures->next);
+    free(signatures->buckets);
+}
+
+/*!
+ * @brief compute_signatures reads the old destination and computes the signatures of its full blocks
+ * @param fd is the destination, at offset 0
+ * @param size is the size of the destination
+ * @param signatures receives the signatures, its block_size must be set
+ * @return 0 in case of success, -1 else
+ */
+static int compute_signatures(int fd, uint64_t size, block_signatures_t *signatures) {
+    uint64_t count = size / signatures->block_size;
+    uint64_t buckets = 1;
+    while (buckets < 2 * count) {
+        buckets *= 2;
+    }
+    signatures->count = count;
+    signatures->buckets_mask = buckets - 1;
+    signatures->weak = malloc(count * sizeof(uint32_t) + 1);
+    signatures->strong = malloc(count * sizeof(uint64_t) + 1);
+    signatures->next = malloc(count * sizeof(uint32_t) + 1);
+    signatures->buckets = malloc(buckets * sizeof(uint32_t));
+    uint8_t *buffer = malloc(signatures->block_size);
+    if (!signatures->weak || !signatures->strong || !signatures->next || !signatures->buckets || !buffer) {
+        free(buffer);
+        return -1;
+    }
+    memset(signatures->buckets, 0xff, buckets * sizeof(uint32_t));
+
+    for (uint32_t i=0; i<count; ++i) {
+        if (read_full(fd, buffer, signatures->block_size) != (ssize_t) signatures->block_size) {
+            free(buffer);
+            return -1;
+        }
+        uint32_t a, b;
+        weak_checksum(buffer, signatures->block_size, &a, &b);
+        signatures->weak[i] = a | (b << 16);
+        signatures->strong[i] = xxh3_hash(buffer, signatures->block_size);
+
+        // Blocks are chained in order, so the first candidate of a bucket is the earliest block
+        uint32_t *link = &signatures->buckets[bucket_of(signatures, signatures->weak[i])];
+        while (*link != NO_BLOCK) {
+            link = &signatures->next[*link];
+        }
+        *link = i;
+        signatures->next[i] = NO_BLOCK;
+    }
+    free(buffer);
+    return 0;
+}
+
+/*!
+ * @brief find_block looks for a block of the old destination with the content of a window of the source
+ * The block at the same offset is preferred, it doesn't need to be written at all.
+ * @param signatures is the signatures of the old destination
+ * @param weak is the rolling checksum of the window
+ * @param window is the window
+ * @param offset is the offset of the window in the source
+ * @return the index of the block, NO_BLOCK if none matches
+ */
+static uint32_t find_block(block_signatures_t *signatures, uint32_t weak, const uint8_t *window, uint64_t offset) {
+    uint32_t found = NO_BLOCK;
+    bool has_strong = false;
+    uint64_t strong = 0;
+    for (uint32_t block=signatures->buckets[bucket_of(signatures, weak)]; block!=NO_BLOCK; block=signatures->next[block]) {
+        if (signatures->weak[block] != weak) {
+            continue;
+        }
+        if (!has_strong) {
+            strong = xxh3_hash(window, signatures->block_size);
+            has_strong = true;
+        }
+        if (signatures->strong[block] == strong) {
+            if (block * signatures->block_size == offset) {
+                return block;
+            }
+            if (found == NO_BLOCK) {
+                found = block;
+            }
+        }
+    }
+    return found;
+}
+
+/*!
+ * @brief add_match appends a match to the array of matches
+ * @return 0 in case of success, -1 if out of memory
+ */
+static int add_match(block_matches_t *matches, uint64_t source_offset, uint32_t block) {
+    if (matches->count == matches->capacity) {
+        size_t new_capacity = (matches->capacity == 0) ? 1024 : matches->capacity * 2;
+        block_match_t *new_items = realloc(matches->items, new_capacity * sizeof(block_match_t));
+        if (!new_items) {
+            return -1;
+        }
+        matches->items = new_items;
+        matches->capacity = new_capacity;
+    }
+    matches->items[matches->count].source_offset = source_offset;
+    matches->items[matches->count].block = block;
+    ++matches->count;
+    return 0;
+}
+
+/*!
+ * @brief scan_source finds the blocks of the old destination in the source, at any offset
+ * The window slides one byte at a time with the rolling checksum, and jumps over the blocks it finds.
+ * The source is read through a buffer that always holds the window and the next byte.
+ * @param fd is the source, at offset 0
+ * @param size is the size of the source
+ * @param signatures is the signatures of the old destination
+ * @param matches receives the matches, ordered by source offset and not overlapping
+ * @return 0 in case of success, -1 else
+ */
+static int scan_source(int fd, uint64_t size, block_signatures_t *signatures, block_matches_t *matches) {
+    uint64_t block_size = signatures->block_size;
+    if (signatures->count == 0 || size < block_size) {
+        return 0;
+    }
+
+    size_t capacity = block_size + DELTA_READ_SIZE;
+    uint8_t *buffer = malloc(capacity);
+    if (!buffer) {
+        return -1;
+    }
+    uint64_t buffer_offset = 0, buffer_length = 0;
+    uint64_t position = 0;
+    bool has_checksum = false;
+    uint32_t a = 0, b = 0;
+    int result = 0;
+
+    while (position + block_size <= size) {
+        // The window and the byte after it (if any) must be in the buffer
+        uint64_t needed = (position + block_size < size) ? position + block_size + 1 : size;
+        if (needed > buffer_offset + buffer_length) {
+            memmove(buffer, buffer + (position - buffer_offset), buffer_offset + buffer_length - position);
+            buffer_length -= position - buffer_offset;
+            buffer_offset = position;
+            ssize_t count = read_full(fd, buffer + buffer_length, capacity - buffer_length);
+            if (count == -1 || buffer_offset + buffer_length + count < needed) {
+                result = -1; // Read error, or the source shrank
+                break;
+            }
+            buffer_length += count;
+        }
+
+        uint8_t *window = buffer + (position - buffer_offset);
+        if (!has_checksum) {
+            weak_checksum(window, block_size, &a, &b);
+            has_checksum = true;
+        }
+        uint32_t block = find_block(signatures, a | (b << 16), window, position);
+        if (block != NO_BLOCK) {
+            if (add_match(matches, position, block) == -1) {
+                result = -1;
+                break;
+            }
+            position += block_size;
+            has_checksum = false;
+        } else if (position + block_size < size) {
+            uint8_t out = window[0], in = window[block_size];
+            a = (a - out + in) & 0xffff;
+            b = (b - block_size * out + a) & 0xffff;
+            ++position;
+        } else {
+            break;
+        }
+    }
+
+    free(buffer);
+    return result;
+}
+
+/*!
+ * @brief write_in_place writes over the destination the parts of the source that are not already at their place
+ * @return 0 in case of success, -1 else
+ */
+static int write_in_place(int source_fd, uint64_t size, int destination_fd, block_signatures_t *signatures, block_matches_t *matches, delta_result_t *result) {
+    uint64_t current = 0;
+    for (size_t i=0; i<=matches->count; ++i) {
+        uint64_t end = size;
+        if (i < matches->count) {
+            block_match_t *match = &matches->items[i];
+            // Blocks found at another offset are written like changes: the old data may be overwritten before it is read
+            if (match->block * signatures->block_size != match->source_offset) {
+                continue;
+            }
+            end = match->source_offset;
+        }
+        if (end > current) {
+            if (copy_file_region(source_fd, current, destination_fd, current, end - current) != (off_t) (end - current)) {
+                return -1;
+            }
+            result->written_bytes += end - current;
+        }
+        current = end + signatures->block_size;
+    }
+    return (ftruncate(destination_fd, size) == 0) ? 0 : -1;
+}
+
+/*!
+ * @brief rebuild_file writes a new destination from the blocks of the old one and the changes of the source
+ * It is written to a temporary file next to the destination, which replaces it. Blocks are copied with
+ * copy_file_range, so they are shared with the old file instead of written where the filesystem allows it.
+ * @return 0 in case of success, -1 else
+ */
+static int rebuild_file(int source_fd, uint64_t size, int old_fd, char *destination_path, block_signatures_t *signatures, block_matches_t *matches, delta_result_t *result) {
+    char temp_path[PATH_SIZE + 32];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.delta", destination_path, (int) getpid());
+    int temp_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (temp_fd == -1) {
+        return -1;
+    }
+
+    bool failed = false;
+    uint64_t current = 0;
+    for (size_t i=0; i<=matches->count && !failed; ++i) {
+        uint64_t end = (i < matches->count) ? matches->items[i].source_offset : size;
+        if (end > current) {
+            failed = copy_file_region(source_fd, current, temp_fd, current, end - current) != (off_t) (end - current);
+        }
+        if (!failed && i < matches->count) {
+            failed = copy_file_region(old_fd, (off_t) matches->items[i].block * signatures->block_size, temp_fd, end, signatures->block_size)
+                     != (off_t) signatures->block_size;
+        }
+        current = end + signatures->block_size;
+    }
+    result->written_bytes = size;
+
+    if (close(temp_fd) != 0 || failed || rename(temp_path, destination_path) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief delta_copy_file updates an existing destination file to the content of the source, writing only what changed
+ * The blocks of the old destination are found in the source with a rolling checksum (and a strong hash to
+ * confirm), like rsync does. When most of the found blocks are still at their place, the changes are written
+ * over the destination. When data moved (inserted or removed bytes), the destination is rebuilt in a
+ * temporary file from its old blocks and the changes. A reflink is used instead when the filesystem allows it.
+ * @param source_fd is the source file, opened for reading at offset 0
+ * @param destination_path is the path of the existing destination
+ * @param result receives the method, and the bytes found and written
+ * @return 0 in case of success, -1 else (the destination may be partially updated)
+ */
+int delta_copy_file(int source_fd, char *destination_path, delta_result_t *result) {
+    memset(result, 0, sizeof(delta_result_t));
+    struct stat source_stat, destination_stat;
+    int destination_fd = open(destination_path, O_RDWR | O_CLOEXEC);
+    if (destination_fd == -1) {
+        return -1;
+    }
+    if (fstat(source_fd, &source_stat) == -1 || fstat(destination_fd, &destination_stat) == -1) {
+        close(destination_fd);
+        return -1;
+    }
+
+    result->method = COPY_METHOD_REFLINK;
+    if (reflink_file(source_fd, destination_fd) == 0) {
+        close(destination_fd);
+        return 0;
+    }
+
+    block_signatures_t signatures = {.block_size = DELTA_BLOCK_SIZE};
+    while ((uint64_t) destination_stat.st_size / signatures.block_size > DELTA_MAX_BLOCKS) {
+        signatures.block_size *= 2;
+    }
+    result->block_size = signatures.block_size;
+    block_matches_t matches = {0};
+    int status = -1;
+    if (compute_signatures(destination_fd, destination_stat.st_size, &signatures) == 0
+        && scan_source(source_fd, source_stat.st_size, &signatures, &matches) == 0) {
+        uint64_t in_place_bytes = 0;
+        for (size_t i=0; i<matches.count; ++i) {
+            if (matches.items[i].block * signatures.block_size == matches.items[i].source_offset) {
+                in_place_bytes += signatures.block_size;
+            }
+        }
+        result->matched_bytes = matches.count * signatures.block_size;
+
+        if (in_place_bytes >= result->matched_bytes - in_place_bytes) {
+            result->method = COPY_METHOD_DELTA_IN_PLACE;
+            status = write_in_place(source_fd, source_stat.st_size, destination_fd, &signatures, &matches, result);
+        } else {
+            result->method = COPY_METHOD_DELTA_REBUILD;
+            status = rebuild_file(source_fd, source_stat.st_size, destination_fd, destination_path, &signatures, &matches, result);
+        }
+    }
+
+    free(matches.items);
+    free_signatures(&signatures);
+    close(destination_fd);
+    return status;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <copy-engine.h>
+
+#define DELTA_BLOCK_SIZE (64 * 1024) // Grows for very large files, so that there are at most DELTA_MAX_BLOCKS
+#define DELTA_MAX_BLOCKS (1 << 22)
+#define DELTA_READ_SIZE (1024 * 1024)
+#define DELTA_DEFAULT_THRESHOLD (64ULL * 1024 * 1024)
+
+typedef struct {
+    copy_method_t method;
+    uint64_t block_size;
+    uint64_t matched_bytes; // Bytes of the source found in the old destination
+    uint64_t written_bytes; // Bytes written to the destination (or its replacement)
+} delta_result_t;
+
+int delta_copy_file(int source_fd, char *destination_path, delta_result_t *result);
@@ -0,0 +1,511 @@
+#include <directory-cache.h>
+#include <defines.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+
+// Directories changed less than this many seconds before they were listed are not cached: a change right
+// after the listing could leave their times unchanged (they are only updated at each clock tick)
+#define RACY_DELAY_SEC 2
+
+// Like the checksum cache, the state is per process: the file is mapped by the main process before the
+// listers are forked, and each process records the directories it lists, then merges them into the file.
+static struct {
+    char path[PATH_SIZE];
+    bool is_open;
+    bool trust_mtime;
+    bool is_read_only; // Nothing is recorded nor saved, with --dry-run
+    char trusted_root[PATH_SIZE]; // Tree whose files keep their cached properties, with trust_mtime
+    uint64_t run; // Time the cache was opened, the same in all the processes of a run
+    directory_cache_header_t *mapping; // NULL when there was no valid cache file
+    size_t mapping_size;
+    directory_record_t *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+    directory_child_t *pending_children;
+    size_t pending_children_count;
+    size_t pending_children_capacity;
+    char *pending_names;
+    size_t pending_names_size;
+    size_t pending_names_capacity;
+} cache;
+
+// Directories are recorded by the walk threads of the pipeline
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*!
+ * @brief hash_key computes the bucket hash of a directory from its device and inode
+ */
+static uint64_t hash_key(directory_key_t *key) {
+    uint64_t hash = key->inode * 0x9e3779b97f4a7c15ULL ^ key->device;
+    hash ^= hash >> 31;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    return hash ^ (hash >> 29);
+}
+
+/*!
+ * @brief find_slot finds the slot of a directory in a table, or the free slot where it would go
+ * @param records is the table
+ * @param capacity is the size of the table, a power of 2 (the table is never full)
+ * @param key is the key of the directory
+ * @return a pointer to the slot
+ */
+static directory_record_t *find_slot(directory_record_t *records, uint64_t capacity, directory_key_t *key) {
+    uint64_t index = hash_key(key) & (capacity - 1);
+    while (records[index].used && (records[index].key.device != key->device || records[index].key.inode != key->inode)) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &records[index];
+}
+
+/*!
+ * @brief cache_children gives the children of a mapped cache file
+ */
+static directory_child_t *cache_children(directory_cache_header_t *header) {
+    return (directory_child_t *) ((directory_record_t *) (header + 1) + header->capacity);
+}
+
+/*!
+ * @brief cache_names gives the names of a mapped cache file
+ */
+static char *cache_names(directory_cache_header_t *header) {
+    return (char *) (cache_children(header) + header->children_count);
+}
+
+/*!
+ * @brief is_valid_cache checks a mapped cache file, before its table is probed and its names are read
+ * The table must keep a free slot (else find_slot never ends) and hold count records, the children of
+ * the records and the names of the children must be in the file.
+ * @param mapping is the mapped file
+ * @param size is the size of the file
+ * @return true if the cache can be used, false else
+ */
+static bool is_valid_cache(directory_cache_header_t *mapping, size_t size) {
+    uint64_t available = size - sizeof(directory_cache_header_t);
+    if (memcmp(mapping->magic, DIRECTORY_CACHE_MAGIC, sizeof(mapping->magic)) != 0
+        || mapping->capacity == 0 || (mapping->capacity & (mapping->capacity - 1)) != 0 || mapping->count >= mapping->capacity
+        || mapping->capacity > available / sizeof(directory_record_t)
+        || mapping->children_count > (available - mapping->capacity * sizeof(directory_record_t)) / sizeof(directory_child_t)
+        || mapping->capacity * sizeof(directory_record_t) + mapping->children_count * sizeof(directory_child_t) + mapping->names_size != available) {
+        return false;
+    }
+
+    // The names are NUL-terminated up to the end of the file
+    directory_record_t *records = (directory_record_t *) (mapping + 1);
+    directory_child_t *children = cache_children(mapping);
+    char *names = cache_names(mapping);
+    if (mapping->names_size > 0 && names[mapping->names_size - 1] != '\0') {
+        return false;
+    }
+    uint64_t used = 0;
+    for (uint64_t i=0; i<mapping->capacity; ++i) {
+        if (!records[i].used) {
+            continue;
+        }
+        if (++used > mapping->count || records[i].first_child > mapping->children_count
+            || records[i].children_count > mapping->children_count - records[i].first_child) {
+            return false;
+        }
+        for (uint32_t j=0; j<records[i].children_count; ++j) {
+            uint64_t name_offset = children[records[i].first_child + j].name_offset;
+            if (name_offset == 0 || name_offset >= mapping->names_size) {
+                return false;
+            }
+        }
+    }
+    return used == mapping->count;
+}
+
+/*!
+ * @brief map_cache_file maps a cache file and checks it
+ * @param path is the path of the cache file
+ * @param size receives the size of the mapping
+ * @return the mapping, NULL if the file doesn't exist or is not a valid cache
+ */
+static directory_cache_header_t *map_cache_file(char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat file_stat;
+    directory_cache_header_t *mapping = NULL;
+    if (fstat(fd, &file_stat) == 0 && (size_t) file_stat.st_size >= sizeof(directory_cache_header_t)) {
+        mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            mapping = NULL;
+        }
+    }
+    close(fd);
+
+    // A file that doesn't match its header is ignored, as if there was no cache: it is replaced on the next save
+    if (mapping && !is_valid_cache(mapping, file_stat.st_size)) {
+        printf("Ignoring invalid directory cache %s\n", path);
+        munmap(mapping, file_stat.st_size);
+        mapping = NULL;
+    }
+    *size = file_stat.st_size;
+    return mapping;
+}
+
+/*!
+ * @brief open_directory_cache opens the directory cache, to be used by the walks
+ * @param path is the path of the cache file. It is created on the first save if it doesn't exist
+ * @param trust_mtime is true to also reuse the properties of the files of unchanged directories of trusted_root
+ * @param trusted_root is the tree whose properties are reused, the source. The destination is never trusted:
+ * the copies write its files without changing the times of their directories
+ * @param is_read_only is true to only reuse the cached listings, the file is then never written
+ * @return 0 in case of success, -1 else
+ */
+int open_directory_cache(char *path, bool trust_mtime, char *trusted_root, bool is_read_only) {
+    if (!path || strlen(path) >= PATH_SIZE - 32 || (trust_mtime && (!trusted_root || strlen(trusted_root) >= PATH_SIZE))) {
+        return -1;
+    }
+
+    close_directory_cache();
+    strcpy(cache.path, path);
+    cache.trust_mtime = trust_mtime;
+    cache.is_read_only = is_read_only;
+    strcpy(cache.trusted_root, trust_mtime ? trusted_root : "");
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    cache.run = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    cache.mapping = map_cache_file(path, &cache.mapping_size);
+    if (cache.mapping) {
+        madvise(cache.mapping, cache.mapping_size, MADV_RANDOM);
+    }
+    cache.is_open = true;
+    return 0;
+}
+
+/*!
+ * @brief is_directory_cache_open tells if the walks use the directory cache
+ */
+bool is_directory_cache_open(void) {
+    return cache.is_open;
+}
+
+/*!
+ * @brief directory_cache_trusts_mtime tells if the files of the unchanged directories of a tree are not read again
+ * @param root is the root of the walked tree
+ */
+bool directory_cache_trusts_mtime(char *root) {
+    return cache.is_open && cache.trust_mtime && strcmp(root, cache.trusted_root) == 0;
+}
+
+/*!
+ * @brief get_directory_key gets the key of an open directory
+ * @param dir_fd is the directory
+ * @param key receives its key
+ * @return 0 in case of success, -1 else
+ */
+int get_directory_key(int dir_fd, directory_key_t *key) {
+    struct stat dir_stat;
+    if (fstat(dir_fd, &dir_stat) == -1) {
+        return -1;
+    }
+    memset(key, 0, sizeof(directory_key_t));
+    key->device = dir_stat.st_dev;
+    key->inode = dir_stat.st_ino;
+    key->mtime_sec = dir_stat.st_mtim.tv_sec;
+    key->mtime_nsec = dir_stat.st_mtim.tv_nsec;
+    key->ctime_sec = dir_stat.st_ctim.tv_sec;
+    key->ctime_nsec = dir_stat.st_ctim.tv_nsec;
+    return 0;
+}
+
+/*!
+ * @brief lookup_directory gives the listing of an unchanged directory, like read_sorted_names
+ * @param key is the key of the directory
+ * @param names_buffer receives the buffer of the names, each one preceded by its d_type, to be freed
+ * @param names receives the array of the names sorted, to be freed
+ * @param children receives the children in the cache, in the same order (valid until the cache is closed)
+ * @return the number of names, -1 if the directory is not in the cache or changed
+ */
+ssize_t lookup_directory(directory_key_t *key, char **names_buffer, char ***names, directory_child_t **children) {
+    if (!cache.is_open || !cache.mapping || !key) {
+        return -1;
+    }
+    directory_record_t *slot = find_slot((directory_record_t *) (cache.mapping + 1), cache.mapping->capacity, key);
+    if (!slot->used || memcmp(&slot->key, key, sizeof(directory_key_t)) != 0
+        || slot->first_child + slot->children_count > cache.mapping->children_count) {
+        return -1;
+    }
+
+    directory_child_t *cached = cache_children(cache.mapping) + slot->first_child;
+    char *cached_names = cache_names(cache.mapping);
+    size_t size = 0;
+    for (uint32_t i=0; i<slot->children_count; ++i) {
+        if (cached[i].name_offset == 0 || cached[i].name_offset >= cache.mapping->names_size) {
+            return -1;
+        }
+        size += strnlen(cached_names + cached[i].name_offset, cache.mapping->names_size - cached[i].name_offset) + 2;
+    }
+    char *buffer = malloc(size > 0 ? size : 1);
+    char **sorted = malloc((slot->children_count > 0 ? slot->children_count : 1) * sizeof(char *));
+    if (!buffer || !sorted) {
+        free(buffer);
+        free(sorted);
+        return -1;
+    }
+    size_t used = 0;
+    for (uint32_t i=0; i<slot->children_count; ++i) {
+        char *name = cached_names + cached[i].name_offset;
+        size_t length = strnlen(name, cache.mapping->names_size - cached[i].name_offset);
+        memcpy(buffer + used, name - 1, length + 1);
+        buffer[used + length + 1] = '\0';
+        sorted[i] = buffer + used + 1;
+        used += length + 2;
+    }
+    *names_buffer = buffer;
+    *names = sorted;
+    *children = cached;
+    return slot->children_count;
+}
+
+/*!
+ * @brief record_directory keeps the listing of a directory, to be written to the cache by save_directory_cache
+ * @param key is the key of the directory, taken before it was read
+ * @param names is the array of its names, each one preceded by its d_type
+ * @param children is the array of the properties of the children (their name_offset is ignored)
+ * @param count is the number of children
+ * @return 0 in case of success (or if the directory changed too recently to be cached, or the cache is read-only), -1 else
+ */
+int record_directory(directory_key_t *key, char **names, directory_child_t *children, size_t count) {
+    if (!cache.is_open || !key || count > UINT32_MAX) {
+        return -1;
+    }
+    if (cache.is_read_only || key->mtime_sec + RACY_DELAY_SEC >= (int64_t) (cache.run / 1000000000ULL) || key->ctime_sec + RACY_DELAY_SEC >= (int64_t) (cache.run / 1000000000ULL)) {
+        return 0;
+    }
+
+    size_t names_size = 0;
+    for (size_t i=0; i<count; ++i) {
+        names_size += strlen(names[i]) + 2;
+    }
+
+    pthread_mutex_lock(&pending_lock);
+    int result = 0;
+    if (cache.pending_count == cache.pending_capacity) {
+        size_t new_capacity = (cache.pending_capacity == 0) ? 256 : cache.pending_capacity * 2;
+        directory_record_t *new_pending = realloc(cache.pending, new_capacity * sizeof(directory_record_t));
+        if (new_pending) {
+            cache.pending = new_pending;
+            cache.pending_capacity = new_capacity;
+        } else {
+            result = -1;
+        }
+    }
+    if (result == 0 && cache.pending_children_count + count > cache.pending_children_capacity) {
+        size_t new_capacity = (cache.pending_children_capacity == 0) ? 4096 : cache.pending_children_capacity * 2;
+        while (cache.pending_children_count + count > new_capacity) {
+            new_capacity *= 2;
+        }
+        directory_child_t *new_children = realloc(cache.pending_children, new_capacity * sizeof(directory_child_t));
+        if (new_children) {
+            cache.pending_children = new_children;
+            cache.pending_children_capacity = new_capacity;
+        } else {
+            result = -1;
+        }
+    }
+    if (result == 0 && cache.pending_names_size + names_size > cache.pending_names_capacity) {
+        size_t new_capacity = (cache.pending_names_capacity == 0) ? 64 * 1024 : cache.pending_names_capacity * 2;
+        while (cache.pending_names_size + names_size > new_capacity) {
+            new_capacity *= 2;
+        }
+        char *new_names = realloc(cache.pending_names, new_capacity);
+        if (new_names) {
+            cache.pending_names = new_names;
+            cache.pending_names_capacity = new_capacity;
+        } else {
+            result = -1;
+        }
+    }
+
+    if (result == 0) {
+        directory_record_t *record = &cache.pending[cache.pending_count++];
+        memset(record, 0, sizeof(directory_record_t));
+        record->key = *key;
+        record->first_child = cache.pending_children_count;
+        record->children_count = count;
+        record->run = cache.run;
+        record->used = 1;
+        for (size_t i=0; i<count; ++i) {
+            size_t length = strlen(names[i]);
+            directory_child_t *child = &cache.pending_children[cache.pending_children_count++];
+            *child = children[i];
+            child->name_offset = cache.pending_names_size + 1;
+            memcpy(cache.pending_names + cache.pending_names_size, names[i] - 1, length + 2);
+            cache.pending_names_size += length + 2;
+        }
+    }
+    pthread_mutex_unlock(&pending_lock);
+    return result;
+}
+
+// Records of a table being built, with where their children come from
+typedef struct {
+    directory_child_t *children;
+    char *names;
+} records_origin_t;
+
+/*!
+ * @brief insert_records inserts the records of a run in a table, replacing the records of the same directories
+ * @param records is the table
+ * @param origins receives where the children of each inserted record are
+ * @param capacity is the size of the table
+ * @param source is the array of records to insert (unused records and records of older runs are skipped)
+ * @param count is the size of source
+ * @param origin is where the children of source are
+ * @return the number of records added to the table (replaced ones are not counted)
+ */
+static uint64_t insert_records(directory_record_t *records, records_origin_t *origins, uint64_t capacity, directory_record_t *source,
+                               uint64_t count, records_origin_t origin) {
+    uint64_t added = 0;
+    for (uint64_t i=0; i<count; ++i) {
+        if (!source[i].used || source[i].run != cache.run) {
+            continue;
+        }
+        directory_record_t *slot = find_slot(records, capacity, &source[i].key);
+        if (!slot->used) {
+            ++added;
+        }
+        *slot = source[i];
+        origins[slot - records] = origin;
+    }
+    return added;
+}
+
+/*!
+ * @brief save_directory_cache merges the recorded directories into the cache file
+ * Several processes (the two listers and the main process) save at the end of a run: the update is
+ * serialized with a lock file and merged with the current content of the file. Only the directories
+ * listed during this run are kept, so removed directories leave the cache. The file is replaced with rename.
+ * @return 0 in case of success (or nothing to save), -1 else
+ */
+int save_directory_cache(void) {
+    if (!cache.is_open || cache.pending_count == 0) {
+        return 0;
+    }
+
+    char lock_path[PATH_SIZE + 32], temp_path[PATH_SIZE + 32];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", cache.path);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", cache.path, (int) getpid());
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1) {
+        perror("directory cache lock");
+        if (lock_fd != -1) {
+            close(lock_fd);
+        }
+        return -1;
+    }
+
+    size_t current_size = 0;
+    directory_cache_header_t *current = map_cache_file(cache.path, &current_size);
+    uint64_t current_count = current ? current->count : 0;
+    uint64_t capacity = 256;
+    while (capacity < 2 * (current_count + cache.pending_count)) {
+        capacity *= 2;
+    }
+
+    int result = -1;
+    directory_record_t *records = calloc(capacity, sizeof(directory_record_t));
+    records_origin_t *origins = calloc(capacity, sizeof(records_origin_t));
+    directory_child_t *children = NULL;
+    char *names = NULL;
+    directory_cache_header_t header = {.capacity = capacity};
+    memcpy(header.magic, DIRECTORY_CACHE_MAGIC, sizeof(header.magic));
+    if (records && origins) {
+        if (current) {
+            header.count += insert_records(records, origins, capacity, (directory_record_t *) (current + 1), current->capacity,
+                                           (records_origin_t) {cache_children(current), cache_names(current)});
+        }
+        header.count += insert_records(records, origins, capacity, cache.pending, cache.pending_count,
+                                       (records_origin_t) {cache.pending_children, cache.pending_names});
+
+        // The children and names of the kept records are packed after the table
+        for (uint64_t i=0; i<capacity; ++i) {
+            if (records[i].used) {
+                header.children_count += records[i].children_count;
+                for (uint32_t j=0; j<records[i].children_count; ++j) {
+                    header.names_size += strlen(origins[i].names + origins[i].children[records[i].first_child + j].name_offset) + 2;
+                }
+            }
+        }
+        children = malloc((header.children_count > 0 ? header.children_count : 1) * sizeof(directory_child_t));
+        names = malloc(header.names_size + 1);
+    }
+    if (children && names) {
+        uint64_t children_count = 0;
+        // Offset 0 is never a name: a name is preceded by its d_type
+        size_t names_size = 0;
+        for (uint64_t i=0; i<capacity; ++i) {
+            if (!records[i].used) {
+                continue;
+            }
+            directory_child_t *source = origins[i].children + records[i].first_child;
+            records[i].first_child = children_count;
+            for (uint32_t j=0; j<records[i].children_count; ++j) {
+                char *name = origins[i].names + source[j].name_offset;
+                size_t length = strlen(name);
+                children[children_count] = source[j];
+                children[children_count++].name_offset = names_size + 1;
+                memcpy(names + names_size, name - 1, length + 2);
+                names_size += length + 2;
+            }
+        }
+
+        FILE *file = fopen(temp_path, "wb");
+        if (file) {
+            bool is_written = fwrite(&header, sizeof(header), 1, file) == 1
+                              && fwrite(records, sizeof(directory_record_t), capacity, file) == capacity
+                              && fwrite(children, sizeof(directory_child_t), header.children_count, file) == header.children_count
+                              && fwrite(names, 1, header.names_size, file) == header.names_size;
+            if (fclose(file) != 0) {
+                is_written = false;
+            }
+            if (is_written && rename(temp_path, cache.path) == 0) {
+                result = 0;
+                cache.pending_count = 0;
+                cache.pending_children_count = 0;
+                cache.pending_names_size = 0;
+            } else {
+                perror("directory cache write");
+                unlink(temp_path);
+            }
+        }
+    }
+    free(records);
+    free(origins);
+    free(children);
+    free(names);
+
+    if (current) {
+        munmap(current, current_size);
+    }
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+    return result;
+}
+
+/*!
+ * @brief close_directory_cache releases the cache, without saving the recorded directories
+ */
+void close_directory_cache(void) {
+    if (cache.mapping) {
+        munmap(cache.mapping, cache.mapping_size);
+    }
+    free(cache.pending);
+    free(cache.pending_children);
+    free(cache.pending_names);
+    memset(&cache, 0, sizeof(cache));
+}
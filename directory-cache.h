@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define DIRECTORY_CACHE_MAGIC "LP25DIR1"
+
+// A directory is identified by its device and inode. If its mtime or ctime changed, its listing must be read again
+typedef struct {
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+} directory_key_t;
+
+// On disk, the cache is a header, an open addressing hash table of directories, their children, then the names
+typedef struct {
+    char magic[8];
+    uint64_t capacity; // Number of directory records, a power of 2
+    uint64_t count; // Number of used directory records
+    uint64_t children_count;
+    uint64_t names_size;
+} directory_cache_header_t;
+
+typedef struct {
+    directory_key_t key;
+    uint64_t first_child; // Index of its first child, the children are sorted by name
+    uint64_t run; // Run that last listed the directory, records of older runs are dropped
+    uint32_t children_count;
+    uint8_t used;
+    uint8_t reserved[3];
+} directory_record_t;
+
+// A child of a directory, and its properties when they were known at the time it was listed
+typedef struct {
+    uint64_t name_offset; // NUL-terminated name, preceded by its d_type
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t mode;
+    uint8_t digest[16];
+    uint8_t hash_algorithm;
+    uint8_t entry_type;
+    uint8_t has_properties;
+    uint8_t reserved[5];
+} directory_child_t;
+
+int open_directory_cache(char *path, bool trust_mtime, char *trusted_root, bool is_read_only);
+bool is_directory_cache_open(void);
+bool directory_cache_trusts_mtime(char *root);
+int get_directory_key(int dir_fd, directory_key_t *key);
+ssize_t lookup_directory(directory_key_t *key, char **names_buffer, char ***names, directory_child_t **children);
+int record_directory(directory_key_t *key, char **names, directory_child_t *children, size_t count);
+int save_directory_cache(void);
+void close_directory_cache(void);
@@ -1,8 +1,8 @@
+#define _GNU_SOURCE
 #include <file-properties.h>
 
 #include <sys/stat.h>
 #include <dirent.h>
-#include <openssl/evp.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
@@ -10,6 +10,16 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <utility.h>
+#include <checksum-cache.h>
+#include <hash-algorithms.h>
+#include <stats.h>
+#include <trace.h>
+#include <io-ring.h>
+#include <errno.h>
+#include <sys/sysmacros.h>
+
+// Algorithm of the digests computed by this process
+static hash_algorithm_t selected_algorithm = HASH_MD5;
 
 /*!
  * @brief get_file_stats gets all of the required information for a file (inc. directories)
@@ -27,83 +37,164 @@
  * @return -1 in case of error, 0 else
  */
 int get_file_stats(files_list_entry_t *entry) {
+    if (!entry || !entry->path_and_name) {
+        return -1;
+    }
+    return get_file_stats_at(AT_FDCWD, entry->path_and_name, entry);
+}
 
-    // We create a variable of type struct stat to stock the information that the stat function returns about the file
-    struct stat file_stat;
+/*!
+ * @brief get_file_stats_at gets the same information as get_file_stats, for a file relative to an open directory
+ * Only the fields that are compared are requested (statx), and the kernel doesn't have to resolve
+ * the whole path again. Symbolic links are not followed, they are unsupported like other special files.
+ * @param dir_fd is the directory the name is relative to (AT_FDCWD for the current directory)
+ * @param name is the name of the file in dir_fd
+ * @param entry is the files list entry to fill. Its path must be set, it is used to compute the MD5 sum
+ * @return -1 in case of error, 0 else
+ */
+int get_file_stats_at(int dir_fd, char *name, files_list_entry_t *entry) {
+    // We create a variable of type struct statx to stock the information that the statx function returns about the file
+    struct statx file_stat;
 
-    // Use of the stat function to obtain information about the file
-    // We verify if the stat function was successful,
+    // We verify if the statx function was successful,
         // if not we return -1
-        // else we fill the different elements of the structure of new_entry
-    if (stat(entry->path_and_name, &file_stat) == -1) {
-        perror("stat");
+        // else we fill the different elements of the structure of the entry
+    uint64_t start = stats_start(), trace_start = trace_begin();
+    int result = statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO, &file_stat);
+    stats_stop(STATS_TIME_STAT, start);
+    trace_end("stat", trace_start, name);
+    stats_add(STATS_STAT_CALLS, 1);
+    if (result == -1) {
+        perror("statx");
         return -1; // Error while getting file stats
-    } else {
-        // mode (permissions)
-        entry->mode = file_stat.st_mode;
-
-        // entry type
-        if (S_ISREG(file_stat.st_mode)) {
-            entry->entry_type = FICHIER;
-            // mtime (in nanoseconds)
-            entry->mtime.tv_nsec = (file_stat.st_mtime)*1000000000;
-            // size
-            entry->size = file_stat.st_size;
-            // MD5 sum
+    }
+    return set_file_stats(entry, &file_stat);
+}
 
+/*!
+ * @brief stat_files_at gets the statx of many files relative to an open directory, like get_file_stats_at
+ * When io_uring is enabled (@see enable_io_ring), the requests are submitted in batches and many are in
+ * flight at once. Else, and if the ring fails, they are made one by one.
+ * @param dir_fd is the directory the names are relative to (AT_FDCWD for the current directory)
+ * @param names is the array of names
+ * @param count is the number of names
+ * @param results receives the statx of each name, to be given to set_file_stats
+ * @param errors receives 0 for each name whose statx succeeded, its errno else
+ */
+void stat_files_at(int dir_fd, char **names, size_t count, struct statx *results, int *errors) {
+    unsigned mask = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO;
+    io_ring_t *ring = thread_io_ring();
+    uint64_t start = stats_start(), trace_start = trace_begin();
+    if (!ring || io_ring_statx_batch(ring, dir_fd, names, count, AT_SYMLINK_NOFOLLOW, mask, results, errors) == -1) {
+        // The requests left in the failed ring must not write in the results anymore
+        discard_thread_io_ring();
+        for (size_t i=0; i<count; ++i) {
+            errors[i] = (statx(dir_fd, names[i], AT_SYMLINK_NOFOLLOW, mask, &results[i]) == -1) ? errno : 0;
+        }
+    }
+    stats_stop(STATS_TIME_STAT, start);
+    if (global_trace) {
+        char detail[TRACE_DETAIL_SIZE];
+        snprintf(detail, sizeof(detail), "%zu files", count);
+        trace_end("stat batch", trace_start, detail);
+    }
+    stats_add(STATS_STAT_CALLS, count);
+}
+
+/*!
+ * @brief set_file_stats fills an entry from the statx of its file, and computes its digest
+ * @param entry is the files list entry to fill. Its path must be set, it is used to compute the MD5 sum
+ * @param file_stat is the statx of the file, with the mask of get_file_stats_at
+ * @return -1 in case of error (or unsupported type), 0 else
+ */
+int set_file_stats(files_list_entry_t *entry, struct statx *file_stat) {
+    // mode (permissions)
+    entry->mode = file_stat->stx_mode;
+    // mtime, of the files and of the directories (their copies get it once their content is copied)
+    entry->mtime.tv_sec = file_stat->stx_mtime.tv_sec;
+    entry->mtime.tv_nsec = file_stat->stx_mtime.tv_nsec;
+
+    // entry type
+    if (S_ISREG(file_stat->stx_mode)) {
+        entry->entry_type = FICHIER;
+        // size
+        entry->size = file_stat->stx_size;
+        // Digest (MD5 sum or the selected hash), from the checksum cache when the file didn't change since it was computed
+        if (selected_algorithm == HASH_NONE) {
+            memset(entry->md5sum, 0, sizeof(entry->md5sum));
+            entry->hash_algorithm = HASH_NONE;
+            return 0;
+        }
+        checksum_key_t key = {
+            .device = makedev(file_stat->stx_dev_major, file_stat->stx_dev_minor),
+            .inode = file_stat->stx_ino,
+            .size = file_stat->stx_size,
+            .mtime_sec = file_stat->stx_mtime.tv_sec,
+            .mtime_nsec = file_stat->stx_mtime.tv_nsec,
+            .algorithm = selected_algorithm,
+        };
+        if (lookup_checksum(&key, entry->md5sum)) {
+            entry->hash_algorithm = selected_algorithm;
+            stats_add(STATS_CHECKSUM_CACHE_HITS, 1);
+        } else {
             if ((compute_file_md5(entry)) == -1) {
                 printf("compute_file_md5");
                 return -1;
             }
-        } else if (S_ISDIR(file_stat.st_mode)) {
-            entry->entry_type = DOSSIER;
-        } else {
-            return -1; // Unsupported file type
+            record_checksum(&key, entry->md5sum);
         }
-
-        return 0; // Success
+    } else if (S_ISDIR(file_stat->stx_mode)) {
+        entry->entry_type = DOSSIER;
+    } else {
+        return -1; // Unsupported file type
     }
+
+    return 0; // Success
+}
+
+/*!
+ * @brief set_hash_algorithm selects the algorithm used by compute_file_md5 (and thus get_file_stats)
+ * @param algorithm is the algorithm, HASH_NONE to skip digests altogether (date and size only)
+ */
+void set_hash_algorithm(hash_algorithm_t algorithm) {
+    selected_algorithm = algorithm;
+}
+
+/*!
+ * @brief get_hash_algorithm gives the algorithm selected with set_hash_algorithm
+ */
+hash_algorithm_t get_hash_algorithm(void) {
+    return selected_algorithm;
 }
 
 /*!
  * @brief compute_file_md5 computes a file's MD5 sum
  * @param the pointer to the files list entry
  * @return -1 in case of error, 0 else
- * Use libcrypto functions from openssl/evp.h
+ * The digest is computed with the selected algorithm (@see set_hash_algorithm), MD5 by default,
+ * and tagged with it in the entry.
+ * The file is read by the hash engine, which adapts its strategy to the size of the file (@see hash_file_contents)
  */
 int compute_file_md5(files_list_entry_t *entry) {
-    // the reason why we have put this function (except the return 0) in commentary is because the EVP functions weren't reconised when compiling the project
-    /*
     if (!entry || !entry->path_and_name) return -1;
 
-    FILE *file = fopen(entry->path_and_name, "rb");
-    if (!file) {
+    int fd = open(entry->path_and_name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
         perror("Error opening file");
         return -1;
     }
 
-    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-    if (!mdctx) {
-        fclose(file);
-        return -1;
-    }
-
-    EVP_DigestInit_ex(mdctx, EVP_md5(), NULL);
-
-    unsigned char buffer[MAX_BUF_SIZE];
-    size_t bytesRead;
-
-    while ((bytesRead = fread(buffer, 1, MAX_BUF_SIZE, file)) > 0) {
-        EVP_DigestUpdate(mdctx, buffer, bytesRead);
+    uint64_t start = stats_start(), trace_start = trace_begin();
+    int result = compute_digest(fd, entry->size, selected_algorithm, entry->md5sum);
+    stats_stop(STATS_TIME_HASHING, start);
+    trace_end("hash", trace_start, entry->path_and_name);
+    entry->hash_algorithm = (result == 0) ? selected_algorithm : HASH_NONE;
+    close(fd);
+    if (result == 0) {
+        stats_add(STATS_FILES_HASHED, 1);
+        stats_add(STATS_BYTES_HASHED, entry->size);
     }
-
-    fclose(file);
-
-    unsigned int md_len;
-    EVP_DigestFinal_ex(mdctx, entry->md5sum, &md_len);
-    EVP_MD_CTX_free(mdctx);
-    */
-    return 0;
+    return result;
 }
 
 /*!
@@ -3,8 +3,16 @@
 #include <files-list.h>
 #include <stdbool.h>
 #include <configuration.h>
+#include <hash-algorithms.h>
+
+struct statx;
 
 int get_file_stats(files_list_entry_t *entry);
+int get_file_stats_at(int dir_fd, char *name, files_list_entry_t *entry);
+void stat_files_at(int dir_fd, char **names, size_t count, struct statx *results, int *errors);
+int set_file_stats(files_list_entry_t *entry, struct statx *file_stat);
 int compute_file_md5(files_list_entry_t *entry);
+void set_hash_algorithm(hash_algorithm_t algorithm);
+hash_algorithm_t get_hash_algorithm(void);
 bool directory_exists(char *path_to_dir);
 bool is_directory_writable(char *path_to_dir);
\ No newline at end of file
@@ -5,23 +5,165 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <file-properties.h>
+#include <utility.h>
+
+/*!
+ * @brief free_pages frees a chain of allocator pages
+ * @param page is the first page of the chain
+ */
+static void free_pages(files_list_page_t *page) {
+    while (page) {
+        files_list_page_t *tmp = page;
+        page = tmp->next;
+        free(tmp);
+    }
+}
+
+/*!
+ * @brief allocate_from_pages reserves memory in a chain of pages (bump allocation)
+ * Only the first page of the chain has free room, a new page is pushed in front when it is full.
+ * @param pages is a pointer to the first page of the chain
+ * @param pages_size is the size of the pages of the list, increased when a page is added
+ * @param size is the size to reserve
+ * @param alignment is the required alignment of the result (a power of 2)
+ * @return a pointer to the reserved memory, NULL if out of memory
+ */
+static void *allocate_from_pages(files_list_page_t **pages, size_t *pages_size, size_t size, size_t alignment) {
+    files_list_page_t *page = *pages;
+    size_t offset = page ? (page->used + alignment - 1) & ~(alignment - 1) : 0;
+
+    if (!page || offset + size > page->capacity) {
+        // Oversized requests get a page of their own
+        size_t capacity = (size > FILES_LIST_PAGE_SIZE) ? size : FILES_LIST_PAGE_SIZE;
+        page = malloc(sizeof(files_list_page_t) + capacity);
+        if (!page) {
+            return NULL;
+        }
+        page->capacity = capacity;
+        *pages_size += sizeof(files_list_page_t) + capacity;
+        page->next = *pages;
+        *pages = page;
+        offset = 0;
+    }
+
+    page->used = offset + size;
+    return page->data + offset;
+}
 
 /*!
  * @brief clear_files_list clears a files list
  * @param list is a pointer to the list to be cleared
- * This function is provided, you don't need to implement nor modify it
+ * Entries and paths are owned by the pages of the list, so it frees pages, not entries.
  */
 void clear_files_list(files_list_t *list) {
-    while (list->head) {
-        files_list_entry_t *tmp = list->head;
-        list->head = tmp->next;
-        free(tmp);
+    free_pages(list->entry_pages);
+    free_pages(list->path_pages);
+    list->entry_pages = NULL;
+    list->path_pages = NULL;
+    list->pages_size = 0;
+    list->head = NULL;
+    list->tail = NULL;
+}
+
+/*!
+ * @brief append_pages appends a chain of pages at the end of another one
+ * The first page of the chain, from which allocations are made, doesn't change.
+ */
+static void append_pages(files_list_page_t **pages, files_list_page_t *appended) {
+    while (*pages) {
+        pages = &(*pages)->next;
     }
+    *pages = appended;
+}
+
+/*!
+ * @brief adopt_files_list_pages moves the pages of a list to another list, without copying
+ * The entries and paths of from live as long as list, from is left without pages.
+ * It is used to gather the entries built in separate lists by several threads.
+ * @param list is the list taking the pages
+ * @param from is the list giving its pages
+ */
+void adopt_files_list_pages(files_list_t *list, files_list_t *from) {
+    append_pages(&list->entry_pages, from->entry_pages);
+    append_pages(&list->path_pages, from->path_pages);
+    list->pages_size += from->pages_size;
+    from->entry_pages = NULL;
+    from->path_pages = NULL;
+    from->pages_size = 0;
+}
+
+/*!
+ * @brief store_path copies a path into the path pool of a list
+ * @param list is the list owning the path
+ * @param file_path is the path to copy
+ * @param length is the length of file_path (without its terminating NUL)
+ * @return a pointer to the stored path, NULL if out of memory
+ */
+char *store_path(files_list_t *list, char *file_path, size_t length) {
+    char *stored = allocate_from_pages(&list->path_pages, &list->pages_size, length + 1, 1);
+    if (stored) {
+        memcpy(stored, file_path, length);
+        stored[length] = '\0';
+    }
+    return stored;
+}
+
+/*!
+ * @brief new_files_list_entry allocates an entry from the pages of a list
+ * The entry is zeroed and its path is stored, but it is not inserted in the list.
+ * It lives until the list is cleared.
+ * @param list is the list owning the entry
+ * @param file_path is the path of the entry
+ * @return a pointer to the new entry, NULL if out of memory
+ */
+files_list_entry_t *new_files_list_entry(files_list_t *list, char *file_path) {
+    if (!list || !file_path) {
+        return NULL;
+    }
+
+    size_t length = strlen(file_path);
+    if (length >= UINT16_MAX) {
+        printf("Path too long: %s\n", file_path);
+        return NULL;
+    }
+
+    files_list_entry_t *entry = allocate_from_pages(&list->entry_pages, &list->pages_size, sizeof(files_list_entry_t), _Alignof(files_list_entry_t));
+    if (!entry) {
+        return NULL;
+    }
+    memset(entry, 0, sizeof(files_list_entry_t));
+
+    entry->path_and_name = store_path(list, file_path, length);
+    if (!entry->path_and_name) {
+        return NULL;
+    }
+    entry->path_length = length;
+    return entry;
+}
+
+/*!
+ * @brief copy_files_list_entry copies an entry, with its path and properties, into the pages of a list
+ * The copy is not inserted in the list. It lives until the list is cleared.
+ * @param list is the list owning the copy
+ * @param entry is the entry to copy
+ * @return a pointer to the copy, NULL if out of memory
+ */
+files_list_entry_t *copy_files_list_entry(files_list_t *list, files_list_entry_t *entry) {
+    files_list_entry_t *copy = new_files_list_entry(list, entry->path_and_name);
+    if (copy) {
+        copy->mtime = entry->mtime;
+        copy->size = entry->size;
+        memcpy(copy->md5sum, entry->md5sum, sizeof(copy->md5sum));
+        copy->mode = entry->mode;
+        copy->entry_type = entry->entry_type;
+        copy->hash_algorithm = entry->hash_algorithm;
+    }
+    return copy;
 }
 
 /*!
  *  @brief add_file_entry adds a new file to the files list.
- *  It adds the file in an ordered manner (strcmp) and fills its properties
+ *  It adds the file in an ordered manner (path_compare) and fills its properties
  *  by calling stat on the file.
  *  Il the file already exists, it does nothing and returns 0
  *  @param list the list to add the file entry into
@@ -40,75 +182,57 @@ files_list_entry_t *add_file_entry(files_list_t *list, char *file_path) {
             printf("The file_path is NULL\n");
         }
         return NULL;
-    } else if (list->head == NULL || list->tail == NULL) {
-        if (list->head == NULL) {
-            printf("The head of the list is NULL\n");
-        }
-        if (list->tail == NULL) {
-            printf("The tail of the list is NULL\n");
-        }
-        return NULL;
     } else {
-        //we verify if the file already exists in the list
-        for (files_list_entry_t *cursor = list->head; cursor != NULL; cursor = cursor->next) {
-            if (strcmp(cursor->path_and_name, file_path) == 0) {
+        // We look for the insertion point from the tail: entries usually come in order,
+        // so this is O(1) for them. We stop on the first entry not after file_path.
+        files_list_entry_t *cursor = list->tail;
+        while (cursor != NULL) {
+            int comparison = path_compare(cursor->path_and_name, file_path);
+            if (comparison == 0) {
+                // The file already exists in the list
                 return 0;
+            } else if (comparison < 0) {
+                break;
             }
+            cursor = cursor->prev;
         }
-        // If the file does not exist in the list, we will add it
 
-        // we allocate memory for a variable of type files_list_entry_t named new_entry
-        files_list_entry_t *new_entry = malloc(sizeof(files_list_entry_t));
+        // we allocate a zeroed entry from the pages of the list, with its path already stored
+        files_list_entry_t *new_entry = new_files_list_entry(list, file_path);
         // We check if the allocation of memory was successful, if not we return NULL (out of memory)
         if (!new_entry) {
             printf("Error when allocating memory in the function add_file_entry of the file files-list.c\n");
             return NULL;
         }
 
-        // We initialize the entire memory space allocated to new entry to 0;
-        memset(new_entry, 0, sizeof(files_list_entry_t));
-
         // We call the fill_entry function to fill the different elements of the structure of new_entry
-        if ((fill_entry(list, file_path, new_entry)) == 0){
-
-            // We add the new_entry to the list of files, but we have to add it in an ordered manner (with strcmp)
-            // We check if the list is empty, if it is we add the new_entry to the head of the list
-            // else we will add it in an ordered manner
-            if (list->head == NULL) {
-                list->head = new_entry;
-                return new_entry;
-            } else {
-                files_list_entry_t *cursor = list->head;
-                while (cursor != NULL) {
-                    if (strcmp(cursor->path_and_name, file_path) > 0) {
-                        cursor = cursor->next;
-                    } else {
-                        if (cursor->prev) {
-                            cursor->prev->next = new_entry;
-                            new_entry->prev = cursor->prev;
-                        } else {
-                            list->head = new_entry;
-                        }
-                        cursor->prev = new_entry;
-                        new_entry->next = cursor;
-                        return new_entry;
-                    }
-                }
-                list->tail->next = new_entry;
-                return new_entry;
-            }
-        } else {
-            // If the fill_entry function failed we free the memory allocated to new_entry, and we return NULL,
-            // the error message is already displayed in the fill_entry function
-            free(new_entry);
+        if ((fill_entry(list, file_path, new_entry)) == -1) {
+            // If the fill_entry function failed we return NULL, the memory of new_entry is
+            // given back when the list is cleared. The error message is already displayed in the fill_entry function
             return NULL;
         }
+
+        // We insert the new_entry after the cursor (at the head of the list if there is none)
+        new_entry->prev = cursor;
+        new_entry->next = cursor ? cursor->next : list->head;
+        if (new_entry->next) {
+            new_entry->next->prev = new_entry;
+        } else {
+            list->tail = new_entry;
+        }
+        if (cursor) {
+            cursor->next = new_entry;
+        } else {
+            list->head = new_entry;
+        }
+        return new_entry;
     }
 }
 
 /*!
  *  @brief fill_entry fills the properties of a file entry
  *  It fills the properties of a file entry by calling stat on the file.
+ *  It doesn't insert the entry in the list (@see add_file_entry, add_entry_to_tail).
  *  @param list the list to add the file entry into
  *  @param file_path the full path (from the root of the considered tree) of the file
  *  @param new_entry the entry to fill
@@ -116,8 +240,14 @@ files_list_entry_t *add_file_entry(files_list_t *list, char *file_path) {
  */
 int fill_entry(files_list_t *list, char *file_path, files_list_entry_t *new_entry) {
 
-    //  Filling "char path_and_name[4096]";
-    strcpy(new_entry->path_and_name, file_path);
+    //  Filling "char *path_and_name", unless it was stored when the entry was allocated
+    if (!new_entry->path_and_name) {
+        new_entry->path_length = strlen(file_path);
+        new_entry->path_and_name = store_path(list, file_path, new_entry->path_length);
+        if (!new_entry->path_and_name) {
+            return -1;
+        }
+    }
 
     if ((get_file_stats(new_entry)) == -1) {
         printf("Error in the function fill_entry of the file files-list.c\n");
@@ -125,17 +255,7 @@ int fill_entry(files_list_t *list, char *file_path, files_list_entry_t *new_entr
         return -1;
     }
 
-    //  Filling "struct _files_list_entry *next"
-    new_entry->next = NULL;
-
-    //  Filling "struct _files_list_entry *prev"
-    if (!list->tail) {
-        new_entry->prev = list->tail;
-    } else {
-        new_entry->prev = NULL;
-    }
-    list->tail = new_entry;
-
+    //  The links (next and prev) are set when the entry is inserted in the list
     return 0;
 }
 
@@ -203,13 +323,19 @@ files_list_entry_t *find_entry_by_name(files_list_t *list, char *file_path, size
         printf("The head of the list is NULL\n");
         return NULL;
     } else {
-        // We create a variable of type files_list_entry_t named cursor, and we initialize it with the head of the list
+        // Names are compared without their root: file_path is relative from start_of_src,
+        // and the list entries are relative from start_of_dest
+        char *relative_path = file_path + start_of_src;
         files_list_entry_t *cursor = list->head;
         while (cursor != NULL) {
+            int comparison = path_compare(relative_path, cursor->path_and_name + start_of_dest);
             // We check if the file_path is the same as the path_and_name of the cursor
             // if it is we return the cursor
-            if (strcmp(file_path, cursor->path_and_name) == 0) {
+            if (comparison == 0) {
                 return cursor;
+            } else if (comparison < 0) {
+                // The list is ordered, file_path can't be found further
+                break;
             } else {
                 cursor = cursor->next;
             }
@@ -1,28 +1,50 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 #include <sys/types.h>
 
+#define FILES_LIST_PAGE_SIZE (256 * 1024)
+
 typedef enum { FICHIER, DOSSIER } file_type_t;
 
+// Entries are kept small: the path is not embedded but interned in the list's path pool,
+// and the entry itself is carved from the list's entry pages (@see new_files_list_entry)
 typedef struct _files_list_entry {
-  char path_and_name[4096];
+  char *path_and_name; // NUL-terminated, owned by the path pool of the list
+  struct _files_list_entry *next;
+  struct _files_list_entry *prev;
   struct timespec mtime;
   uint64_t size;
-  uint8_t md5sum[16];
-  file_type_t entry_type;
+  uint8_t md5sum[16]; // Digest computed with hash_algorithm (not always MD5)
   mode_t mode;
-  struct _files_list_entry *next;
-  struct _files_list_entry *prev;
+  uint16_t path_length;
+  uint8_t entry_type; // Holds a file_type_t
+  uint8_t hash_algorithm; // Holds a hash_algorithm_t, HASH_NONE when md5sum is not set
 } files_list_entry_t;
 
+// A page of a bump allocator, used both for entries and for paths
+typedef struct _files_list_page {
+  struct _files_list_page *next;
+  size_t used;
+  size_t capacity;
+  char data[];
+} files_list_page_t;
+
 typedef struct {
   struct _files_list_entry *head;
   struct _files_list_entry *tail;
+  files_list_page_t *entry_pages;
+  files_list_page_t *path_pages;
+  size_t pages_size; // Bytes allocated by the pages, to bound the memory of a list (@see sorted-runs.h)
 } files_list_t;
 
 void clear_files_list(files_list_t *list);
+void adopt_files_list_pages(files_list_t *list, files_list_t *from);
+files_list_entry_t *new_files_list_entry(files_list_t *list, char *file_path);
+char *store_path(files_list_t *list, char *file_path, size_t length);
+files_list_entry_t *copy_files_list_entry(files_list_t *list, files_list_entry_t *entry);
 files_list_entry_t *add_file_entry(files_list_t *list, char *file_path);
 int fill_entry(files_list_t *list, char *file_path, files_list_entry_t *new_entry);
 int add_entry_to_tail(files_list_t *list, files_list_entry_t *entry);
@@ -0,0 +1,108 @@
+#include <hash-algorithms.h>
+#include <hash-engine.h>
+#include <xxh3.h>
+#include <blake3.h>
+#include <openssl/evp.h>
+#include <string.h>
+
+// Digests are DIGEST_SIZE bytes long:
+// - MD5 fits exactly
+// - XXH3 (64 bits) is stored big endian (its canonical form) in the first 8 bytes, the rest is zero
+// - BLAKE3 is truncated to 128 bits, which is a valid BLAKE3 output length
+
+/*!
+ * @brief parse_hash_algorithm gets an algorithm from its name (as given to --hash)
+ * @param name is the name of the algorithm: md5, xxh3 or blake3
+ * @return the algorithm, -1 if the name is unknown
+ */
+int parse_hash_algorithm(const char *name) {
+    if (!name) {
+        return -1;
+    } else if (strcmp(name, "md5") == 0) {
+        return HASH_MD5;
+    } else if (strcmp(name, "xxh3") == 0) {
+        return HASH_XXH3;
+    } else if (strcmp(name, "blake3") == 0) {
+        return HASH_BLAKE3;
+    }
+    return -1;
+}
+
+/*!
+ * @brief hash_algorithm_name gives the name of an algorithm
+ */
+const char *hash_algorithm_name(hash_algorithm_t algorithm) {
+    switch (algorithm) {
+        case HASH_NONE:
+            return "none";
+        case HASH_MD5:
+            return "md5";
+        case HASH_XXH3:
+            return "xxh3";
+        case HASH_BLAKE3:
+            return "blake3";
+    }
+    return "unknown";
+}
+
+static int md5_update(void *context, const uint8_t *data, size_t length) {
+    return (EVP_DigestUpdate((EVP_MD_CTX *) context, data, length) == 1) ? 0 : -1;
+}
+
+static int xxh3_engine_update(void *context, const uint8_t *data, size_t length) {
+    xxh3_update((xxh3_state_t *) context, data, length);
+    return 0;
+}
+
+static int blake3_engine_update(void *context, const uint8_t *data, size_t length) {
+    blake3_update((blake3_hasher_t *) context, data, length);
+    return 0;
+}
+
+/*!
+ * @brief compute_digest computes the digest of a whole file
+ * @param fd is the file descriptor, open for reading at the beginning of the file
+ * @param size is the expected size of the file (@see hash_file_contents)
+ * @param algorithm is the hash algorithm
+ * @param digest receives the digest
+ * @return 0 in case of success, -1 else
+ */
+int compute_digest(int fd, uint64_t size, hash_algorithm_t algorithm, uint8_t digest[DIGEST_SIZE]) {
+    memset(digest, 0, DIGEST_SIZE);
+
+    if (algorithm == HASH_MD5) {
+        EVP_MD_CTX *context = EVP_MD_CTX_new();
+        if (!context) {
+            return -1;
+        }
+        int result = -1;
+        unsigned int digest_length;
+        if (EVP_DigestInit_ex(context, EVP_md5(), NULL) == 1
+            && hash_file_contents(fd, size, HASH_STRATEGY_AUTO, md5_update, context) == 0
+            && EVP_DigestFinal_ex(context, digest, &digest_length) == 1) {
+            result = 0;
+        }
+        EVP_MD_CTX_free(context);
+        return result;
+    } else if (algorithm == HASH_XXH3) {
+        xxh3_state_t state;
+        xxh3_init(&state);
+        if (hash_file_contents(fd, size, HASH_STRATEGY_AUTO, xxh3_engine_update, &state) == -1) {
+            return -1;
+        }
+        uint64_t hash = xxh3_digest(&state);
+        for (int i=0; i<8; ++i) {
+            digest[i] = hash >> (56 - 8 * i);
+        }
+        return 0;
+    } else if (algorithm == HASH_BLAKE3) {
+        blake3_hasher_t hasher;
+        blake3_init(&hasher);
+        if (hash_file_contents(fd, size, HASH_STRATEGY_AUTO, blake3_engine_update, &hasher) == -1) {
+            return -1;
+        }
+        blake3_finalize(&hasher, digest, DIGEST_SIZE);
+        return 0;
+    }
+    return -1;
+}
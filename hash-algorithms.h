@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+#define DIGEST_SIZE 16
+
+// Tag of the digest stored in an entry: digests of different algorithms are never compared
+typedef enum { HASH_NONE, HASH_MD5, HASH_XXH3, HASH_BLAKE3 } hash_algorithm_t;
+
+int parse_hash_algorithm(const char *name);
+const char *hash_algorithm_name(hash_algorithm_t algorithm);
+int compute_digest(int fd, uint64_t size, hash_algorithm_t algorithm, uint8_t digest[DIGEST_SIZE]);
@@ -0,0 +1,249 @@
+#include <hash-engine.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Each thread (or forked process) reuses its own buffers, small files then cost no allocation
+static _Thread_local uint8_t *thread_buffers[2];
+
+// State shared between the hashing thread and the reader thread of the pipelined strategy
+typedef struct {
+    int fd;
+    uint8_t *buffers[2];
+    ssize_t lengths[2];
+    bool filled[2];
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} hash_pipeline_t;
+
+/*!
+ * @brief get_buffer returns one of the aligned buffers of the calling thread
+ * @param index is the buffer index (0 or 1)
+ * @return a HASH_BUFFER_SIZE bytes buffer, NULL if out of memory
+ */
+static uint8_t *get_buffer(int index) {
+    if (!thread_buffers[index]) {
+        void *buffer = NULL;
+        if (posix_memalign(&buffer, 4096, HASH_BUFFER_SIZE) != 0) {
+            return NULL;
+        }
+        thread_buffers[index] = buffer;
+    }
+    return thread_buffers[index];
+}
+
+/*!
+ * @brief read_full reads until the buffer is full or the end of file
+ * @return the number of bytes read, -1 in case of error
+ */
+static ssize_t read_full(int fd, uint8_t *buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t count = read(fd, buffer + total, size - total);
+        if (count == -1) {
+            return -1;
+        } else if (count == 0) {
+            break;
+        }
+        total += count;
+    }
+    return total;
+}
+
+/*!
+ * @brief hash_with_read hashes a file with one large buffer
+ */
+static int hash_with_read(int fd, hash_update_t update, void *context) {
+    uint8_t *buffer = get_buffer(0);
+    if (!buffer) {
+        return -1;
+    }
+
+    ssize_t count;
+    while ((count = read_full(fd, buffer, HASH_BUFFER_SIZE)) > 0) {
+        if (update(context, buffer, count) == -1) {
+            return -1;
+        }
+        if (count < HASH_BUFFER_SIZE) {
+            break;
+        }
+    }
+    return (count == -1) ? -1 : 0;
+}
+
+/*!
+ * @brief hash_with_mmap hashes a file by mapping it
+ * The file must not be truncated while it is hashed (the process would get a SIGBUS),
+ * which is why the automatic strategy doesn't use it.
+ */
+static int hash_with_mmap(int fd, hash_update_t update, void *context) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        return -1;
+    }
+    if (file_stat.st_size == 0) {
+        return 0;
+    }
+
+    uint8_t *mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+    madvise(mapping, file_stat.st_size, MADV_SEQUENTIAL);
+
+    int result = 0;
+    for (off_t offset=0; offset<file_stat.st_size && result == 0; offset+=HASH_BUFFER_SIZE) {
+        size_t length = (file_stat.st_size - offset < HASH_BUFFER_SIZE) ? (size_t) (file_stat.st_size - offset) : HASH_BUFFER_SIZE;
+        result = update(context, mapping + offset, length);
+    }
+    munmap(mapping, file_stat.st_size);
+    return result;
+}
+
+/*!
+ * @brief pipeline_reader is the reader thread of the pipelined strategy
+ * It fills the buffers alternately, until the end of file, an error or a stop request.
+ */
+static void *pipeline_reader(void *parameters) {
+    hash_pipeline_t *pipeline = (hash_pipeline_t *) parameters;
+
+    for (int index=0; ; index=1-index) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->filled[index] && !pipeline->stop) {
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        }
+        bool stop = pipeline->stop;
+        pthread_mutex_unlock(&pipeline->lock);
+        if (stop) {
+            break;
+        }
+
+        ssize_t count = read_full(pipeline->fd, pipeline->buffers[index], HASH_BUFFER_SIZE);
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->lengths[index] = count;
+        pipeline->filled[index] = true;
+        pthread_cond_broadcast(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->lock);
+
+        // A short read is the end of file, there is nothing more to read
+        if (count < HASH_BUFFER_SIZE) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * @brief hash_with_pipeline hashes a file while a reader thread reads its next chunk
+ * The reading of a chunk overlaps the hashing of the previous one.
+ */
+static int hash_with_pipeline(int fd, hash_update_t update, void *context) {
+    hash_pipeline_t pipeline = {
+        .fd = fd,
+        .buffers = {get_buffer(0), get_buffer(1)},
+    };
+    if (!pipeline.buffers[0] || !pipeline.buffers[1]) {
+        return -1;
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.cond, NULL);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, pipeline_reader, &pipeline) != 0) {
+        pthread_mutex_destroy(&pipeline.lock);
+        pthread_cond_destroy(&pipeline.cond);
+        return hash_with_read(fd, update, context);
+    }
+
+    int result = 0;
+    for (int index=0; ; index=1-index) {
+        pthread_mutex_lock(&pipeline.lock);
+        while (!pipeline.filled[index]) {
+            pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+        }
+        ssize_t count = pipeline.lengths[index];
+        pthread_mutex_unlock(&pipeline.lock);
+
+        if (count == -1) {
+            result = -1;
+        } else if (count > 0) {
+            result = update(context, pipeline.buffers[index], count);
+        }
+        if (result == -1 || count < HASH_BUFFER_SIZE) {
+            break;
+        }
+
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.filled[index] = false;
+        pthread_cond_broadcast(&pipeline.cond);
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.stop = true;
+    pthread_cond_broadcast(&pipeline.cond);
+    pthread_mutex_unlock(&pipeline.lock);
+    pthread_join(reader, NULL);
+
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.cond);
+    return result;
+}
+
+/*!
+ * @brief hash_file_contents reads a whole file and feeds it to a hash function
+ * @param fd is the file descriptor, open for reading at the beginning of the file
+ * @param size is the expected size of the file, used to choose the strategy (the file is read until its end anyway)
+ * @param strategy is the way to read the file, HASH_STRATEGY_AUTO adapts it to the size:
+ * - files that fit in a buffer are read with a single read()
+ * - huge files are read by a reader thread while the previous chunk is hashed
+ * - other files are read with one large buffer
+ * @param update is the function to which all the chunks are passed, in order
+ * @param context is passed to update
+ * @return 0 in case of success, -1 else
+ */
+int hash_file_contents(int fd, uint64_t size, hash_strategy_t strategy, hash_update_t update, void *context) {
+    if (fd < 0 || !update) {
+        return -1;
+    }
+
+    if (strategy == HASH_STRATEGY_AUTO) {
+        strategy = (size >= HASH_PIPELINE_THRESHOLD) ? HASH_STRATEGY_PIPELINED : HASH_STRATEGY_READ;
+    }
+    if (size > HASH_BUFFER_SIZE) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    switch (strategy) {
+        case HASH_STRATEGY_MMAP:
+            return hash_with_mmap(fd, update, context);
+        case HASH_STRATEGY_PIPELINED:
+            return hash_with_pipeline(fd, update, context);
+        default:
+            return hash_with_read(fd, update, context);
+    }
+}
+
+/*!
+ * @brief hash_strategy_name gives the name of a strategy, for reports
+ */
+const char *hash_strategy_name(hash_strategy_t strategy) {
+    switch (strategy) {
+        case HASH_STRATEGY_AUTO:
+            return "auto";
+        case HASH_STRATEGY_READ:
+            return "read";
+        case HASH_STRATEGY_MMAP:
+            return "mmap";
+        case HASH_STRATEGY_PIPELINED:
+            return "pipelined";
+    }
+    return "unknown";
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HASH_BUFFER_SIZE (1024 * 1024)
+#define HASH_PIPELINE_THRESHOLD (16 * 1024 * 1024)
+
+typedef enum {
+    HASH_STRATEGY_AUTO, // Chosen from the file size
+    HASH_STRATEGY_READ, // read() into one large aligned buffer
+    HASH_STRATEGY_MMAP, // mmap with MADV_SEQUENTIAL
+    HASH_STRATEGY_PIPELINED, // Two buffers, one filled by a reader thread while the other is hashed
+} hash_strategy_t;
+
+// Called with each chunk of the file, in order. Returns 0, or -1 to abort
+typedef int (*hash_update_t)(void *context, const uint8_t *data, size_t length);
+
+int hash_file_contents(int fd, uint64_t size, hash_strategy_t strategy, hash_update_t update, void *context);
+const char *hash_strategy_name(hash_strategy_t strategy);
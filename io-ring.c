@@ -0,0 +1,580 @@
+#define _GNU_SOURCE
+#include <io-ring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// Rings are per thread, created on first use. Forked processes create their own
+static bool is_enabled = false;
+static bool batches_metadata = false; // The statx, openat and close of the files are batched (--io-uring)
+static bool chains_copies = false; // The small files are copied by chains of requests (--io-uring-copy)
+static pthread_key_t ring_key;
+
+/*!
+ * @brief release_thread_ring releases the ring of a thread that ends
+ */
+static void release_thread_ring(void *data) {
+    io_ring_t *ring = (io_ring_t *) data;
+    io_ring_release(ring);
+    free(ring);
+}
+
+/*!
+ * @brief forget_thread_ring releases, in a forked child, the ring of its parent thread
+ */
+static void forget_thread_ring(void) {
+    io_ring_t *ring = pthread_getspecific(ring_key);
+    if (ring) {
+        pthread_setspecific(ring_key, NULL);
+        release_thread_ring(ring);
+    }
+}
+
+/*!
+ * @brief probe_operations tells if the kernel supports some operations
+ * @param ring is a ring, used to query the kernel
+ * @param operations is the array of the IORING_OP_* operations
+ * @param count is the number of operations
+ * @return true if all of them are supported, false else
+ */
+static bool probe_operations(io_ring_t *ring, int *operations, size_t count) {
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) {
+        return false;
+    }
+    bool is_supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i=0; is_supported && i<count; ++i) {
+        is_supported = operations[i] <= probe->last_op && (probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return is_supported;
+}
+
+/*!
+ * @brief enable_io_ring has the system calls batched through io_uring, when the kernel allows it
+ * It is called once, before the processes are forked, and checks that a ring can be created and supports
+ * the needed operations. Otherwise the program keeps its synchronous system calls.
+ * @param with_metadata tells if the statx, openat and close of the files are batched (@see is_io_ring_enabled)
+ * @param with_copies tells if the small files are copied by chains of requests (@see is_io_ring_copy_enabled),
+ * it also needs the fixed reads and writes
+ * @return 0 if io_uring is used, -1 else
+ */
+int enable_io_ring(bool with_metadata, bool with_copies) {
+    if (is_enabled) {
+        return 0;
+    }
+    if (pthread_key_create(&ring_key, release_thread_ring) != 0) {
+        return -1;
+    }
+    io_ring_t ring;
+    if (io_ring_init(&ring, IO_RING_ENTRIES) == -1) {
+        return -1;
+    }
+    int metadata_operations[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_CLOSE};
+    int copy_operations[] = {IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED};
+    batches_metadata = with_metadata && probe_operations(&ring, metadata_operations, sizeof(metadata_operations) / sizeof(int));
+    chains_copies = with_copies && probe_operations(&ring, copy_operations, sizeof(copy_operations) / sizeof(int));
+    io_ring_release(&ring);
+    if (!batches_metadata && !chains_copies) {
+        return -1;
+    }
+    pthread_atfork(NULL, NULL, forget_thread_ring);
+    is_enabled = true;
+    return 0;
+}
+
+/*!
+ * @brief is_io_ring_enabled tells if the statx, openat and close of the files are batched through io_uring
+ */
+bool is_io_ring_enabled(void) {
+    return is_enabled && batches_metadata;
+}
+
+/*!
+ * @brief is_io_ring_copy_enabled tells if the small files are copied by chains of io_uring requests
+ */
+bool is_io_ring_copy_enabled(void) {
+    return is_enabled && chains_copies;
+}
+
+/*!
+ * @brief thread_io_ring gives the ring of the calling thread, created on its first call
+ * @return the ring, NULL if io_uring is not enabled or the ring cannot be created
+ */
+io_ring_t *thread_io_ring(void) {
+    if (!is_enabled) {
+        return NULL;
+    }
+    io_ring_t *ring = pthread_getspecific(ring_key);
+    if (!ring) {
+        ring = malloc(sizeof(io_ring_t));
+        if (!ring || io_ring_init(ring, IO_RING_ENTRIES) == -1 || pthread_setspecific(ring_key, ring) != 0) {
+            if (ring && ring->fd != -1) {
+                io_ring_release(ring);
+            }
+            free(ring);
+            return NULL;
+        }
+    }
+    return ring;
+}
+
+/*!
+ * @brief io_ring_wait waits for the completion of a request taken by the kernel, without submitting any
+ * @return 0 in case of success, -1 else
+ */
+static int io_ring_wait(io_ring_t *ring) {
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (result == -1 && errno == EINTR);
+    return (result == -1) ? -1 : 0;
+}
+
+/*!
+ * @brief discard_thread_io_ring drops the ring of the calling thread, after one of its submissions failed
+ * The requests of the failed submission may still point to the memory of the caller: the requests the
+ * kernel took are waited for, and the ring is released with the ones it didn't take, so they never run.
+ * The next call to thread_io_ring creates a new ring.
+ */
+void discard_thread_io_ring(void) {
+    if (!is_enabled) {
+        return;
+    }
+    io_ring_t *ring = pthread_getspecific(ring_key);
+    if (!ring) {
+        return;
+    }
+    pthread_setspecific(ring_key, NULL);
+    uint64_t user_data;
+    int32_t result;
+    while (ring->in_flight > 0) {
+        if (io_ring_wait(ring) == -1) {
+            // Closing the ring cancels the requests left
+            perror("io_uring_enter");
+            break;
+        }
+        while (io_ring_peek(ring, &user_data, &result)) {
+        }
+    }
+    release_thread_ring(ring);
+}
+
+/*!
+ * @brief io_ring_init sets up a ring and maps its queues
+ * @param ring is the ring to set up
+ * @param entries is the size of its submission queue, a power of 2
+ * @return 0 in case of success, -1 else (the fd of the ring is -1)
+ */
+int io_ring_init(io_ring_t *ring, unsigned entries) {
+    memset(ring, 0, sizeof(io_ring_t));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_mapping_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_mapping_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_mapping_size > ring->sq_mapping_size) {
+            ring->sq_mapping_size = ring->cq_mapping_size;
+        }
+        ring->cq_mapping_size = ring->sq_mapping_size;
+    }
+    ring->sq_mapping = mmap(NULL, ring->sq_mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_mapping == MAP_FAILED) {
+        ring->sq_mapping = NULL;
+        io_ring_release(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_mapping = ring->sq_mapping;
+    } else {
+        ring->cq_mapping = mmap(NULL, ring->cq_mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_mapping == MAP_FAILED) {
+            ring->cq_mapping = NULL;
+            io_ring_release(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        io_ring_release(ring);
+        return -1;
+    }
+
+    char *sq = (char *) ring->sq_mapping, *cq = (char *) ring->cq_mapping;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+}
+
+/*!
+ * @brief io_ring_release unmaps the queues of a ring and closes it
+ */
+void io_ring_release(io_ring_t *ring) {
+    if (ring->buffer) {
+        munmap(ring->buffer, ring->buffer_size);
+    }
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_mapping && ring->cq_mapping != ring->sq_mapping) {
+        munmap(ring->cq_mapping, ring->cq_mapping_size);
+    }
+    if (ring->sq_mapping) {
+        munmap(ring->sq_mapping, ring->sq_mapping_size);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(io_ring_t));
+    ring->fd = -1;
+}
+
+/*!
+ * @brief io_ring_get_sqe gives the next free request of the submission queue, cleared
+ * @return the request, NULL if the queue is full
+ */
+struct io_uring_sqe *io_ring_get_sqe(io_ring_t *ring) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned *) ring->sq_head, memory_order_acquire);
+    if (ring->sqe_tail - head >= ring->entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+    ++ring->sqe_tail;
+    return sqe;
+}
+
+/*!
+ * @brief io_ring_submit submits the prepared requests, and waits for completions
+ * @param ring is the ring
+ * @param wait_count is the number of completions to wait for, 0 not to wait
+ * @return the number of requests submitted, -1 in case of error (with errno set)
+ */
+int io_ring_submit(io_ring_t *ring, unsigned wait_count) {
+    unsigned tail = *ring->sq_tail;
+    unsigned to_submit = ring->sqe_tail - tail;
+    unsigned head = atomic_load_explicit((_Atomic unsigned *) ring->sq_head, memory_order_acquire);
+    atomic_store_explicit((_Atomic unsigned *) ring->sq_tail, ring->sqe_tail, memory_order_release);
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_count, wait_count > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (result == -1 && errno == EINTR);
+    // Even when the call fails, the kernel may have taken some requests (@see discard_thread_io_ring)
+    int saved_errno = errno;
+    ring->in_flight += atomic_load_explicit((_Atomic unsigned *) ring->sq_head, memory_order_acquire) - head;
+    errno = saved_errno;
+    return result;
+}
+
+/*!
+ * @brief io_ring_peek takes the next completion, if there is one
+ * @param ring is the ring
+ * @param user_data receives the user data of the completed request
+ * @param result receives its result, a negative errno in case of error
+ * @return true if a completion was taken
+ */
+bool io_ring_peek(io_ring_t *ring, uint64_t *user_data, int32_t *result) {
+    unsigned head = *ring->cq_head;
+    if (head == atomic_load_explicit((_Atomic unsigned *) ring->cq_tail, memory_order_acquire)) {
+        return false;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    atomic_store_explicit((_Atomic unsigned *) ring->cq_head, head + 1, memory_order_release);
+    if (ring->in_flight > 0) {
+        --ring->in_flight;
+    }
+    return true;
+}
+
+/*!
+ * @brief io_ring_prep_statx prepares a statx request (@see statx)
+ */
+void io_ring_prep_statx(struct io_uring_sqe *sqe, int dir_fd, const char *name, int flags, unsigned mask, struct statx *result) {
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dir_fd;
+    sqe->addr = (uint64_t) (uintptr_t) name;
+    sqe->len = mask;
+    sqe->off = (uint64_t) (uintptr_t) result;
+    sqe->statx_flags = flags;
+}
+
+/*!
+ * @brief io_ring_prep_openat prepares an openat request (@see openat), its result is the new fd
+ */
+void io_ring_prep_openat(struct io_uring_sqe *sqe, int dir_fd, const char *name, int flags, mode_t mode) {
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir_fd;
+    sqe->addr = (uint64_t) (uintptr_t) name;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+}
+
+/*!
+ * @brief io_ring_prep_close prepares a close request
+ */
+void io_ring_prep_close(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
+
+/*!
+ * @brief io_ring_register_buffer allocates a buffer and registers it, for the fixed reads and writes
+ * @param ring is the ring, it has no buffer yet
+ * @param size is the size of the buffer
+ * @return 0 in case of success, -1 else
+ */
+int io_ring_register_buffer(io_ring_t *ring, size_t size) {
+    void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (buffer == MAP_FAILED) {
+        return -1;
+    }
+    struct iovec vector = {.iov_base = buffer, .iov_len = size};
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &vector, 1) == -1) {
+        munmap(buffer, size);
+        return -1;
+    }
+    ring->buffer = buffer;
+    ring->buffer_size = size;
+    return 0;
+}
+
+/*!
+ * @brief io_ring_register_files registers empty file slots, filled by the direct opens
+ * A direct descriptor is only known by the ring, so that it can be used by the next requests of a chain.
+ * @param ring is the ring, it has no slots yet
+ * @param count is the number of slots
+ * @return 0 in case of success, -1 else
+ */
+int io_ring_register_files(io_ring_t *ring, unsigned count) {
+    int *fds = malloc(count * sizeof(int));
+    if (!fds) {
+        return -1;
+    }
+    for (unsigned i=0; i<count; ++i) {
+        fds[i] = -1;
+    }
+    int result = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count);
+    free(fds);
+    if (result == -1) {
+        return -1;
+    }
+    ring->files_count = count;
+    return 0;
+}
+
+/*!
+ * @brief io_ring_prep_openat_direct prepares an openat request whose file goes to a slot of the ring
+ */
+void io_ring_prep_openat_direct(struct io_uring_sqe *sqe, int dir_fd, const char *name, int flags, mode_t mode, unsigned slot) {
+    io_ring_prep_openat(sqe, dir_fd, name, flags & ~O_CLOEXEC, mode);
+    sqe->file_index = slot + 1;
+}
+
+/*!
+ * @brief io_ring_prep_close_direct prepares the close of a slot of the ring
+ */
+void io_ring_prep_close_direct(struct io_uring_sqe *sqe, unsigned slot) {
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+}
+
+/*!
+ * @brief io_ring_prep_read_fixed prepares a read from a slot of the ring into its registered buffer
+ */
+void io_ring_prep_read_fixed(struct io_uring_sqe *sqe, unsigned slot, void *buffer, unsigned length, uint64_t offset) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = slot;
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->buf_index = 0;
+}
+
+/*!
+ * @brief io_ring_prep_write_fixed prepares a write to a slot of the ring from its registered buffer
+ */
+void io_ring_prep_write_fixed(struct io_uring_sqe *sqe, unsigned slot, void *buffer, unsigned length, uint64_t offset) {
+    io_ring_prep_read_fixed(sqe, slot, buffer, length, offset);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+}
+
+/*!
+ * @brief batch_prepare_t prepares the request of the element of a batch at an index
+ */
+typedef void (*batch_prepare_t)(struct io_uring_sqe *sqe, size_t index, void *parameters);
+
+/*!
+ * @brief run_batch runs a request per element of a batch, with at most the size of the ring in flight
+ * @param ring is the ring, it must have no request in progress
+ * @param count is the number of elements
+ * @param prepare prepares the request of an element
+ * @param parameters is passed to prepare
+ * @param results receives the result of each request, IO_RING_NOT_DONE for the ones that did not run
+ * @return 0 in case of success, -1 if the ring failed. The requests taken by the kernel are then waited for,
+ * so that none of them still uses the parameters, but the ring must be discarded (@see discard_thread_io_ring)
+ */
+static int run_batch(io_ring_t *ring, size_t count, batch_prepare_t prepare, void *parameters, int32_t *results) {
+    for (size_t i=0; i<count; ++i) {
+        results[i] = IO_RING_NOT_DONE;
+    }
+    size_t next = 0, completed = 0;
+    uint64_t index;
+    int32_t result;
+    while (completed < count) {
+        struct io_uring_sqe *sqe;
+        while (next < count && ring->in_flight + (ring->sqe_tail - *ring->sq_tail) < ring->entries && (sqe = io_ring_get_sqe(ring))) {
+            prepare(sqe, next, parameters);
+            sqe->user_data = next++;
+        }
+        if (io_ring_submit(ring, 1) == -1) {
+            perror("io_uring_enter");
+            while (ring->in_flight > 0 && io_ring_wait(ring) == 0) {
+                while (io_ring_peek(ring, &index, &result)) {
+                    if (index < count) {
+                        results[index] = result;
+                    }
+                }
+            }
+            return -1;
+        }
+        while (io_ring_peek(ring, &index, &result)) {
+            if (index < count) {
+                results[index] = result;
+            }
+            ++completed;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    int dir_fd;
+    char **names;
+    int flags;
+    unsigned mask;
+    struct statx *results;
+} statx_batch_t;
+
+static void prepare_statx(struct io_uring_sqe *sqe, size_t index, void *parameters) {
+    statx_batch_t *batch = parameters;
+    io_ring_prep_statx(sqe, batch->dir_fd, batch->names[index], batch->flags, batch->mask, &batch->results[index]);
+}
+
+/*!
+ * @brief io_ring_statx_batch gets the statx of many names, with at most the size of the ring in flight
+ * @param ring is the ring, it must have no request in progress
+ * @param dir_fd is the directory the names are relative to (AT_FDCWD for the current directory)
+ * @param names is the array of names
+ * @param count is the number of names
+ * @param flags and mask are the flags and mask of statx
+ * @param results receives the statx of each name
+ * @param errors receives 0 for each name whose statx succeeded, its errno else
+ * @return 0 in case of success, -1 if the ring failed (the errors of the names not done are set), it must
+ * then be discarded (@see discard_thread_io_ring)
+ */
+int io_ring_statx_batch(io_ring_t *ring, int dir_fd, char **names, size_t count, int flags, unsigned mask, struct statx *results, int *errors) {
+    int32_t *statuses = malloc(count * sizeof(int32_t));
+    if (!statuses) {
+        for (size_t i=0; i<count; ++i) {
+            errors[i] = ENOMEM;
+        }
+        return -1;
+    }
+    statx_batch_t batch = {.dir_fd = dir_fd, .names = names, .flags = flags, .mask = mask, .results = results};
+    int result = run_batch(ring, count, prepare_statx, &batch, statuses);
+    for (size_t i=0; i<count; ++i) {
+        errors[i] = (statuses[i] == IO_RING_NOT_DONE) ? EIO : (statuses[i] < 0 ? -statuses[i] : 0);
+    }
+    free(statuses);
+    return result;
+}
+
+typedef struct {
+    char **paths;
+    int *flags;
+    mode_t *modes;
+} openat_batch_t;
+
+static void prepare_openat(struct io_uring_sqe *sqe, size_t index, void *parameters) {
+    openat_batch_t *batch = parameters;
+    io_ring_prep_openat(sqe, AT_FDCWD, batch->paths[index], batch->flags[index], batch->modes[index]);
+}
+
+/*!
+ * @brief io_ring_openat_batch opens many files, with at most the size of the ring in flight
+ * @param ring is the ring, it must have no request in progress
+ * @param paths is the array of paths
+ * @param flags and modes are the flags and the modes of each open (@see open)
+ * @param count is the number of files
+ * @param fds receives the descriptor of each file, a negative errno if it could not be opened
+ * @return 0 in case of success, -1 if the ring failed, it must then be discarded. The files that were
+ * opened before have their descriptor in fds, the others get -EIO
+ */
+int io_ring_openat_batch(io_ring_t *ring, char **paths, int *flags, mode_t *modes, size_t count, int *fds) {
+    openat_batch_t batch = {.paths = paths, .flags = flags, .modes = modes};
+    int result = run_batch(ring, count, prepare_openat, &batch, fds);
+    for (size_t i=0; i<count; ++i) {
+        if (fds[i] == IO_RING_NOT_DONE) {
+            fds[i] = -EIO;
+        }
+    }
+    return result;
+}
+
+static void prepare_close(struct io_uring_sqe *sqe, size_t index, void *parameters) {
+    io_ring_prep_close(sqe, ((int *) parameters)[index]);
+}
+
+/*!
+ * @brief io_ring_close_batch closes many descriptors, with at most the size of the ring in flight
+ * The descriptors are always closed: if the ring fails, the ones it did not close are closed with close.
+ * @param ring is the ring, it must have no request in progress
+ * @param fds is the array of descriptors
+ * @param count is the number of descriptors
+ * @return 0 in case of success, -1 if the ring failed, it must then be discarded
+ */
+int io_ring_close_batch(io_ring_t *ring, int *fds, size_t count) {
+    int32_t *results = malloc(count * sizeof(int32_t));
+    if (!results) {
+        for (size_t i=0; i<count; ++i) {
+            close(fds[i]);
+        }
+        return 0;
+    }
+    int result = run_batch(ring, count, prepare_close, fds, results);
+    // A request still in flight may close its descriptor later, it must not be reused by a close in between
+    for (size_t i=0; ring->in_flight == 0 && i<count; ++i) {
+        if (results[i] == IO_RING_NOT_DONE) {
+            close(fds[i]);
+        }
+    }
+    free(results);
+    return result;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+
+struct statx;
+
+#define IO_RING_ENTRIES 256 // Requests submitted at once
+#define IO_RING_NOT_DONE INT32_MIN // Result of a request of a batch that did not run
+
+// An io_uring, set up with the raw system calls (liburing is not required)
+typedef struct {
+    int fd;
+    unsigned entries;
+    // Submission queue, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail; // Requests prepared, published to the kernel by io_ring_submit
+    unsigned in_flight; // Requests taken by the kernel whose completion was not peeked yet
+    // Completion queue, shared with the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings
+    void *sq_mapping;
+    size_t sq_mapping_size;
+    void *cq_mapping; // The same as sq_mapping with IORING_FEAT_SINGLE_MMAP
+    size_t cq_mapping_size;
+    size_t sqes_size;
+    // Resources registered with the kernel, used by the fixed requests
+    void *buffer;
+    size_t buffer_size;
+    unsigned files_count; // File slots of the direct descriptors
+} io_ring_t;
+
+int enable_io_ring(bool with_metadata, bool with_copies);
+bool is_io_ring_enabled(void);
+bool is_io_ring_copy_enabled(void);
+io_ring_t *thread_io_ring(void);
+void discard_thread_io_ring(void);
+
+int io_ring_init(io_ring_t *ring, unsigned entries);
+void io_ring_release(io_ring_t *ring);
+struct io_uring_sqe *io_ring_get_sqe(io_ring_t *ring);
+int io_ring_submit(io_ring_t *ring, unsigned wait_count);
+bool io_ring_peek(io_ring_t *ring, uint64_t *user_data, int32_t *result);
+
+void io_ring_prep_statx(struct io_uring_sqe *sqe, int dir_fd, const char *name, int flags, unsigned mask, struct statx *result);
+void io_ring_prep_openat(struct io_uring_sqe *sqe, int dir_fd, const char *name, int flags, mode_t mode);
+void io_ring_prep_close(struct io_uring_sqe *sqe, int fd);
+int io_ring_register_buffer(io_ring_t *ring, size_t size);
+int io_ring_register_files(io_ring_t *ring, unsigned count);
+void io_ring_prep_openat_direct(struct io_uring_sqe *sqe, int dir_fd, const char *name, int flags, mode_t mode, unsigned slot);
+void io_ring_prep_close_direct(struct io_uring_sqe *sqe, unsigned slot);
+void io_ring_prep_read_fixed(struct io_uring_sqe *sqe, unsigned slot, void *buffer, unsigned length, uint64_t offset);
+void io_ring_prep_write_fixed(struct io_uring_sqe *sqe, unsigned slot, void *buffer, unsigned length, uint64_t offset);
+
+int io_ring_statx_batch(io_ring_t *ring, int dir_fd, char **names, size_t count, int flags, unsigned mask, struct statx *results, int *errors);
+int io_ring_openat_batch(io_ring_t *ring, char **paths, int *flags, mode_t *modes, size_t count, int *fds);
+int io_ring_close_batch(io_ring_t *ring, int *fds, size_t count);
@@ -0,0 +1,250 @@
+#include <manifest.h>
+#include <utility.h>
+#include <defines.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Records and paths being built, before they are written
+typedef struct {
+    manifest_record_t *records;
+    size_t count;
+    size_t capacity;
+    char *paths;
+    size_t paths_size;
+    size_t paths_capacity;
+} manifest_builder_t;
+
+/*!
+ * @brief manifest_path builds the path of the manifest of the destination
+ * @return the path, NULL if it is too long
+ */
+static char *manifest_path(char *result, configuration_t *the_config, char *suffix) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s", MANIFEST_FILE_NAME, suffix);
+    return concat_path(result, the_config->destination, name);
+}
+
+/*!
+ * @brief is_manifest_path tells if a relative path is the one of the manifest (or of its temporary file)
+ */
+static bool is_manifest_path(char *relative_path) {
+    return strncmp(relative_path, MANIFEST_FILE_NAME, sizeof(MANIFEST_FILE_NAME) - 1) == 0
+           && (strcmp(relative_path + sizeof(MANIFEST_FILE_NAME) - 1, "") == 0 || strcmp(relative_path + sizeof(MANIFEST_FILE_NAME) - 1, ".tmp") == 0);
+}
+
+/*!
+ * @brief add_record adds the record of an entry to the manifest being built
+ * @param builder is the manifest being built
+ * @param entry is the entry, a source or destination entry
+ * @param relative_path is the path of the entry relative to its root
+ * @return 0 in case of success, -1 else
+ */
+static int add_record(manifest_builder_t *builder, files_list_entry_t *entry, char *relative_path) {
+    size_t length = strlen(relative_path);
+    if (builder->count == builder->capacity) {
+        size_t capacity = (builder->capacity == 0) ? 1024 : 2 * builder->capacity;
+        manifest_record_t *records = realloc(builder->records, capacity * sizeof(manifest_record_t));
+        if (!records) {
+            return -1;
+        }
+        builder->records = records;
+        builder->capacity = capacity;
+    }
+    if (builder->paths_size + length + 1 > builder->paths_capacity) {
+        size_t capacity = (builder->paths_capacity == 0) ? 64 * 1024 : 2 * builder->paths_capacity;
+        while (builder->paths_size + length + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *paths = realloc(builder->paths, capacity);
+        if (!paths) {
+            return -1;
+        }
+        builder->paths = paths;
+        builder->paths_capacity = capacity;
+    }
+
+    manifest_record_t *record = &builder->records[builder->count++];
+    memset(record, 0, sizeof(manifest_record_t));
+    record->path_offset = builder->paths_size;
+    record->path_length = length;
+    record->mtime_sec = entry->mtime.tv_sec;
+    record->mtime_nsec = entry->mtime.tv_nsec;
+    record->mode = entry->mode;
+    record->size = entry->size;
+    record->entry_type = entry->entry_type;
+    record->hash_algorithm = entry->hash_algorithm;
+    memcpy(record->digest, entry->md5sum, sizeof(record->digest));
+    memcpy(builder->paths + builder->paths_size, relative_path, length + 1);
+    builder->paths_size += length + 1;
+    return 0;
+}
+
+/*!
+ * @brief write_manifest writes the manifest of the destination after a successful synchronization
+ * Every source entry has a copy equal to it, and the entries only in the destination are kept: both
+ * lists are merged like in diff_files_lists. The file is replaced atomically.
+ * @param the_config is a pointer to the configuration
+ * @param src_list is the source list
+ * @param dst_list is the destination list, as it was before the copies
+ * @return 0 in case of success, -1 else
+ */
+int write_manifest(configuration_t *the_config, files_list_t *src_list, files_list_t *dst_list) {
+    char path[PATH_SIZE], temporary_path[PATH_SIZE];
+    if (!manifest_path(path, the_config, "") || !manifest_path(temporary_path, the_config, ".tmp")) {
+        return -1;
+    }
+
+    size_t start_of_src = root_prefix_length(the_config->source), start_of_dest = root_prefix_length(the_config->destination);
+    manifest_builder_t builder = {0};
+    int result = 0;
+    files_list_entry_t *src_cursor = src_list->head, *dst_cursor = dst_list->head;
+    while (result == 0 && (src_cursor || dst_cursor)) {
+        char *src_path = src_cursor ? src_cursor->path_and_name + start_of_src : NULL;
+        char *dst_path = dst_cursor ? dst_cursor->path_and_name + start_of_dest : NULL;
+        int comparison = !src_cursor ? 1 : !dst_cursor ? -1 : path_compare(src_path, dst_path);
+        if (comparison > 0) {
+            // The manifest doesn't describe itself
+            if (!is_manifest_path(dst_path)) {
+                result = add_record(&builder, dst_cursor, dst_path);
+            }
+            dst_cursor = dst_cursor->next;
+        } else {
+            result = add_record(&builder, src_cursor, src_path);
+            src_cursor = src_cursor->next;
+            if (comparison == 0) {
+                dst_cursor = dst_cursor->next;
+            }
+        }
+    }
+
+    FILE *file = (result == 0) ? fopen(temporary_path, "wb") : NULL;
+    if (file) {
+        manifest_header_t header = {.version = MANIFEST_VERSION, .record_size = sizeof(manifest_record_t),
+                                    .count = builder.count, .paths_size = builder.paths_size};
+        memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1
+                       && fwrite(builder.records, sizeof(manifest_record_t), builder.count, file) == builder.count
+                       && fwrite(builder.paths, 1, builder.paths_size, file) == builder.paths_size;
+        if (fclose(file) != 0 || !written || rename(temporary_path, path) == -1) {
+            perror(temporary_path);
+            unlink(temporary_path);
+            result = -1;
+        }
+    } else {
+        result = -1;
+    }
+    free(builder.records);
+    free(builder.paths);
+    return result;
+}
+
+/*!
+ * @brief sample_index tells if the index-th entry is verified, about percent of the entries are
+ */
+static bool sample_index(uint64_t index, double percent) {
+    uint64_t z = (index + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z ^= z >> 31;
+    return (z % 1000000) < percent * 10000;
+}
+
+/*!
+ * @brief verify_entry compares an entry of the manifest with the destination
+ * @return true if the destination has the same type, mode, size and time
+ */
+static bool verify_entry(files_list_entry_t *entry) {
+    struct stat file_stat;
+    if (lstat(entry->path_and_name, &file_stat) == -1 || file_stat.st_mode != entry->mode) {
+        return false;
+    }
+    if (entry->entry_type == DOSSIER) {
+        return S_ISDIR(file_stat.st_mode);
+    }
+    return S_ISREG(file_stat.st_mode) && (uint64_t) file_stat.st_size == entry->size
+           && file_stat.st_mtim.tv_sec == entry->mtime.tv_sec && file_stat.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+/*!
+ * @brief load_manifest builds the destination list from its manifest, instead of walking the destination
+ * A sample of the entries (manifest_verify_percent of them) is compared with the destination first.
+ * @param the_config is a pointer to the configuration
+ * @param dst_list is the list to build, it is left empty in case of error
+ * @return 0 in case of success, -1 if there is no valid manifest, or if it doesn't match the destination
+ */
+int load_manifest(configuration_t *the_config, files_list_t *dst_list) {
+    char path[PATH_SIZE];
+    if (!manifest_path(path, the_config, "")) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat file_stat;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 && (size_t) file_stat.st_size >= sizeof(manifest_header_t)) {
+        mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+
+    manifest_header_t *header = (manifest_header_t *) mapping;
+    manifest_record_t *records = (manifest_record_t *) (header + 1);
+    char *paths = (char *) (records + header->count);
+    bool is_valid = memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) == 0 && header->version == MANIFEST_VERSION
+                    && header->record_size == sizeof(manifest_record_t)
+                    && header->count <= ((uint64_t) file_stat.st_size - sizeof(manifest_header_t)) / sizeof(manifest_record_t)
+                    && sizeof(manifest_header_t) + header->count * sizeof(manifest_record_t) + header->paths_size == (uint64_t) file_stat.st_size;
+    madvise(mapping, file_stat.st_size, MADV_SEQUENTIAL);
+
+    char entry_path[PATH_SIZE];
+    for (uint64_t i=0; is_valid && i<header->count; ++i) {
+        manifest_record_t *record = &records[i];
+        if (record->path_offset + record->path_length >= header->paths_size || paths[record->path_offset + record->path_length] != '\0') {
+            is_valid = false;
+            break;
+        }
+        files_list_entry_t *entry;
+        if (!concat_path(entry_path, the_config->destination, paths + record->path_offset)
+            || !(entry = new_files_list_entry(dst_list, entry_path))) {
+            is_valid = false;
+            break;
+        }
+        entry->mtime.tv_sec = record->mtime_sec;
+        entry->mtime.tv_nsec = record->mtime_nsec;
+        entry->mode = record->mode;
+        entry->size = record->size;
+        entry->entry_type = record->entry_type;
+        entry->hash_algorithm = record->hash_algorithm;
+        memcpy(entry->md5sum, record->digest, sizeof(entry->md5sum));
+        add_entry_to_tail(dst_list, entry);
+        if (the_config->manifest_verify_percent > 0 && sample_index(i, the_config->manifest_verify_percent) && !verify_entry(entry)) {
+            printf("%s doesn't match the manifest\n", entry->path_and_name);
+            is_valid = false;
+        }
+    }
+    munmap(mapping, file_stat.st_size);
+    if (!is_valid) {
+        clear_files_list(dst_list);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief remove_manifest removes the manifest of the destination, once it may not describe it anymore
+ */
+void remove_manifest(configuration_t *the_config) {
+    char path[PATH_SIZE];
+    if (manifest_path(path, the_config, "")) {
+        unlink(path);
+    }
+}
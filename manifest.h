@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <configuration.h>
+#include <files-list.h>
+
+#define MANIFEST_FILE_NAME ".lp25-manifest" // In the destination root
+#define MANIFEST_MAGIC "LP25MAN1"
+#define MANIFEST_VERSION 1
+
+// Manifest file: the header, then the records sorted by relative path (@see path_compare), then the paths
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t paths_size;
+} manifest_header_t;
+
+typedef struct {
+    uint64_t path_offset; // NUL-terminated relative path, from the start of the paths
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t mode;
+    uint64_t size;
+    uint8_t digest[16];
+    uint16_t path_length;
+    uint8_t entry_type;
+    uint8_t hash_algorithm;
+    uint8_t padding[4];
+} manifest_record_t;
+
+int write_manifest(configuration_t *the_config, files_list_t *src_list, files_list_t *dst_list);
+int load_manifest(configuration_t *the_config, files_list_t *dst_list);
+void remove_manifest(configuration_t *the_config);
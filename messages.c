@@ -1,6 +1,8 @@
 #include <messages.h>
 #include <sys/msg.h>
 #include <string.h>
+#include <stddef.h>
+#include <stats.h>
 
 // Functions in this file are required for inter processes communication
 
@@ -20,9 +22,24 @@ int send_file_entry(int msg_queue, int recipient, files_list_entry_t *file_entry
     msg.mtype = recipient;
     msg.op_code = cmd_code;
     msg.payload = *file_entry;
+    strncpy(msg.path, file_entry->path_and_name, PATH_SIZE - 1);
+    msg.path[PATH_SIZE - 1] = '\0';
     msg.reply_to = msg_queue;
 
-    return msgsnd(msg_queue, &msg, sizeof(files_list_entry_transmit_t), 0);
+    return msgsnd(msg_queue, &msg, sizeof(files_list_entry_transmit_t) - sizeof(long), 0);
+}
+
+/*!
+ * @brief received_file_entry gives access to the entry carried by a received message
+ * The entry's path pointer is only valid in the sender, so it is pointed to the copy in the message.
+ * @param msg is a pointer to the received message
+ * @return a pointer to the entry, valid as long as the message is
+ */
+files_list_entry_t *received_file_entry(files_list_entry_transmit_t *msg) {
+    msg->payload.path_and_name = msg->path;
+    msg->payload.next = NULL;
+    msg->payload.prev = NULL;
+    return &msg->payload;
 }
 
 /*!
@@ -38,9 +55,10 @@ int send_analyze_dir_command(int msg_queue, int recipient, char *target_dir) {
 
     msg.mtype = recipient;
     msg.op_code = COMMAND_CODE_ANALYZE_DIR;
-    strcmp(msg.target, target_dir);
+    strncpy(msg.target, target_dir, PATH_SIZE - 1);
+    msg.target[PATH_SIZE - 1] = '\0';
 
-    return msgsnd(msg_queue, &msg, sizeof(analyze_dir_command_t), 0);
+    return msgsnd(msg_queue, &msg, sizeof(analyze_dir_command_t) - sizeof(long), 0);
 }
 
 // The 3 following functions are one-liners
@@ -95,7 +113,7 @@ int send_list_end(int msg_queue, int recipient) {
     msg.op_code = COMMAND_CODE_LIST_COMPLETE;
     msg.reply_to = msg_queue;
 
-    return msgsnd(msg_queue, &msg, sizeof(analyze_dir_command_t), 0);
+    return msgsnd(msg_queue, &msg, sizeof(analyze_dir_command_t) - sizeof(long), 0);
 }
 
 /*!
@@ -112,7 +130,7 @@ int send_terminate_command(int msg_queue, int recipient) {
     msg.op_code = COMMAND_CODE_TERMINATE;
     msg.reply_to = msg_queue;
 
-    return msgsnd(msg_queue, &msg, sizeof(analyze_dir_command_t), 0);
+    return msgsnd(msg_queue, &msg, sizeof(analyze_dir_command_t) - sizeof(long), 0);
 }
 
 /*!
@@ -129,5 +147,306 @@ int send_terminate_confirm(int msg_queue, int recipient) {
     msg.op_code = COMMAND_CODE_TERMINATE_OK;
     msg.reply_to = msg_queue;
 
-    return msgsnd(msg_queue, &msg, sizeof(analyze_dir_command_t), 0);
+    return msgsnd(msg_queue, &msg, sizeof(analyze_dir_command_t) - sizeof(long), 0);
+}
+
+/*!
+ * @brief ring_send_message copies a message to a ring, sleeping while the ring is full
+ * Only the bytes up to the end of the message are copied, so that short paths take little space.
+ * @param ring is the ring to the recipient
+ * @param msg is the message
+ * @param size is the size of the used part of the message, from its start
+ * @return 0 in case of success, -1 else
+ */
+static int ring_send_message(ring_buffer_t *ring, void *msg, size_t size) {
+    void *record = ring_reserve_wait(ring, size);
+    if (!record) {
+        return -1;
+    }
+    memcpy(record, msg, size);
+    ring_commit(ring, size);
+    stats_add(STATS_MESSAGES_SENT, 1);
+    return 0;
+}
+
+/*!
+ * @brief ring_send_analyze_dir_command sends a command to analyze a directory through a ring
+ * @param ring is the ring to the recipient
+ * @param target_dir is a string containing the path to the directory to analyze
+ * @return 0 in case of success, -1 else
+ */
+int ring_send_analyze_dir_command(ring_buffer_t *ring, char *target_dir) {
+    analyze_dir_command_t msg;
+
+    msg.mtype = 0;
+    msg.op_code = COMMAND_CODE_ANALYZE_DIR;
+    size_t length = strnlen(target_dir, PATH_SIZE - 1);
+    memcpy(msg.target, target_dir, length);
+    msg.target[length] = '\0';
+
+    return ring_send_message(ring, &msg, offsetof(analyze_dir_command_t, target) + length + 1);
+}
+
+/*!
+ * @brief ring_send_file_entry sends a file entry through a ring, with a given command code
+ * The message is built directly in the ring. The reply_to field is not sent, the ring tells the sender.
+ * @param ring is the ring to the recipient
+ * @param file_entry is a pointer to the entry to send (it is copied)
+ * @param cmd_code is the cmd code to process the entry
+ * @return 0 in case of success, -1 else
+ */
+int ring_send_file_entry(ring_buffer_t *ring, files_list_entry_t *file_entry, int cmd_code) {
+    size_t length = strnlen(file_entry->path_and_name, PATH_SIZE - 1);
+    size_t size = offsetof(files_list_entry_transmit_t, path) + length + 1;
+    files_list_entry_transmit_t *msg = ring_reserve_wait(ring, size);
+    if (!msg) {
+        return -1;
+    }
+
+    msg->mtype = 0;
+    msg->op_code = cmd_code;
+    msg->payload = *file_entry;
+    memcpy(msg->path, file_entry->path_and_name, length);
+    msg->path[length] = '\0';
+    ring_commit(ring, size);
+    stats_add(STATS_MESSAGES_SENT, 1);
+    stats_add(STATS_ENTRIES_SENT, 1);
+    return 0;
+}
+
+/*!
+ * @brief ring_send_analyze_file_command sends a file entry to be analyzed through a ring
+ */
+int ring_send_analyze_file_command(ring_buffer_t *ring, files_list_entry_t *file_entry) {
+    return ring_send_file_entry(ring, file_entry, COMMAND_CODE_ANALYZE_FILE);
+}
+
+/*!
+ * @brief ring_send_analyze_file_response sends a file entry after analyze through a ring
+ */
+int ring_send_analyze_file_response(ring_buffer_t *ring, files_list_entry_t *file_entry) {
+    return ring_send_file_entry(ring, file_entry, COMMAND_CODE_FILE_ANALYZED);
+}
+
+/*!
+ * @brief ring_send_files_list_element sends a files list entry from a complete files list through a ring
+ */
+int ring_send_files_list_element(ring_buffer_t *ring, files_list_entry_t *file_entry) {
+    return ring_send_file_entry(ring, file_entry, COMMAND_CODE_FILE_ENTRY);
+}
+
+/*!
+ * @brief ring_send_simple_command sends a message made of its command code only
+ * @param ring is the ring to the recipient
+ * @param cmd_code is the command code
+ * @return 0 in case of success, -1 else
+ */
+static int ring_send_simple_command(ring_buffer_t *ring, char cmd_code) {
+    simple_command_t msg;
+
+    msg.mtype = 0;
+    msg.message = cmd_code;
+
+    return ring_send_message(ring, &msg, sizeof(simple_command_t));
+}
+
+/*!
+ * @brief ring_send_list_end sends the end of list message to the main process through a ring
+ */
+int ring_send_list_end(ring_buffer_t *ring) {
+    return ring_send_simple_command(ring, COMMAND_CODE_LIST_COMPLETE);
+}
+
+/*!
+ * @brief ring_send_terminate_command sends a terminate command to a child process through a ring
+ */
+int ring_send_terminate_command(ring_buffer_t *ring) {
+    return ring_send_simple_command(ring, COMMAND_CODE_TERMINATE);
+}
+
+/*!
+ * @brief ring_send_terminate_confirm sends a terminate confirmation to the requesting parent through a ring
+ */
+int ring_send_terminate_confirm(ring_buffer_t *ring) {
+    return ring_send_simple_command(ring, COMMAND_CODE_TERMINATE_OK);
+}
+
+/*!
+ * @brief ring_try_receive_message receives the next message of a ring, if any
+ * @param ring is the ring, only read by the calling process
+ * @param msg receives the message. Its op_code is at the same place whatever its type
+ * @return true if a message was received, false if the ring is empty
+ */
+bool ring_try_receive_message(ring_buffer_t *ring, any_message_t *msg) {
+    size_t size;
+    void *record = ring_peek(ring, &size);
+    if (!record) {
+        return false;
+    }
+    memcpy(msg, record, (size < sizeof(any_message_t)) ? size : sizeof(any_message_t));
+    ring_release(ring);
+    return true;
+}
+
+/*!
+ * @brief ring_receive_message receives the next message of a ring, sleeping until there is one
+ * @param ring is the ring, only read by the calling process
+ * @param msg receives the message
+ */
+void ring_receive_message(ring_buffer_t *ring, any_message_t *msg) {
+    while (true) {
+        uint32_t sequence = doorbell_prepare(ring->consumer_doorbell);
+        if (ring_try_receive_message(ring, msg)) {
+            return;
+        }
+        doorbell_wait(ring->consumer_doorbell, sequence);
+    }
+}
+
+/*!
+ * @brief packed_entry_size computes the space taken by an entry in a batch
+ * @param path_length is the length of the sent path, 0 when paths are not sent
+ * @return the size of the packed entry with its path, aligned on 8 bytes
+ */
+size_t packed_entry_size(size_t path_length) {
+    return (sizeof(packed_entry_t) + path_length + 1 + 7) & ~(size_t) 7;
+}
+
+/*!
+ * @brief pack_entry packs the properties and the path of an entry (@see packed_entry_size)
+ * @param packed is where the entry is packed, with room for packed_entry_size(path_length) bytes
+ * @param file_entry is the entry to pack
+ * @param path_length is the length of the packed path, 0 not to pack it
+ * @return the size of the packed entry
+ */
+size_t pack_entry(packed_entry_t *packed, files_list_entry_t *file_entry, size_t path_length) {
+    packed->mtime = file_entry->mtime;
+    packed->size = file_entry->size;
+    memcpy(packed->md5sum, file_entry->md5sum, sizeof(packed->md5sum));
+    packed->mode = file_entry->mode;
+    packed->path_length = path_length;
+    packed->entry_type = file_entry->entry_type;
+    packed->hash_algorithm = file_entry->hash_algorithm;
+    memcpy(packed->path, file_entry->path_and_name, path_length);
+    packed->path[path_length] = '\0';
+    return packed_entry_size(path_length);
+}
+
+/*!
+ * @brief init_message_batch prepares an empty batch, nothing is reserved in the ring until an entry is added
+ * @param batch is the batch
+ * @param ring is the ring to the recipient
+ * @param op_code is the batch opcode
+ * @param with_paths is true to send the paths of the entries
+ * @param max_count is the maximum number of entries of a batch
+ */
+void init_message_batch(message_batch_t *batch, ring_buffer_t *ring, char op_code, bool with_paths, uint32_t max_count) {
+    batch->ring = ring;
+    batch->op_code = op_code;
+    batch->with_paths = with_paths;
+    batch->max_count = (max_count > 0) ? max_count : 1;
+    batch->record = NULL;
+    batch->used = 0;
+}
+
+/*!
+ * @brief batch_entry_path_length gives the length of the path of an entry as sent in a batch
+ */
+static size_t batch_entry_path_length(message_batch_t *batch, files_list_entry_t *file_entry) {
+    return batch->with_paths ? strnlen(file_entry->path_and_name, PATH_SIZE - 1) : 0;
+}
+
+/*!
+ * @brief batch_has_room tells if an entry can be added to a batch without sending it first
+ * @param batch is the batch
+ * @param file_entry is the entry
+ * @return true if the entry fits, false if the batch is full
+ */
+bool batch_has_room(message_batch_t *batch, files_list_entry_t *file_entry) {
+    if (!batch->record) {
+        return true;
+    }
+    return batch->record->count < batch->max_count
+           && batch->used + packed_entry_size(batch_entry_path_length(batch, file_entry)) <= MESSAGE_BATCH_SIZE;
+}
+
+/*!
+ * @brief batch_add_entry packs an entry in a batch, the batch is sent first if the entry doesn't fit
+ * A whole batch is reserved in the ring (sleeping until there is room), entries are packed in place.
+ * @param batch is the batch
+ * @param file_entry is the entry to pack
+ * @return 0 in case of success, -1 else
+ */
+int batch_add_entry(message_batch_t *batch, files_list_entry_t *file_entry) {
+    if (!batch_has_room(batch, file_entry) && flush_message_batch(batch) == -1) {
+        return -1;
+    }
+    if (!batch->record) {
+        batch->record = ring_reserve_wait(batch->ring, MESSAGE_BATCH_SIZE);
+        if (!batch->record) {
+            return -1;
+        }
+        batch->record->mtype = 0;
+        batch->record->op_code = batch->op_code;
+        batch->record->count = 0;
+        batch->used = offsetof(entries_batch_t, entries);
+    }
+
+    packed_entry_t *packed = (packed_entry_t *) ((char *) batch->record + batch->used);
+    batch->used += pack_entry(packed, file_entry, batch_entry_path_length(batch, file_entry));
+    ++batch->record->count;
+    return 0;
+}
+
+/*!
+ * @brief flush_message_batch sends a batch, if it has entries
+ * Only the used part of the reserved space is published.
+ * @param batch is the batch, it is empty afterwards
+ * @return 0 in case of success, -1 else
+ */
+int flush_message_batch(message_batch_t *batch) {
+    if (batch->record) {
+        stats_add(STATS_MESSAGES_SENT, 1);
+        stats_add(STATS_ENTRIES_SENT, batch->record->count);
+        ring_commit(batch->ring, batch->used);
+        batch->record = NULL;
+        batch->used = 0;
+    }
+    return 0;
+}
+
+/*!
+ * @brief first_packed_entry gives the first entry of a received batch (if its count is not 0)
+ */
+packed_entry_t *first_packed_entry(entries_batch_t *batch) {
+    return (packed_entry_t *) batch->entries;
+}
+
+/*!
+ * @brief next_packed_entry gives the entry after an entry of a received batch
+ */
+packed_entry_t *next_packed_entry(packed_entry_t *packed) {
+    return (packed_entry_t *) ((char *) packed + packed_entry_size(packed->path_length));
+}
+
+/*!
+ * @brief unpack_entry copies the properties of a packed entry to a files list entry
+ * The path and the links of the entry are not changed.
+ * @param packed is the packed entry
+ * @param file_entry is the entry to update
+ */
+void unpack_entry(packed_entry_t *packed, files_list_entry_t *file_entry) {
+    file_entry->mtime = packed->mtime;
+    file_entry->size = packed->size;
+    memcpy(file_entry->md5sum, packed->md5sum, sizeof(file_entry->md5sum));
+    file_entry->mode = packed->mode;
+    file_entry->entry_type = packed->entry_type;
+    file_entry->hash_algorithm = packed->hash_algorithm;
+}
+
+/*!
+ * @brief message_op_code gives the opcode of a message received in a ring (@see ring_peek)
+ */
+char message_op_code(void *record) {
+    return ((simple_command_t *) record)->message;
 }
@@ -2,6 +2,7 @@
 
 #include <files-list.h>
 #include <defines.h>
+#include <ring-buffer.h>
 
 #define COMMAND_CODE_TERMINATE 0x0
 #define COMMAND_CODE_TERMINATE_OK 0x10
@@ -10,6 +11,13 @@
 #define COMMAND_CODE_ANALYZE_DIR 0x02
 #define COMMAND_CODE_FILE_ENTRY 0x12
 #define COMMAND_CODE_LIST_COMPLETE 0x22
+#define COMMAND_CODE_ANALYZE_FILES 0x03 // Batch of files to analyze
+#define COMMAND_CODE_FILES_ANALYZED 0x13 // Batch of analyzed files, without their paths, in the order of the command
+#define COMMAND_CODE_FILE_ENTRIES 0x32 // Batch of files list entries
+
+// Maximum size of a batch message, it must fit in half a ring
+#define MESSAGE_BATCH_SIZE (64 * 1024)
+#define DEFAULT_BATCH_COUNT 128
 
 #define MSG_TYPE_TO_MAIN 1
 #define MSG_TYPE_TO_SOURCE_LISTER 2
@@ -26,12 +34,14 @@ typedef struct {
     long mtype;
     char op_code; // Contains the analyze file opcode
     files_list_entry_t payload;
+    char path[PATH_SIZE]; // The payload's path, which lives in the sender's list pool
 } analyze_file_command_t;
 
 typedef struct {
     long mtype;
     char op_code; // Contains the analyze file opcode
     files_list_entry_t payload;
+    char path[PATH_SIZE]; // The payload's path, which lives in the sender's list pool
     int reply_to; // MQ id of the sender, to build either source or destination list
 } files_list_entry_transmit_t;
 
@@ -41,6 +51,36 @@ typedef struct {
     char target[PATH_SIZE];
 } analyze_dir_command_t;
 
+// Entry of a batch message: the properties of a files list entry followed by its NUL-terminated path,
+// padded to 8 bytes. Batches have a path_length of 0 when the recipient already knows the paths.
+typedef struct {
+    struct timespec mtime;
+    uint64_t size;
+    uint8_t md5sum[16];
+    uint32_t mode;
+    uint16_t path_length; // Without the terminating NUL
+    uint8_t entry_type;
+    uint8_t hash_algorithm;
+    char path[];
+} packed_entry_t;
+
+typedef struct {
+    long mtype;
+    char op_code; // Contains one of the batch opcodes
+    uint32_t count;
+    char entries[]; // count packed_entry_t
+} entries_batch_t;
+
+// A batch being built directly in a ring, it is sent by flush_message_batch
+typedef struct {
+    ring_buffer_t *ring;
+    char op_code;
+    bool with_paths;
+    uint32_t max_count;
+    entries_batch_t *record; // NULL when nothing is reserved yet
+    size_t used;
+} message_batch_t;
+
 typedef union {
     simple_command_t simple_command;
     analyze_file_command_t analyze_file_command;
@@ -49,10 +89,33 @@ typedef union {
 } any_message_t;
 
 int send_analyze_dir_command(int msg_queue, int recipient, char *target_dir);
+files_list_entry_t *received_file_entry(files_list_entry_transmit_t *msg);
 int send_file_entry(int msg_queue, int recipient, files_list_entry_t *file_entry, int cmd_code);
 int send_analyze_file_command(int msg_queue, int recipient, files_list_entry_t *file_entry);
 int send_analyze_file_response(int msg_queue, int recipient, files_list_entry_t *file_entry);
 int send_files_list_element(int msg_queue, int recipient, files_list_entry_t *file_entry);
 int send_list_end(int msg_queue, int recipient);
 int send_terminate_command(int msg_queue, int recipient);
-int send_terminate_confirm(int msg_queue, int recipient);
\ No newline at end of file
+int send_terminate_confirm(int msg_queue, int recipient);
+// Same messages over shared memory rings (@see ring-buffer.h): the recipient is the consumer of the ring
+int ring_send_analyze_dir_command(ring_buffer_t *ring, char *target_dir);
+int ring_send_file_entry(ring_buffer_t *ring, files_list_entry_t *file_entry, int cmd_code);
+int ring_send_analyze_file_command(ring_buffer_t *ring, files_list_entry_t *file_entry);
+int ring_send_analyze_file_response(ring_buffer_t *ring, files_list_entry_t *file_entry);
+int ring_send_files_list_element(ring_buffer_t *ring, files_list_entry_t *file_entry);
+int ring_send_list_end(ring_buffer_t *ring);
+int ring_send_terminate_command(ring_buffer_t *ring);
+int ring_send_terminate_confirm(ring_buffer_t *ring);
+bool ring_try_receive_message(ring_buffer_t *ring, any_message_t *msg);
+void ring_receive_message(ring_buffer_t *ring, any_message_t *msg);
+
+void init_message_batch(message_batch_t *batch, ring_buffer_t *ring, char op_code, bool with_paths, uint32_t max_count);
+bool batch_has_room(message_batch_t *batch, files_list_entry_t *file_entry);
+int batch_add_entry(message_batch_t *batch, files_list_entry_t *file_entry);
+int flush_message_batch(message_batch_t *batch);
+size_t packed_entry_size(size_t path_length);
+size_t pack_entry(packed_entry_t *packed, files_list_entry_t *file_entry, size_t path_length);
+packed_entry_t *first_packed_entry(entries_batch_t *batch);
+packed_entry_t *next_packed_entry(packed_entry_t *packed);
+void unpack_entry(packed_entry_t *packed, files_list_entry_t *file_entry);
+char message_op_code(void *record);
@@ -1,13 +1,26 @@
+#define _GNU_SOURCE
 #include "processes.h"
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/msg.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <stdio.h>
 #include <messages.h>
 #include <file-properties.h>
 #include <sync.h>
 #include <string.h>
 #include <errno.h>
+#include <checksum-cache.h>
+#include <directory-cache.h>
+#include <stats.h>
+#include <trace.h>
+#include <watch.h>
+#include <io-ring.h>
+
+static int setup_transport(process_context_t *p_context);
+static void stop_processes(process_context_t *p_context);
+static void release_transport(process_context_t *p_context);
 
 /*!
  * @brief prepare prepares (only when parallel is enabled) the processes used for the synchronization.
@@ -16,19 +29,210 @@
  * @return 0 if all went good, -1 else
  */
 int prepare(configuration_t *the_config, process_context_t *p_context) {
-       if (!the_config || !p_context) return -1;
+    if (!the_config || !p_context) return -1;
+    memset(p_context, 0, sizeof(process_context_t));
 
-    if (!the_config->is_parallel) return 0; // Only prepare if parallel is enabled
+    // Statistics are shared memory, every process created below adds to them
+    if (strlen(the_config->stats_path) > 0 && !global_stats && enable_stats(the_config->stats_path) == -1) {
+        printf("Cannot enable the statistics, running without them\n");
+    }
+    if (strlen(the_config->trace_path) > 0 && !global_trace) {
+        if (enable_trace(the_config->trace_path) == -1) {
+            printf("Cannot enable the trace, running without it\n");
+        }
+        trace_name_thread("main");
+    }
+    if (the_config->is_watching) {
+        install_watch_signals();
+    }
+
+    // Digests settings are set before forking, so that analyzers inherit them
+    set_hash_algorithm(the_config->uses_md5 ? the_config->hash_algorithm : HASH_NONE);
+    if (the_config->uses_md5 && strlen(the_config->checksum_cache) > 0) {
+        if (open_checksum_cache(the_config->checksum_cache, the_config->force_rehash, the_config->is_dry_run) == -1) {
+            printf("Cannot open checksum cache %s\n", the_config->checksum_cache);
+            return -1;
+        }
+    }
+    // Rings are created by each process and thread, once io_uring is known to work
+    if ((the_config->uses_io_uring || the_config->uses_io_uring_copy) && enable_io_ring(the_config->uses_io_uring, the_config->uses_io_uring_copy) == -1) {
+        printf("io_uring is unavailable, using synchronous system calls\n");
+    } else if (the_config->uses_io_uring_copy && !is_io_ring_copy_enabled()) {
+        printf("io_uring has no fixed reads and writes, copying the small files with synchronous system calls\n");
+    }
+    // The listings of the directories too, each lister records the directories it reads
+    if (strlen(the_config->directory_cache) > 0 && open_directory_cache(the_config->directory_cache, the_config->trust_directory_mtime, the_config->source, the_config->is_dry_run) == -1) {
+        printf("Cannot open directory cache %s\n", the_config->directory_cache);
+        return -1;
+    }
+
+    // Only prepare if parallel is enabled, the threads mode and --max-memory (which lists the trees in the main
+    // process) don't need other processes
+    if (!the_config->is_parallel || the_config->threads_count > 0 || the_config->max_memory > 0) return 0;
+    // With --pipeline, the trees are walked by two threads: the processes are only started by synchronize when
+    // the threads can't be
+    if (the_config->is_pipelined) return 0;
+    return start_processes(the_config, p_context);
+}
 
-    p_context->processes_count = 0;
+/*!
+ * @brief start_processes maps the shared rings and forks the listers and the analyzers
+ * On failure, the synchronization goes on without them (is_parallel is cleared).
+ * @param the_config is a pointer to the program configuration
+ * @param p_context is a pointer to the program processes context, initialized by prepare
+ * @return 0 if all went good, -1 else
+ */
+int start_processes(configuration_t *the_config, process_context_t *p_context) {
+    p_context->processes_count = (the_config->processes_count > 0) ? the_config->processes_count : 1;
     p_context->main_process_pid = getpid();
-    p_context->source_lister_pid = 0;
-    p_context->destination_lister_pid = 0;
+    if (setup_transport(p_context) == -1) {
+        printf("Cannot create the shared memory rings, synchronizing without parallel processes\n");
+        the_config->is_parallel = false;
+        return -1;
+    }
+    p_context->source_lister.batch_size = the_config->batch_size;
+    p_context->destination_lister.batch_size = the_config->batch_size;
+    p_context->source_lister.walkers_count = the_config->walkers_count;
+    p_context->destination_lister.walkers_count = the_config->walkers_count;
+    for (int i=0; i<p_context->processes_count; ++i) {
+        p_context->analyzers[i].use_md5 = the_config->uses_md5;
+        p_context->analyzers[p_context->processes_count + i].use_md5 = the_config->uses_md5;
+        p_context->analyzers[i].index = i;
+        p_context->analyzers[p_context->processes_count + i].index = p_context->processes_count + i;
+    }
+    set_stats_analyzers_count(2 * p_context->processes_count);
 
-    // Initialize necessary resources for parallel processing
-    // This could include setting up message queues, allocating memory for process IDs, etc.
+    // Every process is a child of the main process, which waits for all of them in clean_processes
+    bool started = (p_context->source_lister_pid = make_process(p_context, lister_process_loop, &p_context->source_lister)) > 0
+                   && (p_context->destination_lister_pid = make_process(p_context, lister_process_loop, &p_context->destination_lister)) > 0;
+    for (int i=0; started && i<p_context->processes_count; ++i) {
+        started = (p_context->source_analyzers_pids[i] = make_process(p_context, analyzer_process_loop, &p_context->analyzers[i])) > 0
+                  && (p_context->destination_analyzers_pids[i] = make_process(p_context, analyzer_process_loop, &p_context->analyzers[p_context->processes_count + i])) > 0;
+    }
+    if (!started) {
+        perror("fork");
+        printf("Cannot start the processes, synchronizing without them\n");
+        stop_processes(p_context);
+        release_transport(p_context);
+        the_config->is_parallel = false;
+        return -1;
+    }
 
-    return 0; // Return 0 if successful, -1 otherwise
+    return 0;
+}
+
+/*!
+ * @brief setup_lister_rings creates the rings of a lister and its analyzers in the shared memory
+ * @param lister is the configuration of the lister
+ * @param analyzers is the array of the configurations of its analyzers
+ * @param main_doorbell is the doorbell of the main process
+ * @param doorbells is the array of doorbells for the lister, then its analyzers
+ * @param cursor is the position of the next ring in the shared memory, it is moved after the rings
+ */
+static void setup_lister_rings(lister_configuration_t *lister, analyzer_configuration_t *analyzers, doorbell_t *main_doorbell, doorbell_t *doorbells, char **cursor) {
+    lister->doorbell = &doorbells[0];
+    lister->from_main = (ring_buffer_t *) *cursor;
+    ring_buffer_init(lister->from_main, PROCESS_RING_CAPACITY, main_doorbell, lister->doorbell);
+    *cursor += ring_buffer_size(PROCESS_RING_CAPACITY);
+    lister->to_main = (ring_buffer_t *) *cursor;
+    ring_buffer_init(lister->to_main, PROCESS_RING_CAPACITY, lister->doorbell, main_doorbell);
+    *cursor += ring_buffer_size(PROCESS_RING_CAPACITY);
+
+    for (int i=0; i<lister->analyzers_count; ++i) {
+        analyzers[i].doorbell = &doorbells[i + 1];
+        analyzers[i].from_lister = lister->to_analyzers[i] = (ring_buffer_t *) *cursor;
+        ring_buffer_init(analyzers[i].from_lister, PROCESS_RING_CAPACITY, lister->doorbell, analyzers[i].doorbell);
+        *cursor += ring_buffer_size(PROCESS_RING_CAPACITY);
+        analyzers[i].to_lister = lister->from_analyzers[i] = (ring_buffer_t *) *cursor;
+        ring_buffer_init(analyzers[i].to_lister, PROCESS_RING_CAPACITY, analyzers[i].doorbell, lister->doorbell);
+        *cursor += ring_buffer_size(PROCESS_RING_CAPACITY);
+    }
+}
+
+/*!
+ * @brief setup_transport maps the shared memory and creates the rings between the processes
+ * The main process talks to each lister, and each lister to each of its analyzers, both ways.
+ * The memory is only touched when used, so unused parts of the rings cost nothing.
+ * @param p_context is the processes context, whose processes_count is set
+ * @return 0 in case of success, -1 else
+ */
+static int setup_transport(process_context_t *p_context) {
+    int count = p_context->processes_count;
+    size_t doorbells_count = 3 + 2 * count;
+    size_t rings_count = 2 * (2 + 2 * count);
+    p_context->shared_memory_size = doorbells_count * sizeof(doorbell_t) + rings_count * ring_buffer_size(PROCESS_RING_CAPACITY);
+    p_context->shared_memory = mmap(NULL, p_context->shared_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p_context->shared_memory == MAP_FAILED) {
+        p_context->shared_memory = NULL;
+        return -1;
+    }
+
+    p_context->source_analyzers_pids = calloc(count, sizeof(pid_t));
+    p_context->destination_analyzers_pids = calloc(count, sizeof(pid_t));
+    p_context->analyzers = calloc(2 * count, sizeof(analyzer_configuration_t));
+    ring_buffer_t **rings = calloc(4 * count, sizeof(ring_buffer_t *));
+    if (!p_context->source_analyzers_pids || !p_context->destination_analyzers_pids || !p_context->analyzers || !rings) {
+        free(rings);
+        release_transport(p_context);
+        return -1;
+    }
+    p_context->source_lister.analyzers_count = count;
+    p_context->source_lister.to_analyzers = rings;
+    p_context->source_lister.from_analyzers = rings + count;
+    p_context->destination_lister.analyzers_count = count;
+    p_context->destination_lister.to_analyzers = rings + 2 * count;
+    p_context->destination_lister.from_analyzers = rings + 3 * count;
+
+    // Doorbells come first: the main process, then each lister followed by its analyzers
+    doorbell_t *doorbells = (doorbell_t *) p_context->shared_memory;
+    char *cursor = (char *) (doorbells + doorbells_count);
+    p_context->doorbell = &doorbells[0];
+    setup_lister_rings(&p_context->source_lister, p_context->analyzers, p_context->doorbell, &doorbells[1], &cursor);
+    setup_lister_rings(&p_context->destination_lister, p_context->analyzers + count, p_context->doorbell, &doorbells[2 + count], &cursor);
+    return 0;
+}
+
+/*!
+ * @brief release_transport unmaps the shared memory and frees the processes context
+ * @param p_context is the processes context
+ */
+static void release_transport(process_context_t *p_context) {
+    if (p_context->shared_memory) {
+        munmap(p_context->shared_memory, p_context->shared_memory_size);
+        p_context->shared_memory = NULL;
+    }
+    free(p_context->source_lister.to_analyzers);
+    p_context->source_lister.to_analyzers = NULL;
+    free(p_context->source_analyzers_pids);
+    p_context->source_analyzers_pids = NULL;
+    free(p_context->destination_analyzers_pids);
+    p_context->destination_analyzers_pids = NULL;
+    free(p_context->analyzers);
+    p_context->analyzers = NULL;
+}
+
+/*!
+ * @brief stop_processes kills the started processes, when they can't be all started
+ * @param p_context is the processes context
+ */
+static void stop_processes(process_context_t *p_context) {
+    pid_t pids[] = {p_context->source_lister_pid, p_context->destination_lister_pid};
+    for (size_t i=0; i<sizeof(pids) / sizeof(pids[0]); ++i) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    for (int i=0; i<p_context->processes_count; ++i) {
+        if (p_context->source_analyzers_pids[i] > 0) {
+            kill(p_context->source_analyzers_pids[i], SIGTERM);
+            waitpid(p_context->source_analyzers_pids[i], NULL, 0);
+        }
+        if (p_context->destination_analyzers_pids[i] > 0) {
+            kill(p_context->destination_analyzers_pids[i], SIGTERM);
+            waitpid(p_context->destination_analyzers_pids[i], NULL, 0);
+        }
+    }
 }
 
 /*!
@@ -41,6 +245,8 @@ int prepare(configuration_t *the_config, process_context_t *p_context) {
 int make_process(process_context_t *p_context, process_loop_t func, void *parameters) {
     if (!p_context || !func) return -1;
 
+    // Buffered output would be written again by the child when it exits
+    fflush(stdout);
     pid_t pid = fork();
     if (pid == -1) {
         // Handle error in fork
@@ -55,6 +261,92 @@ int make_process(process_context_t *p_context, process_loop_t func, void *parame
     return pid;
 }
 
+/*!
+ * @brief analyze_files_list has the properties of all the entries of a list computed by the analyzers
+ * Consecutive entries are sent in batches. Each analyzer has at most ANALYZER_WINDOW batches in progress,
+ * and answers them in order with batches of the same size, so a batch in progress is only its first entry
+ * and its count, kept in a circular array per analyzer. Entries that could not be analyzed keep a mode of 0.
+ * @param config is the configuration of the lister
+ * @param list is the list whose entries to analyze
+ */
+static void analyze_files_list(lister_configuration_t *config, files_list_t *list) {
+    typedef struct {
+        files_list_entry_t *first;
+        uint32_t count;
+    } batch_in_flight_t;
+
+    int count = config->analyzers_count;
+    batch_in_flight_t *in_flight = malloc(count * ANALYZER_WINDOW * sizeof(batch_in_flight_t));
+    size_t *first = calloc(count, sizeof(size_t));
+    size_t *pending = calloc(count, sizeof(size_t));
+    if (!in_flight || !first || !pending) {
+        printf("Cannot allocate the analyzers windows\n");
+        free(in_flight);
+        free(first);
+        free(pending);
+        return;
+    }
+
+    message_batch_t batch;
+    files_list_entry_t *cursor = list->head;
+    size_t total_pending = 0;
+    while (cursor || total_pending > 0) {
+        uint32_t sequence = doorbell_prepare(config->doorbell);
+        bool progress = false;
+
+        // Batches are dealt to the analyzers in turn, as long as their window is not full
+        for (int i=0; i<count && cursor; ++i) {
+            if (pending[i] == ANALYZER_WINDOW) {
+                continue;
+            }
+            batch_in_flight_t *sent = &in_flight[i * ANALYZER_WINDOW + (first[i] + pending[i]) % ANALYZER_WINDOW];
+            sent->first = cursor;
+            sent->count = 0;
+            init_message_batch(&batch, config->to_analyzers[i], COMMAND_CODE_ANALYZE_FILES, true, config->batch_size);
+            while (cursor && batch_has_room(&batch, cursor) && batch_add_entry(&batch, cursor) == 0) {
+                ++sent->count;
+                cursor = cursor->next;
+            }
+            flush_message_batch(&batch);
+            ++pending[i];
+            ++total_pending;
+            progress = true;
+        }
+
+        for (int i=0; i<count; ++i) {
+            size_t size;
+            entries_batch_t *received;
+            while (pending[i] > 0 && (received = ring_peek(config->from_analyzers[i], &size))) {
+                if (received->op_code == COMMAND_CODE_FILES_ANALYZED) {
+                    batch_in_flight_t *sent = &in_flight[i * ANALYZER_WINDOW + first[i]];
+                    first[i] = (first[i] + 1) % ANALYZER_WINDOW;
+                    --pending[i];
+                    --total_pending;
+
+                    // The properties are copied, the entries keep their paths and their places in the list
+                    files_list_entry_t *entry = sent->first;
+                    packed_entry_t *packed = first_packed_entry(received);
+                    for (uint32_t j=0; j<sent->count && j<received->count; ++j) {
+                        unpack_entry(packed, entry);
+                        entry = entry->next;
+                        packed = next_packed_entry(packed);
+                    }
+                    progress = true;
+                }
+                ring_release(config->from_analyzers[i]);
+            }
+        }
+
+        if (!progress) {
+            doorbell_wait(config->doorbell, sequence);
+        }
+    }
+
+    free(in_flight);
+    free(first);
+    free(pending);
+}
+
 /*!
  * @brief lister_process_loop is the lister process function (@see make_process)
  * @param parameters is a pointer to its parameters, to be cast to a lister_configuration_t
@@ -62,47 +354,160 @@ int make_process(process_context_t *p_context, process_loop_t func, void *parame
 void lister_process_loop(void *parameters) {
     lister_configuration_t* config = (lister_configuration_t*) parameters;
     any_message_t msg;
-    files_list_t list;
-    list.head = NULL;
-    list.tail = NULL;
+    files_list_t list = {0};
+    trace_name_thread("lister");
 
-    int msg_id = msgget(config->mq_key, 0666);
+    do {
+        ring_receive_message(config->from_main, &msg);
+        if (msg.analyze_dir_command.op_code == COMMAND_CODE_ANALYZE_DIR) {
+            uint64_t start = trace_begin();
+            make_list_threaded(&list, msg.analyze_dir_command.target, config->walkers_count);
+            trace_end("list", start, msg.analyze_dir_command.target);
+            start = trace_begin();
+            analyze_files_list(config, &list);
+            trace_end("analyze", start, msg.analyze_dir_command.target);
 
-    while (msg.list_entry.op_code != COMMAND_CODE_TERMINATE){
-        if (msgrcv(msg_id, &msg, sizeof(any_message_t), config->my_receiver_id, 0) != -1) {
-            if (msg.analyze_file_command.op_code == COMMAND_CODE_ANALYZE_DIR) {
-                make_list(&list, msg.analyze_dir_command.target);
+            message_batch_t batch;
+            init_message_batch(&batch, config->to_main, COMMAND_CODE_FILE_ENTRIES, true, config->batch_size);
+            for (files_list_entry_t *cursor=list.head; cursor; cursor=cursor->next) {
+                // Entries that could not be analyzed are left out, like in the sequential walk
+                if (cursor->mode != 0) {
+                    batch_add_entry(&batch, cursor);
+                }
             }
+            flush_message_batch(&batch);
+            ring_send_list_end(config->to_main);
+            clear_files_list(&list);
+        }
+    } while (msg.simple_command.message != COMMAND_CODE_TERMINATE);
+    save_directory_cache();
+    close_directory_cache();
+
+    for (int i=0; i<config->analyzers_count; ++i) {
+        ring_send_terminate_command(config->to_analyzers[i]);
+    }
+    for (int i=0; i<config->analyzers_count; ++i) {
+        do {
+            ring_receive_message(config->from_analyzers[i], &msg);
+        } while (msg.simple_command.message != COMMAND_CODE_TERMINATE_OK);
+    }
+    ring_send_terminate_confirm(config->to_main);
+}
+
+// The statx of the files of a batch received by an analyzer
+typedef struct {
+    char **paths;
+    struct statx *results;
+    int *errors;
+    uint32_t capacity;
+} stat_batch_t;
 
+/*!
+ * @brief prepare_stat_batch gets the statx of all the files of a received batch (@see stat_files_at)
+ * @param stat_batch receives the results, its arrays grow with the batches
+ * @param received is the batch
+ * @return true in case of success, false if the files must be stat'd one by one
+ */
+static bool prepare_stat_batch(stat_batch_t *stat_batch, entries_batch_t *received) {
+    if (received->count > stat_batch->capacity) {
+        free(stat_batch->paths);
+        free(stat_batch->results);
+        free(stat_batch->errors);
+        stat_batch->paths = malloc(received->count * sizeof(char *));
+        stat_batch->results = malloc(received->count * sizeof(struct statx));
+        stat_batch->errors = malloc(received->count * sizeof(int));
+        stat_batch->capacity = received->count;
+        if (!stat_batch->paths || !stat_batch->results || !stat_batch->errors) {
+            stat_batch->capacity = 0;
+            return false;
         }
     }
-    send_terminate_confirm(msg_id, MSG_TYPE_TO_MAIN);
+    packed_entry_t *packed = first_packed_entry(received);
+    for (uint32_t i=0; i<received->count; ++i) {
+        stat_batch->paths[i] = packed->path;
+        packed = next_packed_entry(packed);
+    }
+    stat_files_at(AT_FDCWD, stat_batch->paths, received->count, stat_batch->results, stat_batch->errors);
+    return true;
 }
 
 /*!
  * @brief analyzer_process_loop is the analyzer process function
+ * Batches are analyzed in place in the ring: the paths are used where they were received.
  * @param parameters is a pointer to its parameters, to be cast to an analyzer_configuration_t
  */
 void analyzer_process_loop(void *parameters) {
-    lister_configuration_t* config = (lister_configuration_t*) parameters;
-    any_message_t msg;
-
-    int msg_id = msgget(config->mq_key, 0666);
+    analyzer_configuration_t* config = (analyzer_configuration_t*) parameters;
+    stats_analyzer_t *stats = (global_stats && config->index < STATS_MAX_ANALYZERS) ? &global_stats->analyzers[config->index] : NULL;
+    char op_code;
+    stat_batch_t stat_batch = {0};
+    if (global_trace) {
+        char name[32];
+        snprintf(name, sizeof(name), "analyzer %d", config->index);
+        trace_name_thread(name);
+    }
 
-    while (msg.list_entry.op_code != COMMAND_CODE_TERMINATE){
-        if (msgrcv(msg_id, &msg, sizeof(any_message_t), config->my_receiver_id, 0) != -1) {
-            if (msg.analyze_file_command.op_code == COMMAND_CODE_ANALYZE_DIR) {
-                if ((get_file_stats(&msg.list_entry.payload)) == -1) {
-                    printf("Error in the function fill_entry of the file files-list.c\n");
-                    printf("The get_file_stats function failed\n");
+    do {
+        size_t size;
+        uint64_t idle_start = stats ? stats_now() : 0;
+        void *record = ring_peek_wait(config->from_lister, &size);
+        uint64_t busy_start = stats ? stats_now() : 0;
+        uint64_t batch_start = trace_begin();
+        op_code = message_op_code(record);
+        if (op_code == COMMAND_CODE_ANALYZE_FILES) {
+            entries_batch_t *received = (entries_batch_t *) record;
+            // The answer has the same number of entries, without their paths, so it is never larger
+            message_batch_t answer;
+            init_message_batch(&answer, config->to_lister, COMMAND_CODE_FILES_ANALYZED, false, received->count);
+            // With io_uring, the files of the batch are stat'd at once
+            bool is_batched = is_io_ring_enabled() && prepare_stat_batch(&stat_batch, received);
+            packed_entry_t *packed = first_packed_entry(received);
+            for (uint32_t i=0; i<received->count; ++i) {
+                files_list_entry_t entry = {.path_and_name = packed->path};
+                unpack_entry(packed, &entry);
+                int result;
+                if (is_batched && stat_batch.errors[i] != 0) {
+                    errno = stat_batch.errors[i];
+                    perror("statx");
+                    result = -1;
+                } else if (is_batched) {
+                    result = set_file_stats(&entry, &stat_batch.results[i]);
+                } else {
+                    result = get_file_stats(&entry);
+                }
+                if (result == -1) {
+                    // The lister drops the entries it gets back without a mode
+                    entry.mode = 0;
                 }
-                send_analyze_file_response(msg_id, config->my_recipient_id, &msg.list_entry.payload);
+                batch_add_entry(&answer, &entry);
+                packed = next_packed_entry(packed);
+            }
+            flush_message_batch(&answer);
+            if (global_trace) {
+                char detail[TRACE_DETAIL_SIZE];
+                snprintf(detail, sizeof(detail), "%u files", received->count);
+                trace_end("batch", batch_start, detail);
+            }
+            if (stats) {
+                atomic_fetch_add_explicit(&stats->batches, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&stats->files, received->count, memory_order_relaxed);
             }
         }
-    }
-
+        ring_release(config->from_lister);
+        if (stats) {
+            uint64_t end = stats_now();
+            atomic_fetch_add_explicit(&stats->idle_ns, busy_start - idle_start, memory_order_relaxed);
+            atomic_fetch_add_explicit(&stats->busy_ns, end - busy_start, memory_order_relaxed);
+        }
+    } while (op_code != COMMAND_CODE_TERMINATE);
 
-    send_terminate_confirm(msg_id, MSG_TYPE_TO_MAIN);
+    free(stat_batch.paths);
+    free(stat_batch.results);
+    free(stat_batch.errors);
+    // Digests computed by this analyzer are merged into the checksum cache
+    save_checksum_cache();
+    close_checksum_cache();
+    ring_send_terminate_confirm(config->to_lister);
 }
 
 /*!
@@ -111,10 +516,39 @@ void analyzer_process_loop(void *parameters) {
  * @param p_context is a pointer to the processes context
  */
 void clean_processes(configuration_t *the_config, process_context_t *p_context) {
-    
-    // Do nothing if not parallel
-    // Send terminate
-    // Wait for responses
-    // Free allocated memory
-    // Free the MQ
+    // Digests computed by the main process (when not parallel) are merged into the checksum cache
+    if (save_checksum_cache() == -1) {
+        printf("Cannot save checksum cache %s\n", the_config->checksum_cache);
+    }
+    close_checksum_cache();
+    if (save_directory_cache() == -1) {
+        printf("Cannot save directory cache %s\n", the_config->directory_cache);
+    }
+    close_directory_cache();
+
+    if (!the_config->is_parallel || !p_context->shared_memory) {
+        write_trace();
+        return;
+    }
+
+    // Listers stop their analyzers before confirming
+    any_message_t msg;
+    ring_send_terminate_command(p_context->source_lister.from_main);
+    ring_send_terminate_command(p_context->destination_lister.from_main);
+    do {
+        ring_receive_message(p_context->source_lister.to_main, &msg);
+    } while (msg.simple_command.message != COMMAND_CODE_TERMINATE_OK);
+    do {
+        ring_receive_message(p_context->destination_lister.to_main, &msg);
+    } while (msg.simple_command.message != COMMAND_CODE_TERMINATE_OK);
+
+    waitpid(p_context->source_lister_pid, NULL, 0);
+    waitpid(p_context->destination_lister_pid, NULL, 0);
+    for (int i=0; i<p_context->processes_count; ++i) {
+        waitpid(p_context->source_analyzers_pids[i], NULL, 0);
+        waitpid(p_context->destination_analyzers_pids[i], NULL, 0);
+    }
+    // All the processes ended, their spans are merged
+    write_trace();
+    release_transport(p_context);
 }
@@ -1,41 +1,56 @@
 #pragma once
 
 #include <configuration.h>
-#include <sys/ipc.h>
 #include <sys/types.h>
 #include <files-list.h>
+#include <ring-buffer.h>
 #include <stdbool.h>
 
-typedef struct {
-    uint8_t processes_count;
-    pid_t main_process_pid;
-    pid_t source_lister_pid;
-    pid_t destination_lister_pid;
-    pid_t *source_analyzers_pids;
-    pid_t *destination_analyzers_pids;
-    key_t shared_key;
-    int message_queue_id;
-} process_context_t;
+// Capacity of each ring between two processes
+#define PROCESS_RING_CAPACITY (256 * 1024)
+// Maximum number of batches sent to an analyzer and not answered yet. The batches and their
+// answers must fit in the rings without the lister or the analyzer having to wait.
+#define ANALYZER_WINDOW 2
 
 typedef struct {
-    int my_recipient_id; // Id of analyzers' MQ topic
-    int my_receiver_id; // Id of MQ topic to listen to
+    ring_buffer_t *from_main; // Commands from the main process
+    ring_buffer_t *to_main; // Files list entries to the main process
+    ring_buffer_t **to_analyzers; // Files to analyze, one ring per analyzer
+    ring_buffer_t **from_analyzers; // Analyzed files, one ring per analyzer
+    doorbell_t *doorbell; // Doorbell of the lister process
     int analyzers_count; // Number of analyzers available
-    key_t mq_key;
+    uint32_t batch_size; // Maximum number of entries per message
+    int walkers_count; // Threads walking the tree (@see make_list_threaded)
 } lister_configuration_t;
 
 typedef struct {
-    int my_recipient_id; // Id of my lister
-    int my_receiver_id; // Id I must listen to
-    key_t mq_key;
+    ring_buffer_t *from_lister; // Files to analyze
+    ring_buffer_t *to_lister; // Analyzed files
+    doorbell_t *doorbell; // Doorbell of the analyzer process
     bool use_md5; // Set to true when computing MD5sum for files
+    int index; // Position in the analyzers of the context, the slot of its statistics
 } analyzer_configuration_t;
 
+typedef struct {
+    uint8_t processes_count;
+    pid_t main_process_pid;
+    pid_t source_lister_pid;
+    pid_t destination_lister_pid;
+    pid_t *source_analyzers_pids;
+    pid_t *destination_analyzers_pids;
+    void *shared_memory; // Rings and doorbells, mapped before forking so that all processes share them
+    size_t shared_memory_size;
+    doorbell_t *doorbell; // Doorbell of the main process
+    lister_configuration_t source_lister;
+    lister_configuration_t destination_lister;
+    analyzer_configuration_t *analyzers; // Source analyzers, then destination analyzers
+} process_context_t;
+
 typedef void (*process_loop_t)(void *);
 
 int prepare(configuration_t *the_config, process_context_t *p_context);
+int start_processes(configuration_t *the_config, process_context_t *p_context);
 int make_process(process_context_t *p_context, process_loop_t func, void *parameters);
 void lister_process_loop(void *parameters);
 void analyzer_process_loop(void *parameters);
 void clean_processes(configuration_t *the_config, process_context_t *p_context);
-void request_element_details(int msg_queue, files_list_entry_t *entry, lister_configuration_t *cfg, int *current_analyzers);
\ No newline at end of file
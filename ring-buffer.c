@@ -0,0 +1,191 @@
+#include <ring-buffer.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stats.h>
+#include <trace.h>
+
+/*!
+ * @brief record_size computes the space taken in the ring by a record
+ * @param size is the size of the record's data
+ * @return the size of the header and the data, aligned
+ */
+static uint64_t record_size(size_t size) {
+    return (RING_RECORD_HEADER_SIZE + size + RING_RECORD_ALIGNMENT - 1) & ~(uint64_t) (RING_RECORD_ALIGNMENT - 1);
+}
+
+/*!
+ * @brief ring_buffer_size computes the memory needed by a ring
+ * @param capacity is the capacity of the ring in bytes, a power of 2
+ * @return the size of the ring structure and its data
+ */
+size_t ring_buffer_size(size_t capacity) {
+    return sizeof(ring_buffer_t) + capacity;
+}
+
+/*!
+ * @brief ring_buffer_init initializes an empty ring
+ * @param ring is the ring, of ring_buffer_size(capacity) bytes
+ * @param capacity is the capacity of the ring in bytes, a power of 2. Records can't be larger than half of it
+ * @param producer_doorbell is the doorbell of the process writing to the ring
+ * @param consumer_doorbell is the doorbell of the process reading from the ring
+ */
+void ring_buffer_init(ring_buffer_t *ring, size_t capacity, doorbell_t *producer_doorbell, doorbell_t *consumer_doorbell) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->capacity = capacity;
+    ring->producer_doorbell = producer_doorbell;
+    ring->consumer_doorbell = consumer_doorbell;
+}
+
+/*!
+ * @brief ring_reserve reserves contiguous space for a record, to be filled then published with ring_commit
+ * When the record doesn't fit before the end of the ring, the end is skipped with a padding record.
+ * @param ring is the ring, only called by its producer
+ * @param size is the size of the record
+ * @return a pointer to the space of the record, NULL if the ring is full
+ */
+void *ring_reserve(ring_buffer_t *ring, size_t size) {
+    uint64_t total = record_size(size);
+    if (total > ring->capacity / 2) {
+        return NULL;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint64_t index = head & (ring->capacity - 1);
+    uint64_t contiguous = ring->capacity - index;
+    uint64_t needed = (total > contiguous) ? total + contiguous : total;
+    if (ring->capacity - (head - tail) < needed) {
+        return NULL;
+    }
+
+    if (total > contiguous) {
+        *(uint32_t *) (ring->data + index) = RING_PADDING;
+        atomic_store_explicit(&ring->head, head + contiguous, memory_order_release);
+        index = 0;
+    }
+    return ring->data + index + RING_RECORD_HEADER_SIZE;
+}
+
+/*!
+ * @brief ring_reserve_wait reserves space for a record, sleeping until the consumer makes room for it
+ * @param ring is the ring, only called by its producer
+ * @param size is the size of the record
+ * @return a pointer to the space of the record, NULL if the record can never fit
+ */
+void *ring_reserve_wait(ring_buffer_t *ring, size_t size) {
+    if (record_size(size) > ring->capacity / 2) {
+        return NULL;
+    }
+    while (true) {
+        uint32_t sequence = doorbell_prepare(ring->producer_doorbell);
+        void *record = ring_reserve(ring, size);
+        if (record) {
+            return record;
+        }
+        doorbell_wait(ring->producer_doorbell, sequence);
+    }
+}
+
+/*!
+ * @brief ring_commit publishes the record reserved by the last ring_reserve, and wakes the consumer up
+ * @param ring is the ring, only called by its producer
+ * @param size is the size of the record, at most the reserved size
+ */
+void ring_commit(ring_buffer_t *ring, size_t size) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    *(uint32_t *) (ring->data + (head & (ring->capacity - 1))) = size;
+    atomic_store_explicit(&ring->head, head + record_size(size), memory_order_release);
+    doorbell_ring(ring->consumer_doorbell);
+}
+
+/*!
+ * @brief ring_peek gives access to the oldest record of a ring, without removing it
+ * @param ring is the ring, only called by its consumer
+ * @param size receives the size of the record
+ * @return a pointer to the record, valid until ring_release, NULL if the ring is empty
+ */
+void *ring_peek(ring_buffer_t *ring, size_t *size) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while (tail != head) {
+        uint64_t index = tail & (ring->capacity - 1);
+        uint32_t record = *(uint32_t *) (ring->data + index);
+        if (record != RING_PADDING) {
+            *size = record;
+            return ring->data + index + RING_RECORD_HEADER_SIZE;
+        }
+        // The producer wrapped, its next record is at the start of the ring
+        tail += ring->capacity - index;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
+
+/*!
+ * @brief ring_peek_wait gives access to the oldest record of a ring, sleeping until there is one
+ * @param ring is the ring, only called by its consumer
+ * @param size receives the size of the record
+ * @return a pointer to the record, valid until ring_release
+ */
+void *ring_peek_wait(ring_buffer_t *ring, size_t *size) {
+    while (true) {
+        uint32_t sequence = doorbell_prepare(ring->consumer_doorbell);
+        void *record = ring_peek(ring, size);
+        if (record) {
+            return record;
+        }
+        doorbell_wait(ring->consumer_doorbell, sequence);
+    }
+}
+
+/*!
+ * @brief ring_release removes the record returned by ring_peek, and wakes the producer up
+ * @param ring is the ring, only called by its consumer
+ */
+void ring_release(ring_buffer_t *ring) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t size = *(uint32_t *) (ring->data + (tail & (ring->capacity - 1)));
+    atomic_store_explicit(&ring->tail, tail + record_size(size), memory_order_release);
+    doorbell_ring(ring->producer_doorbell);
+}
+
+/*!
+ * @brief doorbell_prepare must be called before checking the rings, then doorbell_wait if nothing can be done
+ * A ring occurring between the check and the wait is not lost: the wait returns at once.
+ * @param doorbell is the doorbell of the calling process
+ * @return the sequence to pass to doorbell_wait
+ */
+uint32_t doorbell_prepare(doorbell_t *doorbell) {
+    return atomic_load_explicit(&doorbell->sequence, memory_order_acquire);
+}
+
+/*!
+ * @brief doorbell_wait sleeps until the doorbell is rung after doorbell_prepare
+ * @param doorbell is the doorbell of the calling process
+ * @param sequence is the value returned by doorbell_prepare
+ */
+void doorbell_wait(doorbell_t *doorbell, uint32_t sequence) {
+    uint64_t start = stats_start(), trace_start = trace_begin();
+    atomic_fetch_add(&doorbell->sleepers, 1);
+    // The kernel checks the sequence didn't change before sleeping
+    syscall(SYS_futex, &doorbell->sequence, FUTEX_WAIT, sequence, NULL, NULL, 0);
+    atomic_fetch_sub(&doorbell->sleepers, 1);
+    stats_stop(STATS_TIME_QUEUE_WAITS, start);
+    trace_end("wait", trace_start, NULL);
+    stats_add(STATS_QUEUE_WAITS, 1);
+}
+
+/*!
+ * @brief doorbell_ring wakes up the process owning a doorbell
+ * The futex syscall is only made when the process is sleeping.
+ * @param doorbell is the doorbell to ring
+ */
+void doorbell_ring(doorbell_t *doorbell) {
+    atomic_fetch_add(&doorbell->sequence, 1);
+    if (atomic_load(&doorbell->sleepers) > 0) {
+        syscall(SYS_futex, &doorbell->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Records are aligned on 8 bytes, after an 8 bytes header holding their size
+#define RING_RECORD_ALIGNMENT 8
+#define RING_RECORD_HEADER_SIZE 8
+#define RING_PADDING UINT32_MAX // Size of the record that fills the end of the ring before it wraps
+
+// A doorbell is a futex word a process sleeps on when all its rings are empty (or full).
+// There is one per process: it is rung when any ring it reads gets data, or any ring it writes gets space.
+typedef struct {
+    _Alignas(64) _Atomic uint32_t sequence;
+    _Atomic uint32_t sleepers;
+} doorbell_t;
+
+// Single producer, single consumer ring of variable size records, to be placed in shared memory.
+// Both positions only grow, the producer and the consumer each own one of them (on their own cache line).
+typedef struct {
+    _Alignas(64) _Atomic uint64_t head; // Written by the producer
+    _Alignas(64) _Atomic uint64_t tail; // Written by the consumer
+    _Alignas(64) uint64_t capacity; // A power of 2
+    doorbell_t *producer_doorbell;
+    doorbell_t *consumer_doorbell;
+    _Alignas(64) char data[];
+} ring_buffer_t;
+
+size_t ring_buffer_size(size_t capacity);
+void ring_buffer_init(ring_buffer_t *ring, size_t capacity, doorbell_t *producer_doorbell, doorbell_t *consumer_doorbell);
+void *ring_reserve(ring_buffer_t *ring, size_t size);
+void *ring_reserve_wait(ring_buffer_t *ring, size_t size);
+void ring_commit(ring_buffer_t *ring, size_t size);
+void *ring_peek(ring_buffer_t *ring, size_t *size);
+void *ring_peek_wait(ring_buffer_t *ring, size_t *size);
+void ring_release(ring_buffer_t *ring);
+
+uint32_t doorbell_prepare(doorbell_t *doorbell);
+void doorbell_wait(doorbell_t *doorbell, uint32_t sequence);
+void doorbell_ring(doorbell_t *doorbell);
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <small-copy.h>
+#include <io-ring.h>
+#include <utility.h>
+#include <defines.h>
+#include <stats.h>
+#include <trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Steps of the chain of a file, the user data of a request is its file and its step
+typedef enum {
+    STEP_OPEN_SOURCE,
+    STEP_READ,
+    STEP_OPEN_DESTINATION,
+    STEP_WRITE,
+    STEPS_COUNT
+} copy_step_t;
+
+// Set in a thread whose ring can't register the buffer or the file slots, it copies files synchronously
+static __thread bool is_unavailable = false;
+
+/*!
+ * @brief small_copy_ring gives the ring of the calling thread, with the buffer and the file slots of the copies
+ * @return the ring, NULL if the small files can't be copied with io_uring
+ */
+static io_ring_t *small_copy_ring(void) {
+    io_ring_t *ring = (is_unavailable || !is_io_ring_copy_enabled()) ? NULL : thread_io_ring();
+    if (!ring || (ring->buffer && ring->files_count > 0)) {
+        return ring;
+    }
+    if ((!ring->buffer && io_ring_register_buffer(ring, SMALL_COPY_BATCH * SMALL_FILE_SIZE) == -1)
+        || (ring->files_count == 0 && io_ring_register_files(ring, 2 * SMALL_COPY_BATCH) == -1)) {
+        perror("io_uring_register");
+        is_unavailable = true;
+        return NULL;
+    }
+    return ring;
+}
+
+/*!
+ * @brief is_small_file tells if an entry is copied by copy_small_files
+ * Files updated with a delta transfer are left to copy_entry_to_destination.
+ */
+bool is_small_file(files_list_entry_t *entry, configuration_t *the_config) {
+    return entry->entry_type == FICHIER && entry->size <= SMALL_FILE_SIZE
+           && (the_config->delta_threshold == 0 || entry->size < the_config->delta_threshold);
+}
+
+/*!
+ * @brief copy_chained_files copies up to SMALL_COPY_BATCH files with one chain of requests each
+ * Each chain opens the source in a slot, reads it in the registered buffer, opens the destination in
+ * another slot and writes it: a failure (or a short read, when the file shrank) cancels the rest of the
+ * chain. All the slots are then closed, and the mode and times are set (io_uring can't set them).
+ * @param ring is the ring of the thread
+ * @param files are the files, all small
+ * @param destination_paths are their paths in the destination
+ * @param count is the number of files
+ * @param copied receives true for each copied file
+ * @return the number of copied files
+ */
+static size_t copy_chained_files(io_ring_t *ring, files_list_entry_t **files, char (*destination_paths)[PATH_SIZE], size_t count, bool *copied) {
+    int results[SMALL_COPY_BATCH][STEPS_COUNT];
+    size_t expected = 0;
+    memset(copied, 0, count * sizeof(bool));
+    for (size_t i=0; i<count; ++i) {
+        char *buffer = (char *) ring->buffer + i * SMALL_FILE_SIZE;
+        unsigned source_slot = 2 * i, destination_slot = 2 * i + 1;
+        struct io_uring_sqe *sqes[STEPS_COUNT];
+        for (int step=0; step<STEPS_COUNT; ++step) {
+            sqes[step] = io_ring_get_sqe(ring);
+            results[i][step] = -ECANCELED;
+        }
+        if (!sqes[STEPS_COUNT - 1]) {
+            // The ring is sized for a full batch, this never happens
+            return 0;
+        }
+        io_ring_prep_openat_direct(sqes[STEP_OPEN_SOURCE], AT_FDCWD, files[i]->path_and_name, O_RDONLY, 0, source_slot);
+        io_ring_prep_read_fixed(sqes[STEP_READ], source_slot, buffer, files[i]->size, 0);
+        io_ring_prep_openat_direct(sqes[STEP_OPEN_DESTINATION], AT_FDCWD, destination_paths[i], O_WRONLY | O_CREAT | O_TRUNC,
+                                   files[i]->mode & 07777, destination_slot);
+        io_ring_prep_write_fixed(sqes[STEP_WRITE], destination_slot, buffer, files[i]->size, 0);
+        for (int step=0; step<STEPS_COUNT; ++step) {
+            sqes[step]->user_data = i * STEPS_COUNT + step;
+            if (step < STEPS_COUNT - 1) {
+                sqes[step]->flags |= IOSQE_IO_LINK;
+            }
+        }
+        expected += STEPS_COUNT;
+    }
+
+    // Every request completes, the cancelled ones too
+    uint64_t user_data;
+    int32_t result;
+    for (size_t completed=0; completed<expected; ) {
+        if (io_ring_submit(ring, 1) == -1) {
+            // Requests may still be in flight on the buffer and the paths: the ring is discarded once they are done
+            perror("io_uring_enter");
+            discard_thread_io_ring();
+            is_unavailable = true;
+            return 0;
+        }
+        while (io_ring_peek(ring, &user_data, &result)) {
+            if (user_data < count * STEPS_COUNT) {
+                results[user_data / STEPS_COUNT][user_data % STEPS_COUNT] = result;
+            }
+            ++completed;
+        }
+    }
+
+    for (size_t i=0; i<2 * count; ++i) {
+        struct io_uring_sqe *sqe = io_ring_get_sqe(ring);
+        if (sqe) {
+            io_ring_prep_close_direct(sqe, i);
+            sqe->user_data = UINT64_MAX;
+        }
+    }
+    for (size_t completed=0; completed<2 * count; ) {
+        if (io_ring_submit(ring, 1) == -1) {
+            perror("io_uring_enter");
+            discard_thread_io_ring();
+            is_unavailable = true;
+            break;
+        }
+        while (io_ring_peek(ring, &user_data, &result)) {
+            ++completed;
+        }
+    }
+
+    size_t copied_count = 0;
+    for (size_t i=0; i<count; ++i) {
+        copied[i] = results[i][STEP_OPEN_SOURCE] >= 0 && results[i][STEP_READ] == (int) files[i]->size
+                    && results[i][STEP_OPEN_DESTINATION] >= 0 && results[i][STEP_WRITE] == (int) files[i]->size;
+        if (!copied[i]) {
+            continue;
+        }
+        struct timespec times[2] = {files[i]->mtime, files[i]->mtime};
+        chmod(destination_paths[i], files[i]->mode & 07777);
+        utimensat(AT_FDCWD, destination_paths[i], times, 0);
+        ++copied_count;
+    }
+    return copied_count;
+}
+
+/*!
+ * @brief copy_small_files copies the small files of a batch with io_uring (@see is_small_file)
+ * Many files are copied by one system call, instead of the open, copy, chmod, utimens and close calls
+ * of copy_entry_to_destination for each file. Files that are not small, or that could not be copied
+ * this way, are left to copy_entry_to_destination, which reports their errors.
+ * @param files are the files of the batch
+ * @param count is the number of files
+ * @param the_config is the configuration, with the source and the destination
+ * @param copied receives true for each copied file, it must be set to false by the caller
+ * @return the number of copied files
+ */
+size_t copy_small_files(files_list_entry_t **files, size_t count, configuration_t *the_config, bool *copied) {
+    io_ring_t *ring = small_copy_ring();
+    if (!ring) {
+        return 0;
+    }
+    char (*destination_paths)[PATH_SIZE] = malloc(SMALL_COPY_BATCH * PATH_SIZE);
+    if (!destination_paths) {
+        return 0;
+    }
+
+    size_t prefix_length = root_prefix_length(the_config->source), copied_count = 0;
+    files_list_entry_t *chained[SMALL_COPY_BATCH];
+    size_t indexes[SMALL_COPY_BATCH];
+    bool chained_copied[SMALL_COPY_BATCH];
+    for (size_t next=0; next<count; ) {
+        size_t chained_count = 0;
+        for (; next<count && chained_count<SMALL_COPY_BATCH; ++next) {
+            if (is_small_file(files[next], the_config) && strlen(files[next]->path_and_name) > prefix_length
+                && concat_path(destination_paths[chained_count], the_config->destination, files[next]->path_and_name + prefix_length)) {
+                indexes[chained_count] = next;
+                chained[chained_count++] = files[next];
+            }
+        }
+        if (chained_count == 0) {
+            continue;
+        }
+
+        uint64_t start = stats_start(), trace_start = trace_begin();
+        copied_count += copy_chained_files(ring, chained, destination_paths, chained_count, chained_copied);
+        stats_stop(STATS_TIME_COPYING, start);
+        if (global_trace) {
+            char detail[TRACE_DETAIL_SIZE];
+            snprintf(detail, sizeof(detail), "%zu files", chained_count);
+            trace_end("small copy", trace_start, detail);
+        }
+        for (size_t i=0; i<chained_count; ++i) {
+            copied[indexes[i]] = chained_copied[i];
+            if (chained_copied[i]) {
+                if (the_config->is_verbose) {
+                    printf("%s -> %s (io_uring)\n", chained[i]->path_and_name, destination_paths[i]);
+                }
+                stats_add(STATS_FILES_COPIED, 1);
+                stats_add(STATS_BYTES_COPIED, chained[i]->size);
+            }
+        }
+    }
+    free(destination_paths);
+    return copied_count;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <files-list.h>
+#include <configuration.h>
+
+#define SMALL_FILE_SIZE (16 * 1024) // Files up to this size are copied by io_uring chains
+#define SMALL_COPY_BATCH 64 // Files chained at once, with 4 requests each (@see IO_RING_ENTRIES)
+
+bool is_small_file(files_list_entry_t *entry, configuration_t *the_config);
+size_t copy_small_files(files_list_entry_t **files, size_t count, configuration_t *the_config, bool *copied);
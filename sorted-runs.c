@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+#include <sorted-runs.h>
+#include <utility.h>
+#include <defines.h>
+#include <stats.h>
+#include <trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*!
+ * @brief open_temporary_file creates an anonymous file in $TMPDIR (or /tmp), it is removed once closed
+ * @return the file descriptor, -1 in case of error
+ */
+static int open_temporary_file(void) {
+    char *directory = getenv("TMPDIR");
+    if (!directory || directory[0] == '\0') {
+        directory = "/tmp";
+    }
+    int fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+        // Without O_TMPFILE, a named file is created and removed at once
+        char path[PATH_SIZE];
+        if (concat_path(path, directory, "lp25-runs-XXXXXX") && (fd = mkostemp(path, O_CLOEXEC)) != -1) {
+            unlink(path);
+        }
+    }
+    if (fd == -1) {
+        perror(directory);
+    }
+    return fd;
+}
+
+/*!
+ * @brief write_all writes a whole buffer at an offset of a file
+ * @return 0 in case of success, -1 else
+ */
+static int write_all(int fd, char *buffer, size_t size, off_t offset) {
+    stats_add(STATS_BYTES_SPILLED, size);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, buffer, size, offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        buffer += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+/*!
+ * @brief compare_entries is the qsort_r comparison function of the entries of a run
+ * @param start_of_path points to the position of the relative paths in the entries
+ */
+static int compare_entries(const void *lhs, const void *rhs, void *start_of_path) {
+    size_t start = *(size_t *) start_of_path;
+    return path_compare((*(files_list_entry_t * const *) lhs)->path_and_name + start,
+                        (*(files_list_entry_t * const *) rhs)->path_and_name + start);
+}
+
+/*!
+ * @brief sort_list orders the entries of the list with path_compare
+ * The walks add the entries in order, so the list is only sorted when it is not already.
+ * @return 0 in case of success, -1 if out of memory
+ */
+static int sort_list(sorted_runs_t *runs) {
+    size_t count = 0;
+    bool is_sorted = true;
+    for (files_list_entry_t *cursor=runs->list.head; cursor; cursor=cursor->next) {
+        if (cursor->prev && path_compare(cursor->prev->path_and_name + runs->start_of_path, cursor->path_and_name + runs->start_of_path) > 0) {
+            is_sorted = false;
+        }
+        ++count;
+    }
+    if (is_sorted) {
+        return 0;
+    }
+
+    files_list_entry_t **entries = malloc(count * sizeof(files_list_entry_t *));
+    if (!entries) {
+        return -1;
+    }
+    size_t i = 0;
+    for (files_list_entry_t *cursor=runs->list.head; cursor; cursor=cursor->next) {
+        entries[i++] = cursor;
+    }
+    qsort_r(entries, count, sizeof(files_list_entry_t *), compare_entries, &runs->start_of_path);
+    for (i=0; i<count; ++i) {
+        entries[i]->prev = (i > 0) ? entries[i - 1] : NULL;
+        entries[i]->next = (i + 1 < count) ? entries[i + 1] : NULL;
+    }
+    runs->list.head = entries[0];
+    runs->list.tail = entries[count - 1];
+    free(entries);
+    return 0;
+}
+
+/*!
+ * @brief add_run appends a run to the runs of the first temporary file
+ * @return 0 in case of success, -1 if out of memory
+ */
+static int add_run(sorted_runs_t *runs, off_t offset, off_t end) {
+    if (runs->runs_count == runs->runs_capacity) {
+        size_t capacity = (runs->runs_capacity == 0) ? 16 : 2 * runs->runs_capacity;
+        sorted_run_t *new_runs = realloc(runs->runs, capacity * sizeof(sorted_run_t));
+        if (!new_runs) {
+            return -1;
+        }
+        runs->runs = new_runs;
+        runs->runs_capacity = capacity;
+    }
+    runs->runs[runs->runs_count].offset = offset;
+    runs->runs[runs->runs_count].end = end;
+    ++runs->runs_count;
+    return 0;
+}
+
+/*!
+ * @brief write_list_run sorts the list and writes it at the end of the first temporary file, as a new run
+ * @return 0 in case of success, -1 else
+ */
+static int write_list_run(sorted_runs_t *runs) {
+    if ((runs->fds[0] == -1 && (runs->fds[0] = open_temporary_file()) == -1) || sort_list(runs) == -1) {
+        return -1;
+    }
+    char *buffer = malloc(SORTED_RUNS_BUFFER_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    off_t offset = runs->file_size;
+    size_t used = 0;
+    int result = 0;
+    for (files_list_entry_t *cursor=runs->list.head; result == 0 && cursor; cursor=cursor->next) {
+        size_t path_length = strnlen(cursor->path_and_name, PATH_SIZE - 1);
+        if (used + packed_entry_size(path_length) > SORTED_RUNS_BUFFER_SIZE) {
+            result = write_all(runs->fds[0], buffer, used, offset);
+            offset += used;
+            used = 0;
+        }
+        used += pack_entry((packed_entry_t *) (buffer + used), cursor, path_length);
+    }
+    if (result == 0 && used > 0) {
+        result = write_all(runs->fds[0], buffer, used, offset);
+        offset += used;
+    }
+    free(buffer);
+    if (result == 0 && (result = add_run(runs, runs->file_size, offset)) == 0) {
+        runs->file_size = offset;
+        stats_add(STATS_RUNS_SPILLED, 1);
+    }
+    return result;
+}
+
+/*!
+ * @brief spill_list writes the list as a run, and clears it
+ * When the run can't be written, the entries are lost: the runs are marked as failed.
+ * @return 0 in case of success, -1 else
+ */
+static int spill_list(sorted_runs_t *runs) {
+    uint64_t start = trace_begin();
+    if (write_list_run(runs) == -1) {
+        perror("Cannot spill the files list");
+        runs->has_failed = true;
+    }
+    trace_end("spill", start, NULL);
+    clear_files_list(&runs->list);
+    return runs->has_failed ? -1 : 0;
+}
+
+/*!
+ * @brief init_sorted_runs prepares the runs of a tree, without any entry
+ * @param runs is the runs to prepare
+ * @param start_of_path is the position of the relative paths in the entries (@see root_prefix_length)
+ * @param memory_limit is the size of the list that is spilled as a run, and the memory used by the merge
+ */
+void init_sorted_runs(sorted_runs_t *runs, size_t start_of_path, size_t memory_limit) {
+    memset(runs, 0, sizeof(sorted_runs_t));
+    runs->start_of_path = start_of_path;
+    runs->memory_limit = (memory_limit < SORTED_RUNS_MIN_MEMORY) ? SORTED_RUNS_MIN_MEMORY : memory_limit;
+    runs->fds[0] = -1;
+    runs->fds[1] = -1;
+}
+
+/*!
+ * @brief spill_full_run writes the list as a run once it takes the memory limit, it is called after the
+ * entries are added to runs->list
+ * @param runs is the runs of the tree
+ * @return 0 in case of success, -1 if entries were lost (the walk can be stopped)
+ */
+int spill_full_run(sorted_runs_t *runs) {
+    if (runs->has_failed) {
+        return -1;
+    }
+    return (runs->list.pages_size >= runs->memory_limit) ? spill_list(runs) : 0;
+}
+
+/*!
+ * @brief cursor_entry gives the current entry of a cursor
+ */
+static packed_entry_t *cursor_entry(run_cursor_t *cursor) {
+    return (packed_entry_t *) (cursor->buffer + cursor->position);
+}
+
+/*!
+ * @brief fill_cursor makes the whole current entry of a cursor readable in its buffer
+ * The rest of the buffer is moved to its start, then completed from the run.
+ * @return 1 if there is an entry, 0 at the end of the run, -1 in case of error
+ */
+static int fill_cursor(run_cursor_t *cursor) {
+    for (;;) {
+        size_t remaining = cursor->used - cursor->position;
+        if (remaining >= sizeof(packed_entry_t) && remaining >= packed_entry_size(cursor_entry(cursor)->path_length)) {
+            return 1;
+        }
+        if (cursor->offset >= cursor->end) {
+            return (remaining == 0) ? 0 : -1;
+        }
+        memmove(cursor->buffer, cursor->buffer + cursor->position, remaining);
+        cursor->used = remaining;
+        cursor->position = 0;
+        size_t size = SORTED_RUNS_BUFFER_SIZE - cursor->used;
+        if ((off_t) size > cursor->end - cursor->offset) {
+            size = cursor->end - cursor->offset;
+        }
+        ssize_t read_size = pread(cursor->fd, cursor->buffer + cursor->used, size, cursor->offset);
+        if (read_size == -1 && errno == EINTR) {
+            continue;
+        }
+        if (read_size <= 0) {
+            return -1;
+        }
+        cursor->offset += read_size;
+        cursor->used += read_size;
+    }
+}
+
+/*!
+ * @brief is_before tells if the current entry of a cursor comes before the one of another cursor
+ * Equal paths are taken from the earliest run first.
+ */
+static bool is_before(sorted_runs_t *runs, size_t lhs, size_t rhs) {
+    int comparison = path_compare(cursor_entry(&runs->cursors[lhs])->path + runs->start_of_path,
+                                  cursor_entry(&runs->cursors[rhs])->path + runs->start_of_path);
+    return comparison < 0 || (comparison == 0 && lhs < rhs);
+}
+
+/*!
+ * @brief sift_down moves a cursor of the heap down to its place
+ */
+static void sift_down(sorted_runs_t *runs, size_t index) {
+    for (;;) {
+        size_t smallest = index, left = 2 * index + 1, right = left + 1;
+        if (left < runs->heap_count && is_before(runs, runs->heap[left], runs->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < runs->heap_count && is_before(runs, runs->heap[right], runs->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        size_t swapped = runs->heap[index];
+        runs->heap[index] = runs->heap[smallest];
+        runs->heap[smallest] = swapped;
+        index = smallest;
+    }
+}
+
+/*!
+ * @brief close_merge frees the cursors of a merge
+ */
+static void close_merge(sorted_runs_t *runs) {
+    for (size_t i=0; runs->cursors && i<runs->heap_count; ++i) {
+        free(runs->cursors[runs->heap[i]].buffer);
+    }
+    free(runs->cursors);
+    free(runs->heap);
+    runs->cursors = NULL;
+    runs->heap = NULL;
+    runs->heap_count = 0;
+    runs->is_current_read = false;
+}
+
+/*!
+ * @brief open_merge starts the merge of some runs of a file, with one cursor per run
+ * @param runs is the runs of the tree, receiving the cursors
+ * @param fd is the file of the runs
+ * @param merged is the first run to merge
+ * @param count is the number of runs to merge
+ * @return 0 in case of success, -1 else
+ */
+static int open_merge(sorted_runs_t *runs, int fd, sorted_run_t *merged, size_t count) {
+    runs->cursors = calloc(count, sizeof(run_cursor_t));
+    runs->heap = malloc(count * sizeof(size_t));
+    runs->heap_count = 0;
+    runs->is_current_read = false;
+    if (!runs->cursors || !runs->heap) {
+        close_merge(runs);
+        return -1;
+    }
+    for (size_t i=0; i<count; ++i) {
+        run_cursor_t *cursor = &runs->cursors[i];
+        cursor->fd = fd;
+        cursor->offset = merged[i].offset;
+        cursor->end = merged[i].end;
+        cursor->buffer = malloc(SORTED_RUNS_BUFFER_SIZE);
+        int filled = cursor->buffer ? fill_cursor(cursor) : -1;
+        if (filled == 1) {
+            // Cursors with entries are owned by the heap, which frees their buffers
+            runs->heap[runs->heap_count++] = i;
+            continue;
+        }
+        free(cursor->buffer);
+        if (filled == -1) {
+            close_merge(runs);
+            return -1;
+        }
+    }
+    for (size_t i=runs->heap_count / 2; i-->0; ) {
+        sift_down(runs, i);
+    }
+    return 0;
+}
+
+/*!
+ * @brief next_packed_entry_of_merge reads the smallest entry of the runs being merged
+ * The entry read before is skipped first, so the result stays valid until the next call.
+ * @return the entry, NULL at the end of the merge (or when a run can't be read)
+ */
+static packed_entry_t *next_packed_entry_of_merge(sorted_runs_t *runs) {
+    if (runs->is_current_read && runs->heap_count > 0) {
+        run_cursor_t *cursor = &runs->cursors[runs->heap[0]];
+        cursor->position += packed_entry_size(cursor_entry(cursor)->path_length);
+        int filled = fill_cursor(cursor);
+        if (filled != 1) {
+            if (filled == -1) {
+                perror("Cannot read the spilled files list");
+                runs->has_failed = true;
+            }
+            free(cursor->buffer);
+            runs->heap[0] = runs->heap[--runs->heap_count];
+        }
+        sift_down(runs, 0);
+    }
+    runs->is_current_read = runs->heap_count > 0;
+    return runs->is_current_read ? cursor_entry(&runs->cursors[runs->heap[0]]) : NULL;
+}
+
+/*!
+ * @brief merge_pass merges the runs by groups of fan_in, into the second temporary file
+ * The files are then swapped, so the merged runs are in the first one.
+ * @return 0 in case of success, -1 else
+ */
+static int merge_pass(sorted_runs_t *runs, size_t fan_in) {
+    if (runs->fds[1] == -1 && (runs->fds[1] = open_temporary_file()) == -1) {
+        return -1;
+    }
+    size_t merged_capacity = (runs->runs_count + fan_in - 1) / fan_in, merged_count = 0;
+    sorted_run_t *merged = malloc(merged_capacity * sizeof(sorted_run_t));
+    char *buffer = malloc(SORTED_RUNS_BUFFER_SIZE);
+    int result = (merged && buffer) ? 0 : -1;
+    off_t offset = 0;
+    for (size_t first=0; result == 0 && first<runs->runs_count; first+=fan_in) {
+        size_t count = (runs->runs_count - first < fan_in) ? runs->runs_count - first : fan_in;
+        if (open_merge(runs, runs->fds[0], &runs->runs[first], count) == -1) {
+            result = -1;
+            break;
+        }
+        off_t run_offset = offset;
+        size_t used = 0;
+        packed_entry_t *packed;
+        while (result == 0 && (packed = next_packed_entry_of_merge(runs))) {
+            size_t size = packed_entry_size(packed->path_length);
+            if (used + size > SORTED_RUNS_BUFFER_SIZE) {
+                result = write_all(runs->fds[1], buffer, used, offset);
+                offset += used;
+                used = 0;
+            }
+            memcpy(buffer + used, packed, size);
+            used += size;
+        }
+        if (result == 0 && used > 0) {
+            result = write_all(runs->fds[1], buffer, used, offset);
+            offset += used;
+        }
+        close_merge(runs);
+        if (runs->has_failed) {
+            result = -1;
+        }
+        merged[merged_count].offset = run_offset;
+        merged[merged_count].end = offset;
+        ++merged_count;
+    }
+    free(buffer);
+    if (result == -1) {
+        free(merged);
+        return -1;
+    }
+
+    int fd = runs->fds[0];
+    runs->fds[0] = runs->fds[1];
+    runs->fds[1] = fd;
+    if (ftruncate(runs->fds[1], 0) == -1) {
+        perror("ftruncate");
+    }
+    free(runs->runs);
+    runs->runs = merged;
+    runs->runs_count = merged_count;
+    runs->runs_capacity = merged_capacity;
+    runs->file_size = offset;
+    return 0;
+}
+
+/*!
+ * @brief start_sorted_merge prepares the reading of the entries in order, once they are all added
+ * When nothing was spilled, the list is read in place. Else, the list is spilled as the last run, then
+ * runs are merged until they can all be read at once within the memory limit.
+ * @param runs is the runs of the tree
+ * @return 0 in case of success, -1 if the entries can't be read (some were lost)
+ */
+int start_sorted_merge(sorted_runs_t *runs) {
+    if (runs->has_failed) {
+        return -1;
+    }
+    if (runs->runs_count == 0) {
+        if (sort_list(runs) == -1) {
+            return -1;
+        }
+        runs->next_in_list = runs->list.head;
+        return 0;
+    }
+    if (runs->list.head && spill_list(runs) == -1) {
+        return -1;
+    }
+
+    // One buffer per merged run, and one for the merged run being written
+    size_t fan_in = runs->memory_limit / SORTED_RUNS_BUFFER_SIZE - 1;
+    uint64_t start = trace_begin();
+    while (runs->runs_count > fan_in) {
+        if (merge_pass(runs, fan_in) == -1) {
+            perror("Cannot merge the spilled files list");
+            runs->has_failed = true;
+            return -1;
+        }
+    }
+    trace_end("merge", start, NULL);
+    if (open_merge(runs, runs->fds[0], runs->runs, runs->runs_count) == -1) {
+        perror("Cannot read the spilled files list");
+        runs->has_failed = true;
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief next_sorted_entry reads the next entry of the tree, in order (@see start_sorted_merge)
+ * @param runs is the runs of the tree
+ * @return the entry, valid until the next call, NULL when all the entries were read
+ */
+files_list_entry_t *next_sorted_entry(sorted_runs_t *runs) {
+    if (runs->runs_count == 0) {
+        files_list_entry_t *entry = runs->next_in_list;
+        if (entry) {
+            runs->next_in_list = entry->next;
+        }
+        return entry;
+    }
+
+    packed_entry_t *packed = next_packed_entry_of_merge(runs);
+    if (!packed) {
+        return NULL;
+    }
+    memcpy(runs->current_path, packed->path, packed->path_length + 1);
+    runs->current.path_and_name = runs->current_path;
+    runs->current.path_length = packed->path_length;
+    runs->current.next = NULL;
+    runs->current.prev = NULL;
+    unpack_entry(packed, &runs->current);
+    return &runs->current;
+}
+
+/*!
+ * @brief clear_sorted_runs frees the list, the merge and the temporary files of a tree
+ */
+void clear_sorted_runs(sorted_runs_t *runs) {
+    close_merge(runs);
+    clear_files_list(&runs->list);
+    free(runs->runs);
+    for (int i=0; i<2; ++i) {
+        if (runs->fds[i] != -1) {
+            close(runs->fds[i]);
+        }
+    }
+    init_sorted_runs(runs, runs->start_of_path, runs->memory_limit);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <files-list.h>
+#include <messages.h>
+
+#define SORTED_RUNS_BUFFER_SIZE (256 * 1024) // Buffer of each run read by a merge, and of the run being written
+#define SORTED_RUNS_MIN_MEMORY (4 * SORTED_RUNS_BUFFER_SIZE) // Smallest memory limit, so that at least 3 runs are merged at once
+
+// A run in a temporary file: packed entries (@see pack_entry), ordered with path_compare
+typedef struct {
+    off_t offset;
+    off_t end;
+} sorted_run_t;
+
+// A run being merged, read through its buffer
+typedef struct {
+    int fd;
+    off_t offset; // Next byte of the run to read
+    off_t end;
+    char *buffer;
+    size_t used; // Bytes read in the buffer
+    size_t position; // Position of the current entry in the buffer
+} run_cursor_t;
+
+// The entries of a tree, kept in a list until it takes memory_limit bytes. The list is then sorted and
+// spilled to a temporary file as a run. Once all the entries are added, the runs are merged (several
+// passes are made when there are too many runs to read at once), so the entries are read in order.
+typedef struct {
+    files_list_t list; // Entries not spilled yet, added by the caller
+    size_t start_of_path; // Position of the relative paths in the entries, which are compared
+    size_t memory_limit;
+    bool has_failed; // A run could not be written, entries are missing
+    int fds[2]; // Temporary files: the runs are in the first one, a merge pass writes its runs to the second one
+    off_t file_size; // Size of the first temporary file
+    sorted_run_t *runs;
+    size_t runs_count;
+    size_t runs_capacity;
+    // Merge of the runs
+    run_cursor_t *cursors;
+    size_t *heap; // Cursors with entries left, the one with the smallest path first
+    size_t heap_count;
+    bool is_current_read; // The entry of the first cursor of the heap was read, it is skipped by the next read
+    files_list_entry_t *next_in_list; // Next entry when no run was spilled, the list is read in place
+    files_list_entry_t current;
+    char current_path[PATH_SIZE];
+} sorted_runs_t;
+
+void init_sorted_runs(sorted_runs_t *runs, size_t start_of_path, size_t memory_limit);
+int spill_full_run(sorted_runs_t *runs);
+int start_sorted_merge(sorted_runs_t *runs);
+files_list_entry_t *next_sorted_entry(sorted_runs_t *runs);
+void clear_sorted_runs(sorted_runs_t *runs);
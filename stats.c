@@ -0,0 +1,110 @@
+#include <stats.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+stats_t *global_stats = NULL;
+
+static const char *counter_names[STATS_COUNTERS_COUNT] = {
+    "files_scanned", "directories_scanned", "directories_reused", "stat_calls", "files_hashed", "bytes_hashed", "checksum_cache_hits",
+    "files_copied", "bytes_copied", "messages_sent", "entries_sent", "queue_waits", "runs_spilled", "bytes_spilled",
+};
+
+static const char *timer_names[STATS_TIMERS_COUNT] = {
+    "listing", "copying", "pipeline", "stat", "hashing", "copying", "queue_waits",
+};
+
+static const char *peak_names[STATS_PEAKS_COUNT] = {
+    "copy_queued_jobs", "copy_queued_bytes", "copy_running_jobs", "copy_bytes_in_flight",
+};
+
+/*!
+ * @brief enable_stats enables the statistics, and writes them to a file when the main process exits
+ * It must be called before the processes are forked, so that they share the statistics.
+ * @param path is the file of the JSON report, "-" for the standard output
+ * @return 0 in case of success, -1 else
+ */
+int enable_stats(char *path) {
+    stats_t *stats = mmap(NULL, sizeof(stats_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED || strlen(path) >= sizeof(stats->path)) {
+        if (stats != MAP_FAILED) {
+            munmap(stats, sizeof(stats_t));
+        }
+        return -1;
+    }
+    // The mapping is zeroed, which initializes the counters
+    stats->main_pid = getpid();
+    stats->start_ns = stats_now();
+    strcpy(stats->path, path);
+    global_stats = stats;
+    atexit(write_stats_report);
+    return 0;
+}
+
+/*!
+ * @brief set_stats_analyzers_count sets the number of analyzer processes, for the report
+ * @param count is the number of source and destination analyzers
+ */
+void set_stats_analyzers_count(int count) {
+    if (global_stats) {
+        global_stats->analyzers_count = (count < STATS_MAX_ANALYZERS) ? count : STATS_MAX_ANALYZERS;
+    }
+}
+
+/*!
+ * @brief seconds converts a time in nanoseconds to seconds
+ */
+static double seconds(uint64_t ns) {
+    return ns / 1e9;
+}
+
+/*!
+ * @brief write_stats_report writes the JSON report, it is called at the exit of the main process
+ * The other processes share the statistics, they don't write them.
+ */
+void write_stats_report(void) {
+    stats_t *stats = global_stats;
+    if (!stats || getpid() != stats->main_pid) {
+        return;
+    }
+    FILE *output = (strcmp(stats->path, "-") == 0) ? stdout : fopen(stats->path, "w");
+    if (!output) {
+        perror(stats->path);
+        return;
+    }
+
+    fprintf(output, "{\n  \"total_seconds\": %.6f,\n  \"phases_seconds\": {", seconds(stats_now() - stats->start_ns));
+    for (int i=STATS_PHASE_LISTING; i<=STATS_PHASE_PIPELINE; ++i) {
+        fprintf(output, "%s\"%s\": %.6f", (i == STATS_PHASE_LISTING) ? "" : ", ", timer_names[i], seconds(atomic_load(&stats->timers_ns[i])));
+    }
+    fprintf(output, "},\n  \"counters\": {");
+    for (int i=0; i<STATS_COUNTERS_COUNT; ++i) {
+        fprintf(output, "%s\"%s\": %llu", (i == 0) ? "" : ", ", counter_names[i], (unsigned long long) atomic_load(&stats->counters[i]));
+    }
+    // Summed over the processes and threads, they can exceed the total time
+    fprintf(output, "},\n  \"cumulative_seconds\": {");
+    for (int i=STATS_TIME_STAT; i<STATS_TIMERS_COUNT; ++i) {
+        fprintf(output, "%s\"%s\": %.6f", (i == STATS_TIME_STAT) ? "" : ", ", timer_names[i], seconds(atomic_load(&stats->timers_ns[i])));
+    }
+    fprintf(output, "},\n  \"peaks\": {");
+    for (int i=0; i<STATS_PEAKS_COUNT; ++i) {
+        fprintf(output, "%s\"%s\": %llu", (i == 0) ? "" : ", ", peak_names[i], (unsigned long long) atomic_load(&stats->peaks[i]));
+    }
+    fprintf(output, "},\n  \"analyzers\": [");
+    for (int i=0; i<stats->analyzers_count; ++i) {
+        stats_analyzer_t *analyzer = &stats->analyzers[i];
+        int per_side = stats->analyzers_count / 2;
+        fprintf(output, "%s\n    {\"side\": \"%s\", \"index\": %d, \"busy_seconds\": %.6f, \"idle_seconds\": %.6f, \"batches\": %llu, \"files\": %llu}",
+                (i == 0) ? "" : ",", (i < per_side) ? "source" : "destination", (i < per_side) ? i : i - per_side,
+                seconds(atomic_load(&analyzer->busy_ns)), seconds(atomic_load(&analyzer->idle_ns)),
+                (unsigned long long) atomic_load(&analyzer->batches), (unsigned long long) atomic_load(&analyzer->files));
+    }
+    fprintf(output, "%s]\n}\n", (stats->analyzers_count > 0) ? "\n  " : "");
+    if (output == stdout) {
+        fflush(stdout);
+    } else {
+        fclose(output);
+    }
+}
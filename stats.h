@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define STATS_MAX_ANALYZERS 512 // Source and destination analyzers (2 * UINT8_MAX)
+
+typedef enum {
+    STATS_FILES_SCANNED, // Entries read from directories
+    STATS_DIRECTORIES_SCANNED,
+    STATS_DIRECTORIES_REUSED, // Listings taken from the directory cache
+    STATS_STAT_CALLS,
+    STATS_FILES_HASHED,
+    STATS_BYTES_HASHED,
+    STATS_CHECKSUM_CACHE_HITS,
+    STATS_FILES_COPIED,
+    STATS_BYTES_COPIED,
+    STATS_MESSAGES_SENT, // Records sent through the rings between processes
+    STATS_ENTRIES_SENT, // Files list entries in these messages
+    STATS_QUEUE_WAITS, // Sleeps of a process on its doorbell (a ring was empty or full)
+    STATS_RUNS_SPILLED, // Sorted runs of entries written to temporary files (--max-memory)
+    STATS_BYTES_SPILLED, // Bytes of these runs, and of their merge passes
+    STATS_COUNTERS_COUNT
+} stats_counter_t;
+
+typedef enum {
+    // Phases of the main process
+    STATS_PHASE_LISTING,
+    STATS_PHASE_COPYING, // Diff and copies
+    STATS_PHASE_PIPELINE, // Listing and copies overlapped (--pipeline)
+    // Times summed over all processes and threads
+    STATS_TIME_STAT,
+    STATS_TIME_HASHING,
+    STATS_TIME_COPYING,
+    STATS_TIME_QUEUE_WAITS,
+    STATS_TIMERS_COUNT
+} stats_timer_t;
+
+// Largest values of gauges, sampled while the program runs
+typedef enum {
+    STATS_PEAK_COPY_QUEUED_JOBS, // Jobs of the copy pool not started yet (the queue depth)
+    STATS_PEAK_COPY_QUEUED_BYTES,
+    STATS_PEAK_COPY_RUNNING_JOBS,
+    STATS_PEAK_COPY_BYTES_IN_FLIGHT, // Bytes of the running copy jobs
+    STATS_PEAKS_COUNT
+} stats_peak_t;
+
+typedef struct {
+    _Atomic uint64_t busy_ns; // Analyzing files
+    _Atomic uint64_t idle_ns; // Waiting for files to analyze
+    _Atomic uint64_t batches;
+    _Atomic uint64_t files;
+} stats_analyzer_t;
+
+// Statistics of a run, in memory shared by all the processes (it is mapped before they are forked)
+typedef struct {
+    pid_t main_pid;
+    uint64_t start_ns;
+    int analyzers_count; // The first half are source analyzers
+    char path[1024]; // Where the report is written, "-" for the standard output
+    _Atomic uint64_t counters[STATS_COUNTERS_COUNT];
+    _Atomic uint64_t timers_ns[STATS_TIMERS_COUNT];
+    _Atomic uint64_t peaks[STATS_PEAKS_COUNT];
+    stats_analyzer_t analyzers[STATS_MAX_ANALYZERS];
+} stats_t;
+
+// NULL when --stats is not set: every instrumentation point is then a single test
+extern stats_t *global_stats;
+
+int enable_stats(char *path);
+void set_stats_analyzers_count(int count);
+void write_stats_report(void);
+
+/*!
+ * @brief stats_now returns the monotonic clock in nanoseconds
+ */
+static inline uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*!
+ * @brief stats_add adds a value to a counter, when the statistics are enabled
+ */
+static inline void stats_add(stats_counter_t counter, uint64_t value) {
+    if (global_stats) {
+        atomic_fetch_add_explicit(&global_stats->counters[counter], value, memory_order_relaxed);
+    }
+}
+
+/*!
+ * @brief stats_start starts a timer
+ * @return the start time, 0 when the statistics are disabled (the clock is not read)
+ */
+static inline uint64_t stats_start(void) {
+    return global_stats ? stats_now() : 0;
+}
+
+/*!
+ * @brief stats_stop adds the time elapsed since stats_start to a timer
+ * @return the elapsed time in nanoseconds, 0 when the statistics are disabled
+ */
+static inline uint64_t stats_stop(stats_timer_t timer, uint64_t start) {
+    if (!global_stats) {
+        return 0;
+    }
+    uint64_t elapsed = stats_now() - start;
+    atomic_fetch_add_explicit(&global_stats->timers_ns[timer], elapsed, memory_order_relaxed);
+    return elapsed;
+}
+
+/*!
+ * @brief stats_peak raises a peak to a sampled value, when the statistics are enabled
+ */
+static inline void stats_peak(stats_peak_t peak, uint64_t value) {
+    if (global_stats) {
+        uint64_t current = atomic_load_explicit(&global_stats->peaks[peak], memory_order_relaxed);
+        while (value > current && !atomic_compare_exchange_weak_explicit(&global_stats->peaks[peak], &current, value, memory_order_relaxed, memory_order_relaxed)) {
+        }
+    }
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sync.h>
 #include <dirent.h>
 #include <string.h>
@@ -7,45 +8,238 @@
 #include <file-properties.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <sys/sendfile.h>
+#include <copy-engine.h>
+#include <delta-copy.h>
+#include <copy-pool.h>
+#include <errno.h>
 #include <unistd.h>
-#include <sys/msg.h>
+#include <sys/syscall.h>
+#include <thread-pool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stats.h>
+#include <trace.h>
+#include <watch.h>
+#include <manifest.h>
+#include <directory-cache.h>
+#include <io-ring.h>
+#include <sorted-runs.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <defines.h>
+
+// Record of the getdents64 syscall (struct linux_dirent64 is not exposed by the libc headers)
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64_t;
+
+// Entries of a list published by its lister thread while the walk goes on, for the pipelined synchronization.
+// The entries up to the last published one are complete, and linked: the reader follows their next pointers.
+typedef struct {
+    files_list_t *list;
+    char *root;
+    _Atomic(files_list_entry_t *) last; // NULL until the first entry is published
+    _Atomic bool finished;
+    _Atomic int waiting; // Readers sleeping on published
+    pthread_mutex_t lock;
+    pthread_cond_t published;
+    pthread_t thread;
+    bool is_walked; // False when the list was loaded at once (@see load_manifest), without a thread
+} files_stream_t;
+
+// State shared by the recursive calls of a directory walk
+typedef struct {
+    files_list_t *list;
+    files_stream_t *stream; // Where new entries are published, NULL if they are not
+    sorted_runs_t *runs; // Where the list is spilled once it is full, NULL to keep it in memory
+    bool trusts_cache; // Files of unchanged directories keep their cached properties (@see directory_cache_trusts_mtime)
+    bool get_properties;
+    char dirent_buffer[DIRENT_BUFFER_SIZE];
+    char path[PATH_SIZE];
+} walk_context_t;
+
+// A directory of a threaded walk. Its children are kept in order, and linked into the list once the walk is over
+typedef struct _walk_node {
+    char *path; // Path of the directory
+    int side; // 0 for the source, 1 for the destination
+    bool get_properties; // False to only get the types of the entries, like make_list
+    int dir_fd; // The directory, open until the analyses of its files are over
+    _Atomic size_t pending; // The scan and the analyses not over, the last one closes dir_fd
+    size_t count;
+    files_list_entry_t **entries;
+    struct _walk_node **subdirectories; // The node of each child directory, NULL for files
+    struct _walk_file *files; // The parameters of the analyses, NULL when the properties are not read
+} walk_node_t;
+
+// A file of a threaded walk analyzed by its own task, relative to the directory of its node
+typedef struct _walk_file {
+    walk_node_t *node;
+    files_list_entry_t *entry;
+} walk_file_t;
+
+// State of a worker in a threaded walk: entries are allocated in the worker's own pages, then adopted by the lists
+typedef struct {
+    files_list_t pages[2]; // Only used for their pages, for the source and the destination
+    char dirent_buffer[DIRENT_BUFFER_SIZE];
+} walk_worker_t;
+
+// Parameters of copy_difference
+typedef struct {
+    configuration_t *config;
+    deferred_directories_t directories;
+} direct_copy_t;
+
+static void walk_tree(files_list_t *list, char *target, bool get_properties, files_stream_t *stream, sorted_runs_t *runs);
+static ssize_t read_sorted_names(int dir_fd, char *dirent_buffer, char **names_buffer, char ***names);
+static void publish_entry(files_stream_t *stream, files_list_entry_t *entry);
+static bool synchronize_pipelined(configuration_t *the_config);
+static void synchronize_bounded(configuration_t *the_config);
+static bool load_trusted_manifest(configuration_t *the_config, files_list_t *dst_list);
+static void update_manifest(configuration_t *the_config, files_list_t *src_list, files_list_t *dst_list, size_t failed_files);
+
+/*!
+ * @brief apply_difference is the diff_files_lists callback used by synchronize
+ * It adds to the copy pool the entries that are missing or changed in the destination.
+ * @param src_entry the source entry
+ * @param dst_entry the matching destination entry, NULL if none
+ * @param status the result of the comparison
+ * @param parameters is a pointer to the copy pool
+ */
+static void apply_difference(files_list_entry_t *src_entry, files_list_entry_t *dst_entry, diff_status_t status, void *parameters) {
+    if (status != DIFF_IDENTICAL) {
+        copy_pool_add((copy_pool_t *) parameters, src_entry);
+    }
+}
+
+/*!
+ * @brief report_difference is the diff_files_lists callback used by synchronize with --dry-run
+ * It prints the entries that are missing or changed in the destination, instead of copying them.
+ * @param src_entry the source entry
+ * @param dst_entry the matching destination entry, NULL if none
+ * @param status the result of the comparison
+ * @param parameters is a pointer to the number of differences, a size_t
+ */
+static void report_difference(files_list_entry_t *src_entry, files_list_entry_t *dst_entry, diff_status_t status, void *parameters) {
+    if (status != DIFF_IDENTICAL) {
+        printf("%s %s\n", (status == DIFF_ADDED) ? "added" : "changed", src_entry->path_and_name);
+        ++*(size_t *) parameters;
+    }
+}
+
+/*!
+ * @brief copy_entry_without_pool copies an entry at once, when there is no copy pool
+ * @param source_entry is the entry to copy
+ * @param the_config is a pointer to the configuration
+ * @param directories receives the copied directories, finished once all the entries are copied
+ */
+static void copy_entry_without_pool(files_list_entry_t *source_entry, configuration_t *the_config, deferred_directories_t *directories) {
+    if (copy_entry_to_destination(source_entry, the_config) == 0 && source_entry->entry_type == DOSSIER
+        && defer_directory(directories, source_entry, the_config) == -1) {
+        printf("Cannot set the mode and times of %s\n", source_entry->path_and_name);
+    }
+}
+
+/*!
+ * @brief copy_difference is the diff_files_lists callback used by synchronize without a copy pool
+ * It copies to the destination the entries that are missing or changed.
+ * @param src_entry the source entry
+ * @param dst_entry the matching destination entry, NULL if none
+ * @param status the result of the comparison
+ * @param parameters is a pointer to the direct_copy_t
+ */
+static void copy_difference(files_list_entry_t *src_entry, files_list_entry_t *dst_entry, diff_status_t status, void *parameters) {
+    if (status != DIFF_IDENTICAL) {
+        direct_copy_t *copy = (direct_copy_t *) parameters;
+        copy_entry_without_pool(src_entry, copy->config, &copy->directories);
+    }
+}
 
 /*!
  * @brief synchronize is the main function for synchronization
  * It will build the lists (source and destination), then make a third list with differences, and apply differences to the destination
- * It must adapt to the parallel or not operation of the program.
+ * It must adapt to the parallel or not operation of the program. In pipelined mode, the differences are
+ * copied while the trees are listed (@see synchronize_pipelined). With --dry-run, the differences are
+ * only printed: nothing is copied, and neither the manifest nor the caches are written.
  * @param the_config is a pointer to the configuration
  * @param p_context is a pointer to the processes context
  */
 void synchronize(configuration_t *the_config, process_context_t *p_context) {
     if (!the_config || !p_context) return;
 
+    uint64_t phase_start = stats_start();
+    if (the_config->max_memory > 0) {
+        synchronize_bounded(the_config);
+        return;
+    }
+    if (the_config->is_pipelined && synchronize_pipelined(the_config)) {
+        stats_stop(STATS_PHASE_PIPELINE, phase_start);
+        return;
+    }
+
     // Initialize file lists for source and destination
     files_list_t src_list = {0}, dst_list = {0};
+    phase_start = stats_start();
+
+    // The destination is only walked when it has no trusted manifest
+    files_list_t *walked_dst_list = load_trusted_manifest(the_config, &dst_list) ? NULL : &dst_list;
 
-    // Building the file lists: the approach changes based on parallel or non-parallel operation
-    if (the_config->is_parallel) {
-        // Parallel list building (this function needs to be implemented based on your parallel processing strategy)
-        make_files_lists_parallel(&src_list, &dst_list, the_config, p_context->message_queue_id);
+    // Building the file lists: the approach changes based on threads, parallel or non-parallel operation
+    if (the_config->threads_count > 0) {
+        make_files_lists_threaded(&src_list, walked_dst_list, the_config);
+    } else if (the_config->is_parallel && (p_context->shared_memory || start_processes(the_config, p_context) == 0)) {
+        // Parallel list building. With --pipeline, the processes are only started here, when its threads could not be
+        make_files_lists_parallel(&src_list, walked_dst_list, the_config, p_context);
     } else {
         // Non-parallel list building
         make_files_list(&src_list, the_config->source);
-        make_files_list(&dst_list, the_config->destination);
+        if (walked_dst_list) {
+            make_files_list(&dst_list, the_config->destination);
+        }
     }
+    stats_stop(STATS_PHASE_LISTING, phase_start);
 
-    // Iterate through the source list to find differences and apply them to the destination
-    for (files_list_entry_t *src_entry = src_list.head; src_entry != NULL; src_entry = src_entry->next) {
-        // Find corresponding entry in destination list
-        files_list_entry_t *dst_entry = find_entry_by_name(&dst_list, src_entry->path_and_name, 0, 0);
-
-        // If there is a mismatch or the file doesn't exist in the destination, copy/update it
-        if (!dst_entry || mismatch(src_entry, dst_entry, the_config->uses_md5)) {
-            copy_entry_to_destination(src_entry, the_config);
+    // Both lists are ordered, so a single merge pass finds all differences. They are copied by a pool of workers
+    phase_start = stats_start();
+    copy_pool_t *copies = the_config->is_dry_run ? NULL : create_copy_pool(the_config->copy_workers, the_config);
+    if (the_config->is_dry_run) {
+        size_t differences = 0;
+        diff_files_lists(&src_list, &dst_list, root_prefix_length(the_config->source), root_prefix_length(the_config->destination),
+                         the_config->uses_md5, report_difference, &differences);
+        printf("%zu entries to copy, nothing was copied (dry run)\n", differences);
+    } else if (copies) {
+        diff_files_lists(&src_list, &dst_list, root_prefix_length(the_config->source), root_prefix_length(the_config->destination),
+                         the_config->uses_md5, apply_difference, copies);
+        copy_pool_run(copies);
+        copy_pool_finish_directories(copies);
+        if (the_config->is_verbose) {
+            copy_pool_stats_t stats;
+            copy_pool_get_stats(copies, &stats);
+            printf("Copied %zu files (%llu bytes) with %d workers, %zu failed\n", stats.copied_files,
+                   (unsigned long long) stats.copied_bytes, the_config->copy_workers, stats.failed_files);
         }
+        copy_pool_stats_t stats;
+        copy_pool_get_stats(copies, &stats);
+        update_manifest(the_config, &src_list, &dst_list, stats.failed_files);
+        destroy_copy_pool(copies);
+    } else {
+        printf("Cannot create the copy pool, copying files one at a time\n");
+        direct_copy_t copy = {.config = the_config};
+        diff_files_lists(&src_list, &dst_list, root_prefix_length(the_config->source), root_prefix_length(the_config->destination),
+                         the_config->uses_md5, copy_difference, &copy);
+        apply_deferred_directories(&copy.directories);
+        // Failed copies are not known
+        remove_manifest(the_config);
+    }
+    stats_stop(STATS_PHASE_COPYING, phase_start);
+
+    // The lists stay in memory while the source is watched
+    if (the_config->is_watching && watch_source(the_config, &src_list, &dst_list) == -1) {
+        printf("Cannot watch %s anymore\n", the_config->source);
     }
 
     // Clean up file lists after processing
@@ -65,7 +259,11 @@ bool mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5) {
         return true;
     }
 
-    if (has_md5) {
+    if (has_md5 && lhd->entry_type == FICHIER) {
+        // Digests of different algorithms (or missing ones) can't prove the files are equal
+        if (lhd->hash_algorithm != rhd->hash_algorithm || lhd->hash_algorithm == HASH_NONE) {
+            return true;
+        }
         for (int i = 0; i < 16; i++) {
             if (lhd->md5sum[i] != rhd->md5sum[i]) {
                 return true;
@@ -75,6 +273,364 @@ bool mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5) {
 
     return false;
 }
+/*!
+ * @brief diff_files_lists compares the source and destination lists in a single merge pass
+ * Both lists must be ordered with path_compare on their relative paths. Each source entry is reported
+ * once, as added (no destination entry), changed (@see mismatch) or identical. Entries only present
+ * in the destination are skipped. It runs in O(n+m).
+ * @param src_list is a pointer to the source list
+ * @param dst_list is a pointer to the destination list
+ * @param start_of_src the position of the relative path in source entries (removing the source path)
+ * @param start_of_dest the position of the relative path in destination entries (removing the dest path)
+ * @param has_md5 a value to enable or disable MD5 sum check
+ * @param func is the function called for each source entry
+ * @param parameters is a pointer passed to func
+ */
+void diff_files_lists(files_list_t *src_list, files_list_t *dst_list, size_t start_of_src, size_t start_of_dest, bool has_md5, diff_callback_t func, void *parameters) {
+    if (!src_list || !dst_list || !func) {
+        return;
+    }
+
+    files_list_entry_t *src_cursor = src_list->head;
+    files_list_entry_t *dst_cursor = dst_list->head;
+    while (src_cursor != NULL) {
+        // Move the destination cursor to the first entry not before the source entry
+        int comparison = -1;
+        while (dst_cursor != NULL
+               && (comparison = path_compare(src_cursor->path_and_name + start_of_src, dst_cursor->path_and_name + start_of_dest)) > 0) {
+            dst_cursor = dst_cursor->next;
+        }
+
+        if (dst_cursor == NULL || comparison < 0) {
+            func(src_cursor, NULL, DIFF_ADDED, parameters);
+        } else if (mismatch(src_cursor, dst_cursor, has_md5)) {
+            func(src_cursor, dst_cursor, DIFF_CHANGED, parameters);
+            dst_cursor = dst_cursor->next;
+        } else {
+            func(src_cursor, dst_cursor, DIFF_IDENTICAL, parameters);
+            dst_cursor = dst_cursor->next;
+        }
+        src_cursor = src_cursor->next;
+    }
+}
+
+/*!
+ * @brief publish_entry makes an entry of a stream (and the ones before it) readable, and wakes the reader up
+ * @param stream is the stream, only called by its lister thread
+ * @param entry is the entry, the tail of the list
+ */
+static void publish_entry(files_stream_t *stream, files_list_entry_t *entry) {
+    atomic_store(&stream->last, entry);
+    if (atomic_load(&stream->waiting) > 0) {
+        pthread_mutex_lock(&stream->lock);
+        pthread_cond_broadcast(&stream->published);
+        pthread_mutex_unlock(&stream->lock);
+    }
+}
+
+/*!
+ * @brief stream_lister_thread walks a tree and publishes its entries on a stream, then marks it as finished
+ * @param parameters is the files_stream_t
+ */
+static void *stream_lister_thread(void *parameters) {
+    files_stream_t *stream = (files_stream_t *) parameters;
+    trace_name_thread("walk");
+    walk_tree(stream->list, stream->root, true, stream, NULL);
+    pthread_mutex_lock(&stream->lock);
+    atomic_store(&stream->finished, true);
+    pthread_cond_broadcast(&stream->published);
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+/*!
+ * @brief stream_has_next tells if the entry after current is published
+ * @param stream is the stream
+ * @param current is the last entry read, NULL before the first one
+ * @return true if the next entry can be read at once
+ */
+static bool stream_has_next(files_stream_t *stream, files_list_entry_t *current) {
+    files_list_entry_t *last = atomic_load(&stream->last);
+    return last != NULL && last != current;
+}
+
+/*!
+ * @brief stream_next reads the entry after current, waiting for the lister to publish it
+ * @param stream is the stream
+ * @param current is the last entry read, NULL before the first one
+ * @return the next entry, NULL at the end of the walk
+ */
+static files_list_entry_t *stream_next(files_stream_t *stream, files_list_entry_t *current) {
+    while (!stream_has_next(stream, current)) {
+        if (atomic_load(&stream->finished)) {
+            // Entries published right before the end are checked again
+            if (!stream_has_next(stream, current)) {
+                return NULL;
+            }
+            break;
+        }
+        atomic_fetch_add(&stream->waiting, 1);
+        pthread_mutex_lock(&stream->lock);
+        while (!stream_has_next(stream, current) && !atomic_load(&stream->finished)) {
+            pthread_cond_wait(&stream->published, &stream->lock);
+        }
+        pthread_mutex_unlock(&stream->lock);
+        atomic_fetch_sub(&stream->waiting, 1);
+    }
+    return current ? current->next : stream->list->head;
+}
+
+/*!
+ * @brief next_streamed_entry reads the entry after current, copying the pending files while the lister is behind
+ * Copies are also started once COPY_PIPELINE_FILES are pending, so that they overlap with a fast walk.
+ * @param stream is the stream
+ * @param current is the last entry read, NULL before the first one
+ * @param copies is the copy pool, NULL with --dry-run
+ * @return the next entry, NULL at the end of the walk
+ */
+static files_list_entry_t *next_streamed_entry(files_stream_t *stream, files_list_entry_t *current, copy_pool_t *copies) {
+    size_t pending = copies ? copy_pool_pending_files(copies) : 0;
+    if (pending >= COPY_PIPELINE_FILES || (pending > 0 && !stream_has_next(stream, current))) {
+        copy_pool_run(copies);
+    }
+    return stream_next(stream, current);
+}
+
+/*!
+ * @brief synchronize_pipelined synchronizes while the trees are listed
+ * Both trees are walked by their own thread, which publishes the entries in order as soon as they are
+ * analyzed. The same merge as diff_files_lists runs on the streams: a source entry is compared once the
+ * destination walk passed its path, and its copy is started while the walks go on. A path is only
+ * written after the destination walk passed it, so the copies are never listed.
+ * @param the_config is a pointer to the configuration
+ * @return true if the synchronization was done, false if the threads could not be started
+ */
+static bool synchronize_pipelined(configuration_t *the_config) {
+    files_list_t lists[2] = {{0}, {0}};
+    files_stream_t streams[2];
+    char *roots[2] = {the_config->source, the_config->destination};
+    copy_pool_t *copies = the_config->is_dry_run ? NULL : create_copy_pool(the_config->copy_workers, the_config);
+    if (!copies && !the_config->is_dry_run) {
+        return false;
+    }
+    // A trusted manifest gives the whole destination list at once
+    bool has_manifest = load_trusted_manifest(the_config, &lists[1]);
+
+    int started = 0;
+    for (; started<2; ++started) {
+        files_stream_t *stream = &streams[started];
+        stream->list = &lists[started];
+        stream->root = roots[started];
+        stream->is_walked = !(started == 1 && has_manifest);
+        atomic_init(&stream->last, stream->is_walked ? NULL : lists[1].tail);
+        atomic_init(&stream->finished, !stream->is_walked);
+        atomic_init(&stream->waiting, 0);
+        pthread_mutex_init(&stream->lock, NULL);
+        pthread_cond_init(&stream->published, NULL);
+        if (stream->is_walked && pthread_create(&stream->thread, NULL, stream_lister_thread, stream) != 0) {
+            perror("pthread_create");
+            pthread_mutex_destroy(&stream->lock);
+            pthread_cond_destroy(&stream->published);
+            break;
+        }
+    }
+    if (started < 2) {
+        for (int i=0; i<started; ++i) {
+            if (streams[i].is_walked) {
+                pthread_join(streams[i].thread, NULL);
+            }
+            pthread_mutex_destroy(&streams[i].lock);
+            pthread_cond_destroy(&streams[i].published);
+            clear_files_list(&lists[i]);
+        }
+        destroy_copy_pool(copies);
+        return false;
+    }
+
+    size_t start_of_src = root_prefix_length(the_config->source), start_of_dest = root_prefix_length(the_config->destination);
+    // With --dry-run, the differences are printed instead of copied
+    diff_callback_t on_difference = copies ? apply_difference : report_difference;
+    size_t differences = 0;
+    void *parameters = copies ? (void *) copies : (void *) &differences;
+    files_list_entry_t *src_cursor = next_streamed_entry(&streams[0], NULL, copies);
+    files_list_entry_t *dst_cursor = next_streamed_entry(&streams[1], NULL, copies);
+    while (src_cursor != NULL) {
+        int comparison = -1;
+        while (dst_cursor != NULL
+               && (comparison = path_compare(src_cursor->path_and_name + start_of_src, dst_cursor->path_and_name + start_of_dest)) > 0) {
+            dst_cursor = next_streamed_entry(&streams[1], dst_cursor, copies);
+        }
+
+        if (dst_cursor == NULL || comparison < 0) {
+            on_difference(src_cursor, NULL, DIFF_ADDED, parameters);
+        } else {
+            on_difference(src_cursor, dst_cursor, mismatch(src_cursor, dst_cursor, the_config->uses_md5) ? DIFF_CHANGED : DIFF_IDENTICAL, parameters);
+            dst_cursor = next_streamed_entry(&streams[1], dst_cursor, copies);
+        }
+        src_cursor = next_streamed_entry(&streams[0], src_cursor, copies);
+    }
+    if (copies) {
+        copy_pool_run(copies);
+        copy_pool_finish_directories(copies);
+    }
+
+    for (int i=0; i<2; ++i) {
+        if (streams[i].is_walked) {
+            pthread_join(streams[i].thread, NULL);
+        }
+        pthread_mutex_destroy(&streams[i].lock);
+        pthread_cond_destroy(&streams[i].published);
+    }
+    if (!copies) {
+        printf("%zu entries to copy, nothing was copied (dry run)\n", differences);
+    } else {
+        copy_pool_stats_t stats;
+        copy_pool_get_stats(copies, &stats);
+        if (the_config->is_verbose) {
+            printf("Copied %zu files (%llu bytes) with %d workers while listing, %zu failed\n", stats.copied_files,
+                   (unsigned long long) stats.copied_bytes, the_config->copy_workers, stats.failed_files);
+        }
+        update_manifest(the_config, &lists[0], &lists[1], stats.failed_files);
+        destroy_copy_pool(copies);
+    }
+    if (the_config->is_watching && watch_source(the_config, &lists[0], &lists[1]) == -1) {
+        printf("Cannot watch %s anymore\n", the_config->source);
+    }
+    clear_files_list(&lists[0]);
+    clear_files_list(&lists[1]);
+    return true;
+}
+
+/*!
+ * @brief synchronize_bounded synchronizes with at most max_memory bytes of files lists, with --max-memory
+ * Each tree is walked in this process into a list which is spilled to a sorted run in a temporary file
+ * each time it takes half of the memory. The runs of both trees are then merged, and the same merge as
+ * diff_files_lists runs on the two merged streams. The entries to copy are kept in a small list until
+ * the copy pool copied them. Whole lists never exist, so no manifest is written (the old one is removed).
+ * @param the_config is a pointer to the configuration
+ */
+static void synchronize_bounded(configuration_t *the_config) {
+    sorted_runs_t runs[2];
+    char *roots[2] = {the_config->source, the_config->destination};
+    uint64_t phase_start = stats_start();
+    for (int i=0; i<2; ++i) {
+        init_sorted_runs(&runs[i], root_prefix_length(roots[i]), the_config->max_memory / 2);
+        uint64_t start = trace_begin();
+        walk_tree(&runs[i].list, roots[i], true, NULL, &runs[i]);
+        trace_end("list", start, roots[i]);
+    }
+    stats_stop(STATS_PHASE_LISTING, phase_start);
+
+    phase_start = stats_start();
+    if (start_sorted_merge(&runs[0]) == -1 || start_sorted_merge(&runs[1]) == -1) {
+        printf("Cannot list %s and %s within %llu bytes, nothing was copied\n", the_config->source, the_config->destination,
+               (unsigned long long) the_config->max_memory);
+        clear_sorted_runs(&runs[0]);
+        clear_sorted_runs(&runs[1]);
+        return;
+    }
+
+    // Source entries only live until the next one is read, the ones to copy are kept until they are copied
+    copy_pool_t *copies = the_config->is_dry_run ? NULL : create_copy_pool(the_config->copy_workers, the_config);
+    if (!copies && !the_config->is_dry_run) {
+        printf("Cannot create the copy pool, copying files one at a time\n");
+    }
+    files_list_t pending = {0};
+    deferred_directories_t directories = {0};
+    size_t differences = 0;
+    files_list_entry_t *src_cursor = next_sorted_entry(&runs[0]);
+    files_list_entry_t *dst_cursor = next_sorted_entry(&runs[1]);
+    while (src_cursor != NULL) {
+        int comparison = -1;
+        while (dst_cursor != NULL
+               && (comparison = path_compare(src_cursor->path_and_name + runs[0].start_of_path, dst_cursor->path_and_name + runs[1].start_of_path)) > 0) {
+            dst_cursor = next_sorted_entry(&runs[1]);
+        }
+
+        bool is_added = dst_cursor == NULL || comparison < 0;
+        bool is_different = is_added || mismatch(src_cursor, dst_cursor, the_config->uses_md5);
+        if (dst_cursor != NULL && comparison == 0) {
+            dst_cursor = next_sorted_entry(&runs[1]);
+        }
+        if (is_different && the_config->is_dry_run) {
+            report_difference(src_cursor, NULL, is_added ? DIFF_ADDED : DIFF_CHANGED, &differences);
+        } else if (is_different && !copies) {
+            copy_entry_without_pool(src_cursor, the_config, &directories);
+        } else if (is_different) {
+            // Directories are created at once by the pool, only the files wait for copy_pool_run
+            files_list_entry_t *kept = (src_cursor->entry_type == DOSSIER) ? src_cursor : copy_files_list_entry(&pending, src_cursor);
+            if (kept) {
+                copy_pool_add(copies, kept);
+            } else {
+                copy_entry_to_destination(src_cursor, the_config);
+            }
+            if (copy_pool_pending_files(copies) >= COPY_PIPELINE_FILES) {
+                copy_pool_run(copies);
+                clear_files_list(&pending);
+            }
+        }
+        src_cursor = next_sorted_entry(&runs[0]);
+    }
+    apply_deferred_directories(&directories);
+    if (copies) {
+        copy_pool_run(copies);
+        copy_pool_finish_directories(copies);
+        copy_pool_stats_t stats;
+        copy_pool_get_stats(copies, &stats);
+        if (the_config->is_verbose) {
+            printf("Copied %zu files (%llu bytes) with %d workers, %zu failed\n", stats.copied_files,
+                   (unsigned long long) stats.copied_bytes, the_config->copy_workers, stats.failed_files);
+        }
+        destroy_copy_pool(copies);
+    }
+    if (runs[0].has_failed || runs[1].has_failed) {
+        printf("Some spilled entries could not be read, the synchronization is incomplete\n");
+    }
+    if (the_config->is_dry_run) {
+        printf("%zu entries to copy, nothing was copied (dry run)\n", differences);
+    } else {
+        remove_manifest(the_config);
+    }
+    clear_files_list(&pending);
+    clear_sorted_runs(&runs[0]);
+    clear_sorted_runs(&runs[1]);
+    stats_stop(STATS_PHASE_COPYING, phase_start);
+}
+
+/*!
+ * @brief load_trusted_manifest loads the destination list from its manifest, with --trust-manifest
+ * @param the_config is a pointer to the configuration
+ * @param dst_list is the list to load
+ * @return true if the list was loaded, false if the destination must be walked
+ */
+static bool load_trusted_manifest(configuration_t *the_config, files_list_t *dst_list) {
+    if (!the_config->trust_manifest) {
+        return false;
+    }
+    if (load_manifest(the_config, dst_list) == -1) {
+        printf("No valid manifest in %s, listing it\n", the_config->destination);
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * @brief update_manifest writes the manifest of the destination once it was synchronized
+ * When some copies failed, the destination state is not known: the manifest is removed instead.
+ * @param the_config is a pointer to the configuration
+ * @param src_list is the source list
+ * @param dst_list is the destination list, as it was before the copies
+ * @param failed_files is the number of failed copies
+ */
+static void update_manifest(configuration_t *the_config, files_list_t *src_list, files_list_t *dst_list, size_t failed_files) {
+    if (failed_files > 0) {
+        remove_manifest(the_config);
+    } else if (write_manifest(the_config, src_list, dst_list) == -1) {
+        printf("Cannot write the manifest of %s\n", the_config->destination);
+        remove_manifest(the_config);
+    }
+}
+
 /*!
  * @brief make_files_list builds a files list in no parallel mode
  * @param list is a pointer to the list that will be built
@@ -85,134 +641,738 @@ void make_files_list(files_list_t *list, char *target_path) {
         return;
     }
 
-    DIR *dir = opendir(target_path);
-    if (!dir) {
+    // Same walk as make_list, but properties are read while the parent directory is open
+    walk_tree(list, target_path, true, NULL, NULL);
+}
+
+/*!
+ * @brief make_files_lists_parallel makes both (src and dest) files list with parallel processing
+ * @param src_list is a pointer to the source list to build
+ * @param dst_list is a pointer to the destination list to build, NULL to only list the source
+ * @param the_config is a pointer to the program configuration
+ * @param p_context is a pointer to the processes context, holding the rings to the listers
+ */
+void make_files_lists_parallel(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config, process_context_t *p_context) {
+    ring_send_analyze_dir_command(p_context->source_lister.from_main, the_config->source);
+    if (dst_list) {
+        ring_send_analyze_dir_command(p_context->destination_lister.from_main, the_config->destination);
+    }
+
+    ring_buffer_t *rings[] = {p_context->source_lister.to_main, p_context->destination_lister.to_main};
+    files_list_t *lists[] = {src_list, dst_list};
+    int end = 0, lists_count = dst_list ? 2 : 1;
+
+    while (end != lists_count){
+        // Both listers are served as their batches arrive, the main process sleeps when neither has sent any
+        uint32_t sequence = doorbell_prepare(p_context->doorbell);
+        bool received_any = false;
+        for (int i=0; i<lists_count; ++i) {
+            size_t size;
+            entries_batch_t *received;
+            while ((received = ring_peek(rings[i], &size))) {
+                received_any = true;
+                if (received->op_code == COMMAND_CODE_FILE_ENTRIES) {
+                    // Entries are unpacked from the ring straight into the pages of the list
+                    packed_entry_t *packed = first_packed_entry(received);
+                    for (uint32_t j=0; j<received->count; ++j) {
+                        files_list_entry_t *new_entry = new_files_list_entry(lists[i], packed->path);
+                        if (new_entry) {
+                            unpack_entry(packed, new_entry);
+                            add_entry_to_tail(lists[i], new_entry);
+                        }
+                        packed = next_packed_entry(packed);
+                    }
+                } else if (received->op_code == COMMAND_CODE_LIST_COMPLETE) {
+                    end++;
+                }
+                ring_release(rings[i]);
+            }
+        }
+        if (!received_any) {
+            doorbell_wait(p_context->doorbell, sequence);
+        }
+    }
+}
+
+/*!
+ * @brief release_walk_node ends the scan or an analysis of a walked directory, the last one closes it
+ * @param node is the node of the directory
+ */
+static void release_walk_node(walk_node_t *node) {
+    if (atomic_fetch_sub(&node->pending, 1) == 1) {
+        close(node->dir_fd);
+    }
+}
+
+/*!
+ * @brief analyze_file_task is the thread pool task getting the properties of a file
+ * The file is stat'd relative to its open directory, so that its path is not resolved again.
+ * @param pool is the pool of the walk
+ * @param worker is the worker running the task
+ * @param data is the walk_file_t of the file. The mode of its entry stays 0 when it can't be analyzed
+ */
+static void analyze_file_task(thread_pool_t *pool, int worker, void *data) {
+    walk_file_t *file = (walk_file_t *) data;
+    char *name = strrchr(file->entry->path_and_name, '/');
+    if (get_file_stats_at(file->node->dir_fd, name ? name + 1 : file->entry->path_and_name, file->entry) == -1) {
+        file->entry->mode = 0;
+    }
+    release_walk_node(file->node);
+}
+
+/*!
+ * @brief scan_directory_task is the thread pool task reading a directory
+ * The children are created in the pages of the worker, in order. Each subdirectory is a new scan task,
+ * and each file a new analyze task: they are run by this worker, or stolen by idle ones. The directory
+ * stays open until its files are analyzed.
+ * @param pool is the pool of the walk
+ * @param worker is the worker running the task
+ * @param data is the walk_node_t of the directory
+ */
+static void scan_directory_task(thread_pool_t *pool, int worker, void *data) {
+    walk_node_t *node = (walk_node_t *) data;
+    walk_worker_t *state = &((walk_worker_t *) thread_pool_context(pool))[worker];
+    files_list_t *pages = &state->pages[node->side];
+
+    int dir_fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        perror("Erreur lors de l'ouverture du répertoire");
         return;
     }
+    node->dir_fd = dir_fd;
+    atomic_init(&node->pending, 1);
+    char *names_buffer = NULL;
+    char **names = NULL;
+    uint64_t start = trace_begin();
+    ssize_t count = read_sorted_names(dir_fd, state->dirent_buffer, &names_buffer, &names);
+    trace_end("scan", start, node->path);
+    if (count > 0) {
+        node->entries = malloc(count * sizeof(files_list_entry_t *));
+        node->subdirectories = calloc(count, sizeof(walk_node_t *));
+        node->files = node->get_properties ? malloc(count * sizeof(walk_file_t)) : NULL;
+        if (!node->entries || !node->subdirectories || (node->get_properties && !node->files)) {
+            count = 0;
+        }
+    }
+
+    char path[PATH_SIZE];
+    size_t path_length = strlen(node->path);
+    memcpy(path, node->path, path_length);
+    if (path_length > 0 && path[path_length - 1] != '/') {
+        path[path_length++] = '/';
+    }
+
+    for (ssize_t i=0; i<count; ++i) {
+        size_t name_length = strlen(names[i]);
+        if (path_length + name_length + 1 > PATH_SIZE) {
+            continue;
+        }
+        memcpy(path + path_length, names[i], name_length + 1);
+
+        files_list_entry_t *new_entry = new_files_list_entry(pages, path);
+        if (!new_entry) {
+            continue;
+        }
+        if (!node->get_properties && names[i][-1] != DT_UNKNOWN) {
+            new_entry->entry_type = (names[i][-1] == DT_DIR) ? DOSSIER : FICHIER;
+        } else if (names[i][-1] != DT_REG) {
+            // Directories are read right away (they have no digest), files with an unknown type too
+            if (get_file_stats_at(dir_fd, names[i], new_entry) == -1) {
+                continue;
+            }
+        } else {
+            new_entry->entry_type = FICHIER;
+        }
 
-    struct dirent *entry;
-    while ((entry = get_next_entry(dir)) != NULL) {
-        // Construire le chemin complet
-        char full_path[4096];
-        snprintf(full_path, sizeof(full_path), "%s/%s", target_path, entry->d_name);
-
-        // Créer une nouvelle entrée dans la liste
-        files_list_entry_t *new_entry = add_file_entry(list, full_path);
-        // Ici, vous pouvez définir des propriétés supplémentaires pour new_entry si nécessaire
-        // Si vous voulez inclure les sous-répertoires, appelez récursivement make_files_list pour les parcourir
         if (new_entry->entry_type == DOSSIER) {
-            make_files_list(list, new_entry->path_and_name);
+            walk_node_t *child = calloc(1, sizeof(walk_node_t));
+            if (!child) {
+                continue;
+            }
+            child->path = new_entry->path_and_name;
+            child->side = node->side;
+            child->get_properties = node->get_properties;
+            node->subdirectories[node->count] = child;
+            if (thread_pool_push(pool, worker, scan_directory_task, child) == -1) {
+                scan_directory_task(pool, worker, child);
+            }
+        } else if (node->get_properties && new_entry->mode == 0) {
+            walk_file_t *file = &node->files[node->count];
+            *file = (walk_file_t) {.node = node, .entry = new_entry};
+            atomic_fetch_add(&node->pending, 1);
+            if (thread_pool_push(pool, worker, analyze_file_task, file) == -1) {
+                analyze_file_task(pool, worker, file);
+            }
         }
+        node->entries[node->count++] = new_entry;
     }
 
-    closedir(dir);
+    release_walk_node(node);
+    free(names);
+    free(names_buffer);
 }
 
+/*!
+ * @brief link_walk_node appends the entries of a walked directory to a list, depth-first, and frees its node
+ * @param list is the list
+ * @param node is the node of the directory, its own memory is freed by the caller
+ */
+static void link_walk_node(files_list_t *list, walk_node_t *node) {
+    for (size_t i=0; i<node->count; ++i) {
+        // Files that couldn't be analyzed are left out, like in the sequential walk
+        if (!node->get_properties || node->entries[i]->mode != 0) {
+            add_entry_to_tail(list, node->entries[i]);
+        }
+        if (node->subdirectories[i]) {
+            link_walk_node(list, node->subdirectories[i]);
+            free(node->subdirectories[i]);
+        }
+    }
+    free(node->entries);
+    free(node->subdirectories);
+    free(node->files);
+}
 
 /*!
- * @brief make_files_lists_parallel makes both (src and dest) files list with parallel processing
+ * @brief make_files_lists_threaded makes both (src and dest) files lists with a pool of threads
+ * Directory scans and file analyses are tasks of a work-stealing pool, so that deep and shallow
+ * subtrees are balanced between the workers. Entries are built in the memory of the workers and
+ * linked in order at the end, nothing is copied.
  * @param src_list is a pointer to the source list to build
- * @param dst_list is a pointer to the destination list to build
- * @param the_config is a pointer to the program configuration
- * @param msg_queue is the id of the MQ used for communication
+ * @param dst_list is a pointer to the destination list to build, NULL to only list the source
+ * @param the_config is a pointer to the program configuration, with its threads count
  */
-void make_files_lists_parallel(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config, int msg_queue) {
-    send_analyze_dir_command(msg_queue, MSG_TYPE_TO_SOURCE_LISTER, the_config->source);
-    send_analyze_dir_command(msg_queue, MSG_TYPE_TO_DESTINATION_LISTER, the_config->destination);
+void make_files_lists_threaded(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config) {
+    int workers_count = the_config->threads_count;
+    walk_worker_t *workers = calloc(workers_count, sizeof(walk_worker_t));
+    thread_pool_t *pool = workers ? create_thread_pool(workers_count, workers) : NULL;
+    if (!pool) {
+        printf("Cannot create the threads pool, listing files without threads\n");
+        free(workers);
+        make_files_list(src_list, the_config->source);
+        if (dst_list) {
+            make_files_list(dst_list, the_config->destination);
+        }
+        return;
+    }
 
-    any_message_t msg;
-    files_list_entry_t *new_list = NULL;
-    int end = 0;
+    walk_node_t roots[2] = {{.path = the_config->source, .side = 0, .get_properties = true},
+                            {.path = the_config->destination, .side = 1, .get_properties = true}};
+    thread_pool_push(pool, 0, scan_directory_task, &roots[0]);
+    if (dst_list) {
+        thread_pool_push(pool, workers_count - 1, scan_directory_task, &roots[1]);
+    }
+    thread_pool_run(pool);
 
-    while (end != 2){
-        msgrcv(msg_queue, &msg, sizeof(any_message_t), MSG_TYPE_TO_MAIN, 0);
-        if(msg.list_entry.op_code == COMMAND_CODE_FILE_ENTRY && msg.list_entry.mtype == MSG_TYPE_TO_SOURCE_LISTER) {
-            new_list = (files_list_entry_t *) malloc(sizeof(files_list_entry_t));
-            memcpy(new_list, &msg.list_entry.payload, sizeof(files_list_entry_t));
-            add_entry_to_tail(src_list, new_list);
-        } else if (msg.list_entry.op_code == COMMAND_CODE_FILE_ENTRY && msg.list_entry.mtype == MSG_TYPE_TO_DESTINATION_LISTER) {
-            new_list = (files_list_entry_t *) malloc(sizeof(files_list_entry_t));
-            memcpy(new_list, &msg.list_entry.payload, sizeof(files_list_entry_t));
-            add_entry_to_tail(src_list, new_list);
-        } else if (msg.list_entry.op_code == COMMAND_CODE_LIST_COMPLETE) {
-            end++;
+    link_walk_node(src_list, &roots[0]);
+    if (dst_list) {
+        link_walk_node(dst_list, &roots[1]);
+    }
+    for (int i=0; i<workers_count; ++i) {
+        adopt_files_list_pages(src_list, &workers[i].pages[0]);
+        if (dst_list) {
+            adopt_files_list_pages(dst_list, &workers[i].pages[1]);
         }
     }
+    destroy_thread_pool(pool);
+    free(workers);
+}
+
+/*!
+ * @brief make_list_threaded lists files in a location like make_list, with several walkers
+ * Every directory read is a task of a work-stealing pool: the subdirectories found by a walker are
+ * taken by the idle ones, so wide trees are read concurrently. Each directory keeps its sorted children,
+ * and the directories are linked depth-first once the walk is over, in the order of make_list.
+ * @param list is a pointer to the list that will be built
+ * @param target is the target dir whose content must be listed
+ * @param walkers_count is the number of walkers (threads), make_list is used with a single one
+ */
+void make_list_threaded(files_list_t *list, char *target, int walkers_count) {
+    if (!list || !target) {
+        return;
+    }
+    // The directory cache is only used by the sequential walk, and reused listings make it cheap
+    if (walkers_count <= 1 || is_directory_cache_open()) {
+        make_list(list, target);
+        return;
+    }
+    walk_worker_t *workers = calloc(walkers_count, sizeof(walk_worker_t));
+    thread_pool_t *pool = workers ? create_thread_pool(walkers_count, workers) : NULL;
+    if (!pool) {
+        free(workers);
+        make_list(list, target);
+        return;
+    }
+
+    walk_node_t root = {.path = target, .side = 0, .get_properties = false};
+    thread_pool_push(pool, 0, scan_directory_task, &root);
+    thread_pool_run(pool);
+
+    link_walk_node(list, &root);
+    for (int i=0; i<walkers_count; ++i) {
+        adopt_files_list_pages(list, &workers[i].pages[0]);
+    }
+    destroy_thread_pool(pool);
+    free(workers);
 }
 
 /*!
  * @brief copy_entry_to_destination copies a file from the source to the destination
  * It keeps access modes and mtime (@see utimensat)
- * Pay attention to the path so that the prefixes are not repeated from the source to the destination
- * Use sendfile to copy the file, mkdir to create the directory
+ * The destination path is the destination root followed by the path relative to the source root.
+ * Directories are created with mkdir, writable by their owner so that their content can be copied: their
+ * own mode and mtime are set afterwards (@see defer_directory). Files contents are copied by the copy engine (@see copy_file_contents),
+ * which reports its method in verbose mode. Existing files of at least delta_threshold bytes are updated with
+ * a delta transfer (@see delta_copy_file).
+ * @param source_entry is the entry to copy
+ * @param the_config is a pointer to the configuration
+ * @return 0 in case of success, -1 else
  */
+int copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t *the_config) {
+    if (!source_entry || !the_config) return -1;
 
-void copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t *the_config) {
-    if (!source_entry || !the_config) return;
+    size_t prefix_length = root_prefix_length(the_config->source);
+    if (strlen(source_entry->path_and_name) <= prefix_length) {
+        return 0;
+    }
+    char destination_path[PATH_SIZE];
+    if (!concat_path(destination_path, the_config->destination, source_entry->path_and_name + prefix_length)) {
+        printf("Destination path too long for %s\n", source_entry->path_and_name);
+        return -1;
+    }
 
-    // Ouvrir le fichier source
-    int source_fd = open(source_entry->path_and_name, O_RDONLY);
+    struct timespec times[2];
+    times[0] = source_entry->mtime; // atime
+    times[1] = source_entry->mtime; // mtime
+
+    if (source_entry->entry_type == DOSSIER) {
+        mode_t writable_mode = (source_entry->mode & 07777) | S_IRWXU;
+        if (mkdir(destination_path, writable_mode) == -1 && errno != EEXIST) {
+            perror(destination_path);
+            return -1;
+        }
+        // The mode may be restricted by the umask, or be read-only on an existing directory
+        chmod(destination_path, writable_mode);
+        return 0;
+    }
+
+    int source_fd = open(source_entry->path_and_name, O_RDONLY | O_CLOEXEC);
     if (source_fd == -1) {
-        return;
+        perror(source_entry->path_and_name);
+        return -1;
     }
 
-    // Créer le chemin du fichier de destination
-    char destination_path[4096];
-    // En supposant que concat_path soit implémentée correctement
-    concat_path(destination_path, the_config->destination, source_entry->path_and_name);
+    // Large files that already exist in the destination only get their changed blocks written
+    struct stat destination_stat;
+    if (the_config->delta_threshold > 0 && source_entry->size >= the_config->delta_threshold
+        && stat(destination_path, &destination_stat) == 0 && S_ISREG(destination_stat.st_mode) && destination_stat.st_size > 0) {
+        delta_result_t delta;
+        uint64_t trace_start = trace_begin();
+        int delta_result = delta_copy_file(source_fd, destination_path, &delta);
+        trace_end("delta copy", trace_start, source_entry->path_and_name);
+        if (delta_result == 0) {
+            if (the_config->is_verbose) {
+                printf("%s -> %s (%s, %llu bytes matched, %llu bytes written)\n", source_entry->path_and_name, destination_path,
+                       copy_method_name(delta.method), (unsigned long long) delta.matched_bytes, (unsigned long long) delta.written_bytes);
+            }
+            chmod(destination_path, source_entry->mode & 07777);
+            utimensat(AT_FDCWD, destination_path, times, 0);
+            close(source_fd);
+            stats_add(STATS_FILES_COPIED, 1);
+            stats_add(STATS_BYTES_COPIED, delta.written_bytes);
+            return 0;
+        }
+        printf("Delta transfer of %s failed (%s), copying it entirely\n", source_entry->path_and_name, copy_method_name(delta.method));
+        lseek(source_fd, 0, SEEK_SET);
+    }
 
-    // Ouvrir ou créer le fichier de destination
-    int dest_fd = open(destination_path, O_WRONLY | O_CREAT, source_entry->mode);
+    int dest_fd = open(destination_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, source_entry->mode & 07777);
     if (dest_fd == -1) {
+        perror(destination_path);
         close(source_fd);
-        return;
+        return -1;
     }
 
-    // Copier les données du fichier
-    struct stat file_stat;
-    fstat(source_fd, &file_stat);
-    sendfile(dest_fd, source_fd, NULL, file_stat.st_size);
+    int result = copy_opened_file(source_entry, source_fd, dest_fd, destination_path, the_config);
+    close(source_fd);
+    close(dest_fd);
+    return result;
+}
 
-    // Conserver l'heure de modification
-    struct timespec times[2];
-    times[0] = source_entry->mtime; // atime
-    times[1] = source_entry->mtime; // mtime
+/*!
+ * @brief copy_opened_file copies the content of a file whose source and destination are already open, then
+ * sets the mode and times of the destination. The descriptors are left open.
+ * @param source_entry is the source entry, with its properties
+ * @param source_fd is the source, opened for reading
+ * @param dest_fd is the destination, opened for writing and truncated
+ * @param destination_path is the path of the destination, for the messages
+ * @param the_config is a pointer to the configuration
+ * @return 0 in case of success, -1 else
+ */
+int copy_opened_file(files_list_entry_t *source_entry, int source_fd, int dest_fd, char *destination_path, configuration_t *the_config) {
+    struct timespec times[2] = {source_entry->mtime, source_entry->mtime};
+    copy_method_t method;
+    uint64_t start = stats_start(), trace_start = trace_begin();
+    int result = copy_file_contents(source_fd, dest_fd, &method);
+    stats_stop(STATS_TIME_COPYING, start);
+    trace_end("copy", trace_start, source_entry->path_and_name);
+    if (result == -1) {
+        printf("Cannot copy %s to %s (%s): %s\n", source_entry->path_and_name, destination_path, copy_method_name(method), strerror(errno));
+        return -1;
+    }
+    if (the_config->is_verbose) {
+        printf("%s -> %s (%s)\n", source_entry->path_and_name, destination_path, copy_method_name(method));
+    }
+    fchmod(dest_fd, source_entry->mode & 07777);
     futimens(dest_fd, times);
+    stats_add(STATS_FILES_COPIED, 1);
+    stats_add(STATS_BYTES_COPIED, source_entry->size);
+    return 0;
+}
 
-    close(source_fd);
-    close(dest_fd);
+/*!
+ * @brief defer_directory records a directory copied by copy_entry_to_destination, to set its mode and times later
+ * @param deferred is the list of the directories of the synchronization
+ * @param source_entry is the source entry of the directory, with its properties
+ * @param the_config is a pointer to the configuration
+ * @return 0 in case of success, -1 else (the directory keeps its writable mode and its current times)
+ */
+int defer_directory(deferred_directories_t *deferred, files_list_entry_t *source_entry, configuration_t *the_config) {
+    size_t prefix_length = root_prefix_length(the_config->source);
+    char destination_path[PATH_SIZE];
+    if (strlen(source_entry->path_and_name) <= prefix_length
+        || !concat_path(destination_path, the_config->destination, source_entry->path_and_name + prefix_length)) {
+        return -1;
+    }
+    if (deferred->count == deferred->capacity) {
+        size_t new_capacity = (deferred->capacity == 0) ? 256 : deferred->capacity * 2;
+        deferred_directory_t *new_directories = realloc(deferred->directories, new_capacity * sizeof(deferred_directory_t));
+        if (!new_directories) {
+            return -1;
+        }
+        deferred->directories = new_directories;
+        deferred->capacity = new_capacity;
+    }
+    char *path = strdup(destination_path);
+    if (!path) {
+        return -1;
+    }
+    deferred->directories[deferred->count++] = (deferred_directory_t) {.path = path, .mode = source_entry->mode & 07777, .mtime = source_entry->mtime};
+    return 0;
 }
 
 /*!
- * @brief make_list lists files in a location (it recurses in directories)
- * It doesn't get files properties, only a list of paths
- * This function is used by make_files_list and make_files_list_parallel
- * @param list is a pointer to the list that will be built
- * @param target is the target dir whose content must be listed
+ * @brief apply_deferred_directories sets the mode and times of the recorded directories, once all the copies are done
+ * Like cp -a, the directories are finished in post-order (from the last one): the content of a read-only
+ * directory is copied before it becomes read-only, and the mtime of a directory is set after its content
+ * was written. The list is empty afterwards.
+ * @param deferred is the list of the directories of the synchronization
  */
-void make_list(files_list_t *list, char *target) {
-    DIR *dir = open_dir(target);
-    if (!dir) {
-        return;
+void apply_deferred_directories(deferred_directories_t *deferred) {
+    for (size_t i=deferred->count; i-->0; ) {
+        deferred_directory_t *directory = &deferred->directories[i];
+        struct timespec times[2] = {directory->mtime, directory->mtime};
+        if (chmod(directory->path, directory->mode) == -1 || utimensat(AT_FDCWD, directory->path, times, 0) == -1) {
+            perror(directory->path);
+        }
+        free(directory->path);
     }
+    free(deferred->directories);
+    deferred->directories = NULL;
+    deferred->count = 0;
+    deferred->capacity = 0;
+}
 
-    struct dirent *entry;
-    while ((entry = get_next_entry(dir)) != NULL) {
-        // Construire le chemin complet
-        char full_path[4096];
-        snprintf(full_path, sizeof(full_path), "%s/%s", target, entry->d_name);
+/*!
+ * @brief compare_names is the qsort comparison function for the names of a directory
+ */
+static int compare_names(const void *lhs, const void *rhs) {
+    return strcmp(*(char * const *) lhs, *(char * const *) rhs);
+}
+
+/*!
+ * @brief read_sorted_names reads all the names in an open directory and sorts them
+ * Entries are read with getdents64 into large buffers. Each name is stored right after its d_type,
+ * so that the type of names[i] is names[i][-1].
+ * @param dir_fd is the directory to read
+ * @param dirent_buffer is a buffer of DIRENT_BUFFER_SIZE bytes for getdents64
+ * @param names_buffer receives a buffer holding all the names, to be freed by the caller
+ * @param names receives an array of pointers to the sorted names, to be freed by the caller
+ * @return the number of names, -1 in case of error
+ */
+static ssize_t read_sorted_names(int dir_fd, char *dirent_buffer, char **names_buffer, char ***names) {
+    // Names are packed in a single buffer, their offsets are turned into pointers once it stops moving
+    char *buffer = NULL;
+    size_t used = 0, capacity = 0;
+    size_t *offsets = NULL;
+    size_t count = 0, offsets_capacity = 0;
+    ssize_t read_size;
+
+    while ((read_size = syscall(SYS_getdents64, dir_fd, dirent_buffer, DIRENT_BUFFER_SIZE)) > 0) {
+        for (ssize_t position=0; position<read_size; ) {
+            linux_dirent64_t *entry = (linux_dirent64_t *) (dirent_buffer + position);
+            position += entry->d_reclen;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            // Only regular files and dirs are listed, DT_UNKNOWN is resolved later with a stat
+            if (entry->d_type != DT_REG && entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) {
+                continue;
+            }
+
+            size_t length = strlen(entry->d_name) + 2;
+            if (used + length > capacity) {
+                size_t new_capacity = (capacity == 0) ? 4096 : capacity * 2;
+                while (used + length > new_capacity) {
+                    new_capacity *= 2;
+                }
+                char *new_buffer = realloc(buffer, new_capacity);
+                if (!new_buffer) {
+                    continue;
+                }
+                buffer = new_buffer;
+                capacity = new_capacity;
+            }
+            if (count == offsets_capacity) {
+                size_t new_capacity = (offsets_capacity == 0) ? 64 : offsets_capacity * 2;
+                size_t *new_offsets = realloc(offsets, new_capacity * sizeof(size_t));
+                if (!new_offsets) {
+                    continue;
+                }
+                offsets = new_offsets;
+                offsets_capacity = new_capacity;
+            }
+            buffer[used] = entry->d_type;
+            memcpy(buffer + used + 1, entry->d_name, length - 1);
+            offsets[count++] = used + 1;
+            used += length;
+        }
+    }
+    if (read_size == -1) {
+        perror("getdents64");
+    }
 
-        // Créer une nouvelle entrée dans la liste
-        files_list_entry_t *new_entry = add_file_entry(list, full_path);
-        // Ici, vous pouvez définir des propriétés supplémentaires pour new_entry si nécessaire
+    // The offsets array is reused for the pointers, which have the same size
+    char **sorted = (char **) offsets;
+    for (size_t i=0; i<count; ++i) {
+        sorted[i] = buffer + offsets[i];
+    }
+    qsort(sorted, count, sizeof(char *), compare_names);
+    stats_add(STATS_DIRECTORIES_SCANNED, 1);
+    stats_add(STATS_FILES_SCANNED, count);
+
+    *names_buffer = buffer;
+    *names = sorted;
+    return count;
+}
+
+/*!
+ * @brief walk_directory lists the content of an open directory, and recurses in its subdirectories
+ * The directory stays open while its subdirectories are walked, so every name is resolved relative
+ * to its parent (openat, statx) and the kernel never walks the full path again.
+ * @param context is the walk context. Its path holds the path of the directory
+ * @param dir_fd is the open directory, it is closed by this function
+ * @param path_length is the length of the path of the directory in context->path
+ */
+static void walk_directory(walk_context_t *context, int dir_fd, size_t path_length) {
+    char *names_buffer = NULL;
+    char **names = NULL;
+    uint64_t start = trace_begin();
+    // An unchanged directory is not read again, its listing is taken from the directory cache
+    directory_key_t key;
+    directory_child_t *cached_children = NULL;
+    bool has_key = is_directory_cache_open() && get_directory_key(dir_fd, &key) == 0;
+    ssize_t count = has_key ? lookup_directory(&key, &names_buffer, &names, &cached_children) : -1;
+    if (count >= 0) {
+        stats_add(STATS_DIRECTORIES_REUSED, 1);
+    } else {
+        cached_children = NULL;
+        count = read_sorted_names(dir_fd, context->dirent_buffer, &names_buffer, &names);
+    }
+    trace_end("scan", start, context->path);
+
+    // The listing is recorded as it is walked, with the names that were kept and their properties when known
+    directory_child_t *children = NULL;
+    char **kept_names = NULL;
+    size_t kept_count = 0;
+    if (has_key && count > 0) {
+        children = malloc(count * sizeof(directory_child_t));
+        kept_names = malloc(count * sizeof(char *));
+        if (!children || !kept_names) {
+            free(children);
+            free(kept_names);
+            children = NULL;
+            kept_names = NULL;
+            has_key = false;
+        }
+    }
+    bool trusts_children = cached_children && context->trusts_cache;
+    hash_algorithm_t algorithm = get_hash_algorithm();
+
+    // With io_uring, the children are stat'd at once, before they are walked
+    struct statx *stats = NULL;
+    int *stat_errors = NULL;
+    if (context->get_properties && !trusts_children && count > 1 && is_io_ring_enabled()) {
+        stats = malloc(count * sizeof(struct statx));
+        stat_errors = malloc(count * sizeof(int));
+        if (stats && stat_errors) {
+            stat_files_at(dir_fd, names, count, stats, stat_errors);
+        } else {
+            free(stats);
+            free(stat_errors);
+            stats = NULL;
+            stat_errors = NULL;
+        }
+    }
+
+    // Children paths are built in place, after the directory path and a separator
+    if (path_length > 0 && context->path[path_length - 1] != '/') {
+        context->path[path_length++] = '/';
+    }
 
-        // Si l'entrée est un répertoire, appelez récursivement make_list pour explorer son contenu
+    for (ssize_t i=0; i<count; ++i) {
+        // Once the list could not be spilled, the walk is stopped
+        if (context->runs && spill_full_run(context->runs) == -1) {
+            break;
+        }
+        size_t name_length = strlen(names[i]);
+        if (path_length + name_length + 1 > PATH_SIZE) {
+            continue;
+        }
+        memcpy(context->path + path_length, names[i], name_length + 1);
+
+        files_list_entry_t *new_entry = new_files_list_entry(context->list, context->path);
+        if (!new_entry) {
+            continue;
+        }
+        // With --trust-dir-mtime, the files of an unchanged directory keep the properties they had when it was cached.
+        // Subdirectories are stat'd again: their mtime changes with their content, without changing the one of their parent
+        directory_child_t *cached = cached_children ? &cached_children[i] : NULL;
+        bool is_trusted = trusts_children && cached->has_properties
+                          && cached->entry_type == FICHIER && cached->hash_algorithm == algorithm;
+        bool has_properties = context->get_properties || is_trusted;
+        if (is_trusted) {
+            new_entry->entry_type = cached->entry_type;
+            new_entry->mode = cached->mode;
+            new_entry->size = cached->size;
+            new_entry->mtime.tv_sec = cached->mtime_sec;
+            new_entry->mtime.tv_nsec = cached->mtime_nsec;
+            new_entry->hash_algorithm = cached->hash_algorithm;
+            memcpy(new_entry->md5sum, cached->digest, sizeof(new_entry->md5sum));
+        } else if (stats) {
+            if (stat_errors[i] != 0) {
+                errno = stat_errors[i];
+                perror("statx");
+                continue;
+            }
+            if (set_file_stats(new_entry, &stats[i]) == -1) {
+                continue;
+            }
+        } else if (context->get_properties || names[i][-1] == DT_UNKNOWN) {
+            // The d_type can't be trusted to be set on all filesystems
+            if (get_file_stats_at(dir_fd, names[i], new_entry) == -1) {
+                continue;
+            }
+        } else {
+            new_entry->entry_type = (names[i][-1] == DT_DIR) ? DOSSIER : FICHIER;
+        }
+        add_entry_to_tail(context->list, new_entry);
+        if (context->stream) {
+            publish_entry(context->stream, new_entry);
+        }
+
+        if (children) {
+            // The resolved type is kept, so that a cached DT_UNKNOWN doesn't need a stat
+            names[i][-1] = (new_entry->entry_type == DOSSIER) ? DT_DIR : DT_REG;
+            directory_child_t *child = &children[kept_count];
+            memset(child, 0, sizeof(directory_child_t));
+            child->entry_type = new_entry->entry_type;
+            child->has_properties = has_properties;
+            if (has_properties) {
+                child->mode = new_entry->mode;
+                child->size = new_entry->size;
+                child->mtime_sec = new_entry->mtime.tv_sec;
+                child->mtime_nsec = new_entry->mtime.tv_nsec;
+                child->hash_algorithm = new_entry->hash_algorithm;
+                memcpy(child->digest, new_entry->md5sum, sizeof(child->digest));
+            }
+            kept_names[kept_count++] = names[i];
+        }
+
+        // Si l'entrée est un répertoire, on parcourt récursivement son contenu
         if (new_entry->entry_type == DOSSIER) {
-            make_list(list, new_entry->path_and_name);
+            int child_fd = openat(dir_fd, names[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd == -1) {
+                perror("openat");
+                continue;
+            }
+            walk_directory(context, child_fd, path_length + name_length);
         }
     }
 
-    closedir(dir);
+    if (has_key) {
+        record_directory(&key, kept_names, children, kept_count);
+    }
+    close(dir_fd);
+    free(stats);
+    free(stat_errors);
+    free(children);
+    free(kept_names);
+    free(names);
+    free(names_buffer);
+}
+
+/*!
+ * @brief walk_tree lists a whole tree, in order (@see path_compare)
+ * Each directory is read and sorted on its own, then walked depth-first, so the entries
+ * are appended to the tail of the list.
+ * @param list is a pointer to the list that will be built
+ * @param target is the root of the tree
+ * @param get_properties is true to get the properties of the entries, false to get only their type
+ * @param stream is where the entries are published as soon as they are added, NULL if they are not
+ * @param runs is where list is spilled once it is full (list must be runs->list), NULL to keep it in memory
+ */
+static void walk_tree(files_list_t *list, char *target, bool get_properties, files_stream_t *stream, sorted_runs_t *runs) {
+    size_t length = strlen(target);
+    if (length >= PATH_SIZE) {
+        return;
+    }
+
+    int dir_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        perror("Erreur lors de l'ouverture du répertoire");
+        return;
+    }
+
+    walk_context_t *context = malloc(sizeof(walk_context_t));
+    if (!context) {
+        close(dir_fd);
+        return;
+    }
+    context->list = list;
+    context->stream = stream;
+    context->runs = runs;
+    context->trusts_cache = directory_cache_trusts_mtime(target);
+    context->get_properties = get_properties;
+    memcpy(context->path, target, length + 1);
+
+    walk_directory(context, dir_fd, length);
+    free(context);
+}
+
+/*!
+ * @brief make_list lists files in a location (it recurses in directories)
+ * It doesn't get files properties, only a list of paths (and their types, from the directory entries)
+ * This function is used by make_files_list and make_files_list_parallel
+ * @param list is a pointer to the list that will be built
+ * @param target is the target dir whose content must be listed
+ */
+void make_list(files_list_t *list, char *target) {
+    if (!list || !target) {
+        return;
+    }
+    walk_tree(list, target, false, NULL, NULL);
 }
 
 
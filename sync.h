@@ -6,11 +6,35 @@
 #include <processes.h>
 #include <dirent.h>
 
+typedef enum { DIFF_ADDED, DIFF_CHANGED, DIFF_IDENTICAL } diff_status_t;
+
+typedef void (*diff_callback_t)(files_list_entry_t *src_entry, files_list_entry_t *dst_entry, diff_status_t status, void *parameters);
+
+// A directory copied to the destination. It stays writable until its content is copied, then gets its mode and times
+typedef struct {
+    char *path; // Path in the destination
+    mode_t mode;
+    struct timespec mtime;
+} deferred_directory_t;
+
+// The directories copied by a synchronization, in the order of the lists (a directory before its content)
+typedef struct {
+    deferred_directory_t *directories;
+    size_t count;
+    size_t capacity;
+} deferred_directories_t;
+
 void synchronize(configuration_t *the_config, process_context_t *p_context);
 void make_files_list(files_list_t *list, char *target_path);
 bool mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5);
-void make_files_lists_parallel(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config, int msg_queue);
-void copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t *the_config);
+void diff_files_lists(files_list_t *src_list, files_list_t *dst_list, size_t start_of_src, size_t start_of_dest, bool has_md5, diff_callback_t func, void *parameters);
+void make_files_lists_parallel(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config, process_context_t *p_context);
+void make_files_lists_threaded(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config);
+int copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t *the_config);
+int copy_opened_file(files_list_entry_t *source_entry, int source_fd, int dest_fd, char *destination_path, configuration_t *the_config);
+int defer_directory(deferred_directories_t *deferred, files_list_entry_t *source_entry, configuration_t *the_config);
+void apply_deferred_directories(deferred_directories_t *deferred);
 void make_list(files_list_t *list, char *target);
+void make_list_threaded(files_list_t *list, char *target, int walkers_count);
 DIR *open_dir(char *path);
 struct dirent *get_next_entry(DIR *dir);
\ No newline at end of file
@@ -0,0 +1,53 @@
+#!/bin/sh
+# A directory cache whose table has no free slot left (every record used, count = capacity) is ignored
+# as if there was no cache, instead of having its lookups and its merge probe the table forever. The
+# next save replaces it with a valid file.
+# Usage: dir-cache-full.sh [lp25-backup binary] (default ./lp25-backup)
+
+set -e
+binary=${1:-./lp25-backup}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Layout of the file (directory-cache.h): a 40 bytes header, with the capacity at offset 8 and the count
+# at offset 16, then the table of 64 bytes records, whose used flag is at offset 60
+HEADER_SIZE=40
+RECORD_SIZE=64
+USED_OFFSET=60
+
+run() {
+    timeout 30 "$binary" "$work/src" "$work/dst" --no-parallel --dir-cache="$work/cache" > "$work/output" || {
+        echo "FAIL: $1: the run failed or did not end"
+        exit 1
+    }
+}
+
+mkdir -p "$work/src/sub" "$work/dst"
+echo one > "$work/src/sub/first"
+echo two > "$work/src/top"
+# Directories changed less than 2 seconds before a run are not cached (RACY_DELAY_SEC, in whole seconds)
+sleep 3
+run "first run"
+
+capacity=$(od -A n -t u8 -j 8 -N 8 "$work/cache" | tr -d ' ')
+dd if="$work/cache" of="$work/cache" bs=1 skip=8 seek=16 count=8 conv=notrunc 2> /dev/null
+i=0
+while [ "$i" -lt "$capacity" ]; do
+    printf '\001' | dd of="$work/cache" bs=1 seek=$((HEADER_SIZE + i * RECORD_SIZE + USED_OFFSET)) conv=notrunc 2> /dev/null
+    i=$((i + 1))
+done
+
+echo changed > "$work/src/sub/first"
+run "run with a full table"
+if ! grep -q "Ignoring invalid directory cache" "$work/output"; then
+    echo "FAIL: the full table was not reported"
+    exit 1
+fi
+run "run after the cache was replaced"
+if grep -q "Ignoring invalid directory cache" "$work/output"; then
+    echo "FAIL: the cache was not replaced by a valid one"
+    exit 1
+fi
+
+diff -r -x .lp25-manifest "$work/src" "$work/dst"
+echo "PASS: dir-cache-full"
@@ -0,0 +1,65 @@
+#!/bin/sh
+# Copied directories keep the mode and the mtime of the source, in every mode of synchronization. A
+# read-only directory only becomes read-only once its content is copied, also on a later run that adds
+# a file to it. As root the permissions are not checked, so the program then runs as the user nobody.
+# Usage: directory-properties.sh [lp25-backup binary] (default ./lp25-backup)
+
+set -e
+binary=$(realpath "${1:-./lp25-backup}")
+work=$(mktemp -d)
+trap 'chmod -R u+w "$work"; rm -rf "$work"' EXIT
+chmod 755 "$work"
+
+as_user() {
+    if [ "$(id -u)" = 0 ]; then
+        setpriv --reuid=65534 --regid=65534 --clear-groups "$@"
+    else
+        "$@"
+    fi
+}
+
+# Prints the mode and the mtime of the directories of a tree, but its root: the manifest is written to the
+# root of the destination after the copy
+directories_of() {
+    (cd "$1" && find . -mindepth 1 -type d -exec stat -c '%n %a %Y' {} + | sort)
+}
+
+check_copy() {
+    if ! diff -r -x .lp25-manifest "$work/src" "$work/dst" > /dev/null || [ "$(directories_of "$work/src")" != "$(directories_of "$work/dst")" ]; then
+        echo "FAIL: $1"
+        directories_of "$work/dst"
+        exit 1
+    fi
+}
+
+mkdir -p "$work/src/empty" "$work/src/ro/sub"
+echo one > "$work/src/ro/first"
+echo two > "$work/src/ro/sub/second"
+chmod 555 "$work/src/ro/sub" "$work/src/ro"
+touch -d "2020-01-02 03:04:05" "$work/src/empty" "$work/src/ro/sub" "$work/src/ro"
+if [ "$(id -u)" = 0 ]; then
+    chown -R 65534 "$work/src"
+fi
+
+for mode in "--no-parallel" "-n 2" "--threads=2" "--pipeline" "--copy-workers=2" "--max-memory=2M"; do
+    rm -rf "$work/dst"
+    mkdir "$work/dst"
+    if [ "$(id -u)" = 0 ]; then
+        chown 65534 "$work/dst"
+    fi
+    as_user "$binary" "$work/src" "$work/dst" $mode > /dev/null
+    check_copy "$mode: first run"
+
+    # A file added to a read-only directory changes its mtime
+    chmod u+w "$work/src/ro"
+    echo three > "$work/src/ro/third"
+    chmod u-w "$work/src/ro"
+    as_user "$binary" "$work/src" "$work/dst" $mode > /dev/null
+    check_copy "$mode: run after a file was added to a read-only directory"
+    chmod u+w "$work/src/ro"
+    rm "$work/src/ro/third"
+    chmod u-w "$work/src/ro"
+    touch -d "2020-01-02 03:04:05" "$work/src/ro"
+    chmod -R u+w "$work/dst"
+done
+echo "PASS: directory-properties"
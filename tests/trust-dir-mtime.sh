@@ -0,0 +1,49 @@
+#!/bin/sh
+# A file of the source replaced by a rename, with --dir-cache and --trust-dir-mtime, is copied by the next
+# run only: the following runs copy nothing. The destination is written by the copies without changing the
+# times of its directories, so its cached properties must never be trusted.
+# Usage: trust-dir-mtime.sh [lp25-backup binary] (default ./lp25-backup)
+
+set -e
+binary=${1:-./lp25-backup}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Directories changed less than 2 seconds before a run are not cached (RACY_DELAY_SEC, in whole seconds)
+wait_racy_delay() {
+    sleep 3
+}
+
+copied_files() {
+    "$binary" "$work/src" "$work/dst" --no-parallel --dir-cache="$work/cache" --trust-dir-mtime --stats=- \
+        | sed -n 's/.*"files_copied": \([0-9]*\).*/\1/p'
+}
+
+expect_copies() {
+    count=$(copied_files)
+    if [ "$count" != "$1" ]; then
+        echo "FAIL: $2: $count files copied, $1 expected"
+        exit 1
+    fi
+}
+
+mkdir -p "$work/src/sub" "$work/dst"
+echo one > "$work/src/sub/first"
+echo two > "$work/src/sub/second"
+echo three > "$work/src/top"
+wait_racy_delay
+expect_copies 3 "first run"
+wait_racy_delay
+expect_copies 0 "unchanged source"
+
+echo replaced > "$work/src/sub/first.tmp"
+mv "$work/src/sub/first.tmp" "$work/src/sub/first"
+wait_racy_delay
+expect_copies 1 "run after the replace-by-rename"
+wait_racy_delay
+expect_copies 0 "second run after the replace-by-rename"
+wait_racy_delay
+expect_copies 0 "third run after the replace-by-rename"
+
+diff -r -x .lp25-manifest "$work/src" "$work/dst"
+echo "PASS: trust-dir-mtime"
@@ -0,0 +1,290 @@
+#include <thread-pool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define DEQUE_INITIAL_CAPACITY 256
+
+typedef struct {
+    task_function_t function;
+    void *data;
+} task_t;
+
+// Tasks of a worker: the worker pushes and pops at the bottom (depth first, the data is hot),
+// idle workers steal from the top (the oldest tasks, usually the largest subtrees)
+typedef struct {
+    pthread_mutex_t lock;
+    task_t *tasks; // Circular array
+    size_t capacity; // A power of 2
+    size_t top;
+    size_t bottom;
+} task_deque_t;
+
+typedef struct {
+    thread_pool_t *pool;
+    int index;
+    pthread_t thread;
+} worker_t;
+
+struct _thread_pool {
+    int workers_count;
+    void *context;
+    task_deque_t *deques;
+    worker_t *workers;
+    _Atomic size_t pending; // Tasks pushed and not finished yet
+    _Atomic int sleepers;
+    pthread_mutex_t lock; // Protects the fields below, used to sleep when there is no task
+    pthread_cond_t wake;
+    uint64_t version; // Incremented to wake the sleeping workers up
+    bool done;
+};
+
+/*!
+ * @brief deque_push pushes a task at the bottom of a deque, growing it when full
+ * @return 0 in case of success, -1 if out of memory
+ */
+static int deque_push(task_deque_t *deque, task_t *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity) {
+        size_t new_capacity = (deque->capacity == 0) ? DEQUE_INITIAL_CAPACITY : deque->capacity * 2;
+        task_t *new_tasks = malloc(new_capacity * sizeof(task_t));
+        if (!new_tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        for (size_t i=deque->top; i<deque->bottom; ++i) {
+            new_tasks[i & (new_capacity - 1)] = deque->tasks[i & (deque->capacity - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = new_tasks;
+        deque->capacity = new_capacity;
+    }
+    deque->tasks[deque->bottom & (deque->capacity - 1)] = *task;
+    ++deque->bottom;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/*!
+ * @brief deque_pop takes the task at the bottom of a deque (the newest one), used by its worker
+ * @return true if a task was taken, false if the deque is empty
+ */
+static bool deque_pop(task_deque_t *deque, task_t *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom != deque->top;
+    if (found) {
+        --deque->bottom;
+        *task = deque->tasks[deque->bottom & (deque->capacity - 1)];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*!
+ * @brief deque_steal takes the task at the top of a deque (the oldest one), used by the other workers
+ * @return true if a task was taken, false if the deque is empty
+ */
+static bool deque_steal(task_deque_t *deque, task_t *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom != deque->top;
+    if (found) {
+        *task = deque->tasks[deque->top & (deque->capacity - 1)];
+        ++deque->top;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*!
+ * @brief create_thread_pool creates a pool of workers, the threads are started by thread_pool_run
+ * @param workers_count is the number of workers, at least 1
+ * @param context is a pointer for the tasks (@see thread_pool_context)
+ * @return the pool, NULL in case of error
+ */
+thread_pool_t *create_thread_pool(int workers_count, void *context) {
+    if (workers_count < 1) {
+        return NULL;
+    }
+    thread_pool_t *pool = calloc(1, sizeof(thread_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->deques = calloc(workers_count, sizeof(task_deque_t));
+    pool->workers = calloc(workers_count, sizeof(worker_t));
+    if (!pool->deques || !pool->workers) {
+        free(pool->deques);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pool->workers_count = workers_count;
+    pool->context = context;
+    for (int i=0; i<workers_count; ++i) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->sleepers, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    return pool;
+}
+
+/*!
+ * @brief destroy_thread_pool frees a pool, which must not be running
+ * @param pool is the pool
+ */
+void destroy_thread_pool(thread_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    for (int i=0; i<pool->workers_count; ++i) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool);
+}
+
+/*!
+ * @brief thread_pool_push pushes a task on the deque of a worker, and wakes up a sleeping worker
+ * @param pool is the pool
+ * @param worker is the index of the worker, the calling worker for tasks pushed by a task
+ * @param function is the function of the task
+ * @param data is passed to function
+ * @return 0 in case of success, -1 else (the task is not run)
+ */
+int thread_pool_push(thread_pool_t *pool, int worker, task_function_t function, void *data) {
+    task_t task = {.function = function, .data = data};
+    atomic_fetch_add(&pool->pending, 1);
+    if (deque_push(&pool->deques[worker], &task) == -1) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+    }
+
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        ++pool->version;
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return 0;
+}
+
+/*!
+ * @brief find_task takes a task from the worker's deque, or steals one from the other workers
+ * @return true if a task was found
+ */
+static bool find_task(thread_pool_t *pool, int index, task_t *task) {
+    if (deque_pop(&pool->deques[index], task)) {
+        return true;
+    }
+    for (int i=1; i<pool->workers_count; ++i) {
+        if (deque_steal(&pool->deques[(index + i) % pool->workers_count], task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * @brief run_task runs a task, and ends the run when it was the last one
+ */
+static void run_task(thread_pool_t *pool, int index, task_t *task) {
+    task->function(pool, index, task->data);
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->done = true;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*!
+ * @brief worker_loop runs tasks until there are no more tasks in the pool
+ * A worker with nothing to run or steal sleeps until a task is pushed.
+ * @param parameters is the worker_t of the thread
+ */
+static void *worker_loop(void *parameters) {
+    worker_t *worker = (worker_t *) parameters;
+    thread_pool_t *pool = worker->pool;
+    task_t task;
+
+    while (true) {
+        if (find_task(pool, worker->index, &task)) {
+            run_task(pool, worker->index, &task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        uint64_t version = pool->version;
+        atomic_fetch_add(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->lock);
+
+        // A task pushed before this worker was counted as sleeping is found by this second look
+        bool found = find_task(pool, worker->index, &task);
+        pthread_mutex_lock(&pool->lock);
+        while (!found && !pool->done && pool->version == version) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        bool done = pool->done;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (found) {
+            run_task(pool, worker->index, &task);
+        } else if (done) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * @brief thread_pool_run runs the pushed tasks, and the tasks they push, until there are none left
+ * The calling thread is the worker 0, the other workers are threads that end with the run.
+ * @param pool is the pool
+ * @return 0 in case of success, -1 if the threads could not be started (the tasks are then run with fewer workers)
+ */
+int thread_pool_run(thread_pool_t *pool) {
+    if (atomic_load(&pool->pending) == 0) {
+        return 0;
+    }
+    pool->done = false;
+
+    int result = 0;
+    int started = 1;
+    for (; started<pool->workers_count; ++started) {
+        if (pthread_create(&pool->workers[started].thread, NULL, worker_loop, &pool->workers[started]) != 0) {
+            perror("pthread_create");
+            result = -1;
+            break;
+        }
+    }
+    // Tasks of the workers that could not be started are stolen by the others
+    worker_loop(&pool->workers[0]);
+    for (int i=1; i<started; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    return result;
+}
+
+/*!
+ * @brief thread_pool_context gives access to the context of the pool in the tasks
+ */
+void *thread_pool_context(thread_pool_t *pool) {
+    return pool->context;
+}
+
+/*!
+ * @brief thread_pool_workers_count returns the number of workers of a pool
+ */
+int thread_pool_workers_count(thread_pool_t *pool) {
+    return pool->workers_count;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct _thread_pool thread_pool_t;
+
+// A task runs on a worker thread, it may push new tasks (preferably on its own worker)
+typedef void (*task_function_t)(thread_pool_t *pool, int worker, void *data);
+
+thread_pool_t *create_thread_pool(int workers_count, void *context);
+void destroy_thread_pool(thread_pool_t *pool);
+int thread_pool_push(thread_pool_t *pool, int worker, task_function_t function, void *data);
+int thread_pool_run(thread_pool_t *pool);
+void *thread_pool_context(thread_pool_t *pool);
+int thread_pool_workers_count(thread_pool_t *pool);
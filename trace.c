@@ -0,0 +1,177 @@
+#include <trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+trace_t *global_trace = NULL;
+
+// Buffer of the calling thread, claimed on its first span. A forked child starts without one
+static __thread trace_buffer_t *local_buffer = NULL;
+
+/*!
+ * @brief forget_local_buffer is run in a forked child: the buffer of the thread that forked belongs to the parent
+ */
+static void forget_local_buffer(void) {
+    local_buffer = NULL;
+}
+
+/*!
+ * @brief enable_trace enables the recording of spans, they are written by write_trace
+ * It must be called before the processes are forked, so that they record in the shared buffers.
+ * @param path is the file of the trace
+ * @return 0 in case of success, -1 else
+ */
+int enable_trace(char *path) {
+    if (strlen(path) >= sizeof(global_trace->path)) {
+        return -1;
+    }
+    // Pages are only allocated when a buffer is written
+    trace_t *trace = mmap(NULL, sizeof(trace_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (trace == MAP_FAILED) {
+        return -1;
+    }
+    trace->main_pid = getpid();
+    trace->start_ns = stats_now();
+    strcpy(trace->path, path);
+    global_trace = trace;
+    pthread_atfork(NULL, NULL, forget_local_buffer);
+    return 0;
+}
+
+/*!
+ * @brief claim_buffer gives the buffer of the calling thread, claiming a free one the first time
+ * @return the buffer, NULL if all of them are taken
+ */
+static trace_buffer_t *claim_buffer(void) {
+    if (!local_buffer) {
+        int index = atomic_fetch_add(&global_trace->buffers_count, 1);
+        if (index >= TRACE_MAX_BUFFERS) {
+            return NULL;
+        }
+        local_buffer = &global_trace->buffers[index];
+        local_buffer->pid = getpid();
+        local_buffer->tid = syscall(SYS_gettid);
+        strcpy(local_buffer->name, (local_buffer->pid == local_buffer->tid) ? "process" : "thread");
+    }
+    return local_buffer;
+}
+
+/*!
+ * @brief trace_name_thread names the calling thread in the trace
+ * @param name is the name, it is truncated to 31 characters
+ */
+void trace_name_thread(char *name) {
+    trace_buffer_t *buffer = global_trace ? claim_buffer() : NULL;
+    if (buffer) {
+        snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+    }
+}
+
+/*!
+ * @brief trace_record adds a span ending now to the buffer of the calling thread
+ * @param name is the name of the span, a string literal
+ * @param start is the start time of the span
+ * @param detail is shown with the span (its end when it is long), NULL for none
+ */
+void trace_record(const char *name, uint64_t start, const char *detail) {
+    uint64_t end = stats_now();
+    trace_buffer_t *buffer = claim_buffer();
+    if (!buffer) {
+        return;
+    }
+    if (buffer->count == TRACE_BUFFER_EVENTS) {
+        ++buffer->dropped;
+        return;
+    }
+    trace_event_t *event = &buffer->events[buffer->count];
+    event->start_ns = start;
+    event->duration_ns = end - start;
+    event->name = name;
+    event->detail[0] = '\0';
+    if (detail) {
+        size_t length = strlen(detail);
+        size_t skipped = (length >= TRACE_DETAIL_SIZE) ? length - (TRACE_DETAIL_SIZE - 1) : 0;
+        // The kept end doesn't start in the middle of a UTF-8 character
+        while ((detail[skipped] & 0xc0) == 0x80) {
+            ++skipped;
+        }
+        memcpy(event->detail, detail + skipped, length - skipped + 1);
+    }
+    ++buffer->count;
+}
+
+/*!
+ * @brief write_json_string writes a string as a JSON string
+ */
+static void write_json_string(FILE *output, const char *string) {
+    fputc('"', output);
+    for (const unsigned char *c=(const unsigned char *) string; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(output, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(output, "\\u%04x", *c);
+        } else {
+            fputc(*c, output);
+        }
+    }
+    fputc('"', output);
+}
+
+/*!
+ * @brief write_trace merges the buffers of all the processes and threads into a Chrome trace (Perfetto reads it too)
+ * It must be called by the main process once the other processes and threads have ended.
+ * @return 0 in case of success, -1 else
+ */
+int write_trace(void) {
+    trace_t *trace = global_trace;
+    if (!trace || getpid() != trace->main_pid) {
+        return 0;
+    }
+    FILE *output = fopen(trace->path, "w");
+    if (!output) {
+        perror(trace->path);
+        return -1;
+    }
+
+    int buffers_count = atomic_load(&trace->buffers_count);
+    if (buffers_count > TRACE_MAX_BUFFERS) {
+        printf("Trace: %d threads were not traced\n", buffers_count - TRACE_MAX_BUFFERS);
+        buffers_count = TRACE_MAX_BUFFERS;
+    }
+    fprintf(output, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (int i=0; i<buffers_count; ++i) {
+        trace_buffer_t *buffer = &trace->buffers[i];
+        // The main thread of a process names the process
+        fprintf(output, "%s{\"ph\": \"M\", \"name\": \"%s\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": ", first ? "" : ",\n",
+                (buffer->pid == buffer->tid) ? "process_name" : "thread_name", (int) buffer->pid, (int) buffer->tid);
+        write_json_string(output, buffer->name);
+        fprintf(output, "}}");
+        first = false;
+        if (buffer->dropped > 0) {
+            printf("Trace: %u spans of %s (%d) were dropped\n", buffer->dropped, buffer->name, (int) buffer->tid);
+        }
+        for (uint32_t j=0; j<buffer->count; ++j) {
+            trace_event_t *event = &buffer->events[j];
+            // Times are in microseconds since tracing was enabled
+            fprintf(output, ",\n{\"ph\": \"X\", \"name\": \"%s\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", event->name,
+                    (int) buffer->pid, (int) buffer->tid, (event->start_ns - trace->start_ns) / 1e3, event->duration_ns / 1e3);
+            if (event->detail[0] != '\0') {
+                fprintf(output, ", \"args\": {\"detail\": ");
+                write_json_string(output, event->detail);
+                fputc('}', output);
+            }
+            fputc('}', output);
+        }
+    }
+    fprintf(output, "\n]}\n");
+    if (fclose(output) == EOF) {
+        perror(trace->path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <stats.h>
+
+#define TRACE_MAX_BUFFERS 128 // Threads and processes recording spans, the others are not traced
+#define TRACE_BUFFER_EVENTS 65536 // Spans per buffer, the next ones are dropped
+#define TRACE_DETAIL_SIZE 40 // End of the path (or other detail) kept with a span
+
+// A complete span. Its name is a string literal: the processes are forked, not executed, so they share its address
+typedef struct {
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    const char *name;
+    char detail[TRACE_DETAIL_SIZE];
+} trace_event_t;
+
+// The spans of one thread, it is the only one writing them
+typedef struct {
+    pid_t pid;
+    pid_t tid;
+    char name[32];
+    uint32_t count;
+    uint32_t dropped;
+    trace_event_t events[TRACE_BUFFER_EVENTS];
+} trace_buffer_t;
+
+// Trace of a run, in memory shared by all the processes (it is mapped before they are forked)
+typedef struct {
+    pid_t main_pid;
+    uint64_t start_ns;
+    char path[1024];
+    _Atomic int buffers_count; // Buffers claimed by a thread
+    trace_buffer_t buffers[TRACE_MAX_BUFFERS];
+} trace_t;
+
+// NULL when --trace is not set
+extern trace_t *global_trace;
+
+int enable_trace(char *path);
+void trace_name_thread(char *name);
+void trace_record(const char *name, uint64_t start, const char *detail);
+int write_trace(void);
+
+/*!
+ * @brief trace_begin starts a span
+ * @return the start time, 0 when tracing is disabled (the clock is not read)
+ */
+static inline uint64_t trace_begin(void) {
+    return global_trace ? stats_now() : 0;
+}
+
+/*!
+ * @brief trace_end records a span started by trace_begin, when tracing is enabled
+ * @param name is the name of the span, a string literal
+ * @param start is the value returned by trace_begin
+ * @param detail is shown with the span (its end when it is long), NULL for none
+ */
+static inline void trace_end(const char *name, uint64_t start, const char *detail) {
+    if (global_trace) {
+        trace_record(name, start, detail);
+    }
+}
@@ -34,3 +34,47 @@ char *concat_path(char *result, char *prefix, char *suffix) {
 
     return result; // Return the concatenated path
 }
+
+/*!
+ * @brief path_compare compares two paths, like strcmp, but with '/' sorting before any other character
+ * This makes the order of full paths the same as the order of a depth-first walk whose directories are
+ * sorted by name: "a/x" comes before "a.b" because the content of a directory comes right after it.
+ * Both source and destination lists must be ordered with this function so they can be merged.
+ * @param lhs the first path
+ * @param rhs the second path
+ * @return a negative value if lhs is before rhs, 0 if they are equal, a positive value else
+ */
+int path_compare(const char *lhs, const char *rhs) {
+    const unsigned char *l = (const unsigned char *) lhs;
+    const unsigned char *r = (const unsigned char *) rhs;
+
+    while (*l != '\0' && *l == *r) {
+        ++l;
+        ++r;
+    }
+    if (*l == *r) {
+        return 0;
+    }
+
+    // Rank: end of string, then '/', then all other characters in byte order
+    int l_rank = (*l == '\0') ? 0 : (*l == '/') ? 1 : *l + 1;
+    int r_rank = (*r == '\0') ? 0 : (*r == '/') ? 1 : *r + 1;
+    return l_rank - r_rank;
+}
+
+/*!
+ * @brief root_prefix_length computes the length of the part of an entry path that belongs to its root
+ * Entries are named "root/relative/path", so the relative path starts after the root and its separator.
+ * @param root the root directory of a files list (source or destination)
+ * @return the offset of the relative path in the entries paths
+ */
+size_t root_prefix_length(const char *root) {
+    if (!root) {
+        return 0;
+    }
+    size_t length = strlen(root);
+    if (length > 0 && root[length - 1] != '/') {
+        ++length;
+    }
+    return length;
+}
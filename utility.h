@@ -1,5 +1,8 @@
 #pragma once
 
 #include <defines.h>
+#include <stddef.h>
 
-char *concat_path(char *result, char *prefix, char *suffix);
\ No newline at end of file
+char *concat_path(char *result, char *prefix, char *suffix);
+int path_compare(const char *lhs, const char *rhs);
+size_t root_prefix_length(const char *root);
\ No newline at end of file
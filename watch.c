@@ -0,0 +1,514 @@
+#include <watch.h>
+#include <sync.h>
+#include <file-properties.h>
+#include <utility.h>
+#include <defines.h>
+#include <trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+// Events that can make a source entry differ from its copy. Deletions are not watched: entries are never
+// removed from the destination
+#define WATCHED_EVENTS (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_MOVED_TO)
+
+static volatile sig_atomic_t stop_requested = 0;
+
+// Entry describing the destination copy of a relative path
+typedef struct {
+    char *relative_path; // Inside the path of the entry, NULL for a free slot
+    files_list_entry_t *entry;
+} indexed_entry_t;
+
+// Open addressing table of the destination entries, by relative path
+typedef struct {
+    indexed_entry_t *slots;
+    size_t capacity; // A power of 2, the table is at most half full
+    size_t count;
+} path_index_t;
+
+// A source path to compare again with its copy, or a directory to compare with all its content
+typedef struct {
+    char *path;
+    bool is_subtree;
+} pending_change_t;
+
+typedef struct {
+    pending_change_t *changes;
+    size_t count;
+    size_t capacity;
+    bool overflowed; // The kernel dropped events
+} pending_changes_t;
+
+typedef struct {
+    configuration_t *config;
+    files_list_t *dst_list; // Holds the entries of the paths copied while watching
+    path_index_t index;
+    int inotify_fd;
+    char **watched_paths; // Path of the directory of each watch descriptor
+    int watched_capacity;
+    size_t watched_count;
+    size_t source_prefix;
+    size_t copied;
+    size_t failed;
+    deferred_directories_t directories; // Directories copied by the current changes, finished once they are applied
+} watch_state_t;
+
+/*!
+ * @brief request_stop is the handler of SIGINT and SIGTERM in watch mode
+ */
+static void request_stop(int signal_number) {
+    stop_requested = 1;
+}
+
+/*!
+ * @brief install_watch_signals makes SIGINT and SIGTERM end the watch, so the program exits cleanly
+ * It must be called before the processes are forked: they inherit the handler, and keep waiting for the
+ * command to terminate instead of dying before the main process could stop them.
+ */
+void install_watch_signals(void) {
+    struct sigaction action = {0};
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    // No SA_RESTART: the poll of the watch loop returns at once
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+/*!
+ * @brief now_ms returns the monotonic clock in milliseconds
+ */
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*!
+ * @brief hash_path is FNV-1a of a relative path
+ */
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c=(const unsigned char *) path; *c; ++c) {
+        hash = (hash ^ *c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*!
+ * @brief find_path_slot finds the slot of a relative path, or the free slot where it would go
+ */
+static indexed_entry_t *find_path_slot(path_index_t *index, const char *relative_path) {
+    size_t position = hash_path(relative_path) & (index->capacity - 1);
+    while (index->slots[position].relative_path && strcmp(index->slots[position].relative_path, relative_path) != 0) {
+        position = (position + 1) & (index->capacity - 1);
+    }
+    return &index->slots[position];
+}
+
+/*!
+ * @brief index_entry sets the destination entry of a relative path, the table grows when it is half full
+ * @param index is the table
+ * @param relative_path is the relative path, it must live as long as the table (it is in the entry path)
+ * @param entry is the entry
+ * @return 0 in case of success, -1 else
+ */
+static int index_entry(path_index_t *index, char *relative_path, files_list_entry_t *entry) {
+    if (2 * (index->count + 1) > index->capacity) {
+        size_t capacity = (index->capacity == 0) ? 1024 : 2 * index->capacity;
+        path_index_t grown = {.slots = calloc(capacity, sizeof(indexed_entry_t)), .capacity = capacity};
+        if (!grown.slots) {
+            return -1;
+        }
+        for (size_t i=0; i<index->capacity; ++i) {
+            if (index->slots[i].relative_path) {
+                *find_path_slot(&grown, index->slots[i].relative_path) = index->slots[i];
+                ++grown.count;
+            }
+        }
+        free(index->slots);
+        *index = grown;
+    }
+    indexed_entry_t *slot = find_path_slot(index, relative_path);
+    if (!slot->relative_path) {
+        slot->relative_path = relative_path;
+        ++index->count;
+    }
+    slot->entry = entry;
+    return 0;
+}
+
+/*!
+ * @brief index_files_list indexes the entries of a list by their relative path
+ * @param index is the table, entries of paths already in it are replaced
+ * @param list is the list
+ * @param prefix_length is the length of the root of the list in the paths (@see root_prefix_length)
+ * @return 0 in case of success, -1 else
+ */
+static int index_files_list(path_index_t *index, files_list_t *list, size_t prefix_length) {
+    for (files_list_entry_t *cursor=list->head; cursor; cursor=cursor->next) {
+        if (strlen(cursor->path_and_name) > prefix_length && index_entry(index, cursor->path_and_name + prefix_length, cursor) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief add_watch watches a source directory
+ * Watching a directory again gives the same descriptor, its path is updated (it may have been renamed).
+ * @param state is the watch state
+ * @param path is the path of the directory
+ * @return 0 in case of success, -1 else
+ */
+static int add_watch(watch_state_t *state, char *path) {
+    int descriptor = inotify_add_watch(state->inotify_fd, path, WATCHED_EVENTS | IN_ONLYDIR);
+    if (descriptor == -1) {
+        if (errno == ENOSPC) {
+            printf("Cannot watch %s: too many watches (see fs.inotify.max_user_watches)\n", path);
+        } else {
+            perror(path);
+        }
+        return -1;
+    }
+    if (descriptor >= state->watched_capacity) {
+        int capacity = (state->watched_capacity == 0) ? 1024 : state->watched_capacity;
+        while (descriptor >= capacity) {
+            capacity *= 2;
+        }
+        char **paths = realloc(state->watched_paths, capacity * sizeof(char *));
+        if (!paths) {
+            return -1;
+        }
+        memset(paths + state->watched_capacity, 0, (capacity - state->watched_capacity) * sizeof(char *));
+        state->watched_paths = paths;
+        state->watched_capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    if (state->watched_paths[descriptor]) {
+        free(state->watched_paths[descriptor]);
+    } else {
+        ++state->watched_count;
+    }
+    state->watched_paths[descriptor] = copy;
+    return 0;
+}
+
+/*!
+ * @brief add_pending_change records a path to compare with its copy once the events settle
+ * @return 0 in case of success, -1 else
+ */
+static int add_pending_change(pending_changes_t *pending, char *path, bool is_subtree) {
+    if (pending->count == pending->capacity) {
+        size_t capacity = (pending->capacity == 0) ? 64 : 2 * pending->capacity;
+        pending_change_t *changes = realloc(pending->changes, capacity * sizeof(pending_change_t));
+        if (!changes) {
+            return -1;
+        }
+        pending->changes = changes;
+        pending->capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    pending->changes[pending->count++] = (pending_change_t) {.path = copy, .is_subtree = is_subtree};
+    return 0;
+}
+
+/*!
+ * @brief read_events reads all the available events and records the changed paths
+ * @param state is the watch state
+ * @param pending receives the changes
+ */
+static void read_events(watch_state_t *state, pending_changes_t *pending) {
+    static char buffer[WATCH_EVENTS_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(state->inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *cursor=buffer; cursor<buffer+length; ) {
+            struct inotify_event *event = (struct inotify_event *) cursor;
+            cursor += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                pending->overflowed = true;
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= state->watched_capacity || !state->watched_paths[event->wd]) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                // The directory was removed
+                free(state->watched_paths[event->wd]);
+                state->watched_paths[event->wd] = NULL;
+                --state->watched_count;
+                continue;
+            }
+            char path[PATH_SIZE];
+            if (event->len == 0 || !concat_path(path, state->watched_paths[event->wd], event->name)) {
+                continue;
+            }
+            // A directory created or moved in brings its whole content
+            bool is_subtree = (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO));
+            if (add_pending_change(pending, path, is_subtree) == -1) {
+                pending->overflowed = true;
+            }
+            // Its directory got a new mtime, and its copy must be writable (it is applied first, @see compare_changes)
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO))
+                && add_pending_change(pending, state->watched_paths[event->wd], false) == -1) {
+                pending->overflowed = true;
+            }
+        }
+    }
+}
+
+/*!
+ * @brief compare_changes orders the changes like a walk, a directory before its content (@see path_compare)
+ */
+static int compare_changes(const void *lhs, const void *rhs) {
+    return path_compare(((pending_change_t *) lhs)->path, ((pending_change_t *) rhs)->path);
+}
+
+/*!
+ * @brief is_inside tells if a path is a directory or inside it
+ */
+static bool is_inside(char *path, char *directory, size_t directory_length) {
+    return strncmp(path, directory, directory_length) == 0 && (path[directory_length] == '\0' || path[directory_length] == '/');
+}
+
+/*!
+ * @brief add_overflow_rescan replaces the changes by the rescan of the smallest subtree holding them
+ * The events dropped by the kernel are unknown: the directories that had events are the ones being
+ * changed, their common ancestor is compared with its copy. Without any event, the whole source is.
+ * @param state is the watch state
+ * @param pending is the changes of the window
+ */
+static void add_overflow_rescan(watch_state_t *state, pending_changes_t *pending) {
+    char ancestor[PATH_SIZE];
+    size_t root_length = strlen(state->config->source);
+    strcpy(ancestor, state->config->source);
+    if (pending->count > 0) {
+        strcpy(ancestor, pending->changes[0].path);
+        char *separator = strrchr(ancestor, '/');
+        if (separator && !pending->changes[0].is_subtree) {
+            *separator = '\0';
+        }
+        for (size_t i=1; i<pending->count; ++i) {
+            size_t length = strlen(ancestor);
+            while (length > root_length && !is_inside(pending->changes[i].path, ancestor, length)) {
+                while (length > 0 && ancestor[length - 1] != '/') {
+                    --length;
+                }
+                // The separator is dropped too
+                length = (length > 0) ? length - 1 : 0;
+            }
+            ancestor[length] = '\0';
+        }
+        if (strlen(ancestor) < root_length) {
+            strcpy(ancestor, state->config->source);
+        }
+    }
+    for (size_t i=0; i<pending->count; ++i) {
+        free(pending->changes[i].path);
+    }
+    pending->count = 0;
+    pending->overflowed = false;
+    if (state->config->is_verbose) {
+        printf("Events were dropped, comparing %s with its copy\n", ancestor);
+    }
+    add_pending_change(pending, ancestor, true);
+}
+
+/*!
+ * @brief apply_entry copies a source entry if it differs from its copy, and records the new copy
+ * @param state is the watch state
+ * @param entry is the source entry, with its properties
+ */
+static void apply_entry(watch_state_t *state, files_list_entry_t *entry) {
+    if (strlen(entry->path_and_name) <= state->source_prefix) {
+        return;
+    }
+    char *relative_path = entry->path_and_name + state->source_prefix;
+    files_list_entry_t *copy = find_path_slot(&state->index, relative_path)->entry;
+    if (copy && !mismatch(entry, copy, state->config->uses_md5)) {
+        return;
+    }
+    if (copy_entry_to_destination(entry, state->config) == -1) {
+        ++state->failed;
+        return;
+    }
+    if (entry->entry_type == DOSSIER) {
+        defer_directory(&state->directories, entry, state->config);
+    }
+    ++state->copied;
+
+    if (!copy) {
+        char destination_path[PATH_SIZE];
+        if (!concat_path(destination_path, state->config->destination, relative_path)
+            || !(copy = new_files_list_entry(state->dst_list, destination_path))) {
+            return;
+        }
+        add_entry_to_tail(state->dst_list, copy);
+        if (index_entry(&state->index, copy->path_and_name + root_prefix_length(state->config->destination), copy) == -1) {
+            return;
+        }
+    }
+    copy->mode = entry->mode;
+    copy->mtime = entry->mtime;
+    copy->size = entry->size;
+    copy->entry_type = entry->entry_type;
+    copy->hash_algorithm = entry->hash_algorithm;
+    memcpy(copy->md5sum, entry->md5sum, sizeof(copy->md5sum));
+}
+
+/*!
+ * @brief apply_change compares a changed source path with its copy, and the content of a subtree
+ * @param state is the watch state
+ * @param change is the change, its path is a source path
+ */
+static void apply_change(watch_state_t *state, pending_change_t *change) {
+    files_list_t scratch = {0};
+    files_list_entry_t *entry = new_files_list_entry(&scratch, change->path);
+    // Paths that disappeared meanwhile are skipped, their copy is kept
+    if (!entry || get_file_stats(entry) == -1) {
+        clear_files_list(&scratch);
+        return;
+    }
+    apply_entry(state, entry);
+
+    if (entry->entry_type == DOSSIER && change->is_subtree) {
+        add_watch(state, change->path);
+        files_list_t subtree = {0};
+        make_files_list(&subtree, change->path);
+        for (files_list_entry_t *cursor=subtree.head; cursor; cursor=cursor->next) {
+            if (cursor->entry_type == DOSSIER) {
+                add_watch(state, cursor->path_and_name);
+            }
+            apply_entry(state, cursor);
+        }
+        clear_files_list(&subtree);
+    }
+    clear_files_list(&scratch);
+}
+
+/*!
+ * @brief apply_pending_changes applies the changes of a window, once each
+ * Changes are sorted, so a directory is created before its content, and the paths of a subtree
+ * being compared are not compared a second time.
+ * @param state is the watch state
+ * @param pending is the changes, it is empty afterwards
+ */
+static void apply_pending_changes(watch_state_t *state, pending_changes_t *pending) {
+    if (pending->overflowed) {
+        add_overflow_rescan(state, pending);
+    }
+    uint64_t start = trace_begin();
+    size_t copied = state->copied, failed = state->failed, count = pending->count;
+    qsort(pending->changes, pending->count, sizeof(pending_change_t), compare_changes);
+    char *subtree = NULL;
+    for (size_t i=0; i<pending->count; ++i) {
+        pending_change_t *change = &pending->changes[i];
+        bool is_duplicate = (i + 1 < pending->count && strcmp(change->path, pending->changes[i + 1].path) == 0);
+        if (is_duplicate) {
+            // The last one is applied, as a subtree if any of them is
+            pending->changes[i + 1].is_subtree |= change->is_subtree;
+        } else if (!subtree || !is_inside(change->path, subtree, strlen(subtree))) {
+            apply_change(state, change);
+            if (change->is_subtree) {
+                subtree = change->path;
+            }
+        }
+    }
+    apply_deferred_directories(&state->directories);
+    trace_end("watch changes", start, NULL);
+    if (state->config->is_verbose) {
+        printf("%zu changes: %zu entries copied, %zu failed\n", count, state->copied - copied, state->failed - failed);
+    }
+    for (size_t i=0; i<pending->count; ++i) {
+        free(pending->changes[i].path);
+    }
+    pending->count = 0;
+}
+
+/*!
+ * @brief watch_source keeps the destination up to date with the source, until SIGINT or SIGTERM
+ * The lists of the first synchronization stay in memory: every source directory is watched (inotify),
+ * and the paths changed are compared with the entry of their copy, then copied if they differ. Changes
+ * are applied once no event came for the debounce time (or after a few debounce times of events), so
+ * a file written many times is copied once. When the kernel drops events, a subtree is compared instead.
+ * @param the_config is a pointer to the configuration
+ * @param src_list is the source list of the first synchronization
+ * @param dst_list is the destination list of the first synchronization, entries of the new copies are added
+ * @return 0 when the watch was stopped, -1 in case of error
+ */
+int watch_source(configuration_t *the_config, files_list_t *src_list, files_list_t *dst_list) {
+    watch_state_t state = {.config = the_config, .dst_list = dst_list, .source_prefix = root_prefix_length(the_config->source)};
+    state.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (state.inotify_fd == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    // After the first synchronization, every source entry was copied (or was already identical)
+    int result = 0;
+    if (index_files_list(&state.index, dst_list, root_prefix_length(the_config->destination)) == -1
+        || index_files_list(&state.index, src_list, state.source_prefix) == -1
+        || add_watch(&state, the_config->source) == -1) {
+        result = -1;
+    }
+    for (files_list_entry_t *cursor=src_list->head; result == 0 && cursor; cursor=cursor->next) {
+        if (cursor->entry_type == DOSSIER && add_watch(&state, cursor->path_and_name) == -1) {
+            result = -1;
+        }
+    }
+    if (result == 0 && the_config->is_verbose) {
+        printf("Watching %zu directories of %s\n", state.watched_count, the_config->source);
+    }
+
+    pending_changes_t pending = {0};
+    uint64_t window_start = 0;
+    uint64_t max_window = (uint64_t) the_config->watch_debounce_ms * WATCH_MAX_DEBOUNCE_PERIODS;
+    while (result == 0 && !stop_requested) {
+        bool has_changes = pending.count > 0 || pending.overflowed;
+        if (has_changes && now_ms() - window_start >= max_window) {
+            apply_pending_changes(&state, &pending);
+            continue;
+        }
+        struct pollfd poll_fd = {.fd = state.inotify_fd, .events = POLLIN};
+        int ready = poll(&poll_fd, 1, has_changes ? the_config->watch_debounce_ms : -1);
+        if (ready == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                result = -1;
+            }
+        } else if (ready == 0) {
+            apply_pending_changes(&state, &pending);
+        } else {
+            if (!has_changes) {
+                window_start = now_ms();
+            }
+            read_events(&state, &pending);
+        }
+    }
+    // Changes seen before the stop are not lost
+    if (pending.count > 0 || pending.overflowed) {
+        apply_pending_changes(&state, &pending);
+    }
+
+    free(pending.changes);
+    for (int i=0; i<state.watched_capacity; ++i) {
+        free(state.watched_paths[i]);
+    }
+    free(state.watched_paths);
+    free(state.index.slots);
+    close(state.inotify_fd);
+    return result;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <configuration.h>
+#include <files-list.h>
+
+#define WATCH_DEFAULT_DEBOUNCE_MS 200 // Quiet time after the last event before the changes are applied
+#define WATCH_MAX_DEBOUNCE_PERIODS 10 // Changes are applied at the latest after this many debounce times of events
+#define WATCH_EVENTS_BUFFER_SIZE (64 * 1024)
+
+void install_watch_signals(void);
+int watch_source(configuration_t *the_config, files_list_t *src_list, files_list_t *dst_list);
@@ -0,0 +1,377 @@
+#include <xxh3.h>
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XXH3_X86 1
+#endif
+
+// XXH3 64 bits (https://github.com/Cyan4973/xxHash), with the default secret and a null seed.
+// The long input loop (accumulate) has SSE2 and AVX2 versions, chosen at run time.
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define STRIPE_LEN 64
+#define SECRET_CONSUME_RATE 8
+#define STRIPES_PER_BLOCK ((XXH3_SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define BLOCK_LEN (STRIPE_LEN * STRIPES_PER_BLOCK)
+#define SECRET_LIMIT (XXH3_SECRET_SIZE - STRIPE_LEN)
+#define SECRET_LASTACC_START 7
+#define SECRET_MERGEACCS_START 11
+#define MIDSIZE_MAX 240
+#define MIDSIZE_STARTOFFSET 3
+#define MIDSIZE_LASTOFFSET 17
+#define SECRET_SIZE_MIN 136
+#define BUFFER_STRIPES (XXH3_BUFFER_SIZE / STRIPE_LEN)
+
+static const uint8_t default_secret[XXH3_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+// Processes nb_stripes stripes of input, the secret moving by SECRET_CONSUME_RATE for each stripe
+typedef void (*accumulate_t)(uint64_t acc[8], const uint8_t *input, const uint8_t *secret, size_t nb_stripes);
+// Scrambles the accumulators at the end of a block
+typedef void (*scramble_t)(uint64_t acc[8], const uint8_t *secret);
+
+static uint32_t read32(const uint8_t *data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint64_t read64(const uint8_t *data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint64_t rotl64(uint64_t value, int count) {
+    return (value << count) | (value >> (64 - count));
+}
+
+static uint64_t mul128_fold64(uint64_t lhs, uint64_t rhs) {
+    __uint128_t product = (__uint128_t) lhs * rhs;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static uint64_t xxh64_avalanche(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    return hash ^ (hash >> 32);
+}
+
+static uint64_t xxh3_avalanche(uint64_t hash) {
+    hash ^= hash >> 37;
+    hash *= PRIME_MX1;
+    return hash ^ (hash >> 32);
+}
+
+static uint64_t rrmxmx(uint64_t hash, uint64_t length) {
+    hash ^= rotl64(hash, 49) ^ rotl64(hash, 24);
+    hash *= PRIME_MX2;
+    hash ^= (hash >> 35) + length;
+    hash *= PRIME_MX2;
+    return hash ^ (hash >> 28);
+}
+
+static uint64_t mix16(const uint8_t *input, const uint8_t *secret) {
+    return mul128_fold64(read64(input) ^ read64(secret), read64(input + 8) ^ read64(secret + 8));
+}
+
+/*!
+ * @brief hash_short hashes inputs up to MIDSIZE_MAX bytes, which have dedicated algorithms
+ */
+static uint64_t hash_short(const uint8_t *input, size_t length) {
+    const uint8_t *secret = default_secret;
+
+    if (length == 0) {
+        return xxh64_avalanche(read64(secret + 56) ^ read64(secret + 64));
+    } else if (length <= 3) {
+        uint32_t combined = ((uint32_t) input[0] << 16) | ((uint32_t) input[length >> 1] << 24) | input[length - 1] | ((uint32_t) length << 8);
+        uint64_t bitflip = read32(secret) ^ read32(secret + 4);
+        return xxh64_avalanche(combined ^ bitflip);
+    } else if (length <= 8) {
+        uint64_t bitflip = read64(secret + 8) ^ read64(secret + 16);
+        uint64_t input64 = read32(input + length - 4) + ((uint64_t) read32(input) << 32);
+        return rrmxmx(input64 ^ bitflip, length);
+    } else if (length <= 16) {
+        uint64_t input_lo = read64(input) ^ (read64(secret + 24) ^ read64(secret + 32));
+        uint64_t input_hi = read64(input + length - 8) ^ (read64(secret + 40) ^ read64(secret + 48));
+        uint64_t acc = length + __builtin_bswap64(input_lo) + input_hi + mul128_fold64(input_lo, input_hi);
+        return xxh3_avalanche(acc);
+    } else if (length <= 128) {
+        uint64_t acc = length * PRIME64_1;
+        if (length > 32) {
+            if (length > 64) {
+                if (length > 96) {
+                    acc += mix16(input + 48, secret + 96);
+                    acc += mix16(input + length - 64, secret + 112);
+                }
+                acc += mix16(input + 32, secret + 64);
+                acc += mix16(input + length - 48, secret + 80);
+            }
+            acc += mix16(input + 16, secret + 32);
+            acc += mix16(input + length - 32, secret + 48);
+        }
+        acc += mix16(input, secret);
+        acc += mix16(input + length - 16, secret + 16);
+        return xxh3_avalanche(acc);
+    }
+
+    uint64_t acc = length * PRIME64_1;
+    size_t rounds = length / 16;
+    for (size_t i=0; i<8; ++i) {
+        acc += mix16(input + 16 * i, secret + 16 * i);
+    }
+    acc = xxh3_avalanche(acc);
+    for (size_t i=8; i<rounds; ++i) {
+        acc += mix16(input + 16 * i, secret + 16 * (i - 8) + MIDSIZE_STARTOFFSET);
+    }
+    acc += mix16(input + length - 16, secret + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET);
+    return xxh3_avalanche(acc);
+}
+
+static void accumulate_scalar(uint64_t acc[8], const uint8_t *input, const uint8_t *secret, size_t nb_stripes) {
+    for (size_t stripe=0; stripe<nb_stripes; ++stripe) {
+        const uint8_t *data = input + stripe * STRIPE_LEN;
+        const uint8_t *key = secret + stripe * SECRET_CONSUME_RATE;
+        for (int i=0; i<8; ++i) {
+            uint64_t data_value = read64(data + 8 * i);
+            uint64_t data_key = data_value ^ read64(key + 8 * i);
+            acc[i ^ 1] += data_value;
+            acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+        }
+    }
+}
+
+static void scramble_scalar(uint64_t acc[8], const uint8_t *secret) {
+    for (int i=0; i<8; ++i) {
+        uint64_t value = acc[i];
+        value ^= value >> 47;
+        value ^= read64(secret + 8 * i);
+        acc[i] = value * PRIME32_1;
+    }
+}
+
+#ifdef XXH3_X86
+static void accumulate_sse2(uint64_t acc[8], const uint8_t *input, const uint8_t *secret, size_t nb_stripes) {
+    __m128i vector_acc[4];
+    memcpy(vector_acc, acc, sizeof(vector_acc));
+    for (size_t stripe=0; stripe<nb_stripes; ++stripe) {
+        const uint8_t *data = input + stripe * STRIPE_LEN;
+        const uint8_t *key = secret + stripe * SECRET_CONSUME_RATE;
+        for (int i=0; i<4; ++i) {
+            __m128i data_value = _mm_loadu_si128((const __m128i *) (data + 16 * i));
+            __m128i data_key = _mm_xor_si128(data_value, _mm_loadu_si128((const __m128i *) (key + 16 * i)));
+            // Low 32 bits times high 32 bits of each 64 bits lane
+            __m128i product = _mm_mul_epu32(data_key, _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+            // The input is added to the neighbour lane
+            __m128i swapped = _mm_shuffle_epi32(data_value, _MM_SHUFFLE(1, 0, 3, 2));
+            vector_acc[i] = _mm_add_epi64(vector_acc[i], _mm_add_epi64(product, swapped));
+        }
+    }
+    memcpy(acc, vector_acc, sizeof(vector_acc));
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t acc[8], const uint8_t *input, const uint8_t *secret, size_t nb_stripes) {
+    __m256i vector_acc[2];
+    memcpy(vector_acc, acc, sizeof(vector_acc));
+    for (size_t stripe=0; stripe<nb_stripes; ++stripe) {
+        const uint8_t *data = input + stripe * STRIPE_LEN;
+        const uint8_t *key = secret + stripe * SECRET_CONSUME_RATE;
+        for (int i=0; i<2; ++i) {
+            __m256i data_value = _mm256_loadu_si256((const __m256i *) (data + 32 * i));
+            __m256i data_key = _mm256_xor_si256(data_value, _mm256_loadu_si256((const __m256i *) (key + 32 * i)));
+            __m256i product = _mm256_mul_epu32(data_key, _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m256i swapped = _mm256_shuffle_epi32(data_value, _MM_SHUFFLE(1, 0, 3, 2));
+            vector_acc[i] = _mm256_add_epi64(vector_acc[i], _mm256_add_epi64(product, swapped));
+        }
+    }
+    memcpy(acc, vector_acc, sizeof(vector_acc));
+}
+#endif
+
+static struct {
+    bool is_selected;
+    accumulate_t accumulate;
+    scramble_t scramble;
+    const char *name;
+} implementation;
+
+/*!
+ * @brief select_implementation picks the fastest accumulate loop supported by the CPU
+ */
+static void select_implementation(void) {
+    if (implementation.is_selected) {
+        return;
+    }
+    implementation.accumulate = accumulate_scalar;
+    implementation.scramble = scramble_scalar;
+    implementation.name = "scalar";
+#ifdef XXH3_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        implementation.accumulate = accumulate_avx2;
+        implementation.name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        implementation.accumulate = accumulate_sse2;
+        implementation.name = "sse2";
+    }
+#endif
+    implementation.is_selected = true;
+}
+
+/*!
+ * @brief consume_stripes accumulates stripes, scrambling when the end of a block is reached
+ */
+static void consume_stripes(uint64_t acc[8], size_t *stripes_so_far, const uint8_t *input, size_t nb_stripes) {
+    if (STRIPES_PER_BLOCK - *stripes_so_far <= nb_stripes) {
+        size_t stripes_to_end = STRIPES_PER_BLOCK - *stripes_so_far;
+        implementation.accumulate(acc, input, default_secret + *stripes_so_far * SECRET_CONSUME_RATE, stripes_to_end);
+        implementation.scramble(acc, default_secret + SECRET_LIMIT);
+        implementation.accumulate(acc, input + stripes_to_end * STRIPE_LEN, default_secret, nb_stripes - stripes_to_end);
+        *stripes_so_far = nb_stripes - stripes_to_end;
+    } else {
+        implementation.accumulate(acc, input, default_secret + *stripes_so_far * SECRET_CONSUME_RATE, nb_stripes);
+        *stripes_so_far += nb_stripes;
+    }
+}
+
+/*!
+ * @brief merge_accumulators computes the final hash of a long input
+ */
+static uint64_t merge_accumulators(uint64_t acc[8], uint64_t length) {
+    uint64_t result = length * PRIME64_1;
+    const uint8_t *secret = default_secret + SECRET_MERGEACCS_START;
+    for (int i=0; i<4; ++i) {
+        result += mul128_fold64(acc[2 * i] ^ read64(secret + 16 * i), acc[2 * i + 1] ^ read64(secret + 16 * i + 8));
+    }
+    return xxh3_avalanche(result);
+}
+
+/*!
+ * @brief xxh3_init initializes a streaming state
+ * @param state is the state to initialize
+ */
+void xxh3_init(xxh3_state_t *state) {
+    static const uint64_t initial_acc[8] = {PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1};
+
+    select_implementation();
+    memcpy(state->acc, initial_acc, sizeof(initial_acc));
+    state->buffered_size = 0;
+    state->stripes_so_far = 0;
+    state->total_length = 0;
+}
+
+/*!
+ * @brief xxh3_update adds data to the hash
+ * At least one byte always stays in the buffer, the last stripe is processed by xxh3_digest.
+ * @param state is the streaming state
+ * @param input is the data
+ * @param length is the length of the data
+ */
+void xxh3_update(xxh3_state_t *state, const uint8_t *input, size_t length) {
+    const uint8_t *end = input + length;
+    state->total_length += length;
+
+    if (state->buffered_size + length <= XXH3_BUFFER_SIZE) {
+        memcpy(state->buffer + state->buffered_size, input, length);
+        state->buffered_size += length;
+        return;
+    }
+
+    if (state->buffered_size > 0) {
+        size_t load_size = XXH3_BUFFER_SIZE - state->buffered_size;
+        memcpy(state->buffer + state->buffered_size, input, load_size);
+        input += load_size;
+        consume_stripes(state->acc, &state->stripes_so_far, state->buffer, BUFFER_STRIPES);
+        state->buffered_size = 0;
+    }
+
+    if ((size_t) (end - input) > XXH3_BUFFER_SIZE) {
+        const uint8_t *limit = end - XXH3_BUFFER_SIZE;
+        do {
+            consume_stripes(state->acc, &state->stripes_so_far, input, BUFFER_STRIPES);
+            input += XXH3_BUFFER_SIZE;
+        } while (input < limit);
+        // The last stripe may need bytes from before the buffered ones
+        memcpy(state->buffer + XXH3_BUFFER_SIZE - STRIPE_LEN, input - STRIPE_LEN, STRIPE_LEN);
+    }
+
+    memcpy(state->buffer, input, end - input);
+    state->buffered_size = end - input;
+}
+
+/*!
+ * @brief xxh3_digest computes the hash of all the data added so far
+ * @param state is the streaming state, it is not modified
+ * @return the hash
+ */
+uint64_t xxh3_digest(xxh3_state_t *state) {
+    if (state->total_length <= MIDSIZE_MAX) {
+        return hash_short(state->buffer, state->total_length);
+    }
+
+    uint64_t acc[8];
+    memcpy(acc, state->acc, sizeof(acc));
+    if (state->buffered_size >= STRIPE_LEN) {
+        size_t stripes_so_far = state->stripes_so_far;
+        consume_stripes(acc, &stripes_so_far, state->buffer, (state->buffered_size - 1) / STRIPE_LEN);
+        implementation.accumulate(acc, state->buffer + state->buffered_size - STRIPE_LEN, default_secret + SECRET_LIMIT - SECRET_LASTACC_START, 1);
+    } else {
+        uint8_t last_stripe[STRIPE_LEN];
+        size_t catchup_size = STRIPE_LEN - state->buffered_size;
+        memcpy(last_stripe, state->buffer + XXH3_BUFFER_SIZE - catchup_size, catchup_size);
+        memcpy(last_stripe + catchup_size, state->buffer, state->buffered_size);
+        implementation.accumulate(acc, last_stripe, default_secret + SECRET_LIMIT - SECRET_LASTACC_START, 1);
+    }
+    return merge_accumulators(acc, state->total_length);
+}
+
+/*!
+ * @brief xxh3_hash hashes a buffer in one call
+ * @param input is the data
+ * @param length is the length of the data
+ * @return the hash
+ */
+uint64_t xxh3_hash(const uint8_t *input, size_t length) {
+    if (length <= MIDSIZE_MAX) {
+        return hash_short(input, length);
+    }
+    xxh3_state_t state;
+    xxh3_init(&state);
+    xxh3_update(&state, input, length);
+    return xxh3_digest(&state);
+}
+
+/*!
+ * @brief xxh3_implementation gives the name of the accumulate loop in use, for reports
+ */
+const char *xxh3_implementation(void) {
+    select_implementation();
+    return implementation.name;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define XXH3_SECRET_SIZE 192
+#define XXH3_BUFFER_SIZE 256
+
+// Streaming state of XXH3 (64 bits, default secret, seed 0)
+typedef struct {
+    uint64_t acc[8];
+    uint8_t buffer[XXH3_BUFFER_SIZE];
+    size_t buffered_size;
+    size_t stripes_so_far; // Stripes accumulated in the current block
+    uint64_t total_length;
+} xxh3_state_t;
+
+void xxh3_init(xxh3_state_t *state);
+void xxh3_update(xxh3_state_t *state, const uint8_t *input, size_t length);
+uint64_t xxh3_digest(xxh3_state_t *state);
+uint64_t xxh3_hash(const uint8_t *input, size_t length);
+const char *xxh3_implementation(void);